@@ -11,6 +11,10 @@
 // Array length can be zero
 // Unused top bits must be zero
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // mremap()
+#endif
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -19,15 +23,21 @@
 #include <signal.h> // needed for abort()
 #include <string.h> // memset()
 #include <assert.h>
-#include <time.h> // needed for seeding rand()
 #include <unistd.h>  // need for getpid() for seeding rand number
 #include <ctype.h>  // need for tolower()
 #include <errno.h>  // perror()
 #include <sys/time.h> // for seeding random
+#include <time.h> // clock_gettime()
 
 // Windows includes
 #if defined(_WIN32)
 #include <intrin.h>
+#include <malloc.h> // _aligned_malloc()
+#else
+#include <fcntl.h> // open()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <sys/syscall.h> // SYS_memfd_create
 #endif
 
 #include "bit_array.h"
@@ -74,80 +84,6 @@ static const word_t reverse_table[256] =
   0x1F, 0x9F, 0x5F, 0xDF, 0x3F, 0xBF, 0x7F, 0xFF,
 };
 
-// Morton table for interleaving bytes
-static const word_t morton_table0[256] =
-{
-  0x0000, 0x0001, 0x0004, 0x0005, 0x0010, 0x0011, 0x0014, 0x0015,
-  0x0040, 0x0041, 0x0044, 0x0045, 0x0050, 0x0051, 0x0054, 0x0055,
-  0x0100, 0x0101, 0x0104, 0x0105, 0x0110, 0x0111, 0x0114, 0x0115,
-  0x0140, 0x0141, 0x0144, 0x0145, 0x0150, 0x0151, 0x0154, 0x0155,
-  0x0400, 0x0401, 0x0404, 0x0405, 0x0410, 0x0411, 0x0414, 0x0415,
-  0x0440, 0x0441, 0x0444, 0x0445, 0x0450, 0x0451, 0x0454, 0x0455,
-  0x0500, 0x0501, 0x0504, 0x0505, 0x0510, 0x0511, 0x0514, 0x0515,
-  0x0540, 0x0541, 0x0544, 0x0545, 0x0550, 0x0551, 0x0554, 0x0555,
-  0x1000, 0x1001, 0x1004, 0x1005, 0x1010, 0x1011, 0x1014, 0x1015,
-  0x1040, 0x1041, 0x1044, 0x1045, 0x1050, 0x1051, 0x1054, 0x1055,
-  0x1100, 0x1101, 0x1104, 0x1105, 0x1110, 0x1111, 0x1114, 0x1115,
-  0x1140, 0x1141, 0x1144, 0x1145, 0x1150, 0x1151, 0x1154, 0x1155,
-  0x1400, 0x1401, 0x1404, 0x1405, 0x1410, 0x1411, 0x1414, 0x1415,
-  0x1440, 0x1441, 0x1444, 0x1445, 0x1450, 0x1451, 0x1454, 0x1455,
-  0x1500, 0x1501, 0x1504, 0x1505, 0x1510, 0x1511, 0x1514, 0x1515,
-  0x1540, 0x1541, 0x1544, 0x1545, 0x1550, 0x1551, 0x1554, 0x1555,
-  0x4000, 0x4001, 0x4004, 0x4005, 0x4010, 0x4011, 0x4014, 0x4015,
-  0x4040, 0x4041, 0x4044, 0x4045, 0x4050, 0x4051, 0x4054, 0x4055,
-  0x4100, 0x4101, 0x4104, 0x4105, 0x4110, 0x4111, 0x4114, 0x4115,
-  0x4140, 0x4141, 0x4144, 0x4145, 0x4150, 0x4151, 0x4154, 0x4155,
-  0x4400, 0x4401, 0x4404, 0x4405, 0x4410, 0x4411, 0x4414, 0x4415,
-  0x4440, 0x4441, 0x4444, 0x4445, 0x4450, 0x4451, 0x4454, 0x4455,
-  0x4500, 0x4501, 0x4504, 0x4505, 0x4510, 0x4511, 0x4514, 0x4515,
-  0x4540, 0x4541, 0x4544, 0x4545, 0x4550, 0x4551, 0x4554, 0x4555,
-  0x5000, 0x5001, 0x5004, 0x5005, 0x5010, 0x5011, 0x5014, 0x5015,
-  0x5040, 0x5041, 0x5044, 0x5045, 0x5050, 0x5051, 0x5054, 0x5055,
-  0x5100, 0x5101, 0x5104, 0x5105, 0x5110, 0x5111, 0x5114, 0x5115,
-  0x5140, 0x5141, 0x5144, 0x5145, 0x5150, 0x5151, 0x5154, 0x5155,
-  0x5400, 0x5401, 0x5404, 0x5405, 0x5410, 0x5411, 0x5414, 0x5415,
-  0x5440, 0x5441, 0x5444, 0x5445, 0x5450, 0x5451, 0x5454, 0x5455,
-  0x5500, 0x5501, 0x5504, 0x5505, 0x5510, 0x5511, 0x5514, 0x5515,
-  0x5540, 0x5541, 0x5544, 0x5545, 0x5550, 0x5551, 0x5554, 0x5555,
-};
-
-// Morton table for interleaving bytes, shifted left 1 bit
-static const word_t morton_table1[256] =
-{
-  0x0000, 0x0002, 0x0008, 0x000A, 0x0020, 0x0022, 0x0028, 0x002A,
-  0x0080, 0x0082, 0x0088, 0x008A, 0x00A0, 0x00A2, 0x00A8, 0x00AA,
-  0x0200, 0x0202, 0x0208, 0x020A, 0x0220, 0x0222, 0x0228, 0x022A,
-  0x0280, 0x0282, 0x0288, 0x028A, 0x02A0, 0x02A2, 0x02A8, 0x02AA,
-  0x0800, 0x0802, 0x0808, 0x080A, 0x0820, 0x0822, 0x0828, 0x082A,
-  0x0880, 0x0882, 0x0888, 0x088A, 0x08A0, 0x08A2, 0x08A8, 0x08AA,
-  0x0A00, 0x0A02, 0x0A08, 0x0A0A, 0x0A20, 0x0A22, 0x0A28, 0x0A2A,
-  0x0A80, 0x0A82, 0x0A88, 0x0A8A, 0x0AA0, 0x0AA2, 0x0AA8, 0x0AAA,
-  0x2000, 0x2002, 0x2008, 0x200A, 0x2020, 0x2022, 0x2028, 0x202A,
-  0x2080, 0x2082, 0x2088, 0x208A, 0x20A0, 0x20A2, 0x20A8, 0x20AA,
-  0x2200, 0x2202, 0x2208, 0x220A, 0x2220, 0x2222, 0x2228, 0x222A,
-  0x2280, 0x2282, 0x2288, 0x228A, 0x22A0, 0x22A2, 0x22A8, 0x22AA,
-  0x2800, 0x2802, 0x2808, 0x280A, 0x2820, 0x2822, 0x2828, 0x282A,
-  0x2880, 0x2882, 0x2888, 0x288A, 0x28A0, 0x28A2, 0x28A8, 0x28AA,
-  0x2A00, 0x2A02, 0x2A08, 0x2A0A, 0x2A20, 0x2A22, 0x2A28, 0x2A2A,
-  0x2A80, 0x2A82, 0x2A88, 0x2A8A, 0x2AA0, 0x2AA2, 0x2AA8, 0x2AAA,
-  0x8000, 0x8002, 0x8008, 0x800A, 0x8020, 0x8022, 0x8028, 0x802A,
-  0x8080, 0x8082, 0x8088, 0x808A, 0x80A0, 0x80A2, 0x80A8, 0x80AA,
-  0x8200, 0x8202, 0x8208, 0x820A, 0x8220, 0x8222, 0x8228, 0x822A,
-  0x8280, 0x8282, 0x8288, 0x828A, 0x82A0, 0x82A2, 0x82A8, 0x82AA,
-  0x8800, 0x8802, 0x8808, 0x880A, 0x8820, 0x8822, 0x8828, 0x882A,
-  0x8880, 0x8882, 0x8888, 0x888A, 0x88A0, 0x88A2, 0x88A8, 0x88AA,
-  0x8A00, 0x8A02, 0x8A08, 0x8A0A, 0x8A20, 0x8A22, 0x8A28, 0x8A2A,
-  0x8A80, 0x8A82, 0x8A88, 0x8A8A, 0x8AA0, 0x8AA2, 0x8AA8, 0x8AAA,
-  0xA000, 0xA002, 0xA008, 0xA00A, 0xA020, 0xA022, 0xA028, 0xA02A,
-  0xA080, 0xA082, 0xA088, 0xA08A, 0xA0A0, 0xA0A2, 0xA0A8, 0xA0AA,
-  0xA200, 0xA202, 0xA208, 0xA20A, 0xA220, 0xA222, 0xA228, 0xA22A,
-  0xA280, 0xA282, 0xA288, 0xA28A, 0xA2A0, 0xA2A2, 0xA2A8, 0xA2AA,
-  0xA800, 0xA802, 0xA808, 0xA80A, 0xA820, 0xA822, 0xA828, 0xA82A,
-  0xA880, 0xA882, 0xA888, 0xA88A, 0xA8A0, 0xA8A2, 0xA8A8, 0xA8AA,
-  0xAA00, 0xAA02, 0xAA08, 0xAA0A, 0xAA20, 0xAA22, 0xAA28, 0xAA2A,
-  0xAA80, 0xAA82, 0xAA88, 0xAA8A, 0xAAA0, 0xAAA2, 0xAAA8, 0xAAAA,
-};
-
 //
 // Macros
 //
@@ -198,2854 +134,7992 @@ static word_t __inline windows_parity(word_t w)
 #define CLEAR_REGION(arr,start,len)  _set_region((arr),(start),(len),ZERO_REGION)
 #define TOGGLE_REGION(arr,start,len) _set_region((arr),(start),(len),SWAP_REGION)
 
-// Have we initialised with srand() ?
+// Generator used by bit_array_random() and bit_array_shuffle()
+static BIT_ARRAY_RNG global_rng;
+
+// Have we seeded global_rng ?
 static char rand_initiated = 0;
 
-static void _seed_rand()
+static BIT_ARRAY_RNG* _seed_rand()
 {
   if(!rand_initiated)
   {
     // Initialise random number generator
     struct timeval time;
     gettimeofday(&time, NULL);
-    srand((((time.tv_sec ^ getpid()) * 1000001) + time.tv_usec));
+    bit_array_rng_seed(&global_rng, (((time.tv_sec ^ getpid()) * 1000001) +
+                                     time.tv_usec));
     rand_initiated = 1;
   }
+  return &global_rng;
 }
 
 //
-// Common internal functions
+// Word kernels
+//
+// The bulk loops over words[] (logic operators and popcounts) go through a
+// table of function pointers.  The table is picked once at startup from what
+// the CPU supports, so a single libbitarr.a runs the widest kernels available.
+// Build with -DBIT_ARRAY_NO_SIMD (`make SCALAR=1`) to always use the plain C
+// loops -- useful for checking results and timing against the vector paths.
 //
 
-#define bits_in_top_word(nbits) ((nbits) ? bitset64_idx((nbits) - 1) + 1 : 0)
+#if !defined(BIT_ARRAY_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+  #define BIT_ARRAY_SIMD_X86 1
+  #include <immintrin.h>
+#elif !defined(BIT_ARRAY_NO_SIMD) && defined(__GNUC__) && \
+      (defined(__aarch64__) || defined(__ARM_NEON))
+  #define BIT_ARRAY_SIMD_NEON 1
+  #include <arm_neon.h>
+#endif
 
-// Mostly used for debugging
-static inline void _print_word(word_t word, FILE* out)
+typedef struct
+{
+  const char *name;
+  void (*and_words)(word_t *dst, const word_t *a, const word_t *b, word_addr_t n);
+  void (*or_words) (word_t *dst, const word_t *a, const word_t *b, word_addr_t n);
+  void (*xor_words)(word_t *dst, const word_t *a, const word_t *b, word_addr_t n);
+  // dst = a & ~b
+  void (*andnot_words)(word_t *dst, const word_t *a, const word_t *b, word_addr_t n);
+  void (*not_words)(word_t *dst, const word_t *src, word_addr_t n);
+  bit_index_t (*popcount)(const word_t *src, word_addr_t n);
+  bit_index_t (*xor_popcount)(const word_t *a, const word_t *b, word_addr_t n);
+  // Popcounts of a & b, a | b and a & ~b, without storing them
+  bit_index_t (*and_popcount)(const word_t *a, const word_t *b, word_addr_t n);
+  bit_index_t (*or_popcount)(const word_t *a, const word_t *b, word_addr_t n);
+  bit_index_t (*andnot_popcount)(const word_t *a, const word_t *b, word_addr_t n);
+  // 1 iff a & b has a bit set, stops at the first word that does
+  char (*intersects)(const word_t *a, const word_t *b, word_addr_t n);
+  // In place funnel shift of n words by 0 < r < 64 bits, shifting in zeros,
+  // towards the top word (shl) or towards word 0 (shr)
+  void (*shl_words)(word_t *w, word_addr_t n, word_offset_t r);
+  void (*shr_words)(word_t *w, word_addr_t n, word_offset_t r);
+} WordKernels;
+
+// Portable versions, also used to finish off the tail of the vector loops
+static void _and_words_scalar(word_t *dst, const word_t *a, const word_t *b,
+                              word_addr_t n)
 {
-  word_offset_t i;
-  for(i = 0; i < WORD_SIZE; i++)
-  {
-    fprintf(out, "%c", ((word >> i) & (word_t)0x1) == 0 ? '0' : '1');
-  }
+  word_addr_t i;
+  for(i = 0; i < n; i++) dst[i] = a[i] & b[i];
 }
 
-// prints right to left
-static inline char* _word_to_str(word_t word, char str[WORD_SIZE+1])
-  __attribute__((unused));
+static void _or_words_scalar(word_t *dst, const word_t *a, const word_t *b,
+                             word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i < n; i++) dst[i] = a[i] | b[i];
+}
 
-static inline char* _word_to_str(word_t word, char str[WORD_SIZE+1])
+static void _xor_words_scalar(word_t *dst, const word_t *a, const word_t *b,
+                              word_addr_t n)
 {
-  word_offset_t i;
-  for(i = 0; i < WORD_SIZE; i++)
-  {
-    str[WORD_SIZE-i-1] = ((word >> i) & (word_t)0x1) == 0 ? '0' : '1';
-  }
-  str[WORD_SIZE] = '\0';
-  return str;
+  word_addr_t i;
+  for(i = 0; i < n; i++) dst[i] = a[i] ^ b[i];
 }
 
-// Used in debugging
-#ifdef DEBUG
-  #define DEBUG_PRINT(msg,...) printf("[%s:%i] "msg, __FILE__, __LINE__, ##__VA_ARGS__);
-  #define DEBUG_VALIDATE(a) validate_bitarr((a), __FILE__, __LINE__)
-#else
-  #define DEBUG_PRINT(msg,...)
-  #define DEBUG_VALIDATE(a)
-#endif
+static void _andnot_words_scalar(word_t *dst, const word_t *a, const word_t *b,
+                                 word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i < n; i++) dst[i] = a[i] & ~b[i];
+}
 
-void validate_bitarr(BIT_ARRAY *arr, const char *file, int lineno)
+static void _not_words_scalar(word_t *dst, const word_t *src, word_addr_t n)
 {
-  // Check top word is masked
-  word_addr_t tw = arr->num_of_words == 0 ? 0 : arr->num_of_words - 1;
-  bit_index_t top_bits = bits_in_top_word(arr->num_of_bits);
-  int err = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) dst[i] = ~src[i];
+}
 
-  if(arr->words[tw] > bitmask64(top_bits))
-  {
-    _print_word(arr->words[tw], stderr);
-    fprintf(stderr, "\n[%s:%i] Expected %i bits in top word[%i]\n",
-            file, lineno, (int)top_bits, (int)tw);
-    err = 1;
-  }
+static bit_index_t _popcount_scalar(const word_t *src, word_addr_t n)
+{
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) c += POPCOUNT(src[i]);
+  return c;
+}
 
-  // Check num of words is correct
-  word_addr_t num_words = roundup_bits2words64(arr->num_of_bits);
-  if(num_words != arr->num_of_words)
-  {
-    fprintf(stderr, "\n[%s:%i] num of words wrong "
-                    "[bits: %i, word: %i, actual words: %i]\n", file, lineno,
-            (int)arr->num_of_bits, (int)num_words, (int)arr->num_of_words);
-    err = 1;
-  }
+static bit_index_t _xor_popcount_scalar(const word_t *a, const word_t *b,
+                                        word_addr_t n)
+{
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) c += POPCOUNT(a[i] ^ b[i]);
+  return c;
+}
 
-  if(err) abort();
+static bit_index_t _and_popcount_scalar(const word_t *a, const word_t *b,
+                                        word_addr_t n)
+{
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) c += POPCOUNT(a[i] & b[i]);
+  return c;
 }
 
-// Reverse a word
-static inline word_t _reverse_word(word_t word)
+static bit_index_t _or_popcount_scalar(const word_t *a, const word_t *b,
+                                       word_addr_t n)
 {
-  word_t reverse = (reverse_table[(word)       & 0xff] << 56) |
-                   (reverse_table[(word >>  8) & 0xff] << 48) |
-                   (reverse_table[(word >> 16) & 0xff] << 40) |
-                   (reverse_table[(word >> 24) & 0xff] << 32) |
-                   (reverse_table[(word >> 32) & 0xff] << 24) |
-                   (reverse_table[(word >> 40) & 0xff] << 16) |
-                   (reverse_table[(word >> 48) & 0xff] << 8) |
-                   (reverse_table[(word >> 56) & 0xff]);
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) c += POPCOUNT(a[i] | b[i]);
+  return c;
+}
 
-  return reverse;
+static bit_index_t _andnot_popcount_scalar(const word_t *a, const word_t *b,
+                                           word_addr_t n)
+{
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i < n; i++) c += POPCOUNT(a[i] & ~b[i]);
+  return c;
 }
 
-static inline void _mask_top_word(BIT_ARRAY* bitarr)
+static char _intersects_scalar(const word_t *a, const word_t *b, word_addr_t n)
 {
-  // Mask top word
-  word_addr_t num_of_words = MAX(1, bitarr->num_of_words);
-  word_offset_t bits_active = bits_in_top_word(bitarr->num_of_bits);
-  bitarr->words[num_of_words-1] &= bitmask64(bits_active);
+  word_addr_t i;
+  for(i = 0; i < n; i++) if(a[i] & b[i]) return 1;
+  return 0;
 }
 
-//
-// Get and set words (internal use only -- no bounds checking)
-//
+// Top word first, so each word is read before it is overwritten
+static void _shl_words_scalar(word_t *w, word_addr_t n, word_offset_t r)
+{
+  for(; n > 1; n--) w[n-1] = (w[n-1] << r) | (w[n-2] >> (WORD_SIZE - r));
+  if(n == 1) w[0] <<= r;
+}
 
-static inline word_t _get_word(const BIT_ARRAY* bitarr, bit_index_t start)
+static void _shr_words_scalar(word_t *w, word_addr_t n, word_offset_t r)
 {
-  word_addr_t word_index = bitset64_wrd(start);
-  word_offset_t word_offset = bitset64_idx(start);
+  word_addr_t i;
+  if(n == 0) return;
+  for(i = 0; i + 1 < n; i++) w[i] = (w[i] >> r) | (w[i+1] << (WORD_SIZE - r));
+  w[i] >>= r;
+}
+
+static const WordKernels kernels_scalar = {
+  "scalar",
+  _and_words_scalar, _or_words_scalar, _xor_words_scalar, _andnot_words_scalar,
+  _not_words_scalar,
+  _popcount_scalar, _xor_popcount_scalar,
+  _and_popcount_scalar, _or_popcount_scalar, _andnot_popcount_scalar,
+  _intersects_scalar,
+  _shl_words_scalar, _shr_words_scalar
+};
 
-  word_t result = bitarr->words[word_index] >> word_offset;
+#if defined(BIT_ARRAY_SIMD_X86)
 
-  word_offset_t bits_taken = WORD_SIZE - word_offset;
+// Define a binary logic kernel. VEC is the vector type, W the number of words
+// per vector, LOAD/STORE/OP the intrinsics.
+#define _simd_logic_func_def(FUNC,TGT,VEC,W,LOAD,STORE,OP,SCALAR) \
+__attribute__((target(TGT))) \
+static void FUNC(word_t *dst, const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  word_addr_t i; \
+  for(i = 0; i + W <= n; i += W) { \
+    VEC va = LOAD((const VEC*)(a+i)), vb = LOAD((const VEC*)(b+i)); \
+    STORE((VEC*)(dst+i), OP(va, vb)); \
+  } \
+  SCALAR(dst+i, a+i, b+i, n-i); \
+}
+
+_simd_logic_func_def(_and_words_sse2, "sse2", __m128i, 2, _mm_loadu_si128,
+                     _mm_storeu_si128, _mm_and_si128, _and_words_scalar);
+_simd_logic_func_def(_or_words_sse2,  "sse2", __m128i, 2, _mm_loadu_si128,
+                     _mm_storeu_si128, _mm_or_si128,  _or_words_scalar);
+_simd_logic_func_def(_xor_words_sse2, "sse2", __m128i, 2, _mm_loadu_si128,
+                     _mm_storeu_si128, _mm_xor_si128, _xor_words_scalar);
+
+_simd_logic_func_def(_and_words_avx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+                     _mm256_storeu_si256, _mm256_and_si256, _and_words_scalar);
+_simd_logic_func_def(_or_words_avx2,  "avx2", __m256i, 4, _mm256_loadu_si256,
+                     _mm256_storeu_si256, _mm256_or_si256,  _or_words_scalar);
+_simd_logic_func_def(_xor_words_avx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+                     _mm256_storeu_si256, _mm256_xor_si256, _xor_words_scalar);
+
+// x86 andnot intrinsics compute ~first & second
+#define _andnot128(a,b) _mm_andnot_si128(b,a)
+#define _andnot256(a,b) _mm256_andnot_si256(b,a)
+#define _andnot512(a,b) _mm512_andnot_si512(b,a)
+
+_simd_logic_func_def(_andnot_words_sse2, "sse2", __m128i, 2, _mm_loadu_si128,
+                     _mm_storeu_si128, _andnot128, _andnot_words_scalar);
+_simd_logic_func_def(_andnot_words_avx2, "avx2", __m256i, 4, _mm256_loadu_si256,
+                     _mm256_storeu_si256, _andnot256, _andnot_words_scalar);
+
+#define _load512(p) _mm512_loadu_si512((const void*)(p))
+#define _store512(p,v) _mm512_storeu_si512((void*)(p),v)
+
+_simd_logic_func_def(_and_words_avx512, "avx512f", __m512i, 8, _load512,
+                     _store512, _mm512_and_si512, _and_words_scalar);
+_simd_logic_func_def(_or_words_avx512,  "avx512f", __m512i, 8, _load512,
+                     _store512, _mm512_or_si512,  _or_words_scalar);
+_simd_logic_func_def(_xor_words_avx512, "avx512f", __m512i, 8, _load512,
+                     _store512, _mm512_xor_si512, _xor_words_scalar);
+_simd_logic_func_def(_andnot_words_avx512, "avx512f", __m512i, 8, _load512,
+                     _store512, _andnot512, _andnot_words_scalar);
+
+// Define a pair of funnel shift kernels. A vector of words and the same vector
+// loaded one word lower (shl) or higher (shr) are shifted in opposite
+// directions and ORed. Vectors are read before the store that overlaps them.
+#define _simd_shift_func_def(SHL,SHR,TGT,VEC,W,LOAD,STORE,SLL,SRL,OR) \
+__attribute__((target(TGT))) \
+static void SHL(word_t *w, word_addr_t n, word_offset_t r) \
+{ \
+  __m128i cl = _mm_cvtsi32_si128(r), cr = _mm_cvtsi32_si128(WORD_SIZE - r); \
+  for(; n > W; n -= W) { \
+    VEC cur = LOAD((const VEC*)(w+n-W)), prev = LOAD((const VEC*)(w+n-W-1)); \
+    STORE((VEC*)(w+n-W), OR(SLL(cur, cl), SRL(prev, cr))); \
+  } \
+  _shl_words_scalar(w, n, r); \
+} \
+__attribute__((target(TGT))) \
+static void SHR(word_t *w, word_addr_t n, word_offset_t r) \
+{ \
+  __m128i cr = _mm_cvtsi32_si128(r), cl = _mm_cvtsi32_si128(WORD_SIZE - r); \
+  word_addr_t i; \
+  for(i = 0; i + W < n; i += W) { \
+    VEC cur = LOAD((const VEC*)(w+i)), next = LOAD((const VEC*)(w+i+1)); \
+    STORE((VEC*)(w+i), OR(SRL(cur, cr), SLL(next, cl))); \
+  } \
+  _shr_words_scalar(w+i, n-i, r); \
+}
 
-  // word_offset is now the number of bits we need from the next word
-  // Check the next word has at least some bits
-  if(word_offset > 0 && start + bits_taken < bitarr->num_of_bits)
-  {
-    result |= bitarr->words[word_index+1] << (WORD_SIZE - word_offset);
-  }
+_simd_shift_func_def(_shl_words_sse2, _shr_words_sse2, "sse2", __m128i, 2,
+                     _mm_loadu_si128, _mm_storeu_si128,
+                     _mm_sll_epi64, _mm_srl_epi64, _mm_or_si128);
+_simd_shift_func_def(_shl_words_avx2, _shr_words_avx2, "avx2", __m256i, 4,
+                     _mm256_loadu_si256, _mm256_storeu_si256,
+                     _mm256_sll_epi64, _mm256_srl_epi64, _mm256_or_si256);
+_simd_shift_func_def(_shl_words_avx512, _shr_words_avx512, "avx512f", __m512i, 8,
+                     _load512, _store512,
+                     _mm512_sll_epi64, _mm512_srl_epi64, _mm512_or_si512);
 
-  return result;
+__attribute__((target("sse2")))
+static void _not_words_sse2(word_t *dst, const word_t *src, word_addr_t n)
+{
+  const __m128i ones = _mm_set1_epi32(-1);
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+    _mm_storeu_si128((__m128i*)(dst+i), _mm_xor_si128(v, ones));
+  }
+  _not_words_scalar(dst+i, src+i, n-i);
 }
 
-// Set 64 bits from a particular start position
-// Doesn't extend bit array
-static inline void _set_word(BIT_ARRAY* bitarr, bit_index_t start, word_t word)
+__attribute__((target("avx2")))
+static void _not_words_avx2(word_t *dst, const word_t *src, word_addr_t n)
 {
-  word_addr_t word_index = bitset64_wrd(start);
-  word_offset_t word_offset = bitset64_idx(start);
-
-  if(word_offset == 0)
-  {
-    bitarr->words[word_index] = word;
+  const __m256i ones = _mm256_set1_epi32(-1);
+  word_addr_t i;
+  for(i = 0; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src+i));
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm256_xor_si256(v, ones));
   }
-  else
-  {
-    bitarr->words[word_index]
-      = (word << word_offset) |
-        (bitarr->words[word_index] & bitmask64(word_offset));
+  _not_words_scalar(dst+i, src+i, n-i);
+}
 
-    if(word_index+1 < bitarr->num_of_words)
-    {
-      bitarr->words[word_index+1]
-        = (word >> (WORD_SIZE - word_offset)) |
-          (bitarr->words[word_index+1] & (WORD_MAX << word_offset));
-    }
+__attribute__((target("avx512f")))
+static void _not_words_avx512(word_t *dst, const word_t *src, word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i + 8 <= n; i += 8) {
+    __m512i v = _mm512_loadu_si512((const void*)(src+i));
+    _mm512_storeu_si512((void*)(dst+i), _mm512_ternarylogic_epi64(v, v, v, 0x55));
   }
+  _not_words_scalar(dst+i, src+i, n-i);
+}
 
-  // Mask top word
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
+// SSE2 has no popcount instruction: count bits in parallel within each byte,
+// then sum the bytes with psadbw
+__attribute__((target("sse2")))
+static inline __m128i _popcount_bytes_sse2(__m128i v)
+{
+  const __m128i m1 = _mm_set1_epi8(0x55);
+  const __m128i m2 = _mm_set1_epi8(0x33);
+  const __m128i m4 = _mm_set1_epi8(0x0f);
+  v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+  v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+  v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+  return _mm_sad_epu8(v, _mm_setzero_si128());
 }
 
-static inline void _set_byte(BIT_ARRAY *bitarr, bit_index_t start, uint8_t byte)
+__attribute__((target("sse2")))
+static bit_index_t _popcount_sse2(const word_t *src, word_addr_t n)
 {
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, (w & ~(word_t)0xff) | byte);
+  __m128i acc = _mm_setzero_si128();
+  uint64_t sums[2];
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2)
+    acc = _mm_add_epi64(acc, _popcount_bytes_sse2(_mm_loadu_si128((const __m128i*)(src+i))));
+  _mm_storeu_si128((__m128i*)sums, acc);
+  return sums[0] + sums[1] + _popcount_scalar(src+i, n-i);
 }
 
-// 4 bits
-static inline void _set_nibble(BIT_ARRAY *bitarr, bit_index_t start,
-                               uint8_t nibble)
+// Define a popcount of OP(a, b) for SSE2
+#define _sse2_popcount_func_def(FUNC,OP,SCALAR) \
+__attribute__((target("sse2"))) \
+static bit_index_t FUNC(const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  __m128i acc = _mm_setzero_si128(); \
+  uint64_t sums[2]; \
+  word_addr_t i; \
+  for(i = 0; i + 2 <= n; i += 2) { \
+    __m128i v = OP(_mm_loadu_si128((const __m128i*)(a+i)), \
+                   _mm_loadu_si128((const __m128i*)(b+i))); \
+    acc = _mm_add_epi64(acc, _popcount_bytes_sse2(v)); \
+  } \
+  _mm_storeu_si128((__m128i*)sums, acc); \
+  return sums[0] + sums[1] + SCALAR(a+i, b+i, n-i); \
+}
+
+_sse2_popcount_func_def(_xor_popcount_sse2, _mm_xor_si128, _xor_popcount_scalar);
+_sse2_popcount_func_def(_and_popcount_sse2, _mm_and_si128, _and_popcount_scalar);
+_sse2_popcount_func_def(_or_popcount_sse2,  _mm_or_si128,  _or_popcount_scalar);
+_sse2_popcount_func_def(_andnot_popcount_sse2, _andnot128,
+                        _andnot_popcount_scalar);
+
+// AVX2: nibble lookup with vpshufb, byte sums with vpsadbw (Mula et al.)
+__attribute__((target("avx2")))
+static inline __m256i _popcount_bytes_avx2(__m256i v)
 {
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, (w & ~(word_t)0xf) | nibble);
+  const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                          0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i lo = _mm256_and_si256(v, low_mask);
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+  __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                _mm256_shuffle_epi8(lookup, hi));
+  return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
 }
 
-// Wrap around
-static inline word_t _get_word_cyclic(const BIT_ARRAY* bitarr, bit_index_t start)
+__attribute__((target("avx2")))
+static inline uint64_t _hsum_epi64_avx2(__m256i v)
 {
-  word_t word = _get_word(bitarr, start);
+  uint64_t sums[4];
+  _mm256_storeu_si256((__m256i*)sums, v);
+  return sums[0] + sums[1] + sums[2] + sums[3];
+}
 
-  bit_index_t bits_taken = bitarr->num_of_bits - start;
+__attribute__((target("avx2,popcnt")))
+static bit_index_t _popcount_avx2(const word_t *src, word_addr_t n)
+{
+  __m256i acc = _mm256_setzero_si256();
+  bit_index_t c = 0;
+  word_addr_t i;
+  for(i = 0; i + 4 <= n; i += 4)
+    acc = _mm256_add_epi64(acc, _popcount_bytes_avx2(_mm256_loadu_si256((const __m256i*)(src+i))));
+  for(; i < n; i++) c += POPCOUNT(src[i]);
+  return c + _hsum_epi64_avx2(acc);
+}
+
+// Carry-save adder: h:l = a + b + c, bitwise
+#define _csa_avx2(h,l,a,b,c) do { \
+  __m256i _a = (a), _b = (b), _c = (c), _u = _mm256_xor_si256(_a, _b); \
+  h = _mm256_or_si256(_mm256_and_si256(_a, _b), _mm256_and_si256(_u, _c)); \
+  l = _mm256_xor_si256(_u, _c); \
+} while(0)
+
+// Harley-Seal: add 16 vectors to the running ones, twos, fours and eights
+// bit-sliced counters, and return the carry out (the sixteens) so only one in
+// 16 vectors needs a popcount (Mula, Kurz & Lemire)
+__attribute__((target("avx2")))
+static inline __m256i _harley_seal_avx2(const __m256i *v, __m256i *ones,
+                                        __m256i *twos, __m256i *fours,
+                                        __m256i *eights)
+{
+  __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b, sixteens;
+  _csa_avx2(twos_a, *ones, *ones, v[0], v[1]);
+  _csa_avx2(twos_b, *ones, *ones, v[2], v[3]);
+  _csa_avx2(fours_a, *twos, *twos, twos_a, twos_b);
+  _csa_avx2(twos_a, *ones, *ones, v[4], v[5]);
+  _csa_avx2(twos_b, *ones, *ones, v[6], v[7]);
+  _csa_avx2(fours_b, *twos, *twos, twos_a, twos_b);
+  _csa_avx2(eights_a, *fours, *fours, fours_a, fours_b);
+  _csa_avx2(twos_a, *ones, *ones, v[8], v[9]);
+  _csa_avx2(twos_b, *ones, *ones, v[10], v[11]);
+  _csa_avx2(fours_a, *twos, *twos, twos_a, twos_b);
+  _csa_avx2(twos_a, *ones, *ones, v[12], v[13]);
+  _csa_avx2(twos_b, *ones, *ones, v[14], v[15]);
+  _csa_avx2(fours_b, *twos, *twos, twos_a, twos_b);
+  _csa_avx2(eights_b, *fours, *fours, fours_a, fours_b);
+  _csa_avx2(sixteens, *eights, *eights, eights_a, eights_b);
+  return sixteens;
+}
+
+// Define a popcount of OP(a, b) for AVX2: Harley-Seal over blocks of 64 words,
+// then a vector and word at a time
+#define _avx2_popcount_func_def(FUNC,OP,SCALAR) \
+__attribute__((target("avx2,popcnt"))) \
+static bit_index_t FUNC(const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  __m256i v[16], acc = _mm256_setzero_si256(); \
+  __m256i ones = acc, twos = acc, fours = acc, eights = acc; \
+  word_addr_t i, k; \
+  for(i = 0; i + 64 <= n; i += 64) { \
+    for(k = 0; k < 16; k++) \
+      v[k] = OP(_mm256_loadu_si256((const __m256i*)(a+i+4*k)), \
+                _mm256_loadu_si256((const __m256i*)(b+i+4*k))); \
+    acc = _mm256_add_epi64(acc, _popcount_bytes_avx2( \
+            _harley_seal_avx2(v, &ones, &twos, &fours, &eights))); \
+  } \
+  acc = _mm256_slli_epi64(acc, 4); \
+  acc = _mm256_add_epi64(acc, _mm256_slli_epi64(_popcount_bytes_avx2(eights), 3)); \
+  acc = _mm256_add_epi64(acc, _mm256_slli_epi64(_popcount_bytes_avx2(fours), 2)); \
+  acc = _mm256_add_epi64(acc, _mm256_slli_epi64(_popcount_bytes_avx2(twos), 1)); \
+  acc = _mm256_add_epi64(acc, _popcount_bytes_avx2(ones)); \
+  for(; i + 4 <= n; i += 4) { \
+    __m256i x = OP(_mm256_loadu_si256((const __m256i*)(a+i)), \
+                   _mm256_loadu_si256((const __m256i*)(b+i))); \
+    acc = _mm256_add_epi64(acc, _popcount_bytes_avx2(x)); \
+  } \
+  return _hsum_epi64_avx2(acc) + SCALAR(a+i, b+i, n-i); \
+}
 
-  if(bits_taken < WORD_SIZE)
-  {
-    word |= (bitarr->words[0] << bits_taken);
+_avx2_popcount_func_def(_xor_popcount_avx2, _mm256_xor_si256, _xor_popcount_scalar);
+_avx2_popcount_func_def(_and_popcount_avx2, _mm256_and_si256, _and_popcount_scalar);
+_avx2_popcount_func_def(_or_popcount_avx2,  _mm256_or_si256,  _or_popcount_scalar);
+_avx2_popcount_func_def(_andnot_popcount_avx2, _andnot256,
+                        _andnot_popcount_scalar);
 
-    if(bitarr->num_of_bits < (bit_index_t)WORD_SIZE)
-    {
-      // Mask word to prevent repetition of the same bits
-      word = word & bitmask64(bitarr->num_of_bits);
-    }
+__attribute__((target("avx2")))
+static char _intersects_avx2(const word_t *a, const word_t *b, word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i + 4 <= n; i += 4) {
+    if(!_mm256_testz_si256(_mm256_loadu_si256((const __m256i*)(a+i)),
+                           _mm256_loadu_si256((const __m256i*)(b+i))))
+      return 1;
   }
-
-  return word;
+  return _intersects_scalar(a+i, b+i, n-i);
 }
 
-// Wrap around
-static inline void _set_word_cyclic(BIT_ARRAY* bitarr,
-                                    bit_index_t start, word_t word)
+// AVX-512 with VPOPCNTQ: per-lane 64 bit popcount, masked loads for the tail
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static bit_index_t _popcount_avx512(const word_t *src, word_addr_t n)
 {
-  _set_word(bitarr, start, word);
-
-  bit_index_t bits_set = bitarr->num_of_bits - start;
+  __m512i acc = _mm512_setzero_si512();
+  word_addr_t i;
+  for(i = 0; i + 8 <= n; i += 8)
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512((const void*)(src+i))));
+  if(i < n) {
+    __mmask8 m = (__mmask8)bitmask64(n - i);
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(m, src+i)));
+  }
+  return (bit_index_t)_mm512_reduce_add_epi64(acc);
+}
 
-  if(bits_set < WORD_SIZE && start > 0)
-  {
-    word >>= bits_set;
+// Define a popcount of OP(a, b) for AVX-512 with VPOPCNTQ. Masked loads of
+// the tail read zeros, and OP(0, 0) is 0 for all the ops
+#define _avx512_popcount_func_def(FUNC,OP) \
+__attribute__((target("avx512f,avx512vpopcntdq"))) \
+static bit_index_t FUNC(const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  __m512i acc = _mm512_setzero_si512(); \
+  word_addr_t i; \
+  for(i = 0; i + 8 <= n; i += 8) { \
+    __m512i v = OP(_mm512_loadu_si512((const void*)(a+i)), \
+                   _mm512_loadu_si512((const void*)(b+i))); \
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v)); \
+  } \
+  if(i < n) { \
+    __mmask8 m = (__mmask8)bitmask64(n - i); \
+    __m512i v = OP(_mm512_maskz_loadu_epi64(m, a+i), \
+                   _mm512_maskz_loadu_epi64(m, b+i)); \
+    acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v)); \
+  } \
+  return (bit_index_t)_mm512_reduce_add_epi64(acc); \
+}
 
-    // Prevent overwriting the bits we've just set
-    // by setting 'start' as the upper bound for the number of bits to write
-    word_offset_t bits_remaining = MIN(WORD_SIZE - bits_set, start);
-    word_t mask = bitmask64(bits_remaining);
+_avx512_popcount_func_def(_xor_popcount_avx512, _mm512_xor_si512);
+_avx512_popcount_func_def(_and_popcount_avx512, _mm512_and_si512);
+_avx512_popcount_func_def(_or_popcount_avx512,  _mm512_or_si512);
+_avx512_popcount_func_def(_andnot_popcount_avx512, _andnot512);
 
-    bitarr->words[0] = bitmask_merge(word, bitarr->words[0], mask);
+__attribute__((target("avx512f")))
+static char _intersects_avx512(const word_t *a, const word_t *b, word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i + 8 <= n; i += 8) {
+    if(_mm512_test_epi64_mask(_mm512_loadu_si512((const void*)(a+i)),
+                              _mm512_loadu_si512((const void*)(b+i))))
+      return 1;
   }
+  if(i < n) {
+    __mmask8 m = (__mmask8)bitmask64(n - i);
+    return _mm512_test_epi64_mask(_mm512_maskz_loadu_epi64(m, a+i),
+                                  _mm512_maskz_loadu_epi64(m, b+i)) != 0;
+  }
+  return 0;
 }
 
-//
-// Fill a region (internal use only)
-//
+static const WordKernels kernels_sse2 = {
+  "sse2",
+  _and_words_sse2, _or_words_sse2, _xor_words_sse2, _andnot_words_sse2,
+  _not_words_sse2,
+  _popcount_sse2, _xor_popcount_sse2,
+  _and_popcount_sse2, _or_popcount_sse2, _andnot_popcount_sse2,
+  _intersects_scalar,
+  _shl_words_sse2, _shr_words_sse2
+};
 
-// FillAction is fill with 0 or 1 or toggle
-typedef enum {ZERO_REGION, FILL_REGION, SWAP_REGION} FillAction;
+static const WordKernels kernels_avx2 = {
+  "avx2",
+  _and_words_avx2, _or_words_avx2, _xor_words_avx2, _andnot_words_avx2,
+  _not_words_avx2,
+  _popcount_avx2, _xor_popcount_avx2,
+  _and_popcount_avx2, _or_popcount_avx2, _andnot_popcount_avx2,
+  _intersects_avx2,
+  _shl_words_avx2, _shr_words_avx2
+};
 
-static inline void _set_region(BIT_ARRAY* bitarr, bit_index_t start,
-                               bit_index_t length, FillAction action)
-{
-  if(length == 0) return;
+// AVX-512F without VPOPCNTQ (e.g. Skylake-X) keeps the AVX2 popcounts
+static const WordKernels kernels_avx512f = {
+  "avx512f",
+  _and_words_avx512, _or_words_avx512, _xor_words_avx512, _andnot_words_avx512,
+  _not_words_avx512,
+  _popcount_avx2, _xor_popcount_avx2,
+  _and_popcount_avx2, _or_popcount_avx2, _andnot_popcount_avx2,
+  _intersects_avx512,
+  _shl_words_avx512, _shr_words_avx512
+};
 
-  word_addr_t first_word = bitset64_wrd(start);
-  word_addr_t last_word = bitset64_wrd(start+length-1);
-  word_offset_t foffset = bitset64_idx(start);
-  word_offset_t loffset = bitset64_idx(start+length-1);
+static const WordKernels kernels_avx512 = {
+  "avx512",
+  _and_words_avx512, _or_words_avx512, _xor_words_avx512, _andnot_words_avx512,
+  _not_words_avx512,
+  _popcount_avx512, _xor_popcount_avx512,
+  _and_popcount_avx512, _or_popcount_avx512, _andnot_popcount_avx512,
+  _intersects_avx512,
+  _shl_words_avx512, _shr_words_avx512
+};
 
-  if(first_word == last_word)
-  {
-    word_t mask = bitmask64(length) << foffset;
+#elif defined(BIT_ARRAY_SIMD_NEON)
 
-    switch(action)
-    {
-      case ZERO_REGION: bitarr->words[first_word] &= ~mask; break;
-      case FILL_REGION: bitarr->words[first_word] |=  mask; break;
-      case SWAP_REGION: bitarr->words[first_word] ^=  mask; break;
-    }
+#define _neon_logic_func_def(FUNC,OP,SCALAR) \
+static void FUNC(word_t *dst, const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  word_addr_t i; \
+  for(i = 0; i + 2 <= n; i += 2) \
+    vst1q_u64(dst+i, OP(vld1q_u64(a+i), vld1q_u64(b+i))); \
+  SCALAR(dst+i, a+i, b+i, n-i); \
+}
+
+_neon_logic_func_def(_and_words_neon, vandq_u64, _and_words_scalar);
+_neon_logic_func_def(_or_words_neon,  vorrq_u64, _or_words_scalar);
+_neon_logic_func_def(_xor_words_neon, veorq_u64, _xor_words_scalar);
+_neon_logic_func_def(_andnot_words_neon, vbicq_u64, _andnot_words_scalar);
+
+static void _not_words_neon(word_t *dst, const word_t *src, word_addr_t n)
+{
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2) {
+    uint8x16_t v = vreinterpretq_u8_u64(vld1q_u64(src+i));
+    vst1q_u64(dst+i, vreinterpretq_u64_u8(vmvnq_u8(v)));
   }
-  else
-  {
-    // Set first word
-    switch(action)
-    {
-      case ZERO_REGION: bitarr->words[first_word] &=  bitmask64(foffset); break;
-      case FILL_REGION: bitarr->words[first_word] |= ~bitmask64(foffset); break;
-      case SWAP_REGION: bitarr->words[first_word] ^= ~bitmask64(foffset); break;
-    }
-
-    word_addr_t i;
-
-    // Set whole words
-    switch(action)
-    {
-      case ZERO_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] = (word_t)0;
-        break;
-      case FILL_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] = WORD_MAX;
-        break;
-      case SWAP_REGION:
-        for(i = first_word + 1; i < last_word; i++)
-          bitarr->words[i] ^= WORD_MAX;
-        break;
-    }
+  _not_words_scalar(dst+i, src+i, n-i);
+}
 
-    // Set last word
-    switch(action)
-    {
-      case ZERO_REGION: bitarr->words[last_word] &= ~bitmask64(loffset+1); break;
-      case FILL_REGION: bitarr->words[last_word] |=  bitmask64(loffset+1); break;
-      case SWAP_REGION: bitarr->words[last_word] ^=  bitmask64(loffset+1); break;
-    }
-  }
+// vcnt counts bits per byte, then pairwise widening adds up to 64 bits
+static inline uint64x2_t _popcount_neon(uint64x2_t v)
+{
+  uint8x16_t c = vcntq_u8(vreinterpretq_u8_u64(v));
+  return vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(c)));
 }
 
+static bit_index_t _popcount_words_neon(const word_t *src, word_addr_t n)
+{
+  uint64x2_t acc = vdupq_n_u64(0);
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2)
+    acc = vaddq_u64(acc, _popcount_neon(vld1q_u64(src+i)));
+  return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) +
+         _popcount_scalar(src+i, n-i);
+}
 
+#define _neon_popcount_func_def(FUNC,OP,SCALAR) \
+static bit_index_t FUNC(const word_t *a, const word_t *b, word_addr_t n) \
+{ \
+  uint64x2_t acc = vdupq_n_u64(0); \
+  word_addr_t i; \
+  for(i = 0; i + 2 <= n; i += 2) \
+    acc = vaddq_u64(acc, _popcount_neon(OP(vld1q_u64(a+i), vld1q_u64(b+i)))); \
+  return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) + \
+         SCALAR(a+i, b+i, n-i); \
+}
 
-//
-// Constructor
-//
+_neon_popcount_func_def(_xor_popcount_neon, veorq_u64, _xor_popcount_scalar);
+_neon_popcount_func_def(_and_popcount_neon, vandq_u64, _and_popcount_scalar);
+_neon_popcount_func_def(_or_popcount_neon,  vorrq_u64, _or_popcount_scalar);
+_neon_popcount_func_def(_andnot_popcount_neon, vbicq_u64,
+                        _andnot_popcount_scalar);
 
-// If cannot allocate memory, set errno to ENOMEM, return NULL
-BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits)
+// vshl shifts right for negative counts
+static void _shl_words_neon(word_t *w, word_addr_t n, word_offset_t r)
 {
-  bitarr->num_of_bits = nbits;
-  bitarr->num_of_words = roundup_bits2words64(nbits);
-  bitarr->capacity_in_words = MAX(8, roundup2pow(bitarr->num_of_words));
-  bitarr->words = (word_t*)calloc(bitarr->capacity_in_words, sizeof(word_t));
-  if(bitarr->words == NULL) {
-    errno = ENOMEM;
-    return NULL;
+  int64x2_t cl = vdupq_n_s64(r), cr = vdupq_n_s64((int64_t)r - WORD_SIZE);
+  for(; n > 2; n -= 2) {
+    uint64x2_t cur = vld1q_u64(w+n-2), prev = vld1q_u64(w+n-3);
+    vst1q_u64(w+n-2, vorrq_u64(vshlq_u64(cur, cl), vshlq_u64(prev, cr)));
   }
-  return bitarr;
+  _shl_words_scalar(w, n, r);
 }
 
-void bit_array_dealloc(BIT_ARRAY* bitarr)
+static void _shr_words_neon(word_t *w, word_addr_t n, word_offset_t r)
 {
-  free(bitarr->words);
-  memset(bitarr, 0, sizeof(BIT_ARRAY));
+  int64x2_t cr = vdupq_n_s64(-(int64_t)r), cl = vdupq_n_s64(WORD_SIZE - r);
+  word_addr_t i;
+  for(i = 0; i + 2 < n; i += 2) {
+    uint64x2_t cur = vld1q_u64(w+i), next = vld1q_u64(w+i+1);
+    vst1q_u64(w+i, vorrq_u64(vshlq_u64(cur, cr), vshlq_u64(next, cl)));
+  }
+  _shr_words_scalar(w+i, n-i, r);
 }
 
-// If cannot allocate memory, set errno to ENOMEM, return NULL
-BIT_ARRAY* bit_array_create(bit_index_t nbits)
-{
-  BIT_ARRAY* bitarr = (BIT_ARRAY*)malloc(sizeof(BIT_ARRAY));
+static const WordKernels kernels_neon = {
+  "neon",
+  _and_words_neon, _or_words_neon, _xor_words_neon, _andnot_words_neon,
+  _not_words_neon,
+  _popcount_words_neon, _xor_popcount_neon,
+  _and_popcount_neon, _or_popcount_neon, _andnot_popcount_neon,
+  _intersects_scalar,
+  _shl_words_neon, _shr_words_neon
+};
 
-  // error if could not allocate enough memory
-  if(bitarr == NULL || bit_array_alloc(bitarr, nbits) == NULL)
-  {
-    if(bitarr != NULL) free(bitarr);
-    errno = ENOMEM;
-    return NULL;
-  }
+#endif
 
-  DEBUG_PRINT("Creating BIT_ARRAY (bits: %lu; allocated words: %lu; "
-              "using words: %lu; WORD_SIZE: %i)\n",
-              (unsigned long)nbits, (unsigned long)bitarr->capacity_in_words,
-              (unsigned long)roundup_bits2words64(nbits), (int)WORD_SIZE);
+//
+// Text kernels
+//
+// Conversions between words and '0'/'1' (or any on/off chars) and hex
+// strings, a vector at a time: SSE2 does 16 chars per step, AVX2 32 and
+// AVX-512BW 64 (NEON uses the scalar versions). Chars are in bit order:
+// char i is bit i (least significant first), hex char i is nibble i.
+//
 
-  DEBUG_VALIDATE(bitarr);
+typedef struct
+{
+  // 64 chars per word
+  void (*words_to_chars)(char *dst, const word_t *src, word_addr_t n,
+                         char on, char off);
+  // Bit is set iff the char is `on`
+  void (*chars_to_words)(word_t *dst, const char *src, word_addr_t n, char on);
+  // 16 hex chars per word
+  void (*words_to_hex)(char *dst, const word_t *src, word_addr_t n,
+                       char uppercase);
+  // Returns the number of words decoded before a word with a non-hex char
+  word_addr_t (*hex_to_words)(word_t *dst, const char *src, word_addr_t n);
+} TextKernels;
 
-  return bitarr;
+static const char hex_digits_lower[] = "0123456789abcdef";
+static const char hex_digits_upper[] = "0123456789ABCDEF";
+
+// Returns 0..15, or a value > 15 if c is not a hex char
+static inline uint8_t _hex_value(char c)
+{
+  uint8_t d = (uint8_t)(c - '0'), l = (uint8_t)((c | 0x20) - 'a');
+  return d < 10 ? d : (l < 6 ? l + 10 : 0xff);
 }
 
-//
-// Destructor
-//
-void bit_array_free(BIT_ARRAY* bitarr)
+static void _words_to_chars_scalar(char *dst, const word_t *src, word_addr_t n,
+                                   char on, char off)
 {
-  if(bitarr->words != NULL)
-    free(bitarr->words);
+  word_addr_t i;
+  word_offset_t j;
+  const char diff = on ^ off;
+  for(i = 0; i < n; i++, dst += WORD_SIZE)
+    for(j = 0; j < WORD_SIZE; j++)
+      dst[j] = off ^ (diff & -(char)((src[i] >> j) & 1));
+}
 
-  free(bitarr);
+static void _chars_to_words_scalar(word_t *dst, const char *src, word_addr_t n,
+                                   char on)
+{
+  word_addr_t i;
+  word_offset_t j;
+  for(i = 0; i < n; i++, src += WORD_SIZE) {
+    word_t w = 0;
+    for(j = 0; j < WORD_SIZE; j++) w |= (word_t)(src[j] == on) << j;
+    dst[i] = w;
+  }
 }
 
-bit_index_t bit_array_length(const BIT_ARRAY* bit_arr)
+static void _words_to_hex_scalar(char *dst, const word_t *src, word_addr_t n,
+                                 char uppercase)
 {
-  return bit_arr->num_of_bits;
+  const char *digits = uppercase ? hex_digits_upper : hex_digits_lower;
+  word_addr_t i;
+  word_offset_t j;
+  for(i = 0; i < n; i++, dst += 16)
+    for(j = 0; j < 16; j++) dst[j] = digits[(src[i] >> (4*j)) & 0xf];
 }
 
-// Change the size of a bit array. Enlarging an array will add zeros
-// to the end of it. Returns 1 on success, 0 on failure (e.g. not enough memory)
-char bit_array_resize(BIT_ARRAY* bitarr, bit_index_t new_num_of_bits)
+static word_addr_t _hex_to_words_scalar(word_t *dst, const char *src,
+                                        word_addr_t n)
 {
-  word_addr_t old_num_of_words = bitarr->num_of_words;
-  word_addr_t new_num_of_words = roundup_bits2words64(new_num_of_bits);
+  word_addr_t i;
+  word_offset_t j;
+  for(i = 0; i < n; i++, src += 16) {
+    word_t w = 0;
+    uint8_t bad = 0, v;
+    for(j = 0; j < 16; j++) {
+      v = _hex_value(src[j]);
+      bad |= v;
+      w |= (word_t)(v & 0xf) << (4*j);
+    }
+    if(bad > 0xf) break;
+    dst[i] = w;
+  }
+  return i;
+}
 
-  bitarr->num_of_bits = new_num_of_bits;
-  bitarr->num_of_words = new_num_of_words;
+static const TextKernels text_kernels_scalar = {
+  _words_to_chars_scalar, _chars_to_words_scalar,
+  _words_to_hex_scalar, _hex_to_words_scalar
+};
 
-  DEBUG_PRINT("Resize: old_num_of_words: %i; new_num_of_words: %i capacity: %i\n",
-              (int)old_num_of_words, (int)new_num_of_words,
-              (int)bitarr->capacity_in_words);
+#if defined(BIT_ARRAY_SIMD_X86)
 
-  if(new_num_of_words > bitarr->capacity_in_words)
+__attribute__((target("sse2")))
+static void _words_to_chars_sse2(char *dst, const word_t *src, word_addr_t n,
+                                 char on, char off)
+{
+  const __m128i bits = _mm_set1_epi64x((long long)0x8040201008040201ULL);
+  const __m128i von = _mm_set1_epi8(on), voff = _mm_set1_epi8(off);
+  word_addr_t i;
+  int k;
+  for(i = 0; i < n; i++)
   {
-    // Need to change the amount of memory used
-    word_addr_t old_capacity_in_words = bitarr->capacity_in_words;
-    size_t old_capacity_in_bytes = old_capacity_in_words * sizeof(word_t);
-
-    bitarr->capacity_in_words = roundup2pow(new_num_of_words);
-    bitarr->capacity_in_words = MAX(8, bitarr->capacity_in_words);
-
-    size_t new_capacity_in_bytes = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->words = (word_t*)realloc(bitarr->words, new_capacity_in_bytes);
-
-    if(bitarr->words == NULL)
+    for(k = 0; k < 4; k++, dst += 16)
     {
-      // error - could not allocate enough memory
-      perror("resize realloc");
-      errno = ENOMEM;
-      return 0;
+      // Spread 16 bits over 16 bytes: byte j gets byte j/8 of x
+      __m128i v = _mm_cvtsi32_si128((int)((src[i] >> (16*k)) & 0xffff));
+      v = _mm_unpacklo_epi8(v, v);
+      v = _mm_unpacklo_epi16(v, v);
+      v = _mm_unpacklo_epi32(v, v);
+      __m128i m = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+      _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(m, von),
+                                                   _mm_andnot_si128(m, voff)));
     }
-
-    // Need to zero new memory
-    size_t num_bytes_to_zero = new_capacity_in_bytes - old_capacity_in_bytes;
-    memset(bitarr->words + old_capacity_in_words, 0, num_bytes_to_zero);
-
-    DEBUG_PRINT("zeroing from word %i for %i bytes\n", (int)old_capacity_in_words,
-                (int)num_bytes_to_zero);
   }
-  else if(new_num_of_words < old_num_of_words)
-  {
-    // Shrunk -- need to zero old memory
-    size_t num_bytes_to_zero = (old_num_of_words - new_num_of_words)*sizeof(word_t);
+}
 
-    memset(bitarr->words + new_num_of_words, 0, num_bytes_to_zero);
+__attribute__((target("sse2")))
+static void _chars_to_words_sse2(word_t *dst, const char *src, word_addr_t n,
+                                 char on)
+{
+  const __m128i von = _mm_set1_epi8(on);
+  word_addr_t i;
+  int k;
+  for(i = 0; i < n; i++)
+  {
+    word_t w = 0;
+    for(k = 0; k < 4; k++, src += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)src);
+      w |= (word_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, von)) << (16*k);
+    }
+    dst[i] = w;
   }
-
-  // Mask top word
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
-  return 1;
 }
 
-void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+// Nibbles 0..15 to hex chars: add '0', and 7 ('A'-'9'-1) or 39 for 10..15
+__attribute__((target("sse2")))
+static inline __m128i _nibbles_to_hex_sse2(__m128i v, __m128i adj)
 {
-  bit_index_t old_num_of_bits = bitarr->num_of_bits;
+  __m128i gt9 = _mm_cmpgt_epi8(v, _mm_set1_epi8(9));
+  return _mm_add_epi8(_mm_add_epi8(v, _mm_set1_epi8('0')), _mm_and_si128(gt9, adj));
+}
 
-  if(!bit_array_resize(bitarr, num_of_bits))
+__attribute__((target("sse2")))
+static void _words_to_hex_sse2(char *dst, const word_t *src, word_addr_t n,
+                               char uppercase)
+{
+  const __m128i low = _mm_set1_epi8(0x0f);
+  const __m128i adj = _mm_set1_epi8(uppercase ? 7 : 39);
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2, dst += 32)
   {
-    fprintf(stderr, "Ran out of memory resizing [%lu -> %lu]",
-            (unsigned long)old_num_of_bits, (unsigned long)num_of_bits);
-    abort();
+    __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+    __m128i lo = _mm_and_si128(v, low);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+    // low nibble of each byte comes first
+    _mm_storeu_si128((__m128i*)dst, _nibbles_to_hex_sse2(_mm_unpacklo_epi8(lo, hi), adj));
+    _mm_storeu_si128((__m128i*)(dst+16), _nibbles_to_hex_sse2(_mm_unpackhi_epi8(lo, hi), adj));
   }
+  _words_to_hex_scalar(dst, src+i, n-i, uppercase);
 }
 
-// If bitarr length < num_bits, resizes to num_bits
-char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits)
+__attribute__((target("sse2")))
+static word_addr_t _hex_to_words_sse2(word_t *dst, const char *src,
+                                      word_addr_t n)
 {
-  if(bitarr->num_of_bits < ensure_num_of_bits)
-  {
-    return bit_array_resize(bitarr, ensure_num_of_bits);
+  const __m128i zero = _mm_set1_epi8('0'), a = _mm_set1_epi8('a');
+  const __m128i nine = _mm_set1_epi8(9), five = _mm_set1_epi8(5);
+  const __m128i lower = _mm_set1_epi8(0x20), ten = _mm_set1_epi8(10);
+  const __m128i low_byte = _mm_set1_epi16(0xff);
+  word_addr_t i;
+  for(i = 0; i < n; i++, src += 16)
+  {
+    __m128i c = _mm_loadu_si128((const __m128i*)src);
+    __m128i d = _mm_sub_epi8(c, zero);
+    __m128i l = _mm_sub_epi8(_mm_or_si128(c, lower), a);
+    // unsigned d <= 9, l <= 5
+    __m128i digit = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+    __m128i alpha = _mm_cmpeq_epi8(_mm_min_epu8(l, five), l);
+    if(_mm_movemask_epi8(_mm_or_si128(digit, alpha)) != 0xffff) break;
+
+    __m128i v = _mm_or_si128(_mm_and_si128(digit, d),
+                             _mm_andnot_si128(digit, _mm_add_epi8(l, ten)));
+    // 16 bit lanes (v0 | v1 << 8) to bytes (v0 | v1 << 4)
+    v = _mm_and_si128(_mm_or_si128(v, _mm_srli_epi16(v, 4)), low_byte);
+    _mm_storel_epi64((__m128i*)(dst+i), _mm_packus_epi16(v, v));
   }
-
-  return 1;
+  return i;
 }
 
-void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+__attribute__((target("avx2")))
+static void _words_to_chars_avx2(char *dst, const word_t *src, word_addr_t n,
+                                 char on, char off)
 {
-  if(num_of_bits > bitarr->num_of_bits)
+  // byte j of each 32 byte vector gets byte j/8 of the 32 bit input
+  const __m256i spread = _mm256_setr_epi8(0,0,0,0,0,0,0,0,1,1,1,1,1,1,1,1,
+                                          2,2,2,2,2,2,2,2,3,3,3,3,3,3,3,3);
+  const __m256i bits = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+  const __m256i von = _mm256_set1_epi8(on), voff = _mm256_set1_epi8(off);
+  word_addr_t i;
+  int k;
+  for(i = 0; i < n; i++)
   {
-    bit_array_resize_critical(bitarr, num_of_bits);
+    for(k = 0; k < 2; k++, dst += 32)
+    {
+      __m256i v = _mm256_set1_epi32((int)(uint32_t)(src[i] >> (32*k)));
+      v = _mm256_shuffle_epi8(v, spread);
+      __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+      _mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(voff, von, m));
+    }
   }
 }
 
-static inline
-void _bit_array_ensure_nwords(BIT_ARRAY* bitarr, word_addr_t nwords,
-                              const char *file, int lineno, const char *func)
+__attribute__((target("avx2")))
+static void _chars_to_words_avx2(word_t *dst, const char *src, word_addr_t n,
+                                 char on)
 {
-  size_t newmem, oldmem;
-  if(bitarr->capacity_in_words < nwords) {
-    oldmem = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->capacity_in_words = roundup2pow(nwords);
-    newmem = bitarr->capacity_in_words * sizeof(word_t);
-    bitarr->words = (word_t*)realloc(bitarr->words, newmem);
-
-    if(bitarr->words == NULL) {
-      fprintf(stderr, "[%s:%i:%s()] Ran out of memory resizing [%zu -> %zu]",
-              file, lineno, func, oldmem, newmem);
-      abort();
-    }
-
-    DEBUG_PRINT("Ensure nwords realloc %zu -> %zu\n", oldmem, newmem);
+  const __m256i von = _mm256_set1_epi8(on);
+  word_addr_t i;
+  for(i = 0; i < n; i++, src += 64)
+  {
+    __m256i v0 = _mm256_loadu_si256((const __m256i*)src);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*)(src+32));
+    uint32_t m0 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, von));
+    uint32_t m1 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, von));
+    dst[i] = (word_t)m0 | ((word_t)m1 << 32);
   }
 }
 
+__attribute__((target("avx2")))
+static inline __m256i _nibbles_to_hex_avx2(__m256i v, __m256i adj)
+{
+  __m256i gt9 = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(9));
+  return _mm256_add_epi8(_mm256_add_epi8(v, _mm256_set1_epi8('0')),
+                         _mm256_and_si256(gt9, adj));
+}
 
-//
-// Get, set, clear, assign and toggle individual bits
-//
-
-// Get the value of a bit (returns 0 or 1)
-char bit_array_get_bit(const BIT_ARRAY* bitarr, bit_index_t b)
+__attribute__((target("avx2")))
+static void _words_to_hex_avx2(char *dst, const word_t *src, word_addr_t n,
+                               char uppercase)
 {
-  assert(b < bitarr->num_of_bits);
-  return bit_array_get(bitarr, b);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  const __m256i adj = _mm256_set1_epi8(uppercase ? 7 : 39);
+  word_addr_t i;
+  for(i = 0; i + 4 <= n; i += 4, dst += 64)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(src+i));
+    __m256i lo = _mm256_and_si256(v, low);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+    // unpack works within 128 bit lanes: a = bytes 0-7,16-23; b = 8-15,24-31
+    __m256i a = _nibbles_to_hex_avx2(_mm256_unpacklo_epi8(lo, hi), adj);
+    __m256i b = _nibbles_to_hex_avx2(_mm256_unpackhi_epi8(lo, hi), adj);
+    _mm256_storeu_si256((__m256i*)dst, _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i*)(dst+32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  _words_to_hex_sse2(dst, src+i, n-i, uppercase);
 }
 
-// set a bit (to 1) at position b
-void bit_array_set_bit(BIT_ARRAY* bitarr, bit_index_t b)
+__attribute__((target("avx2")))
+static word_addr_t _hex_to_words_avx2(word_t *dst, const char *src,
+                                      word_addr_t n)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_set(bitarr,b);
-  DEBUG_VALIDATE(bitarr);
+  const __m256i zero = _mm256_set1_epi8('0'), a = _mm256_set1_epi8('a');
+  const __m256i nine = _mm256_set1_epi8(9), five = _mm256_set1_epi8(5);
+  const __m256i lower = _mm256_set1_epi8(0x20), ten = _mm256_set1_epi8(10);
+  const __m256i pair = _mm256_set1_epi16(0x1001); // v0*1 + v1*16
+  word_addr_t i;
+  for(i = 0; i + 2 <= n; i += 2, src += 32)
+  {
+    __m256i c = _mm256_loadu_si256((const __m256i*)src);
+    __m256i d = _mm256_sub_epi8(c, zero);
+    __m256i l = _mm256_sub_epi8(_mm256_or_si256(c, lower), a);
+    __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+    __m256i alpha = _mm256_cmpeq_epi8(_mm256_min_epu8(l, five), l);
+    if(_mm256_movemask_epi8(_mm256_or_si256(digit, alpha)) != -1) break;
+
+    __m256i v = _mm256_blendv_epi8(_mm256_add_epi8(l, ten), d, digit);
+    v = _mm256_maddubs_epi16(v, pair);
+    v = _mm256_packus_epi16(v, v);
+    v = _mm256_permute4x64_epi64(v, 0x08);
+    _mm_storeu_si128((__m128i*)(dst+i), _mm256_castsi256_si128(v));
+  }
+  return i + _hex_to_words_sse2(dst+i, src, n-i);
 }
 
-// clear a bit (to 0) at position b
-void bit_array_clear_bit(BIT_ARRAY* bitarr, bit_index_t b)
+__attribute__((target("avx512f,avx512bw")))
+static void _words_to_chars_avx512(char *dst, const word_t *src, word_addr_t n,
+                                   char on, char off)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_clear(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  const __m512i von = _mm512_set1_epi8(on), voff = _mm512_set1_epi8(off);
+  word_addr_t i;
+  for(i = 0; i < n; i++, dst += 64)
+    _mm512_storeu_si512((void*)dst, _mm512_mask_blend_epi8((__mmask64)src[i], voff, von));
 }
 
-// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
-void bit_array_toggle_bit(BIT_ARRAY* bitarr, bit_index_t b)
+__attribute__((target("avx512f,avx512bw")))
+static void _chars_to_words_avx512(word_t *dst, const char *src, word_addr_t n,
+                                   char on)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_toggle(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  const __m512i von = _mm512_set1_epi8(on);
+  word_addr_t i;
+  for(i = 0; i < n; i++, src += 64)
+    dst[i] = (word_t)_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void*)src), von);
 }
 
-// If char c != 0, set bit; otherwise clear bit
-void bit_array_assign_bit(BIT_ARRAY* bitarr, bit_index_t b, char c)
+__attribute__((target("avx512f,avx512bw")))
+static word_addr_t _hex_to_words_avx512(word_t *dst, const char *src,
+                                        word_addr_t n)
 {
-  assert(b < bitarr->num_of_bits);
-  bit_array_assign(bitarr, b, c ? 1 : 0);
-  DEBUG_VALIDATE(bitarr);
+  const __m512i zero = _mm512_set1_epi8('0'), a = _mm512_set1_epi8('a');
+  const __m512i ten = _mm512_set1_epi8(10), six = _mm512_set1_epi8(6);
+  const __m512i lower = _mm512_set1_epi8(0x20);
+  const __m512i pair = _mm512_set1_epi16(0x1001);
+  word_addr_t i;
+  for(i = 0; i + 4 <= n; i += 4, src += 64)
+  {
+    __m512i c = _mm512_loadu_si512((const void*)src);
+    __m512i d = _mm512_sub_epi8(c, zero);
+    __m512i l = _mm512_sub_epi8(_mm512_or_si512(c, lower), a);
+    __mmask64 digit = _mm512_cmplt_epu8_mask(d, ten);
+    __mmask64 alpha = _mm512_cmplt_epu8_mask(l, six);
+    if((digit | alpha) != ~(__mmask64)0) break;
+
+    __m512i v = _mm512_mask_blend_epi8(digit, _mm512_add_epi8(l, ten), d);
+    v = _mm512_maddubs_epi16(v, pair);
+    _mm256_storeu_si256((__m256i*)(dst+i), _mm512_cvtepi16_epi8(v));
+  }
+  return i + _hex_to_words_avx2(dst+i, src, n-i);
 }
 
+static const TextKernels text_kernels_sse2 = {
+  _words_to_chars_sse2, _chars_to_words_sse2,
+  _words_to_hex_sse2, _hex_to_words_sse2
+};
+
+static const TextKernels text_kernels_avx2 = {
+  _words_to_chars_avx2, _chars_to_words_avx2,
+  _words_to_hex_avx2, _hex_to_words_avx2
+};
+
+// Hex encoding is already 64 chars a step with AVX2
+static const TextKernels text_kernels_avx512 = {
+  _words_to_chars_avx512, _chars_to_words_avx512,
+  _words_to_hex_avx2, _hex_to_words_avx512
+};
+
+#endif
+
 //
-// Get, set etc with resize
+// CRC32C (Castagnoli) kernels, used for stream trailers
+// Software version is slicing-by-8, x86-64 uses the SSE4.2 crc32 instruction.
+// Both take and return the crc without the initial/final inversion.
 //
 
-// Get the value of a bit (returns 0 or 1)
-char bit_array_rget(BIT_ARRAY* bitarr, bit_index_t b)
+// Load a uint32 from little endian format
+static inline uint32_t le32_to_cpu(const uint8_t *x)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  return bit_array_get(bitarr, b);
+  return ((uint32_t)(x[0])       | ((uint32_t)(x[1]) << 8) |
+          ((uint32_t)(x[2]) << 16) | ((uint32_t)(x[3]) << 24));
 }
 
-// set a bit (to 1) at position b
-void bit_array_rset(BIT_ARRAY* bitarr, bit_index_t b)
+#define CRC32C_POLY 0x82F63B78U // reflected
+
+static uint32_t crc32c_table[8][256];
+static volatile char crc32c_table_ready = 0;
+
+static void _crc32c_init_table(void)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_set(bitarr,b);
-  DEBUG_VALIDATE(bitarr);
+  uint32_t i, j, c;
+  for(i = 0; i < 256; i++) {
+    for(c = i, j = 0; j < 8; j++) c = (c >> 1) ^ (CRC32C_POLY & (0U - (c & 1)));
+    crc32c_table[0][i] = c;
+  }
+  for(i = 0; i < 256; i++)
+    for(j = 1; j < 8; j++)
+      crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^
+                           crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+  crc32c_table_ready = 1;
 }
 
-// clear a bit (to 0) at position b
-void bit_array_rclear(BIT_ARRAY* bitarr, bit_index_t b)
+static uint32_t _crc32c_scalar(uint32_t crc, const uint8_t *buf, size_t len)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_clear(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  if(!crc32c_table_ready) _crc32c_init_table();
+
+  for(; len > 0 && ((size_t)buf & 7); len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+
+  for(; len >= 8; len -= 8, buf += 8) {
+    uint32_t lo = crc ^ le32_to_cpu(buf), hi = le32_to_cpu(buf+4);
+    crc = crc32c_table[7][lo & 0xff]         ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff]         ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+  }
+
+  for(; len > 0; len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xff];
+
+  return crc;
 }
 
-// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
-void bit_array_rtoggle(BIT_ARRAY* bitarr, bit_index_t b)
+#if defined(BIT_ARRAY_SIMD_X86) && defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
 {
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_toggle(bitarr, b);
-  DEBUG_VALIDATE(bitarr);
+  uint64_t c = crc, w;
+  for(; len > 0 && ((size_t)buf & 7); len--) c = _mm_crc32_u8((uint32_t)c, *buf++);
+  for(; len >= 8; len -= 8, buf += 8) {
+    memcpy(&w, buf, 8);
+    c = _mm_crc32_u64(c, w);
+  }
+  for(; len > 0; len--) c = _mm_crc32_u8((uint32_t)c, *buf++);
+  return (uint32_t)c;
 }
 
-// If char c != 0, set bit; otherwise clear bit
-void bit_array_rassign(BIT_ARRAY* bitarr, bit_index_t b, char c)
-{
-  bit_array_ensure_size_critical(bitarr, b+1);
-  bit_array_assign(bitarr, b, c ? 1 : 0);
-  DEBUG_VALIDATE(bitarr);
-}
+#endif
+
+static uint32_t (*crc32c_kernel)(uint32_t crc, const uint8_t *buf, size_t len)
+  = _crc32c_scalar;
 
 //
-// Get, set, clear and toggle several bits at once
+// Set bit decoding kernels
+// Write the positions of the set bits of (src[i] ^ flip), i < n, to dst, where
+// src[0] is at position base. Returns the number of positions written, which
+// is at most 64*n -- the caller makes sure there is room.
 //
 
-// Get the offsets of the set bits (for offsets start<=offset<end)
-// Returns the number of bits set
-// It is assumed that dst is at least of length (end-start)
-bit_index_t bit_array_get_bits(const BIT_ARRAY* bitarr,
-                               bit_index_t start, bit_index_t end,
-                               bit_index_t* dst)
+typedef struct
 {
-  bit_index_t i, n = 0;
-  assert(end <= bitarr->num_of_bits);
-  for(i = start; i < end; i++) {
-    if(bit_array_get(bitarr, i)) {
-      dst[n++] = i;
-    }
-  }
-  return n;
-}
+  size_t (*decode64)(uint64_t *dst, const word_t *src, word_addr_t n,
+                     bit_index_t base, word_t flip);
+  size_t (*decode32)(uint32_t *dst, const word_t *src, word_addr_t n,
+                     bit_index_t base, word_t flip);
+} DecodeKernels;
 
-// Set multiple bits at once.
-// e.g. set bits 1, 20 & 31: bit_array_set_bits(bitarr, 3, 1,20,31);
-void bit_array_set_bits(BIT_ARRAY* bitarr, size_t n, ...)
-{
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
+// w &= w-1 clears the lowest set bit
+#define _decode_word(dst,k,w,base,type) do {                                   \
+  for(; (w) != 0; (w) &= (w) - 1) (dst)[(k)++] = (type)((base) + trailing_zeros(w)); \
+} while(0)
 
-  for(i = 0; i < n; i++)
-  {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_set_bit(bitarr, bit_index);
+static size_t _decode64_scalar(uint64_t *dst, const word_t *src, word_addr_t n,
+                               bit_index_t base, word_t flip)
+{
+  size_t k = 0;
+  word_addr_t i;
+  word_t w;
+  for(i = 0; i < n; i++, base += WORD_SIZE) {
+    w = src[i] ^ flip;
+    _decode_word(dst, k, w, base, uint64_t);
   }
-
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
+  return k;
 }
 
-// Clear multiple bits at once.
-// e.g. clear bits 1, 20 & 31: bit_array_clear_bits(bitarr, 3, 1,20,31);
-void bit_array_clear_bits(BIT_ARRAY* bitarr, size_t n, ...)
+static size_t _decode32_scalar(uint32_t *dst, const word_t *src, word_addr_t n,
+                               bit_index_t base, word_t flip)
 {
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
-
-  for(i = 0; i < n; i++)
-  {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_clear_bit(bitarr, bit_index);
+  size_t k = 0;
+  word_addr_t i;
+  word_t w;
+  for(i = 0; i < n; i++, base += WORD_SIZE) {
+    w = src[i] ^ flip;
+    _decode_word(dst, k, w, base, uint32_t);
   }
-
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
+  return k;
 }
 
-// Toggle multiple bits at once
-// e.g. toggle bits 1, 20 & 31: bit_array_toggle_bits(bitarr, 3, 1,20,31);
-void bit_array_toggle_bits(BIT_ARRAY* bitarr, size_t n, ...)
-{
-  size_t i;
-  va_list argptr;
-  va_start(argptr, n);
-
-  for(i = 0; i < n; i++)
-  {
-    unsigned int bit_index = va_arg(argptr, unsigned int);
-    bit_array_toggle_bit(bitarr, bit_index);
-  }
+static const DecodeKernels decode_kernels_scalar = {
+  _decode64_scalar, _decode32_scalar
+};
 
-  va_end(argptr);
-  DEBUG_VALIDATE(bitarr);
-}
+#if defined(BIT_ARRAY_SIMD_X86)
+
+// Zero words are skipped 8 at a time. For dense words, compress a vector of
+// positions by each slice of the word, sparse words are quicker bit by bit.
+#define DECODE_DENSE_BITS 12
+
+#define _decode_avx512(dst,src,n,base,flip,type,ADD,SET1,LANES,NLANES,COMPRESS) \
+  const __m512i _vflip = _mm512_set1_epi64((long long)(flip));                   \
+  const __m512i _lanes = LANES, _step = SET1(NLANES);                            \
+  size_t _k = 0;                                                                 \
+  word_addr_t _i = 0, _j;                                                        \
+  __mmask8 _nz;                                                                  \
+  word_t _w;                                                                     \
+  unsigned _c;                                                                   \
+  while(_i < (n)) {                                                              \
+    if(_i + 8 <= (n)) {                                                          \
+      __m512i _v = _mm512_xor_si512(_mm512_loadu_si512((const void*)((src)+_i)), _vflip); \
+      _nz = _mm512_test_epi64_mask(_v, _v);                                      \
+    }                                                                            \
+    else _nz = 1;                                                                \
+    for(; _nz != 0; _nz &= _nz - 1) {                                            \
+      _j = _i + trailing_zeros((unsigned)_nz);                                   \
+      _w = (src)[_j] ^ (flip);                                                   \
+      bit_index_t _b = (base) + _j * WORD_SIZE;                                  \
+      if(POPCOUNT(_w) < DECODE_DENSE_BITS) { _decode_word(dst, _k, _w, _b, type); } \
+      else {                                                                     \
+        __m512i _pos = ADD(SET1((type)_b), _lanes);                              \
+        for(_c = 0; _c < 64; _c += NLANES, _w >>= NLANES, _pos = ADD(_pos, _step)) { \
+          COMPRESS((dst) + _k, _w, _pos);                                        \
+          _k += POPCOUNT(_w & (~(word_t)0 >> (64 - NLANES)));                    \
+        }                                                                        \
+      }                                                                          \
+    }                                                                            \
+    _i += _i + 8 <= (n) ? 8 : 1;                                                 \
+  }                                                                              \
+  return _k;
+
+#define _set1_epi64(x) _mm512_set1_epi64((long long)(x))
+#define _set1_epi32(x) _mm512_set1_epi32((int)(x))
+#define _compress64(ptr,m,v) _mm512_mask_compressstoreu_epi64(ptr, (__mmask8)(m), v)
+#define _compress32(ptr,m,v) _mm512_mask_compressstoreu_epi32(ptr, (__mmask16)(m), v)
+
+__attribute__((target("avx512f,popcnt")))
+static size_t _decode64_avx512(uint64_t *dst, const word_t *src, word_addr_t n,
+                               bit_index_t base, word_t flip)
+{
+  _decode_avx512(dst, src, n, base, flip, uint64_t, _mm512_add_epi64,
+                 _set1_epi64, _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0), 8,
+                 _compress64)
+}
+
+__attribute__((target("avx512f,popcnt")))
+static size_t _decode32_avx512(uint32_t *dst, const word_t *src, word_addr_t n,
+                               bit_index_t base, word_t flip)
+{
+  _decode_avx512(dst, src, n, base, flip, uint32_t, _mm512_add_epi32,
+                 _set1_epi32, _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                               7, 6, 5, 4, 3, 2, 1, 0), 16,
+                 _compress32)
+}
+
+static const DecodeKernels decode_kernels_avx512 = {
+  _decode64_avx512, _decode32_avx512
+};
 
+#endif
 
 //
-// Set, clear and toggle all bits in a region
+// Morton (interleave) kernels
+//
+// interleave2: dst[0..2n) from a[0..n) and b[0..n), bit i of a to bit 2i and
+//   bit i of b to bit 2i+1. deinterleave2 is the inverse.
+// interleave_k: k-way, dst[0..k*n) from src[0..k)[0..n), bit i of src[j] to
+//   bit k*i+j. deinterleave_k is the inverse. k <= BIT_ARRAY_INTERLEAVE_MAX
+// Word i of each source fills words [k*i, k*i+k) of dst, so groups of words
+// can be done separately (and in parallel).
 //
 
-// Set all the bits in a region
-void bit_array_set_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
-{
-  assert(start + len <= bitarr->num_of_bits);
-  SET_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
-
-
-// Clear all the bits in a region
-void bit_array_clear_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
-{
-  assert(start + len <= bitarr->num_of_bits);
-  CLEAR_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
-
-// Toggle all the bits in a region
-void bit_array_toggle_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+typedef struct
 {
-  assert(start + len <= bitarr->num_of_bits);
-  TOGGLE_REGION(bitarr, start, len);
-  DEBUG_VALIDATE(bitarr);
-}
+  void (*interleave2)(word_t *dst, const word_t *a, const word_t *b,
+                      word_addr_t n);
+  void (*deinterleave2)(word_t *a, word_t *b, const word_t *src, word_addr_t n);
+  void (*interleave_k)(word_t *dst, const word_t **src, size_t k, word_addr_t n);
+  void (*deinterleave_k)(word_t **dst, const word_t *src, size_t k,
+                         word_addr_t n);
+} MortonKernels;
 
+#define MORTON_EVEN 0x5555555555555555ULL
+#define MORTON_ODD  0xAAAAAAAAAAAAAAAAULL
 
-//
-// Set, clear and toggle all bits at once
-//
-
-// set all elements of data to one
-void bit_array_set_all(BIT_ARRAY* bitarr)
+// Spread the low 32 bits of x over the even bits
+static inline word_t _morton_spread(word_t x)
 {
-  bit_index_t num_of_bytes = bitarr->num_of_words * sizeof(word_t);
-  memset(bitarr->words, 0xFF, num_of_bytes);
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
+  x &= 0x00000000ffffffffULL;
+  x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+  x = (x | (x <<  8)) & 0x00ff00ff00ff00ffULL;
+  x = (x | (x <<  4)) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | (x <<  2)) & 0x3333333333333333ULL;
+  x = (x | (x <<  1)) & MORTON_EVEN;
+  return x;
 }
 
-// set all elements of data to zero
-void bit_array_clear_all(BIT_ARRAY* bitarr)
+// Gather the even bits of x into the low 32 bits
+static inline word_t _morton_compact(word_t x)
 {
-  memset(bitarr->words, 0, bitarr->num_of_words * sizeof(word_t));
-  DEBUG_VALIDATE(bitarr);
+  x &= MORTON_EVEN;
+  x = (x | (x >>  1)) & 0x3333333333333333ULL;
+  x = (x | (x >>  2)) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | (x >>  4)) & 0x00ff00ff00ff00ffULL;
+  x = (x | (x >>  8)) & 0x0000ffff0000ffffULL;
+  x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+  return x;
 }
 
-// Set all 1 bits to 0, and all 0 bits to 1. AKA flip
-void bit_array_toggle_all(BIT_ARRAY* bitarr)
+static void _interleave2_scalar(word_t *dst, const word_t *a, const word_t *b,
+                                word_addr_t n)
 {
   word_addr_t i;
-  for(i = 0; i < bitarr->num_of_words; i++)
-  {
-    bitarr->words[i] ^= WORD_MAX;
+  for(i = 0; i < n; i++) {
+    dst[2*i]   = _morton_spread(a[i])       | (_morton_spread(b[i]) << 1);
+    dst[2*i+1] = _morton_spread(a[i] >> 32) | (_morton_spread(b[i] >> 32) << 1);
   }
-
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
 }
 
-//
-// Get a word at a time
-//
-
-uint64_t bit_array_get_word64(const BIT_ARRAY* bitarr, bit_index_t start)
+static void _deinterleave2_scalar(word_t *a, word_t *b, const word_t *src,
+                                  word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint64_t)_get_word(bitarr, start);
+  word_addr_t i;
+  for(i = 0; i < n; i++) {
+    word_t lo = src[2*i], hi = src[2*i+1];
+    a[i] = _morton_compact(lo)      | (_morton_compact(hi) << 32);
+    b[i] = _morton_compact(lo >> 1) | (_morton_compact(hi >> 1) << 32);
+  }
+}
+
+// Word t of a group of k output words has the bits of source j from bit
+// shift[t][j] up (the bits in low[t][j]), at bits first[t][j],
+// first[t][j]+k, ... (the bits in mask[t][j])
+// Without pdep, bits are spread to every k-th bit in log steps: level[l] is
+// blocks of 2^l bits at multiples of 2^l * k
+typedef struct
+{
+  word_t mask[BIT_ARRAY_INTERLEAVE_MAX][BIT_ARRAY_INTERLEAVE_MAX];
+  word_t low[BIT_ARRAY_INTERLEAVE_MAX][BIT_ARRAY_INTERLEAVE_MAX];
+  word_offset_t shift[BIT_ARRAY_INTERLEAVE_MAX][BIT_ARRAY_INTERLEAVE_MAX];
+  word_offset_t first[BIT_ARRAY_INTERLEAVE_MAX][BIT_ARRAY_INTERLEAVE_MAX];
+  word_t level[7];
+  size_t k;
+} MortonMasks;
+
+static void _morton_masks(MortonMasks *m, size_t k)
+{
+  size_t t, j, p, l, nbits;
+  m->k = k;
+  for(t = 0; t < k; t++) {
+    for(j = 0; j < k; j++) {
+      // first bit of word t that is from source j
+      m->first[t][j] = (word_offset_t)((j + k - (t * WORD_SIZE) % k) % k);
+      m->shift[t][j] = (word_offset_t)((t * WORD_SIZE + m->first[t][j] - j) / k);
+      m->mask[t][j] = 0;
+      for(p = m->first[t][j], nbits = 0; p < WORD_SIZE; p += k, nbits++)
+        m->mask[t][j] |= (word_t)1 << p;
+      m->low[t][j] = bitmask64(nbits);
+    }
+  }
+  for(l = 0; l < 7; l++) {
+    for(p = 0, m->level[l] = 0; p < WORD_SIZE; p++)
+      if(p % (k << l) < ((size_t)1 << l)) m->level[l] |= (word_t)1 << p;
+  }
 }
 
-uint32_t bit_array_get_word32(const BIT_ARRAY* bitarr, bit_index_t start)
+// pdep(x >> shift[t][j], mask[t][j])
+static inline word_t _morton_deposit(const MortonMasks *m, word_t x,
+                                     size_t t, size_t j)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint32_t)_get_word(bitarr, start);
+  size_t l, dist;
+  x = (x >> m->shift[t][j]) & m->low[t][j];
+  for(l = 6; l-- > 0; ) {
+    // upper half of each block moves up by dist, none is left if dist >= 64
+    dist = (m->k - 1) << l;
+    if(dist < WORD_SIZE) x |= x << dist;
+    x &= m->level[l];
+  }
+  return x << m->first[t][j];
 }
 
-uint16_t bit_array_get_word16(const BIT_ARRAY* bitarr, bit_index_t start)
+// pext(x, mask[t][j]) << shift[t][j]
+static inline word_t _morton_extract(const MortonMasks *m, word_t x,
+                                     size_t t, size_t j)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint16_t)_get_word(bitarr, start);
+  size_t l, dist;
+  x = (x >> m->first[t][j]) & m->level[0];
+  for(l = 0; l < 6; l++) {
+    dist = (m->k - 1) << l;
+    if(dist < WORD_SIZE) x |= x >> dist;
+    x &= m->level[l+1];
+  }
+  return (x & m->low[t][j]) << m->shift[t][j];
 }
 
-uint8_t bit_array_get_word8(const BIT_ARRAY* bitarr, bit_index_t start)
+static void _interleave_k_scalar(word_t *dst, const word_t **src, size_t k,
+                                 word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  return (uint8_t)_get_word(bitarr, start);
+  MortonMasks m;
+  word_addr_t i;
+  size_t t, j;
+  word_t w;
+  _morton_masks(&m, k);
+  for(i = 0; i < n; i++, dst += k) {
+    for(t = 0; t < k; t++) {
+      for(w = 0, j = 0; j < k; j++) w |= _morton_deposit(&m, src[j][i], t, j);
+      dst[t] = w;
+    }
+  }
 }
 
-uint64_t bit_array_get_wordn(const BIT_ARRAY* bitarr, bit_index_t start, int n)
+static void _deinterleave_k_scalar(word_t **dst, const word_t *src, size_t k,
+                                   word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  assert(n <= 64);
-  return (uint64_t)(_get_word(bitarr, start) & bitmask64(n));
+  MortonMasks m;
+  word_addr_t i;
+  size_t t, j;
+  word_t w;
+  _morton_masks(&m, k);
+  for(i = 0; i < n; i++, src += k) {
+    for(j = 0; j < k; j++) {
+      for(w = 0, t = 0; t < k; t++) w |= _morton_extract(&m, src[t], t, j);
+      dst[j][i] = w;
+    }
+  }
 }
 
-//
-// Set a word at a time
-//
-// Doesn't extend bit array. However it is safe to TRY to set bits beyond the
-// end of the array, as long as: `start` is < `bit_array_length(arr)`
-//
+static const MortonKernels morton_kernels_scalar = {
+  _interleave2_scalar, _deinterleave2_scalar,
+  _interleave_k_scalar, _deinterleave_k_scalar
+};
 
-void bit_array_set_word64(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word)
-{
-  assert(start < bitarr->num_of_bits);
-  _set_word(bitarr, start, (word_t)word);
-}
+#if defined(BIT_ARRAY_SIMD_X86) && defined(__x86_64__)
 
-void bit_array_set_word32(BIT_ARRAY* bitarr, bit_index_t start, uint32_t word)
+__attribute__((target("bmi2")))
+static void _interleave2_bmi2(word_t *dst, const word_t *a, const word_t *b,
+                              word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffff00000000UL));
+  word_addr_t i;
+  for(i = 0; i < n; i++) {
+    dst[2*i]   = _pdep_u64(a[i], MORTON_EVEN) | _pdep_u64(b[i], MORTON_ODD);
+    dst[2*i+1] = _pdep_u64(a[i] >> 32, MORTON_EVEN) |
+                 _pdep_u64(b[i] >> 32, MORTON_ODD);
+  }
 }
 
-void bit_array_set_word16(BIT_ARRAY* bitarr, bit_index_t start, uint16_t word)
+__attribute__((target("bmi2")))
+static void _deinterleave2_bmi2(word_t *a, word_t *b, const word_t *src,
+                                word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  word_t w = _get_word(bitarr, start);
-  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffffffff0000UL));
+  word_addr_t i;
+  for(i = 0; i < n; i++) {
+    word_t lo = src[2*i], hi = src[2*i+1];
+    a[i] = _pext_u64(lo, MORTON_EVEN) | (_pext_u64(hi, MORTON_EVEN) << 32);
+    b[i] = _pext_u64(lo, MORTON_ODD)  | (_pext_u64(hi, MORTON_ODD)  << 32);
+  }
 }
 
-void bit_array_set_word8(BIT_ARRAY* bitarr, bit_index_t start, uint8_t byte)
+__attribute__((target("bmi2")))
+static void _interleave_k_bmi2(word_t *dst, const word_t **src, size_t k,
+                               word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  _set_byte(bitarr, start, byte);
+  MortonMasks m;
+  word_addr_t i;
+  size_t t, j;
+  word_t w;
+  _morton_masks(&m, k);
+  for(i = 0; i < n; i++, dst += k) {
+    for(t = 0; t < k; t++) {
+      for(w = 0, j = 0; j < k; j++)
+        w |= _pdep_u64(src[j][i] >> m.shift[t][j], m.mask[t][j]);
+      dst[t] = w;
+    }
+  }
 }
 
-void bit_array_set_wordn(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word, int n)
+__attribute__((target("bmi2")))
+static void _deinterleave_k_bmi2(word_t **dst, const word_t *src, size_t k,
+                                 word_addr_t n)
 {
-  assert(start < bitarr->num_of_bits);
-  assert(n <= 64);
-  word_t w = _get_word(bitarr, start), m = bitmask64(n);
-  _set_word(bitarr, start, bitmask_merge(word,w,m));
+  MortonMasks m;
+  word_addr_t i;
+  size_t t, j;
+  word_t w;
+  _morton_masks(&m, k);
+  for(i = 0; i < n; i++, src += k) {
+    for(j = 0; j < k; j++) {
+      for(w = 0, t = 0; t < k; t++)
+        w |= _pext_u64(src[t], m.mask[t][j]) << m.shift[t][j];
+      dst[j][i] = w;
+    }
+  }
 }
 
-//
-// Number of bits set
-//
+static const MortonKernels morton_kernels_bmi2 = {
+  _interleave2_bmi2, _deinterleave2_bmi2,
+  _interleave_k_bmi2, _deinterleave_k_bmi2
+};
 
-// Get the number of bits set (hamming weight)
-bit_index_t bit_array_num_bits_set(const BIT_ARRAY* bitarr)
-{
+// GF(2) affine transforms of each byte (gf2p8affineqb). Byte 7-i of a matrix
+// selects the input bits XORed into output bit i.
+#define GF2_SPREAD_LO_EVEN 0x0100020004000800ULL // bit i -> 2i, i < 4
+#define GF2_SPREAD_HI_EVEN 0x1000200040008000ULL // bit 4+i -> 2i
+#define GF2_SPREAD_LO_ODD  0x0001000200040008ULL // bit i -> 2i+1
+#define GF2_SPREAD_HI_ODD  0x0010002000400080ULL // bit 4+i -> 2i+1
+#define GF2_EVEN_TO_LO     0x0104104000000000ULL // bit 2i -> i
+#define GF2_EVEN_TO_HI     0x0000000001041040ULL // bit 2i -> 4+i
+#define GF2_ODD_TO_LO      0x0208208000000000ULL // bit 2i+1 -> i
+#define GF2_ODD_TO_HI      0x0000000002082080ULL // bit 2i+1 -> 4+i
+
+#define _gf2_affine(x,mat) \
+  _mm512_gf2p8affine_epi64_epi8(x, _mm512_set1_epi64((long long)(mat)), 0)
+#define _gf2_mask_affine(src,k,x,mat) \
+  _mm512_mask_gf2p8affine_epi64_epi8(src, k, x, _mm512_set1_epi64((long long)(mat)), 0)
+
+// Byte m of a and b give output bytes 2m (low nibbles) and 2m+1 (high
+// nibbles): copy each input byte twice (vpermb), then spread a nibble of it
+// per output byte
+__attribute__((target("avx512f,avx512bw,avx512vbmi,gfni,bmi2")))
+static void _interleave2_vbmi(word_t *dst, const word_t *a, const word_t *b,
+                              word_addr_t n)
+{
+  uint8_t idx[64];
   word_addr_t i;
+  for(i = 0; i < 64; i++) idx[i] = (uint8_t)(i / 2);
 
-  bit_index_t num_of_bits_set = 0;
+  const __m512i dup = _mm512_loadu_si512((const void*)idx);
+  const __mmask64 odd = (__mmask64)MORTON_ODD;
 
-  for(i = 0; i < bitarr->num_of_words; i++)
-  {
-    if(bitarr->words[i] > 0)
-    {
-      num_of_bits_set += POPCOUNT(bitarr->words[i]);
-    }
+  for(i = 0; i + 4 <= n; i += 4) {
+    __m512i va = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)(a+i)));
+    __m512i vb = _mm512_castsi256_si512(_mm256_loadu_si256((const __m256i*)(b+i)));
+    va = _mm512_permutexvar_epi8(dup, va);
+    vb = _mm512_permutexvar_epi8(dup, vb);
+    __m512i ea = _gf2_mask_affine(_gf2_affine(va, GF2_SPREAD_LO_EVEN), odd, va,
+                                  GF2_SPREAD_HI_EVEN);
+    __m512i eb = _gf2_mask_affine(_gf2_affine(vb, GF2_SPREAD_LO_ODD), odd, vb,
+                                  GF2_SPREAD_HI_ODD);
+    _mm512_storeu_si512((void*)(dst+2*i), _mm512_or_si512(ea, eb));
   }
 
-  return num_of_bits_set;
-}
-
-// Get the number of bits not set (1 - hamming weight)
-bit_index_t bit_array_num_bits_cleared(const BIT_ARRAY* bitarr)
-{
-  return bitarr->num_of_bits - bit_array_num_bits_set(bitarr);
+  _interleave2_bmi2(dst+2*i, a+i, b+i, n-i);
 }
 
-
-// Get the number of bits set in on array and not the other.  This is equivalent
-// to hamming weight of the XOR when the two arrays are the same length.
-// e.g. 10101 vs 00111 => hamming distance 2 (XOR is 10010)
-bit_index_t bit_array_hamming_distance(const BIT_ARRAY* arr1,
-                                       const BIT_ARRAY* arr2)
+// Compact the even (a) and odd (b) bits of each byte into the low nibble of
+// even bytes and the high nibble of odd bytes, then OR byte pairs together,
+// picking them out with vpermi2b
+__attribute__((target("avx512f,avx512bw,avx512vbmi,gfni,bmi2")))
+static void _deinterleave2_vbmi(word_t *a, word_t *b, const word_t *src,
+                                word_addr_t n)
 {
-  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
-  word_addr_t max_words = MAX(arr1->num_of_words, arr2->num_of_words);
-
-  bit_index_t hamming_distance = 0;
+  uint8_t idx[64];
   word_addr_t i;
+  for(i = 0; i < 64; i++) idx[i] = (uint8_t)(i < 32 ? 2*i : 64 + 2*(i-32));
 
-  for(i = 0; i < min_words; i++)
-  {
-    hamming_distance += POPCOUNT(arr1->words[i] ^ arr2->words[i]);
-  }
-
-  if(min_words != max_words)
-  {
-    const BIT_ARRAY* long_arr
-      = (arr1->num_of_words > arr2->num_of_words ? arr1 : arr2);
+  const __m512i even = _mm512_loadu_si512((const void*)idx);
+  const __m512i odd_bytes = _mm512_add_epi8(even, _mm512_set1_epi8(1));
+  const __mmask64 odd = (__mmask64)MORTON_ODD;
 
-    for(i = min_words; i < max_words; i++)
-    {
-      hamming_distance += POPCOUNT(long_arr->words[i]);
-    }
+  for(i = 0; i + 4 <= n; i += 4) {
+    __m512i s = _mm512_loadu_si512((const void*)(src+2*i));
+    __m512i za = _gf2_mask_affine(_gf2_affine(s, GF2_EVEN_TO_LO), odd, s,
+                                  GF2_EVEN_TO_HI);
+    __m512i zb = _gf2_mask_affine(_gf2_affine(s, GF2_ODD_TO_LO), odd, s,
+                                  GF2_ODD_TO_HI);
+    __m512i r = _mm512_or_si512(_mm512_permutex2var_epi8(za, even, zb),
+                                _mm512_permutex2var_epi8(za, odd_bytes, zb));
+    _mm256_storeu_si256((__m256i*)(a+i), _mm512_castsi512_si256(r));
+    _mm256_storeu_si256((__m256i*)(b+i), _mm512_extracti64x4_epi64(r, 1));
   }
 
-  return hamming_distance;
+  _deinterleave2_bmi2(a+i, b+i, src+2*i, n-i);
 }
 
-// Parity - returns 1 if odd number of bits set, 0 if even
-char bit_array_parity(const BIT_ARRAY* bitarr)
+static const MortonKernels morton_kernels_vbmi = {
+  _interleave2_vbmi, _deinterleave2_vbmi,
+  _interleave_k_bmi2, _deinterleave_k_bmi2
+};
+
+#endif
+
+// Kernels in use. Starts as the scalar table so results are always correct,
+// replaced by _init_kernels() before main() runs.
+static const WordKernels *kernels = &kernels_scalar;
+static const TextKernels *text_kernels = &text_kernels_scalar;
+static const DecodeKernels *decode_kernels = &decode_kernels_scalar;
+static const MortonKernels *morton_kernels = &morton_kernels_scalar;
+
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void _init_kernels(void)
 {
-  word_addr_t w;
-  unsigned int parity = 0;
+#if defined(BIT_ARRAY_SIMD_X86)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    kernels = __builtin_cpu_supports("avx512vpopcntdq") ? &kernels_avx512
+                                                        : &kernels_avx512f;
+  else if(__builtin_cpu_supports("avx2")) kernels = &kernels_avx2;
+  else if(__builtin_cpu_supports("sse2")) kernels = &kernels_sse2;
 
-  for(w = 0; w < bitarr->num_of_words; w++)
+  if(__builtin_cpu_supports("avx512bw")) text_kernels = &text_kernels_avx512;
+  else if(__builtin_cpu_supports("avx2")) text_kernels = &text_kernels_avx2;
+  else if(__builtin_cpu_supports("sse2")) text_kernels = &text_kernels_sse2;
+
+  if(__builtin_cpu_supports("avx512f")) decode_kernels = &decode_kernels_avx512;
+
+#if defined(__x86_64__)
+  if(__builtin_cpu_supports("sse4.2")) crc32c_kernel = _crc32c_sse42;
+
+  // pdep/pext are microcoded (slow) on AMD before Zen 3
+  if(__builtin_cpu_supports("bmi2") &&
+     !__builtin_cpu_is("amdfam15h") && !__builtin_cpu_is("amdfam17h"))
   {
-    parity ^= PARITY(bitarr->words[w]);
+    morton_kernels = &morton_kernels_bmi2;
+    if(__builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("gfni"))
+      morton_kernels = &morton_kernels_vbmi;
   }
-
-  return (char)parity;
+#endif
+#elif defined(BIT_ARRAY_SIMD_NEON)
+  kernels = &kernels_neon;
+#endif
 }
 
 //
-// Find indices of set/clear bits
+// Common internal functions
 //
 
-// Find the index of the next bit that is set/clear, at or after `offset`
-// Returns 1 if such a bit is found, otherwise 0
-// Index is stored in the integer pointed to by `result`
-// If no such bit is found, value at `result` is not changed
-#define _next_bit_func_def(FUNC,GET) \
-char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
-{ \
-  assert(offset < bitarr->num_of_bits); \
-  if(bitarr->num_of_bits == 0 || offset >= bitarr->num_of_bits) { return 0; } \
- \
-  /* Find first word that is greater than zero */ \
-  word_addr_t i = bitset64_wrd(offset); \
-  word_t w = GET(bitarr->words[i]) & ~bitmask64(bitset64_idx(offset)); \
- \
-  while(1) { \
-    if(w > 0) { \
-      bit_index_t pos = i * WORD_SIZE + trailing_zeros(w); \
-      if(pos < bitarr->num_of_bits) { *result = pos; return 1; } \
-      else { return 0; } \
-    } \
-    i++; \
-    if(i >= bitarr->num_of_words) break; \
-    w = GET(bitarr->words[i]); \
-  } \
- \
-  return 0; \
-}
+#define bits_in_top_word(nbits) ((nbits) ? bitset64_idx((nbits) - 1) + 1 : 0)
 
-// Find the index of the previous bit that is set/clear, before `offset`.
-// Returns 1 if such a bit is found, otherwise 0
-// Index is stored in the integer pointed to by `result`
-// If no such bit is found, value at `result` is not changed
-#define _prev_bit_func_def(FUNC,GET) \
-char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
-{ \
-  assert(offset <= bitarr->num_of_bits); \
-  if(bitarr->num_of_bits == 0 || offset == 0) { return 0; } \
- \
-  /* Find prev word that is greater than zero */ \
-  word_addr_t i = bitset64_wrd(offset-1); \
-  word_t w = GET(bitarr->words[i]) & bitmask64(bitset64_idx(offset-1)+1); \
- \
-  if(w > 0) { *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; return 1; } \
- \
-  /* i is unsigned so have to use break when i == 0 */ \
-  for(--i; i != BIT_INDEX_MAX; i--) { \
-    w = GET(bitarr->words[i]); \
-    if(w > 0) { \
-      *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; \
-      return 1; \
-    } \
-  } \
- \
-  return 0; \
+// Mostly used for debugging
+static inline void _print_word(word_t word, FILE* out)
+{
+  word_offset_t i;
+  for(i = 0; i < WORD_SIZE; i++)
+  {
+    fprintf(out, "%c", ((word >> i) & (word_t)0x1) == 0 ? '0' : '1');
+  }
 }
 
-#define GET_WORD(x) (x)
-#define NEG_WORD(x) (~(x))
-_next_bit_func_def(bit_array_find_next_set_bit,  GET_WORD);
-_next_bit_func_def(bit_array_find_next_clear_bit,NEG_WORD);
-_prev_bit_func_def(bit_array_find_prev_set_bit,  GET_WORD);
-_prev_bit_func_def(bit_array_find_prev_clear_bit,NEG_WORD);
+// prints right to left
+static inline char* _word_to_str(word_t word, char str[WORD_SIZE+1])
+  __attribute__((unused));
 
-// Find the index of the first bit that is set.
-// Returns 1 if a bit is set, otherwise 0
-// Index of first set bit is stored in the integer pointed to by result
-// If no bits are set, value at `result` is not changed
-char bit_array_find_first_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+static inline char* _word_to_str(word_t word, char str[WORD_SIZE+1])
 {
-  return bit_array_find_next_set_bit(bitarr, 0, result);
+  word_offset_t i;
+  for(i = 0; i < WORD_SIZE; i++)
+  {
+    str[WORD_SIZE-i-1] = ((word >> i) & (word_t)0x1) == 0 ? '0' : '1';
+  }
+  str[WORD_SIZE] = '\0';
+  return str;
 }
 
-// same same
-char bit_array_find_first_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+// Used in debugging
+#ifdef DEBUG
+  #define DEBUG_PRINT(msg,...) printf("[%s:%i] "msg, __FILE__, __LINE__, ##__VA_ARGS__);
+  #define DEBUG_VALIDATE(a) validate_bitarr((a), __FILE__, __LINE__)
+#else
+  #define DEBUG_PRINT(msg,...)
+  #define DEBUG_VALIDATE(a)
+#endif
+
+void validate_bitarr(BIT_ARRAY *arr, const char *file, int lineno)
 {
-  return bit_array_find_next_clear_bit(bitarr, 0, result);
+  // Check top word is masked
+  word_addr_t tw = arr->num_of_words == 0 ? 0 : arr->num_of_words - 1;
+  bit_index_t top_bits = bits_in_top_word(arr->num_of_bits);
+  int err = 0;
+
+  if(arr->words[tw] > bitmask64(top_bits))
+  {
+    _print_word(arr->words[tw], stderr);
+    fprintf(stderr, "\n[%s:%i] Expected %i bits in top word[%i]\n",
+            file, lineno, (int)top_bits, (int)tw);
+    err = 1;
+  }
+
+  // Check num of words is correct
+  word_addr_t num_words = roundup_bits2words64(arr->num_of_bits);
+  if(num_words != arr->num_of_words)
+  {
+    fprintf(stderr, "\n[%s:%i] num of words wrong "
+                    "[bits: %i, word: %i, actual words: %i]\n", file, lineno,
+            (int)arr->num_of_bits, (int)num_words, (int)arr->num_of_words);
+    err = 1;
+  }
+
+  if(err) abort();
 }
 
-// Find the index of the last bit that is set.
-// Returns 1 if a bit is set, otherwise 0
-// Index of last set bit is stored in the integer pointed to by `result`
-// If no bits are set, value at `result` is not changed
-char bit_array_find_last_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+// Reverse a word
+static inline word_t _reverse_word(word_t word)
 {
-  return bit_array_find_prev_set_bit(bitarr, bitarr->num_of_bits, result);
+  word_t reverse = (reverse_table[(word)       & 0xff] << 56) |
+                   (reverse_table[(word >>  8) & 0xff] << 48) |
+                   (reverse_table[(word >> 16) & 0xff] << 40) |
+                   (reverse_table[(word >> 24) & 0xff] << 32) |
+                   (reverse_table[(word >> 32) & 0xff] << 24) |
+                   (reverse_table[(word >> 40) & 0xff] << 16) |
+                   (reverse_table[(word >> 48) & 0xff] << 8) |
+                   (reverse_table[(word >> 56) & 0xff]);
+
+  return reverse;
 }
 
-// same same
-char bit_array_find_last_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+static inline void _mask_top_word(BIT_ARRAY* bitarr)
 {
-  return bit_array_find_prev_clear_bit(bitarr, bitarr->num_of_bits, result);
+  // Mask top word
+  word_addr_t num_of_words = MAX(1, bitarr->num_of_words);
+  word_offset_t bits_active = bits_in_top_word(bitarr->num_of_bits);
+  bitarr->words[num_of_words-1] &= bitmask64(bits_active);
 }
 
 //
-// "Sorting" bits
+// Get and set words (internal use only -- no bounds checking)
 //
 
-// Put all the 0s before all the 1s
-void bit_array_sort_bits(BIT_ARRAY* bitarr)
+static inline word_t _get_word(const BIT_ARRAY* bitarr, bit_index_t start)
 {
-  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
-  bit_index_t num_of_bits_cleared = bitarr->num_of_bits - num_of_bits_set;
-  bit_array_set_all(bitarr);
-  CLEAR_REGION(bitarr, 0, num_of_bits_cleared);
-  DEBUG_VALIDATE(bitarr);
+  word_addr_t word_index = bitset64_wrd(start);
+  word_offset_t word_offset = bitset64_idx(start);
+
+  word_t result = bitarr->words[word_index] >> word_offset;
+
+  word_offset_t bits_taken = WORD_SIZE - word_offset;
+
+  // word_offset is now the number of bits we need from the next word
+  // Check the next word has at least some bits
+  if(word_offset > 0 && start + bits_taken < bitarr->num_of_bits)
+  {
+    result |= bitarr->words[word_index+1] << (WORD_SIZE - word_offset);
+  }
+
+  return result;
 }
 
-// Put all the 1s before all the 0s
-void bit_array_sort_bits_rev(BIT_ARRAY* bitarr)
+// Set 64 bits from a particular start position
+// Doesn't extend bit array
+static inline void _set_word(BIT_ARRAY* bitarr, bit_index_t start, word_t word)
 {
-  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
-  bit_array_clear_all(bitarr);
-  SET_REGION(bitarr, 0, num_of_bits_set);
+  word_addr_t word_index = bitset64_wrd(start);
+  word_offset_t word_offset = bitset64_idx(start);
+
+  if(word_offset == 0)
+  {
+    bitarr->words[word_index] = word;
+  }
+  else
+  {
+    bitarr->words[word_index]
+      = (word << word_offset) |
+        (bitarr->words[word_index] & bitmask64(word_offset));
+
+    if(word_index+1 < bitarr->num_of_words)
+    {
+      bitarr->words[word_index+1]
+        = (word >> (WORD_SIZE - word_offset)) |
+          (bitarr->words[word_index+1] & (WORD_MAX << word_offset));
+    }
+  }
+
+  // Mask top word
+  _mask_top_word(bitarr);
   DEBUG_VALIDATE(bitarr);
 }
 
+static inline void _set_byte(BIT_ARRAY *bitarr, bit_index_t start, uint8_t byte)
+{
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, (w & ~(word_t)0xff) | byte);
+}
 
-//
-// Strings and printing
-//
+// 4 bits
+static inline void _set_nibble(BIT_ARRAY *bitarr, bit_index_t start,
+                               uint8_t nibble)
+{
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, (w & ~(word_t)0xf) | nibble);
+}
 
-// Construct a BIT_ARRAY from a substring with given on and off characters.
-void bit_array_from_substr(BIT_ARRAY* bitarr, bit_index_t offset,
-                           const char *str, size_t len,
-                           const char *on, const char *off,
-                           char left_to_right)
+// Wrap around
+static inline word_t _get_word_cyclic(const BIT_ARRAY* bitarr, bit_index_t start)
 {
-  bit_array_ensure_size(bitarr, offset + len);
-  bit_array_clear_region(bitarr, offset, len);
+  word_t word = _get_word(bitarr, start);
 
-  // BitArray region is now all 0s -- just set the 1s
-  size_t i;
-  bit_index_t j;
+  bit_index_t bits_taken = bitarr->num_of_bits - start;
 
-  for(i = 0; i < len; i++)
+  if(bits_taken < WORD_SIZE)
   {
-    if(strchr(on, str[i]) != NULL)
+    word |= (bitarr->words[0] << bits_taken);
+
+    if(bitarr->num_of_bits < (bit_index_t)WORD_SIZE)
     {
-      j = offset + (left_to_right ? i : len - i - 1);
-      bit_array_set(bitarr, j);
+      // Mask word to prevent repetition of the same bits
+      word = word & bitmask64(bitarr->num_of_bits);
     }
-    else { assert(strchr(off, str[i]) != NULL); }
   }
 
-  DEBUG_VALIDATE(bitarr);
+  return word;
 }
 
-// From string method
-void bit_array_from_str(BIT_ARRAY* bitarr, const char* str)
+// Wrap around
+static inline void _set_word_cyclic(BIT_ARRAY* bitarr,
+                                    bit_index_t start, word_t word)
 {
-  bit_array_from_substr(bitarr, 0, str, strlen(str), "1", "0", 1);
-}
+  _set_word(bitarr, start, word);
 
-// Takes a char array to write to.  `str` must be bitarr->num_of_bits+1 in length
-// Terminates string with '\0'
-char* bit_array_to_str(const BIT_ARRAY* bitarr, char* str)
-{
-  bit_index_t i;
+  bit_index_t bits_set = bitarr->num_of_bits - start;
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
+  if(bits_set < WORD_SIZE && start > 0)
   {
-    str[i] = bit_array_get(bitarr, i) ? '1' : '0';
-  }
+    word >>= bits_set;
+
+    // Prevent overwriting the bits we've just set
+    // by setting 'start' as the upper bound for the number of bits to write
+    word_offset_t bits_remaining = MIN(WORD_SIZE - bits_set, start);
+    word_t mask = bitmask64(bits_remaining);
+
+    bitarr->words[0] = bitmask_merge(word, bitarr->words[0], mask);
+  }
+}
+
+//
+// Fill a region (internal use only)
+//
+
+// FillAction is fill with 0 or 1 or toggle
+typedef enum {ZERO_REGION, FILL_REGION, SWAP_REGION} FillAction;
+
+static inline void _set_region(BIT_ARRAY* bitarr, bit_index_t start,
+                               bit_index_t length, FillAction action)
+{
+  if(length == 0) return;
+
+  word_addr_t first_word = bitset64_wrd(start);
+  word_addr_t last_word = bitset64_wrd(start+length-1);
+  word_offset_t foffset = bitset64_idx(start);
+  word_offset_t loffset = bitset64_idx(start+length-1);
+
+  if(first_word == last_word)
+  {
+    word_t mask = bitmask64(length) << foffset;
+
+    switch(action)
+    {
+      case ZERO_REGION: bitarr->words[first_word] &= ~mask; break;
+      case FILL_REGION: bitarr->words[first_word] |=  mask; break;
+      case SWAP_REGION: bitarr->words[first_word] ^=  mask; break;
+    }
+  }
+  else
+  {
+    // Set first word
+    switch(action)
+    {
+      case ZERO_REGION: bitarr->words[first_word] &=  bitmask64(foffset); break;
+      case FILL_REGION: bitarr->words[first_word] |= ~bitmask64(foffset); break;
+      case SWAP_REGION: bitarr->words[first_word] ^= ~bitmask64(foffset); break;
+    }
+
+    word_addr_t i;
+
+    // Set whole words
+    switch(action)
+    {
+      case ZERO_REGION:
+        for(i = first_word + 1; i < last_word; i++)
+          bitarr->words[i] = (word_t)0;
+        break;
+      case FILL_REGION:
+        for(i = first_word + 1; i < last_word; i++)
+          bitarr->words[i] = WORD_MAX;
+        break;
+      case SWAP_REGION:
+        for(i = first_word + 1; i < last_word; i++)
+          bitarr->words[i] ^= WORD_MAX;
+        break;
+    }
+
+    // Set last word
+    switch(action)
+    {
+      case ZERO_REGION: bitarr->words[last_word] &= ~bitmask64(loffset+1); break;
+      case FILL_REGION: bitarr->words[last_word] |=  bitmask64(loffset+1); break;
+      case SWAP_REGION: bitarr->words[last_word] ^=  bitmask64(loffset+1); break;
+    }
+  }
+}
+
+
+
+//
+// Statistics and probes
+//
+// Built with -DBIT_ARRAY_STATS, bulk functions count calls, bytes of words
+// they touch and cycles (TSC ticks on x86, nanoseconds elsewhere) in counters
+// of the calling thread; word storage growth is counted as events. Built with
+// -DBIT_ARRAY_USDT, the same functions have USDT probes (provider bit_array,
+// args: array, bytes) for perf / bpftrace. Without them STAT_SCOPE is empty.
+//
+
+#if defined(BIT_ARRAY_USDT)
+  #include <sys/sdt.h>
+  #define _PROBE2(name,a,b) DTRACE_PROBE2(bit_array, name, a, b)
+  #define _PROBE3(name,a,b,c) DTRACE_PROBE3(bit_array, name, a, b, c)
+#else
+  #define _PROBE2(name,a,b)
+  #define _PROBE3(name,a,b,c)
+#endif
+
+#define STAT_FUNCS(X)                                                          \
+  X(resize) X(grow) X(shrink) X(clone) X(copy) X(copy_all)                     \
+  X(set_all) X(clear_all) X(toggle_all) X(set_region) X(clear_region)          \
+  X(num_bits_set) X(hamming_distance) X(cmp)                                   \
+  X(and_count) X(or_count) X(andnot_count) X(count_many)                       \
+  X(logical_and) X(logical_or) X(logical_xor) X(logical_not)                   \
+  X(shift_left) X(shift_right) X(interleave) X(deinterleave) X(add)            \
+  X(save) X(load) X(hash)
+
+#define _STAT_ENUM(name) STAT_##name,
+#define _STAT_NAME(name) #name,
+
+enum { STAT_FUNCS(_STAT_ENUM) STAT_NUM };
+
+#if defined(BIT_ARRAY_STATS)
+
+static const char *stat_names[STAT_NUM] = { STAT_FUNCS(_STAT_NAME) };
+
+// One per thread, never freed so counts of exited threads are kept
+struct stat_block
+{
+  uint64_t calls[STAT_NUM], bytes[STAT_NUM], cycles[STAT_NUM];
+  struct stat_block *next;
+};
+
+static __thread struct stat_block *stat_local = NULL;
+static struct stat_block *stat_blocks = NULL;
+
+static inline uint64_t _stat_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static struct stat_block* _stat_block(void)
+{
+  struct stat_block *b = stat_local;
+  if(b == NULL) {
+    if((b = (struct stat_block*)calloc(1, sizeof(*b))) == NULL) {
+      fprintf(stderr, "[%s:%i] Out of memory\n", __FILE__, __LINE__);
+      abort();
+    }
+    b->next = __atomic_load_n(&stat_blocks, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&stat_blocks, &b->next, b, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+    stat_local = b;
+  }
+  return b;
+}
+
+// Atomic since bit_array_stats_reset() may clear the block from another thread
+static inline void _stat_add(int stat, uint64_t bytes, uint64_t cycles)
+{
+  struct stat_block *b = _stat_block();
+  __atomic_fetch_add(&b->calls[stat], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&b->bytes[stat], bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&b->cycles[stat], cycles, __ATOMIC_RELAXED);
+}
+
+struct stat_scope { int stat; uint64_t bytes, start; };
+
+static inline struct stat_scope _stat_begin(int stat, uint64_t bytes)
+{
+  struct stat_scope scope = {stat, bytes, _stat_clock()};
+  return scope;
+}
+
+static inline void _stat_end(struct stat_scope *scope)
+{
+  _stat_add(scope->stat, scope->bytes, _stat_clock() - scope->start);
+}
+
+// Count the rest of the enclosing block as a call to `name`
+#define STAT_SCOPE(name,arr,nbytes)                                            \
+  _PROBE2(name, arr, nbytes);                                                  \
+  struct stat_scope _stat_scope __attribute__((cleanup(_stat_end)))            \
+    = _stat_begin(STAT_##name, (uint64_t)(nbytes))
+
+// Set the bytes of the call, once known
+#define STAT_BYTES(nbytes) (_stat_scope.bytes = (uint64_t)(nbytes))
+
+#define STAT_EVENT(name,arr,old_bytes,new_bytes) do {                          \
+  _PROBE3(name, arr, old_bytes, new_bytes);                                    \
+  _stat_add(STAT_##name,                                                       \
+            (uint64_t)((new_bytes) > (old_bytes) ? (new_bytes) - (old_bytes)   \
+                                                 : (old_bytes) - (new_bytes)), \
+            0);                                                                \
+} while(0)
+
+size_t bit_array_stats(BIT_ARRAY_STAT *stats, size_t max)
+{
+  const struct stat_block *b;
+  size_t i, n = MIN(max, (size_t)STAT_NUM);
+
+  memset(stats, 0, n * sizeof(*stats));
+  for(i = 0; i < n; i++) stats[i].name = stat_names[i];
+
+  for(b = __atomic_load_n(&stat_blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+    for(i = 0; i < n; i++) {
+      stats[i].calls += __atomic_load_n(&b->calls[i], __ATOMIC_RELAXED);
+      stats[i].bytes += __atomic_load_n(&b->bytes[i], __ATOMIC_RELAXED);
+      stats[i].cycles += __atomic_load_n(&b->cycles[i], __ATOMIC_RELAXED);
+    }
+  }
+  return STAT_NUM;
+}
+
+void bit_array_stats_reset(void)
+{
+  struct stat_block *b;
+  size_t i;
+  for(b = __atomic_load_n(&stat_blocks, __ATOMIC_ACQUIRE); b != NULL; b = b->next) {
+    for(i = 0; i < STAT_NUM; i++) {
+      __atomic_store_n(&b->calls[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&b->bytes[i], 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&b->cycles[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void bit_array_stats_dump(FILE *f)
+{
+  BIT_ARRAY_STAT stats[STAT_NUM];
+  size_t i;
+
+  bit_array_stats(stats, STAT_NUM);
+  fprintf(f, "%-18s %12s %16s %16s %12s %10s\n", "function", "calls",
+          "bytes", "cycles", "cycles/call", "bytes/cyc");
+  for(i = 0; i < STAT_NUM; i++) {
+    if(stats[i].calls == 0) continue;
+    fprintf(f, "%-18s %12llu %16llu %16llu %12.1f %10.2f\n", stats[i].name,
+            (unsigned long long)stats[i].calls,
+            (unsigned long long)stats[i].bytes,
+            (unsigned long long)stats[i].cycles,
+            (double)stats[i].cycles / stats[i].calls,
+            stats[i].cycles ? (double)stats[i].bytes / stats[i].cycles : 0.0);
+  }
+}
+
+#else
+
+#define STAT_SCOPE(name,arr,nbytes) _PROBE2(name, arr, nbytes)
+#define STAT_BYTES(nbytes)
+#define STAT_EVENT(name,arr,old_bytes,new_bytes) \
+  _PROBE3(name, arr, old_bytes, new_bytes)
+
+size_t bit_array_stats(BIT_ARRAY_STAT *stats, size_t max)
+{
+  (void)stats; (void)max;
+  return 0;
+}
+
+void bit_array_stats_reset(void) {}
+
+void bit_array_stats_dump(FILE *f)
+{
+  fprintf(f, "bit_array: built without BIT_ARRAY_STATS\n");
+}
+
+#endif
+
+//
+// Allocators
+//
+
+static const BIT_ARRAY_ALLOCATOR *default_allocator = NULL;
+
+void bit_array_set_default_allocator(const BIT_ARRAY_ALLOCATOR *allocator)
+{
+  default_allocator = allocator;
+}
+
+const BIT_ARRAY_ALLOCATOR* bit_array_get_default_allocator(void)
+{
+  return default_allocator;
+}
+
+//
+// Big blocks (Linux): with the default allocator, blocks of BIG_BYTES or more
+// are mmap()ed rather than malloc()ed. They grow and shrink with mremap(),
+// which moves pages rather than copying bytes, and pages added are zero
+// without a memset. The bytes from the end of a block to the end of its last
+// page are kept zero, so growing within that page needs no memset either.
+//
+
+#if defined(__linux__)
+
+#define BIG_BYTES ((size_t)1 << 20)
+
+// Is a block of `size` bytes from allocator `a` mmap()ed
+#define _is_big(a,size) ((a) == NULL && (size) >= BIG_BYTES)
+
+static size_t big_page_size = 0;
+
+static inline size_t _big_round(size_t bytes)
+{
+  if(big_page_size == 0) big_page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return (bytes + big_page_size - 1) & ~(big_page_size - 1);
+}
+
+static void* _big_alloc(size_t size)
+{
+  void *ptr = mmap(NULL, _big_round(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static void _big_free(void *ptr, size_t size)
+{
+  munmap(ptr, _big_round(size));
+}
+
+// Grow or shrink a block that is big before or after
+static void* _big_realloc(void *ptr, size_t old_size, size_t new_size)
+{
+  void *new_ptr;
+
+  if(old_size < BIG_BYTES) {
+    if((new_ptr = _big_alloc(new_size)) == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size);
+    free(ptr);
+    return new_ptr;
+  }
+
+  if(new_size < BIG_BYTES) {
+    if((new_ptr = malloc(new_size)) == NULL) return NULL;
+    memcpy(new_ptr, ptr, new_size);
+    _big_free(ptr, old_size);
+    return new_ptr;
+  }
+
+  // Bytes cut off in the new last page must read as zero if it grows again
+  if(new_size < old_size)
+    memset((char*)ptr + new_size, 0, MIN(old_size, _big_round(new_size)) - new_size);
+
+  new_ptr = mremap(ptr, _big_round(old_size), _big_round(new_size), MREMAP_MAYMOVE);
+  return new_ptr == MAP_FAILED ? NULL : new_ptr;
+}
+
+#else
+
+#define _is_big(a,size) 0
+#define _big_alloc(size) NULL
+#define _big_free(ptr,size) ((void)(ptr), (void)(size))
+#define _big_realloc(ptr,old_size,new_size) NULL
+
+#endif
+
+// A NULL allocator is plain malloc (or mmap for big blocks)
+static inline void* _ba_alloc(const BIT_ARRAY_ALLOCATOR *a, size_t size)
+{
+  if(_is_big(a, size)) return _big_alloc(size);
+  return a == NULL ? malloc(size) : a->alloc(a->ctx, size);
+}
+
+static inline void* _ba_realloc(const BIT_ARRAY_ALLOCATOR *a, void *ptr,
+                                size_t old_size, size_t new_size)
+{
+  if(ptr != NULL && (_is_big(a, old_size) || _is_big(a, new_size)))
+    return _big_realloc(ptr, old_size, new_size);
+  if(a == NULL) return realloc(ptr, new_size);
+  if(ptr == NULL) return a->alloc(a->ctx, new_size);
+  return a->realloc(a->ctx, ptr, old_size, new_size);
+}
+
+static inline void _ba_free(const BIT_ARRAY_ALLOCATOR *a, void *ptr, size_t size)
+{
+  if(_is_big(a, size)) _big_free(ptr, size);
+  else if(a == NULL) free(ptr);
+  else if(ptr != NULL) a->free(a->ctx, ptr, size);
+}
+
+// Zero words [first, first+n) of heap storage. Whole pages of a big block are
+// dropped instead: the kernel gives fresh zero pages when they are next used.
+static void _words_zero(BIT_ARRAY *bitarr, word_addr_t first, word_addr_t n)
+{
+  word_t *start = bitarr->words + first, *end = start + n;
+
+#if defined(__linux__)
+  if(n * sizeof(word_t) >= BIG_BYTES &&
+     _is_big(bitarr->allocator, bitarr->capacity_in_words * sizeof(word_t)) &&
+     bitarr->cow == NULL && bitarr->words != bitarr->inline_words)
+  {
+    char *pstart = (char*)_big_round((size_t)start);
+    char *pend = (char*)((size_t)end & ~(big_page_size - 1));
+    if(madvise(pstart, (size_t)(pend - pstart), MADV_DONTNEED) == 0) {
+      memset(start, 0, (size_t)(pstart - (char*)start));
+      memset(pend, 0, (size_t)((char*)end - pend));
+      return;
+    }
+  }
+#endif
+
+  memset(start, 0, n * sizeof(word_t));
+}
+
+//
+// Growth policy
+//
+
+static BIT_ARRAY_GROWTH growth_policy = BIT_ARRAY_GROW_DOUBLE;
+static word_addr_t growth_chunk_words = 0;
+
+void bit_array_set_growth(BIT_ARRAY_GROWTH growth, bit_index_t chunk_bits)
+{
+  assert(growth != BIT_ARRAY_GROW_CHUNK || chunk_bits > 0);
+  growth_policy = growth;
+  growth_chunk_words = roundup_bits2words64(chunk_bits);
+}
+
+BIT_ARRAY_GROWTH bit_array_get_growth(void)
+{
+  return growth_policy;
+}
+
+// Capacity in words to grow to from capacity old_capacity, to fit nwords
+static word_addr_t _grow_capacity(word_addr_t old_capacity, word_addr_t nwords)
+{
+  word_addr_t cap;
+  switch(growth_policy) {
+    case BIT_ARRAY_GROW_EXACT: return nwords;
+    case BIT_ARRAY_GROW_CHUNK:
+      return ((nwords + growth_chunk_words - 1) / growth_chunk_words) *
+             growth_chunk_words;
+    case BIT_ARRAY_GROW_1_5X:
+      cap = old_capacity + old_capacity / 2;
+      return MAX(cap, nwords);
+    default: return MAX(8, roundup2pow(nwords));
+  }
+}
+
+//
+// Copy-on-write storage
+//
+// bit_array_clone_cow() moves the words of the source into a memfd mapped
+// MAP_SHARED and maps the same file MAP_PRIVATE for each clone, so a clone
+// costs no copying until a page of it is written. The kernel copies a page
+// when a clone writes to it. Before the source writes a page that clones may
+// still share, _cow_write() has each clone take its own copy of the page (by
+// writing to it), so clones never see the change. Every function that
+// modifies words calls _before_write() first.
+//
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+  #define BIT_ARRAY_COW_MMAP
+#endif
+
+struct BIT_ARRAY_COW
+{
+  int fd; // -1 in clones
+  word_t *map;
+  size_t map_bytes;
+  // Source: clones of it, and pages one of them may still share
+  struct BIT_ARRAY_COW *clones;
+  uint64_t *shared;
+  size_t shared_pages;
+  // Clone: the source (NULL once freed), next clone of the same source and
+  // pages we have our own copy of
+  struct BIT_ARRAY_COW *source, *next;
+  uint64_t *detached;
+};
+
+// Guards the source <-> clone links, which readers change when freeing clones
+static volatile char cow_lock[1] = {0};
+static size_t cow_page_size = 0;
+
+static inline size_t _cow_page(void)
+{
+  if(cow_page_size == 0) cow_page_size = (size_t)sysconf(_SC_PAGESIZE);
+  return cow_page_size;
+}
+
+#define _cow_num_pages(bytes) (((bytes) + _cow_page() - 1) / _cow_page())
+
+#ifdef BIT_ARRAY_COW_MMAP
+
+// Cloning arrays smaller than this is a plain copy
+#define COW_MIN_BYTES ((size_t)64 << 10)
+
+// Give each clone still sharing page p its own copy, then the source can
+// write it
+static void _cow_unshare_page(struct BIT_ARRAY_COW *cow, size_t p)
+{
+  struct BIT_ARRAY_COW *clone;
+  size_t words_per_page = _cow_page() / sizeof(word_t);
+
+  bitlock_acquire(cow_lock, 0);
+  for(clone = cow->clones; clone != NULL; clone = clone->next)
+  {
+    if(p < _cow_num_pages(clone->map_bytes) && !bitset_get(clone->detached, p))
+    {
+      // A write to the page of a MAP_PRIVATE mapping makes the kernel copy it.
+      // CAS writes the value back unchanged, even if the clone is being read.
+      word_t *ptr = clone->map + p * words_per_page, w = *ptr;
+      __sync_bool_compare_and_swap(ptr, w, w);
+      bitset_set(clone->detached, p);
+    }
+  }
+  bitset_del(cow->shared, p);
+  bitlock_release(cow_lock, 0);
+}
+
+// Called before the source writes words [first_word, first_word+num_words)
+static void _cow_write(BIT_ARRAY *bitarr, word_addr_t first_word,
+                       word_addr_t num_words)
+{
+  struct BIT_ARRAY_COW *cow = bitarr->cow;
+  if(cow->fd < 0 || cow->clones == NULL || num_words == 0) return;
+
+  size_t page_shift = trailing_zeros(_cow_page() / sizeof(word_t));
+  size_t p = first_word >> page_shift;
+  size_t end = ((first_word + num_words - 1) >> page_shift) + 1;
+  end = MIN(end, cow->shared_pages);
+
+  for(; p < end; p++)
+    if(bitset_get(cow->shared, p)) _cow_unshare_page(cow, p);
+}
+
+static void _cow_unmap(struct BIT_ARRAY_COW *cow)
+{
+  munmap(cow->map, cow->map_bytes);
+  if(cow->fd >= 0) close(cow->fd);
+  free(cow->shared);
+  free(cow->detached);
+  free(cow);
+}
+
+// Map nbytes of fd. Returns MAP_FAILED on error
+static word_t* _cow_map(int fd, size_t nbytes, int flags)
+{
+  return (word_t*)mmap(NULL, nbytes, PROT_READ|PROT_WRITE, flags, fd, 0);
+}
+
+// Release the words of a source or clone
+static void _cow_release(BIT_ARRAY *bitarr)
+{
+  struct BIT_ARRAY_COW *cow = bitarr->cow, **ptr;
+
+  bitlock_acquire(cow_lock, 0);
+  if(cow->fd >= 0) {
+    // Clones keep their mappings, which keep the file
+    struct BIT_ARRAY_COW *clone;
+    for(clone = cow->clones; clone != NULL; clone = clone->next)
+      clone->source = NULL;
+  }
+  else if(cow->source != NULL) {
+    for(ptr = &cow->source->clones; *ptr != cow; ptr = &(*ptr)->next) {}
+    *ptr = cow->next;
+  }
+  bitlock_release(cow_lock, 0);
+
+  _cow_unmap(cow);
+  bitarr->cow = NULL;
+}
+
+// Words of a source array now in a memfd with room for new_capacity words
+// Returns 1 on success, 0 on failure
+static char _cow_grow(BIT_ARRAY *bitarr, word_addr_t new_capacity)
+{
+  struct BIT_ARRAY_COW *cow = bitarr->cow;
+  size_t nbytes = _cow_num_pages(new_capacity * sizeof(word_t)) * _cow_page();
+  word_t *map;
+
+  // Clones keep their own mappings of the start of the file
+  if(ftruncate(cow->fd, (off_t)nbytes) != 0 ||
+     (map = _cow_map(cow->fd, nbytes, MAP_SHARED)) == MAP_FAILED) return 0;
+
+  munmap(cow->map, cow->map_bytes);
+  cow->map = bitarr->words = map;
+  cow->map_bytes = nbytes;
+  bitarr->capacity_in_words = nbytes / sizeof(word_t);
+  return 1;
+}
+
+#else
+
+static void _cow_write(BIT_ARRAY *bitarr, word_addr_t first_word,
+                       word_addr_t num_words)
+{
+  (void)bitarr; (void)first_word; (void)num_words;
+}
+
+static void _cow_release(BIT_ARRAY *bitarr) { (void)bitarr; }
+
+static char _cow_grow(BIT_ARRAY *bitarr, word_addr_t new_capacity)
+{
+  (void)bitarr; (void)new_capacity;
+  return 0;
+}
+
+#endif
+
+//
+// Write tracking
+//
+// With tracking on, writes mark 4KB blocks in two bitmaps: dirty (cleared by
+// the user) and stale (cleared when the cached popcount and hash tree are
+// brought up to date, which then only rescans stale blocks).
+//
+
+#define TRACK_BLOCK_WORDS 512
+#define TRACK_BLOCK_SHIFT 9
+
+struct BIT_ARRAY_TRACK
+{
+  uint64_t *dirty, *stale;
+  uint32_t *block_pop; // popcount of each block
+  size_t cap_blocks; // blocks that fit in the bitmaps, a multiple of 64
+  size_t num_blocks; // blocks covered by the caches
+  bit_index_t pop; // sum of block_pop
+  // Hash tree: node i has children 2i and 2i+1, block b is leaf leaves+b
+  uint64_t *tree;
+  size_t leaves; // power of two >= num_blocks
+};
+
+#define _track_num_blocks(nwords) \
+  (((nwords) + TRACK_BLOCK_WORDS - 1) >> TRACK_BLOCK_SHIFT)
+
+// Make room for at least nblocks. Returns 1 on success, 0 if out of memory
+static char _track_reserve(struct BIT_ARRAY_TRACK *t, size_t nblocks)
+{
+  if(nblocks <= t->cap_blocks) return 1;
+
+  size_t cap = MAX(roundup2pow(nblocks), 64), i;
+  size_t old_words = t->cap_blocks / 64, new_words = cap / 64;
+  uint64_t *dirty = (uint64_t*)realloc(t->dirty, new_words * sizeof(uint64_t));
+  if(dirty != NULL) t->dirty = dirty;
+  uint64_t *stale = (uint64_t*)realloc(t->stale, new_words * sizeof(uint64_t));
+  if(stale != NULL) t->stale = stale;
+  uint32_t *pop = (uint32_t*)realloc(t->block_pop, cap * sizeof(uint32_t));
+  if(pop != NULL) t->block_pop = pop;
+  if(dirty == NULL || stale == NULL || pop == NULL) return 0;
+
+  for(i = old_words; i < new_words; i++) dirty[i] = stale[i] = 0;
+  memset(pop + t->cap_blocks, 0, (cap - t->cap_blocks) * sizeof(uint32_t));
+  t->cap_blocks = cap;
+  return 1;
+}
+
+// Set bits [start, end) of a bitmap
+static void _bitmap_set_range(uint64_t *bits, size_t start, size_t end)
+{
+  if(start >= end) return;
+  size_t w = start / 64, last = (end - 1) / 64;
+  uint64_t first_mask = WORD_MAX << (start % 64);
+  uint64_t last_mask = WORD_MAX >> (63 - (end - 1) % 64);
+  if(w == last) { bits[w] |= first_mask & last_mask; return; }
+  bits[w++] |= first_mask;
+  for(; w < last; w++) bits[w] = WORD_MAX;
+  bits[last] |= last_mask;
+}
+
+static void _track_write(BIT_ARRAY *bitarr, word_addr_t first_word,
+                         word_addr_t num_words)
+{
+  struct BIT_ARRAY_TRACK *t = bitarr->track;
+  if(num_words == 0) return;
+
+  size_t start = first_word >> TRACK_BLOCK_SHIFT;
+  size_t end = ((first_word + num_words - 1) >> TRACK_BLOCK_SHIFT) + 1;
+
+  if(!_track_reserve(t, end)) {
+    fprintf(stderr, "Ran out of memory tracking writes [%zu blocks]\n", end);
+    abort();
+  }
+
+  _bitmap_set_range(t->dirty, start, end);
+  _bitmap_set_range(t->stale, start, end);
+}
+
+static void _track_free(BIT_ARRAY *bitarr)
+{
+  struct BIT_ARRAY_TRACK *t = bitarr->track;
+  if(t == NULL) return;
+  free(t->dirty);
+  free(t->stale);
+  free(t->block_pop);
+  free(t->tree);
+  free(t);
+  bitarr->track = NULL;
+}
+
+// Called before modifying words [first_word, first_word+num_words)
+static inline void _before_write(BIT_ARRAY *bitarr, word_addr_t first_word,
+                                 word_addr_t num_words)
+{
+  if(bitarr->cow != NULL) _cow_write(bitarr, first_word, num_words);
+  if(bitarr->track != NULL) _track_write(bitarr, first_word, num_words);
+}
+
+// Before modifying bits [start, start+len)
+static inline void _before_write_bits(BIT_ARRAY *bitarr, bit_index_t start,
+                                      bit_index_t len)
+{
+  if((bitarr->cow != NULL || bitarr->track != NULL) && len > 0)
+    _before_write(bitarr, bitset64_wrd(start),
+                  bitset64_wrd(start + len - 1) - bitset64_wrd(start) + 1);
+}
+
+// Before modifying any of the words
+#define _before_write_all(arr) _before_write(arr, 0, (arr)->capacity_in_words)
+
+// Before modifying words from w onwards (e.g. adding with carry)
+#define _before_write_from(arr,w) do {                                         \
+  if((w) < (arr)->capacity_in_words)                                           \
+    _before_write(arr, w, (arr)->capacity_in_words - (w));                     \
+} while(0)
+
+// Word storage is inline (in the struct) for small arrays
+static inline char _words_inline(const BIT_ARRAY *bitarr)
+{
+  return bitarr->words == bitarr->inline_words;
+}
+
+static inline void _words_free(BIT_ARRAY *bitarr)
+{
+  if(bitarr->cow != NULL) _cow_release(bitarr);
+  else if(!_words_inline(bitarr))
+    _ba_free(bitarr->allocator, bitarr->words,
+             bitarr->capacity_in_words * sizeof(word_t));
+}
+
+// Grow word storage to new_capacity words, leaving bitarr untouched on failure
+// New words are zero. Returns 1 on success, 0 if out of memory
+static char _words_grow(BIT_ARRAY *bitarr, word_addr_t new_capacity)
+{
+  size_t old_bytes = bitarr->capacity_in_words * sizeof(word_t);
+  size_t new_bytes = new_capacity * sizeof(word_t);
+  word_t *words;
+
+  // Growing the file adds zeros
+  if(bitarr->cow != NULL && bitarr->cow->fd >= 0)
+    return _cow_grow(bitarr, new_capacity);
+
+  // Copy out of the struct or a copy-on-write clone
+  if(_words_inline(bitarr) || bitarr->cow != NULL) {
+    if((words = (word_t*)_ba_alloc(bitarr->allocator, new_bytes)) == NULL)
+      return 0;
+    memcpy(words, bitarr->words, old_bytes);
+    if(bitarr->cow != NULL) _cow_release(bitarr);
+  }
+  else if((words = (word_t*)_ba_realloc(bitarr->allocator, bitarr->words,
+                                        old_bytes, new_bytes)) == NULL)
+    return 0;
+
+  // Big blocks get fresh pages, which are already zero
+  if(!_is_big(bitarr->allocator, new_bytes))
+    memset((char*)words + old_bytes, 0, new_bytes - old_bytes);
+
+  STAT_EVENT(grow, bitarr, old_bytes, new_bytes);
+
+  bitarr->words = words;
+  bitarr->capacity_in_words = new_capacity;
+  return 1;
+}
+
+// Shrink heap storage to new_capacity words (at least num_of_words), moving
+// back into the struct if it fits. Returns 1 on success, 0 if out of memory
+static char _words_shrink(BIT_ARRAY *bitarr, word_addr_t new_capacity)
+{
+  size_t old_bytes = bitarr->capacity_in_words * sizeof(word_t);
+  size_t new_bytes = new_capacity * sizeof(word_t);
+  word_t *words = bitarr->words;
+
+  if(new_capacity <= BIT_ARRAY_INLINE_WORDS) {
+    memset(bitarr->inline_words, 0, sizeof(bitarr->inline_words));
+    memcpy(bitarr->inline_words, words, bitarr->num_of_words * sizeof(word_t));
+    _ba_free(bitarr->allocator, words, old_bytes);
+    STAT_EVENT(shrink, bitarr, old_bytes, sizeof(bitarr->inline_words));
+    bitarr->words = bitarr->inline_words;
+    bitarr->capacity_in_words = BIT_ARRAY_INLINE_WORDS;
+    return 1;
+  }
+
+  if((words = (word_t*)_ba_realloc(bitarr->allocator, words,
+                                   old_bytes, new_bytes)) == NULL)
+    return 0;
+
+  STAT_EVENT(shrink, bitarr, old_bytes, new_bytes);
+  bitarr->words = words;
+  bitarr->capacity_in_words = new_capacity;
+  return 1;
+}
+
+//
+// Aligned allocator: 64 byte aligned, big blocks mmap()ed on 2MB boundaries
+// so the kernel can back them with huge pages.
+//
+
+#define ALIGNED_BYTES 64
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define _huge_len(size) (((size) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1))
+
+static void* _align_alloc(void *ctx, size_t size)
+{
+  void *ptr;
+  (void)ctx;
+
+#if defined(_WIN32)
+  ptr = _aligned_malloc(size ? size : ALIGNED_BYTES, ALIGNED_BYTES);
+#else
+  if(size >= HUGE_PAGE_SIZE)
+  {
+    // Map an extra huge page so we can trim to a 2MB boundary
+    size_t len = _huge_len(size), extra;
+    uint8_t *map = (uint8_t*)mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE,
+                                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED) return NULL;
+
+    extra = (HUGE_PAGE_SIZE - ((size_t)map & (HUGE_PAGE_SIZE-1))) & (HUGE_PAGE_SIZE-1);
+    if(extra > 0) munmap(map, extra);
+    munmap(map + extra + len, HUGE_PAGE_SIZE - extra);
+    ptr = map + extra;
+
+    #if defined(MADV_HUGEPAGE)
+      madvise(ptr, len, MADV_HUGEPAGE);
+    #endif
+    return ptr;
+  }
+
+  if(posix_memalign(&ptr, ALIGNED_BYTES, size ? size : ALIGNED_BYTES) != 0)
+    ptr = NULL;
+#endif
+
+  return ptr;
+}
+
+static void _align_free(void *ctx, void *ptr, size_t size)
+{
+  (void)ctx;
+#if defined(_WIN32)
+  (void)size;
+  _aligned_free(ptr);
+#else
+  if(size >= HUGE_PAGE_SIZE) munmap(ptr, _huge_len(size));
+  else free(ptr);
+#endif
+}
+
+static void* _align_realloc(void *ctx, void *ptr, size_t old_size,
+                              size_t new_size)
+{
+#if !defined(_WIN32)
+  // Still fits in the same mapping
+  if(old_size >= HUGE_PAGE_SIZE && new_size >= HUGE_PAGE_SIZE &&
+     _huge_len(old_size) == _huge_len(new_size)) return ptr;
+#endif
+
+  void *new_ptr = _align_alloc(ctx, new_size);
+  if(new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, MIN(old_size, new_size));
+  _align_free(ctx, ptr, old_size);
+  return new_ptr;
+}
+
+static const BIT_ARRAY_ALLOCATOR aligned_allocator = {
+  _align_alloc, _align_realloc, _align_free, NULL
+};
+
+const BIT_ARRAY_ALLOCATOR* bit_array_aligned_allocator(void)
+{
+  return &aligned_allocator;
+}
+
+// Views borrow their words: nothing to allocate, grow or free
+static void* _view_alloc(void *ctx, size_t size)
+{
+  (void)ctx; (void)size;
+  return NULL;
+}
+
+static void* _view_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+  (void)ctx; (void)ptr; (void)old_size; (void)new_size;
+  return NULL;
+}
+
+static void _view_free(void *ctx, void *ptr, size_t size)
+{
+  (void)ctx; (void)ptr; (void)size;
+}
+
+static const BIT_ARRAY_ALLOCATOR view_allocator = {
+  _view_alloc, _view_realloc, _view_free, NULL
+};
+
+static inline char _is_view(const BIT_ARRAY *bitarr)
+{
+  return bitarr->allocator == &view_allocator;
+}
+
+// Allocator for a copy of bitarr
+static inline const BIT_ARRAY_ALLOCATOR* _copy_allocator(const BIT_ARRAY *bitarr)
+{
+  return _is_view(bitarr) ? default_allocator : bitarr->allocator;
+}
+
+//
+// Arena: small blocks come from per size class free lists, carved from slabs.
+// Size classes are 64, 128, ... BIT_ARENA_MAX_SMALL bytes. Big blocks have a
+// 64 byte header linking them into a list so the arena can free them all.
+//
+
+#define ARENA_SLAB_SIZE (64 * 1024)
+#define ARENA_MIN_SHIFT 6 // 64 bytes
+#define ARENA_NUM_CLASSES 7
+
+typedef struct ArenaNode { struct ArenaNode *next; } ArenaNode;
+
+typedef struct ArenaBig
+{
+  struct ArenaBig *prev, *next;
+  size_t size;
+  char _pad[ALIGNED_BYTES - 2 * sizeof(void*) - sizeof(size_t)];
+} ArenaBig;
+
+struct BIT_ARRAY_ARENA
+{
+  BIT_ARRAY_ALLOCATOR allocator; // ctx is the arena
+  ArenaNode *free_lists[ARENA_NUM_CLASSES];
+  ArenaNode *slabs;
+  uint8_t *slab_pos, *slab_end; // unused part of the newest slab
+  ArenaBig *big;
+};
+
+static inline int _arena_class(size_t size)
+{
+  int c = 0;
+  while(((size_t)1 << (ARENA_MIN_SHIFT + c)) < size) c++;
+  return c;
+}
+
+static void* _arena_alloc(void *ctx, size_t size)
+{
+  BIT_ARRAY_ARENA *arena = (BIT_ARRAY_ARENA*)ctx;
+
+  if(size > BIT_ARENA_MAX_SMALL)
+  {
+    ArenaBig *b = (ArenaBig*)_align_alloc(NULL, size + sizeof(ArenaBig));
+    if(b == NULL) return NULL;
+    b->size = size;
+    b->prev = NULL;
+    b->next = arena->big;
+    if(arena->big != NULL) arena->big->prev = b;
+    arena->big = b;
+    return b + 1;
+  }
+
+  int c = _arena_class(size);
+  size_t csize = (size_t)1 << (ARENA_MIN_SHIFT + c);
+  ArenaNode *node = arena->free_lists[c];
+
+  if(node != NULL) {
+    arena->free_lists[c] = node->next;
+    return node;
+  }
+
+  if(arena->slab_pos == NULL || arena->slab_pos + csize > arena->slab_end)
+  {
+    // First 64 bytes of a slab link it into the list of slabs
+    ArenaNode *slab = (ArenaNode*)_align_alloc(NULL, ARENA_SLAB_SIZE);
+    if(slab == NULL) return NULL;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+    arena->slab_pos = (uint8_t*)slab + ALIGNED_BYTES;
+    arena->slab_end = (uint8_t*)slab + ARENA_SLAB_SIZE;
+  }
+
+  void *ptr = arena->slab_pos;
+  arena->slab_pos += csize;
+  return ptr;
+}
+
+static void _arena_free(void *ctx, void *ptr, size_t size)
+{
+  BIT_ARRAY_ARENA *arena = (BIT_ARRAY_ARENA*)ctx;
+
+  if(size > BIT_ARENA_MAX_SMALL)
+  {
+    ArenaBig *b = (ArenaBig*)ptr - 1;
+    if(b->prev != NULL) b->prev->next = b->next;
+    else arena->big = b->next;
+    if(b->next != NULL) b->next->prev = b->prev;
+    _align_free(NULL, b, b->size + sizeof(ArenaBig));
+    return;
+  }
+
+  int c = _arena_class(size);
+  ArenaNode *node = (ArenaNode*)ptr;
+  node->next = arena->free_lists[c];
+  arena->free_lists[c] = node;
+}
+
+static void* _arena_realloc(void *ctx, void *ptr, size_t old_size,
+                            size_t new_size)
+{
+  // Same size class
+  if(old_size <= BIT_ARENA_MAX_SMALL && new_size <= BIT_ARENA_MAX_SMALL &&
+     _arena_class(old_size) == _arena_class(new_size)) return ptr;
+
+  void *new_ptr = _arena_alloc(ctx, new_size);
+  if(new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, MIN(old_size, new_size));
+  _arena_free(ctx, ptr, old_size);
+  return new_ptr;
+}
+
+BIT_ARRAY_ARENA* bit_array_arena_create(void)
+{
+  BIT_ARRAY_ARENA *arena = (BIT_ARRAY_ARENA*)calloc(1, sizeof(BIT_ARRAY_ARENA));
+  if(arena == NULL) { errno = ENOMEM; return NULL; }
+  arena->allocator.alloc = _arena_alloc;
+  arena->allocator.realloc = _arena_realloc;
+  arena->allocator.free = _arena_free;
+  arena->allocator.ctx = arena;
+  return arena;
+}
+
+void bit_array_arena_free(BIT_ARRAY_ARENA *arena)
+{
+  ArenaNode *slab, *next_slab;
+  ArenaBig *b, *next_big;
+
+  for(b = arena->big; b != NULL; b = next_big) {
+    next_big = b->next;
+    _align_free(NULL, b, b->size + sizeof(ArenaBig));
+  }
+
+  for(slab = arena->slabs; slab != NULL; slab = next_slab) {
+    next_slab = slab->next;
+    _align_free(NULL, slab, ARENA_SLAB_SIZE);
+  }
+
+  free(arena);
+}
+
+const BIT_ARRAY_ALLOCATOR* bit_array_arena_allocator(BIT_ARRAY_ARENA *arena)
+{
+  return &arena->allocator;
+}
+
+//
+// Constructor
+//
+
+// If cannot allocate memory, set errno to ENOMEM, return NULL
+BIT_ARRAY* bit_array_alloc_with(BIT_ARRAY* bitarr, bit_index_t nbits,
+                                const BIT_ARRAY_ALLOCATOR *allocator)
+{
+  bitarr->num_of_bits = nbits;
+  bitarr->num_of_words = roundup_bits2words64(nbits);
+  bitarr->allocator = allocator;
+  bitarr->cow = NULL;
+  bitarr->track = NULL;
+
+  if(bitarr->num_of_words <= BIT_ARRAY_INLINE_WORDS) {
+    bitarr->capacity_in_words = BIT_ARRAY_INLINE_WORDS;
+    bitarr->words = bitarr->inline_words;
+    memset(bitarr->inline_words, 0, sizeof(bitarr->inline_words));
+    return bitarr;
+  }
+
+  bitarr->capacity_in_words = MAX(BIT_ARRAY_INLINE_WORDS + 1,
+                                  _grow_capacity(0, bitarr->num_of_words));
+
+  size_t bytes = bitarr->capacity_in_words * sizeof(word_t);
+  if(_is_big(allocator, bytes)) bitarr->words = (word_t*)_big_alloc(bytes);
+  else if(allocator == NULL) bitarr->words = (word_t*)calloc(1, bytes);
+  else if((bitarr->words = (word_t*)allocator->alloc(allocator->ctx, bytes)) != NULL)
+    memset(bitarr->words, 0, bytes);
+
+  if(bitarr->words == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return bitarr;
+}
+
+BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits)
+{
+  return bit_array_alloc_with(bitarr, nbits, default_allocator);
+}
+
+void bit_array_dealloc(BIT_ARRAY* bitarr)
+{
+  _track_free(bitarr);
+  _words_free(bitarr);
+  memset(bitarr, 0, sizeof(BIT_ARRAY));
+}
+
+// If cannot allocate memory, set errno to ENOMEM, return NULL
+BIT_ARRAY* bit_array_create_with(bit_index_t nbits,
+                                 const BIT_ARRAY_ALLOCATOR *allocator)
+{
+  BIT_ARRAY* bitarr = (BIT_ARRAY*)_ba_alloc(allocator, sizeof(BIT_ARRAY));
+
+  // error if could not allocate enough memory
+  if(bitarr == NULL || bit_array_alloc_with(bitarr, nbits, allocator) == NULL)
+  {
+    if(bitarr != NULL) _ba_free(allocator, bitarr, sizeof(BIT_ARRAY));
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  DEBUG_PRINT("Creating BIT_ARRAY (bits: %lu; allocated words: %lu; "
+              "using words: %lu; WORD_SIZE: %i)\n",
+              (unsigned long)nbits, (unsigned long)bitarr->capacity_in_words,
+              (unsigned long)roundup_bits2words64(nbits), (int)WORD_SIZE);
+
+  DEBUG_VALIDATE(bitarr);
+
+  return bitarr;
+}
+
+BIT_ARRAY* bit_array_create(bit_index_t nbits)
+{
+  return bit_array_create_with(nbits, default_allocator);
+}
+
+//
+// Destructor
+//
+void bit_array_free(BIT_ARRAY* bitarr)
+{
+  _track_free(bitarr);
+  if(bitarr->words != NULL) _words_free(bitarr);
+  _ba_free(bitarr->allocator, bitarr, sizeof(BIT_ARRAY));
+}
+
+//
+// Views
+//
+
+// If the top word has bits set past nbits, sets errno to EINVAL, returns NULL
+BIT_ARRAY* bit_array_view(BIT_ARRAY* view, word_t* words, bit_index_t nbits)
+{
+  word_addr_t nwords = roundup_bits2words64(nbits);
+
+  if(nwords > 0 && (words[nwords-1] & ~bitmask64(bits_in_top_word(nbits)))) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  view->words = nwords > 0 ? words : view->inline_words;
+  view->num_of_bits = nbits;
+  view->num_of_words = view->capacity_in_words = nwords;
+  view->allocator = &view_allocator;
+  view->cow = NULL;
+  view->track = NULL;
+  view->inline_words[0] = 0;
+
+  DEBUG_VALIDATE(view);
+  return view;
+}
+
+// If start is not word aligned, or len does not end on a word boundary or at
+// the end of src, sets errno to EINVAL, returns NULL
+BIT_ARRAY* bit_array_view_range(BIT_ARRAY* view, const BIT_ARRAY* src,
+                                bit_index_t start, bit_index_t len)
+{
+  assert(start <= src->num_of_bits && len <= src->num_of_bits - start);
+
+  if(bitset64_idx(start) != 0 ||
+     (bitset64_idx(len) != 0 && start + len != src->num_of_bits)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  return bit_array_view(view, src->words + bitset64_wrd(start), len);
+}
+
+char bit_array_is_view(const BIT_ARRAY* bitarr)
+{
+  return _is_view(bitarr);
+}
+
+bit_index_t bit_array_length(const BIT_ARRAY* bit_arr)
+{
+  return bit_arr->num_of_bits;
+}
+
+// Name of the word kernels picked at startup e.g. "avx2", "neon", "scalar"
+const char* bit_array_simd_name(void)
+{
+  return kernels->name;
+}
+
+// Change the size of a bit array. Enlarging an array will add zeros
+// to the end of it. Returns 1 on success, 0 on failure (e.g. not enough memory)
+char bit_array_resize(BIT_ARRAY* bitarr, bit_index_t new_num_of_bits)
+{
+  word_addr_t old_num_of_words = bitarr->num_of_words;
+  word_addr_t new_num_of_words = roundup_bits2words64(new_num_of_bits);
+  STAT_SCOPE(resize, bitarr,
+             (new_num_of_words > old_num_of_words ? new_num_of_words - old_num_of_words
+                                                  : old_num_of_words - new_num_of_words)
+             * sizeof(word_t));
+
+  // The length of borrowed words is fixed
+  if(_is_view(bitarr) && new_num_of_bits != bitarr->num_of_bits) {
+    errno = EPERM;
+    return 0;
+  }
+
+  // Shrinking zeros the bits cut off
+  if(new_num_of_bits < bitarr->num_of_bits)
+    _before_write_bits(bitarr, new_num_of_bits,
+                       bitarr->num_of_bits - new_num_of_bits);
+
+  bitarr->num_of_bits = new_num_of_bits;
+  bitarr->num_of_words = new_num_of_words;
+
+  DEBUG_PRINT("Resize: old_num_of_words: %i; new_num_of_words: %i capacity: %i\n",
+              (int)old_num_of_words, (int)new_num_of_words,
+              (int)bitarr->capacity_in_words);
+
+  if(new_num_of_words > bitarr->capacity_in_words)
+  {
+    // Need to change the amount of memory used, new words are zero
+    word_addr_t new_capacity
+      = _grow_capacity(bitarr->capacity_in_words, new_num_of_words);
+
+    if(!_words_grow(bitarr, new_capacity))
+    {
+      // error - could not allocate enough memory
+      perror("resize realloc");
+      errno = ENOMEM;
+      return 0;
+    }
+  }
+
+  // Words added to the end are new, even though they are zero
+  if(bitarr->track != NULL && new_num_of_words > old_num_of_words)
+    _track_write(bitarr, old_num_of_words, new_num_of_words - old_num_of_words);
+  else if(new_num_of_words < old_num_of_words)
+  {
+    // Shrunk -- need to zero old memory
+    _words_zero(bitarr, new_num_of_words, old_num_of_words - new_num_of_words);
+  }
+
+  // Mask top word
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
+}
+
+void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+{
+  bit_index_t old_num_of_bits = bitarr->num_of_bits;
+
+  if(!bit_array_resize(bitarr, num_of_bits))
+  {
+    fprintf(stderr, "Ran out of memory resizing [%lu -> %lu]",
+            (unsigned long)old_num_of_bits, (unsigned long)num_of_bits);
+    abort();
+  }
+}
+
+// If bitarr length < num_bits, resizes to num_bits
+char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits)
+{
+  if(bitarr->num_of_bits < ensure_num_of_bits)
+  {
+    return bit_array_resize(bitarr, ensure_num_of_bits);
+  }
+
+  return 1;
+}
+
+void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits)
+{
+  if(num_of_bits > bitarr->num_of_bits)
+  {
+    bit_array_resize_critical(bitarr, num_of_bits);
+  }
+}
+
+bit_index_t bit_array_capacity(const BIT_ARRAY* bitarr)
+{
+  return (bit_index_t)bitarr->capacity_in_words * WORD_SIZE;
+}
+
+// Make room for nbits without changing the length
+char bit_array_reserve(BIT_ARRAY* bitarr, bit_index_t nbits)
+{
+  word_addr_t nwords = roundup_bits2words64(nbits);
+
+  if(nwords <= bitarr->capacity_in_words) return 1;
+
+  if(_is_view(bitarr)) {
+    errno = EPERM;
+    return 0;
+  }
+
+  if(!_words_grow(bitarr, nwords)) {
+    errno = ENOMEM;
+    return 0;
+  }
+  return 1;
+}
+
+// Free the capacity past the length
+char bit_array_shrink_to_fit(BIT_ARRAY* bitarr)
+{
+  word_addr_t nwords = bitarr->num_of_words;
+
+  // Views do not own their words, copy-on-write arrays share theirs
+  if(_is_view(bitarr) || bitarr->cow != NULL || _words_inline(bitarr) ||
+     nwords == bitarr->capacity_in_words) return 1;
+
+  if(!_words_shrink(bitarr, nwords)) {
+    errno = ENOMEM;
+    return 0;
+  }
+  return 1;
+}
+
+static inline
+void _bit_array_ensure_nwords(BIT_ARRAY* bitarr, word_addr_t nwords,
+                              const char *file, int lineno, const char *func)
+{
+  size_t newmem, oldmem;
+  if(bitarr->capacity_in_words < nwords) {
+    oldmem = bitarr->capacity_in_words * sizeof(word_t);
+    word_addr_t new_capacity = _grow_capacity(bitarr->capacity_in_words, nwords);
+    newmem = new_capacity * sizeof(word_t);
+
+    if(!_words_grow(bitarr, new_capacity)) {
+      fprintf(stderr, "[%s:%i:%s()] Ran out of memory resizing [%zu -> %zu]",
+              file, lineno, func, oldmem, newmem);
+      abort();
+    }
+
+    DEBUG_PRINT("Ensure nwords realloc %zu -> %zu\n", oldmem, newmem);
+  }
+}
+
+
+//
+// Get, set, clear, assign and toggle individual bits
+//
+
+// Get the value of a bit (returns 0 or 1)
+char bit_array_get_bit(const BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  return bit_array_get(bitarr, b);
+}
+
+// set a bit (to 1) at position b
+void bit_array_set_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_set(bitarr,b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// clear a bit (to 0) at position b
+void bit_array_clear_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_clear(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
+void bit_array_toggle_bit(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  assert(b < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_toggle(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If char c != 0, set bit; otherwise clear bit
+void bit_array_assign_bit(BIT_ARRAY* bitarr, bit_index_t b, char c)
+{
+  assert(b < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_assign(bitarr, b, c ? 1 : 0);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get, set etc with resize
+//
+
+// Get the value of a bit (returns 0 or 1)
+char bit_array_rget(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  return bit_array_get(bitarr, b);
+}
+
+// set a bit (to 1) at position b
+void bit_array_rset(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_set(bitarr,b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// clear a bit (to 0) at position b
+void bit_array_rclear(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_clear(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If bit is 0 -> 1, if bit is 1 -> 0.  AKA 'flip'
+void bit_array_rtoggle(BIT_ARRAY* bitarr, bit_index_t b)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_toggle(bitarr, b);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// If char c != 0, set bit; otherwise clear bit
+void bit_array_rassign(BIT_ARRAY* bitarr, bit_index_t b, char c)
+{
+  bit_array_ensure_size_critical(bitarr, b+1);
+  _before_write(bitarr, bitset64_wrd(b), 1);
+  bit_array_assign(bitarr, b, c ? 1 : 0);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get, set, clear and toggle several bits at once
+//
+
+// Get the offsets of the set bits (for offsets start<=offset<end)
+// Returns the number of bits set
+// It is assumed that dst is at least of length (end-start)
+bit_index_t bit_array_get_bits(const BIT_ARRAY* bitarr,
+                               bit_index_t start, bit_index_t end,
+                               bit_index_t* dst)
+{
+  BIT_ARRAY_ITER it;
+  bit_array_iter_init(&it, bitarr, start, end, 0);
+  return end > start ? bit_array_iter_decode64(&it, dst, end - start) : 0;
+}
+
+// Get the offsets of the bits not set, for start<=offset<end
+bit_index_t bit_array_get_clear_bits(const BIT_ARRAY* bitarr,
+                                     bit_index_t start, bit_index_t end,
+                                     bit_index_t* dst)
+{
+  BIT_ARRAY_ITER it;
+  bit_array_iter_init(&it, bitarr, start, end, 1);
+  return end > start ? bit_array_iter_decode64(&it, dst, end - start) : 0;
+}
+
+//
+// Iterate over set or clear bits
+// it->word holds the bits of word it->wrd still to be returned. Clear bits are
+// found by flipping each word as it is loaded.
+//
+
+static inline word_t _iter_load(const BIT_ARRAY_ITER *it, word_addr_t wrd)
+{
+  word_t w = it->words[wrd] ^ it->flip;
+  return wrd == it->last_wrd ? w & it->last_mask : w;
+}
+
+void bit_array_iter_init(BIT_ARRAY_ITER *it, const BIT_ARRAY *bitarr,
+                         bit_index_t start, bit_index_t end, char clear_bits)
+{
+  assert(end <= bitarr->num_of_bits);
+
+  it->words = bitarr->words;
+  it->flip = clear_bits ? WORD_MAX : 0;
+
+  if(start >= end) {
+    it->wrd = it->last_wrd = 0;
+    it->word = it->last_mask = 0;
+    return;
+  }
+
+  it->wrd = bitset64_wrd(start);
+  it->last_wrd = bitset64_wrd(end - 1);
+  it->last_mask = WORD_MAX >> (WORD_SIZE - 1 - bitset64_idx(end - 1));
+  it->word = _iter_load(it, it->wrd) & (WORD_MAX << bitset64_idx(start));
+}
+
+// Returns 1 and sets *result to the next position, or 0 at the end
+char bit_array_iter_next(BIT_ARRAY_ITER *it, bit_index_t *result)
+{
+  while(it->word == 0) {
+    if(it->wrd >= it->last_wrd) return 0;
+    it->wrd++;
+    it->word = _iter_load(it, it->wrd);
+  }
+
+  *result = it->wrd * WORD_SIZE + trailing_zeros(it->word);
+  it->word &= it->word - 1;
+  return 1;
+}
+
+// Whole words between the current and the last go through the decode kernel
+// while there is room for all 64 bits of each
+#define _iter_decode(it,dst,n,type,kernel) do {                                \
+  size_t _k = 0;                                                               \
+  word_addr_t _nw;                                                             \
+  while(_k < (n)) {                                                            \
+    if((it)->word == 0) {                                                      \
+      if((it)->wrd >= (it)->last_wrd) break;                                   \
+      _nw = MIN((it)->last_wrd - (it)->wrd - 1, ((n) - _k) / WORD_SIZE);       \
+      if(_nw > 0) {                                                            \
+        _k += kernel((dst) + _k, (it)->words + (it)->wrd + 1, _nw,             \
+                     ((it)->wrd + 1) * WORD_SIZE, (it)->flip);                 \
+        (it)->wrd += _nw;                                                      \
+      }                                                                        \
+      else {                                                                   \
+        (it)->wrd++;                                                           \
+        (it)->word = _iter_load(it, (it)->wrd);                                \
+      }                                                                        \
+      continue;                                                                \
+    }                                                                          \
+    bit_index_t _base = (it)->wrd * WORD_SIZE;                                 \
+    for(; (it)->word != 0 && _k < (n); (it)->word &= (it)->word - 1)           \
+      (dst)[_k++] = (type)(_base + trailing_zeros((it)->word));                \
+  }                                                                            \
+  return _k;                                                                   \
+} while(0)
+
+// Write up to n positions to dst. Returns number written, less than n only at
+// the end
+size_t bit_array_iter_decode64(BIT_ARRAY_ITER *it, uint64_t *dst, size_t n)
+{
+  _iter_decode(it, dst, n, uint64_t, decode_kernels->decode64);
+}
+
+// As bit_array_iter_decode64, for ranges that end before bit 2^32
+size_t bit_array_iter_decode32(BIT_ARRAY_ITER *it, uint32_t *dst, size_t n)
+{
+  assert(it->last_wrd < ((word_addr_t)1 << 26));
+  _iter_decode(it, dst, n, uint32_t, decode_kernels->decode32);
+}
+
+// Set multiple bits at once.
+// e.g. set bits 1, 20 & 31: bit_array_set_bits(bitarr, 3, 1,20,31);
+void bit_array_set_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_set_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Clear multiple bits at once.
+// e.g. clear bits 1, 20 & 31: bit_array_clear_bits(bitarr, 3, 1,20,31);
+void bit_array_clear_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_clear_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Toggle multiple bits at once
+// e.g. toggle bits 1, 20 & 31: bit_array_toggle_bits(bitarr, 3, 1,20,31);
+void bit_array_toggle_bits(BIT_ARRAY* bitarr, size_t n, ...)
+{
+  size_t i;
+  va_list argptr;
+  va_start(argptr, n);
+
+  for(i = 0; i < n; i++)
+  {
+    unsigned int bit_index = va_arg(argptr, unsigned int);
+    bit_array_toggle_bit(bitarr, bit_index);
+  }
+
+  va_end(argptr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Batches of bit indices
+//
+// Scattered updates to a big array are bound by cache misses, so we prefetch
+// the word a few indices ahead. Sorted input instead merges indices that fall
+// in the same word into one update. (Bucketing unsorted indices by region
+// first was tried, but the extra pass cost more than it saved.)
+//
+
+#if defined(__GNUC__)
+  #define _prefetch_word(ptr) __builtin_prefetch(ptr, 1)
+#else
+  #define _prefetch_word(ptr) (void)(ptr)
+#endif
+
+#define BATCH_PREFETCH 16
+// Arrays smaller than this (256KB) stay in cache, so prefetching is a waste
+#define BATCH_PREFETCH_MIN_WORDS (1UL<<15)
+
+typedef enum {BATCH_SET, BATCH_CLEAR, BATCH_TOGGLE} BatchOp;
+
+static inline void _batch_check(const BIT_ARRAY* bitarr, const bit_index_t* idx,
+                                size_t n)
+{
+#ifndef NDEBUG
+  size_t i;
+  for(i = 0; i < n; i++) assert(idx[i] < bitarr->num_of_bits);
+#else
+  (void)bitarr; (void)idx; (void)n;
+#endif
+}
+
+#define _batch_loop(words,idx,n,pf,OP) do {                                    \
+  size_t _i;                                                                   \
+  for(_i = 0; _i < (n); _i++) {                                                \
+    if((pf) && _i + BATCH_PREFETCH < (n))                                      \
+      _prefetch_word((words) + bitset64_wrd((idx)[_i + BATCH_PREFETCH]));      \
+    (words)[bitset64_wrd((idx)[_i])] OP ((word_t)1 << bitset64_idx((idx)[_i])); \
+  }                                                                            \
+} while(0)
+
+static void _batch_apply(word_t *words, const bit_index_t* idx, size_t n,
+                         char pf, BatchOp op)
+{
+  switch(op) {
+    case BATCH_SET:    _batch_loop(words, idx, n, pf, |=);  break;
+    case BATCH_CLEAR:  _batch_loop(words, idx, n, pf, &= ~); break;
+    case BATCH_TOGGLE: _batch_loop(words, idx, n, pf, ^=);  break;
+  }
+}
+
+// Indices in ascending order: build up a mask for each word
+static void _batch_apply_sorted(word_t *words, const bit_index_t* idx, size_t n,
+                                BatchOp op)
+{
+  size_t i = 0;
+  word_addr_t w;
+  word_t mask, bit;
+
+  while(i < n)
+  {
+    w = bitset64_wrd(idx[i]);
+    for(mask = 0; i < n && bitset64_wrd(idx[i]) == w; i++) {
+      bit = (word_t)1 << bitset64_idx(idx[i]);
+      mask = op == BATCH_TOGGLE ? mask ^ bit : mask | bit;
+    }
+
+    switch(op) {
+      case BATCH_SET:    words[w] |= mask;  break;
+      case BATCH_CLEAR:  words[w] &= ~mask; break;
+      case BATCH_TOGGLE: words[w] ^= mask;  break;
+    }
+  }
+}
+
+static void _batch_update(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                          int flags, BatchOp op)
+{
+  size_t i;
+  _batch_check(bitarr, idx, n);
+
+  if(bitarr->cow != NULL || bitarr->track != NULL)
+    for(i = 0; i < n; i++) _before_write(bitarr, bitset64_wrd(idx[i]), 1);
+
+  if(flags & BIT_BATCH_SORTED) _batch_apply_sorted(bitarr->words, idx, n, op);
+  else _batch_apply(bitarr->words, idx, n,
+                    bitarr->num_of_words >= BATCH_PREFETCH_MIN_WORDS, op);
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set, clear or toggle the bits at idx[0..n). Indices may repeat (toggling a
+// bit twice leaves it unchanged). flags: BIT_BATCH_SORTED if idx is ascending
+void bit_array_set_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                         int flags)
+{
+  _batch_update(bitarr, idx, n, flags, BATCH_SET);
+}
+
+void bit_array_clear_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                           int flags)
+{
+  _batch_update(bitarr, idx, n, flags, BATCH_CLEAR);
+}
+
+void bit_array_toggle_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                            int flags)
+{
+  _batch_update(bitarr, idx, n, flags, BATCH_TOGGLE);
+}
+
+// Number of idx[0..n) that are set (repeats are counted each time)
+bit_index_t bit_array_test_batch(const BIT_ARRAY* bitarr, const bit_index_t* idx,
+                                 size_t n)
+{
+  bit_index_t count = 0;
+  size_t i;
+  char pf = bitarr->num_of_words >= BATCH_PREFETCH_MIN_WORDS;
+
+  _batch_check(bitarr, idx, n);
+
+  for(i = 0; i < n; i++) {
+    if(pf && i + BATCH_PREFETCH < n)
+      _prefetch_word(bitarr->words + bitset64_wrd(idx[i + BATCH_PREFETCH]));
+    count += bitset_get(bitarr->words, idx[i]);
+  }
+
+  return count;
+}
+
+// out is resized to n, and bit i of out is set to bit idx[i] of bitarr
+void bit_array_gather(const BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                      BIT_ARRAY* out)
+{
+  size_t i, j, end;
+  word_t w;
+  char pf = bitarr->num_of_words >= BATCH_PREFETCH_MIN_WORDS;
+
+  assert(out != bitarr);
+  _batch_check(bitarr, idx, n);
+  bit_array_resize_critical(out, n);
+  _before_write(out, 0, out->num_of_words);
+
+  for(i = 0; i < n; i += WORD_SIZE)
+  {
+    end = MIN(n - i, WORD_SIZE);
+    for(w = 0, j = 0; j < end; j++) {
+      if(pf && i + j + BATCH_PREFETCH < n)
+        _prefetch_word(bitarr->words + bitset64_wrd(idx[i + j + BATCH_PREFETCH]));
+      w |= (word_t)bitset_get(bitarr->words, idx[i+j]) << j;
+    }
+    out->words[i / WORD_SIZE] = w;
+  }
+
+  DEBUG_VALIDATE(out);
+}
+
+
+//
+// Set, clear and toggle all bits in a region
+//
+
+// Set all the bits in a region
+void bit_array_set_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  STAT_SCOPE(set_region, bitarr, roundup_bits2bytes(len));
+  assert(start + len <= bitarr->num_of_bits);
+  _before_write_bits(bitarr, start, len);
+  SET_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+// Clear all the bits in a region
+void bit_array_clear_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  STAT_SCOPE(clear_region, bitarr, roundup_bits2bytes(len));
+  assert(start + len <= bitarr->num_of_bits);
+  _before_write_bits(bitarr, start, len);
+  CLEAR_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Toggle all the bits in a region
+void bit_array_toggle_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  _before_write_bits(bitarr, start, len);
+  TOGGLE_REGION(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Set, clear and toggle all bits at once
+//
+
+// set all elements of data to one
+void bit_array_set_all(BIT_ARRAY* bitarr)
+{
+  STAT_SCOPE(set_all, bitarr, bitarr->num_of_words * sizeof(word_t));
+  bit_index_t num_of_bytes = bitarr->num_of_words * sizeof(word_t);
+  _before_write(bitarr, 0, bitarr->num_of_words);
+  memset(bitarr->words, 0xFF, num_of_bytes);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// set all elements of data to zero
+void bit_array_clear_all(BIT_ARRAY* bitarr)
+{
+  STAT_SCOPE(clear_all, bitarr, bitarr->num_of_words * sizeof(word_t));
+  _before_write(bitarr, 0, bitarr->num_of_words);
+  memset(bitarr->words, 0, bitarr->num_of_words * sizeof(word_t));
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set all 1 bits to 0, and all 0 bits to 1. AKA flip
+void bit_array_toggle_all(BIT_ARRAY* bitarr)
+{
+  word_addr_t i;
+  STAT_SCOPE(toggle_all, bitarr, bitarr->num_of_words * 2 * sizeof(word_t));
+  _before_write(bitarr, 0, bitarr->num_of_words);
+  for(i = 0; i < bitarr->num_of_words; i++)
+  {
+    bitarr->words[i] ^= WORD_MAX;
+  }
+
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+//
+// Get a word at a time
+//
+
+uint64_t bit_array_get_word64(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint64_t)_get_word(bitarr, start);
+}
+
+uint32_t bit_array_get_word32(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint32_t)_get_word(bitarr, start);
+}
+
+uint16_t bit_array_get_word16(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint16_t)_get_word(bitarr, start);
+}
+
+uint8_t bit_array_get_word8(const BIT_ARRAY* bitarr, bit_index_t start)
+{
+  assert(start < bitarr->num_of_bits);
+  return (uint8_t)_get_word(bitarr, start);
+}
+
+uint64_t bit_array_get_wordn(const BIT_ARRAY* bitarr, bit_index_t start, int n)
+{
+  assert(start < bitarr->num_of_bits);
+  assert(n <= 64);
+  return (uint64_t)(_get_word(bitarr, start) & bitmask64(n));
+}
+
+//
+// Set a word at a time
+//
+// Doesn't extend bit array. However it is safe to TRY to set bits beyond the
+// end of the array, as long as: `start` is < `bit_array_length(arr)`
+//
+
+void bit_array_set_word64(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(start), 2);
+  _set_word(bitarr, start, (word_t)word);
+}
+
+void bit_array_set_word32(BIT_ARRAY* bitarr, bit_index_t start, uint32_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(start), 2);
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffff00000000UL));
+}
+
+void bit_array_set_word16(BIT_ARRAY* bitarr, bit_index_t start, uint16_t word)
+{
+  assert(start < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(start), 2);
+  word_t w = _get_word(bitarr, start);
+  _set_word(bitarr, start, bitmask_merge(w, word, 0xffffffffffff0000UL));
+}
+
+void bit_array_set_word8(BIT_ARRAY* bitarr, bit_index_t start, uint8_t byte)
+{
+  assert(start < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(start), 2);
+  _set_byte(bitarr, start, byte);
+}
+
+void bit_array_set_wordn(BIT_ARRAY* bitarr, bit_index_t start, uint64_t word, int n)
+{
+  assert(start < bitarr->num_of_bits);
+  _before_write(bitarr, bitset64_wrd(start), 2);
+  assert(n <= 64);
+  word_t w = _get_word(bitarr, start), m = bitmask64(n);
+  _set_word(bitarr, start, bitmask_merge(word,w,m));
+}
+
+//
+// Number of bits set
+//
+
+// Get the number of bits set (hamming weight)
+bit_index_t bit_array_num_bits_set(const BIT_ARRAY* bitarr)
+{
+  STAT_SCOPE(num_bits_set, bitarr, bitarr->num_of_words * sizeof(word_t));
+  return kernels->popcount(bitarr->words, bitarr->num_of_words);
+}
+
+// Get the number of bits not set (1 - hamming weight)
+bit_index_t bit_array_num_bits_cleared(const BIT_ARRAY* bitarr)
+{
+  return bitarr->num_of_bits - bit_array_num_bits_set(bitarr);
+}
+
+
+// Get the number of bits set in on array and not the other.  This is equivalent
+// to hamming weight of the XOR when the two arrays are the same length.
+// e.g. 10101 vs 00111 => hamming distance 2 (XOR is 10010)
+bit_index_t bit_array_hamming_distance(const BIT_ARRAY* arr1,
+                                       const BIT_ARRAY* arr2)
+{
+  STAT_SCOPE(hamming_distance, arr1,
+             (arr1->num_of_words + arr2->num_of_words) * sizeof(word_t));
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  word_addr_t max_words = MAX(arr1->num_of_words, arr2->num_of_words);
+
+  bit_index_t hamming_distance
+    = kernels->xor_popcount(arr1->words, arr2->words, min_words);
+
+  if(min_words != max_words)
+  {
+    const BIT_ARRAY* long_arr
+      = (arr1->num_of_words > arr2->num_of_words ? arr1 : arr2);
+
+    hamming_distance += kernels->popcount(long_arr->words + min_words,
+                                          max_words - min_words);
+  }
+
+  return hamming_distance;
+}
+
+//
+// Set algebra counts
+//
+
+// Words in one past the end of the shorter array are counted by popcount:
+// `a_tail` for the words of arr1, `b_tail` for arr2
+static inline bit_index_t _count_tails(const BIT_ARRAY* arr1,
+                                       const BIT_ARRAY* arr2,
+                                       char a_tail, char b_tail)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  if(a_tail && arr1->num_of_words > min_words)
+    return kernels->popcount(arr1->words + min_words,
+                             arr1->num_of_words - min_words);
+  if(b_tail && arr2->num_of_words > min_words)
+    return kernels->popcount(arr2->words + min_words,
+                             arr2->num_of_words - min_words);
+  return 0;
+}
+
+// |arr1 & arr2|
+bit_index_t bit_array_and_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  STAT_SCOPE(and_count, arr1, min_words * 2 * sizeof(word_t));
+  return kernels->and_popcount(arr1->words, arr2->words, min_words);
+}
+
+// |arr1 | arr2|
+bit_index_t bit_array_or_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  STAT_SCOPE(or_count, arr1,
+             (arr1->num_of_words + arr2->num_of_words) * sizeof(word_t));
+  return kernels->or_popcount(arr1->words, arr2->words, min_words) +
+         _count_tails(arr1, arr2, 1, 1);
+}
+
+// |arr1 & ~arr2|
+bit_index_t bit_array_andnot_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  STAT_SCOPE(andnot_count, arr1, (arr1->num_of_words + min_words) * sizeof(word_t));
+  return kernels->andnot_popcount(arr1->words, arr2->words, min_words) +
+         _count_tails(arr1, arr2, 1, 0);
+}
+
+// Returns 1 iff arr1 & arr2 has a bit set
+char bit_array_intersects(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2)
+{
+  word_addr_t min_words = MIN(arr1->num_of_words, arr2->num_of_words);
+  return kernels->intersects(arr1->words, arr2->words, min_words);
+}
+
+// |arr1 & arr2| / |arr1 | arr2|, 1 if both are empty
+double bit_array_jaccard(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2)
+{
+  bit_index_t num_union = bit_array_or_count(arr1, arr2);
+  if(num_union == 0) return 1.0;
+  return (double)bit_array_and_count(arr1, arr2) / num_union;
+}
+
+// Words of the query per block of bit_array_count_many: 16KB stays in L1
+// while it is compared against each of the arrays
+#define COUNT_BLOCK_WORDS 2048
+
+// Bytes read by bit_array_count_many, counting the query once
+static inline bit_index_t _count_many_bytes(const BIT_ARRAY* query,
+                                            const BIT_ARRAY** arrs, size_t m)
+{
+  bit_index_t nwords = query->num_of_words;
+  size_t j;
+  for(j = 0; j < m; j++) nwords += arrs[j]->num_of_words;
+  return nwords * sizeof(word_t);
+}
+
+void bit_array_count_many(BIT_ARRAY_COUNT_OP op, const BIT_ARRAY* query,
+                          const BIT_ARRAY** arrs, size_t m,
+                          bit_index_t* counts)
+{
+  bit_index_t (*count)(const word_t *a, const word_t *b, word_addr_t n);
+  char q_tail = 1, arr_tail = 1;
+  word_addr_t w, end;
+  size_t j;
+
+  switch(op) {
+    case BIT_ARRAY_COUNT_AND:
+      count = kernels->and_popcount; q_tail = arr_tail = 0; break;
+    case BIT_ARRAY_COUNT_OR: count = kernels->or_popcount; break;
+    case BIT_ARRAY_COUNT_XOR: count = kernels->xor_popcount; break;
+    case BIT_ARRAY_COUNT_ANDNOT:
+      count = kernels->andnot_popcount; arr_tail = 0; break;
+    default:
+      fprintf(stderr, "[%s:%i] Bad op %i\n", __FILE__, __LINE__, (int)op);
+      abort();
+  }
+
+  STAT_SCOPE(count_many, query, _count_many_bytes(query, arrs, m));
+  memset(counts, 0, m * sizeof(bit_index_t));
+
+  for(w = 0; w < query->num_of_words; w += COUNT_BLOCK_WORDS) {
+    for(j = 0; j < m; j++) {
+      end = MIN(w + COUNT_BLOCK_WORDS, MIN(query->num_of_words,
+                                           arrs[j]->num_of_words));
+      if(end > w)
+        counts[j] += count(query->words + w, arrs[j]->words + w, end - w);
+    }
+  }
+
+  for(j = 0; j < m; j++)
+    counts[j] += _count_tails(query, arrs[j], q_tail, arr_tail);
+}
+
+// Parity - returns 1 if odd number of bits set, 0 if even
+char bit_array_parity(const BIT_ARRAY* bitarr)
+{
+  word_addr_t w;
+  unsigned int parity = 0;
+
+  for(w = 0; w < bitarr->num_of_words; w++)
+  {
+    parity ^= PARITY(bitarr->words[w]);
+  }
+
+  return (char)parity;
+}
+
+//
+// Find indices of set/clear bits
+//
+
+// Find the index of the next bit that is set/clear, at or after `offset`
+// Returns 1 if such a bit is found, otherwise 0
+// Index is stored in the integer pointed to by `result`
+// If no such bit is found, value at `result` is not changed
+#define _next_bit_func_def(FUNC,GET) \
+char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
+{ \
+  assert(offset < bitarr->num_of_bits); \
+  if(bitarr->num_of_bits == 0 || offset >= bitarr->num_of_bits) { return 0; } \
+ \
+  /* Find first word that is greater than zero */ \
+  word_addr_t i = bitset64_wrd(offset); \
+  word_t w = GET(bitarr->words[i]) & ~bitmask64(bitset64_idx(offset)); \
+ \
+  while(1) { \
+    if(w > 0) { \
+      bit_index_t pos = i * WORD_SIZE + trailing_zeros(w); \
+      if(pos < bitarr->num_of_bits) { *result = pos; return 1; } \
+      else { return 0; } \
+    } \
+    i++; \
+    if(i >= bitarr->num_of_words) break; \
+    w = GET(bitarr->words[i]); \
+  } \
+ \
+  return 0; \
+}
+
+// Find the index of the previous bit that is set/clear, before `offset`.
+// Returns 1 if such a bit is found, otherwise 0
+// Index is stored in the integer pointed to by `result`
+// If no such bit is found, value at `result` is not changed
+#define _prev_bit_func_def(FUNC,GET) \
+char FUNC(const BIT_ARRAY* bitarr, bit_index_t offset, bit_index_t* result) \
+{ \
+  assert(offset <= bitarr->num_of_bits); \
+  if(bitarr->num_of_bits == 0 || offset == 0) { return 0; } \
+ \
+  /* Find prev word that is greater than zero */ \
+  word_addr_t i = bitset64_wrd(offset-1); \
+  word_t w = GET(bitarr->words[i]) & bitmask64(bitset64_idx(offset-1)+1); \
+ \
+  if(w > 0) { *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; return 1; } \
+ \
+  /* i is unsigned so have to use break when i == 0 */ \
+  for(--i; i != BIT_INDEX_MAX; i--) { \
+    w = GET(bitarr->words[i]); \
+    if(w > 0) { \
+      *result = (i+1) * WORD_SIZE - leading_zeros(w) - 1; \
+      return 1; \
+    } \
+  } \
+ \
+  return 0; \
+}
+
+#define GET_WORD(x) (x)
+#define NEG_WORD(x) (~(x))
+_next_bit_func_def(bit_array_find_next_set_bit,  GET_WORD);
+_next_bit_func_def(bit_array_find_next_clear_bit,NEG_WORD);
+_prev_bit_func_def(bit_array_find_prev_set_bit,  GET_WORD);
+_prev_bit_func_def(bit_array_find_prev_clear_bit,NEG_WORD);
+
+// Find the index of the first bit that is set.
+// Returns 1 if a bit is set, otherwise 0
+// Index of first set bit is stored in the integer pointed to by result
+// If no bits are set, value at `result` is not changed
+char bit_array_find_first_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_next_set_bit(bitarr, 0, result);
+}
+
+// same same
+char bit_array_find_first_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_next_clear_bit(bitarr, 0, result);
+}
+
+// Find the index of the last bit that is set.
+// Returns 1 if a bit is set, otherwise 0
+// Index of last set bit is stored in the integer pointed to by `result`
+// If no bits are set, value at `result` is not changed
+char bit_array_find_last_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_prev_set_bit(bitarr, bitarr->num_of_bits, result);
+}
+
+// same same
+char bit_array_find_last_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result)
+{
+  return bit_array_find_prev_clear_bit(bitarr, bitarr->num_of_bits, result);
+}
+
+//
+// Rank / select index
+//
+// Poppy style layout (Zhou, Andersen & Kaminsky 2013):
+// - l0: cumulative count before every 2^32 bits
+// - l12: one word per 2048 bit block. Top 32 bits are the cumulative count
+//   before the block (relative to l0), the bottom 30 bits hold the counts of
+//   the first three 512 bit sub-blocks (10 bits each)
+// - samples: index of the block holding every RANK_SAMPLE_RATE-th set bit,
+//   used to narrow the search in select
+// Overhead is ~3.2% of the bit array plus a word per 8192 bits set.
+//
+
+#define RANK_BLOCK_BITS 2048
+#define RANK_BLOCK_WORDS (RANK_BLOCK_BITS / WORD_SIZE)
+#define RANK_SUB_WORDS 8
+#define RANK_L0_SHIFT 21 /* blocks per l0 entry: 2^32 / 2048 = 2^21 */
+#define RANK_SAMPLE_RATE 8192
+
+#define _rank_cum(rs,j) \
+  ((j) < (rs)->num_of_blocks ? (rs)->l0[(j) >> RANK_L0_SHIFT] + ((rs)->l12[j] >> 32) \
+                             : (rs)->num_bits_set)
+
+// Select the r-th (from zero) set bit in a word. w must have > r bits set
+static inline word_offset_t _select_in_word(word_t w, unsigned int r)
+{
+  word_offset_t offset = 0;
+  unsigned int c;
+
+  // Skip whole bytes, then clear set bits below the one we want
+  while((c = POPCOUNT(w & 0xff)) <= r) { r -= c; w >>= 8; offset += 8; }
+  while(r--) w &= w - 1;
+
+  return offset + trailing_zeros(w);
+}
+
+// Store the cumulative count and sub-block counts for block j
+static inline void _rank_set_block(BIT_ARRAY_RANK *rs, word_addr_t j,
+                                   bit_index_t cum, word_t subcounts)
+{
+  if((j & bitmask64(RANK_L0_SHIFT)) == 0) rs->l0[j >> RANK_L0_SHIFT] = cum;
+  rs->l12[j] = ((cum - rs->l0[j >> RANK_L0_SHIFT]) << 32) | subcounts;
+}
+
+// Recount blocks [first, last] from the array, shift the cumulative counts of
+// the following blocks and rebuild the select samples
+static char _rank_recount(BIT_ARRAY_RANK* rs, word_addr_t first,
+                          word_addr_t last)
+{
+  const BIT_ARRAY *arr = rs->bitarr;
+  bit_index_t cum = _rank_cum(rs, first), old_end = _rank_cum(rs, last+1);
+  bit_index_t old, old_l0 = 0;
+  word_addr_t j, w, nw;
+  word_t subcounts, c;
+  int s;
+
+  // l0 of the first block after the range, before we overwrite it
+  if(last+1 < rs->num_of_blocks) old_l0 = rs->l0[(last+1) >> RANK_L0_SHIFT];
+
+  for(j = first; j <= last && j < rs->num_of_blocks; j++)
+  {
+    bit_index_t block_count = 0;
+    subcounts = 0;
+
+    for(s = 0; s < 4; s++)
+    {
+      w = j * RANK_BLOCK_WORDS + s * RANK_SUB_WORDS;
+      nw = w < arr->num_of_words ? MIN(RANK_SUB_WORDS, arr->num_of_words - w) : 0;
+      c = nw ? kernels->popcount(arr->words + w, nw) : 0;
+      if(s < 3) subcounts |= c << (10 * s);
+      block_count += c;
+    }
+
+    _rank_set_block(rs, j, cum, subcounts);
+    cum += block_count;
+  }
+
+  // Shift everything after the recounted blocks
+  for(; j < rs->num_of_blocks; j++)
+  {
+    if((j & bitmask64(RANK_L0_SHIFT)) == 0) old_l0 = rs->l0[j >> RANK_L0_SHIFT];
+    old = old_l0 + (rs->l12[j] >> 32);
+    _rank_set_block(rs, j, old - old_end + cum, rs->l12[j] & bitmask64(30));
+  }
+
+  rs->num_bits_set = rs->num_bits_set - old_end + cum;
+
+  // Rebuild select samples
+  size_t num_samples = (rs->num_bits_set + RANK_SAMPLE_RATE - 1) / RANK_SAMPLE_RATE;
+
+  if(num_samples > rs->capacity_samples)
+  {
+    size_t cap = roundup2pow(num_samples);
+    word_addr_t *tmp = (word_addr_t*)realloc(rs->samples, cap * sizeof(word_addr_t));
+    if(tmp == NULL) { errno = ENOMEM; return 0; }
+    rs->samples = tmp;
+    rs->capacity_samples = cap;
+  }
+
+  rs->num_samples = num_samples;
+
+  size_t k = 0;
+  for(j = 0; j < rs->num_of_blocks && k < num_samples; j++)
+  {
+    while(k < num_samples && (bit_index_t)k * RANK_SAMPLE_RATE < _rank_cum(rs, j+1))
+      rs->samples[k++] = j;
+  }
+
+  return 1;
+}
+
+// Build (or rebuild after a resize) the index for the current contents of
+// rs->bitarr. Returns 1 on success, 0 if out of memory
+char bit_array_rank_rebuild(BIT_ARRAY_RANK* rs)
+{
+  const BIT_ARRAY *arr = rs->bitarr;
+  word_addr_t num_of_blocks = (arr->num_of_bits + RANK_BLOCK_BITS - 1) / RANK_BLOCK_BITS;
+  size_t num_l0 = (num_of_blocks >> RANK_L0_SHIFT) + 1;
+
+  word_t *l0 = (word_t*)realloc(rs->l0, num_l0 * sizeof(word_t));
+  if(l0 == NULL) { errno = ENOMEM; return 0; }
+  rs->l0 = l0;
+
+  word_t *l12 = (word_t*)realloc(rs->l12, MAX(1, num_of_blocks) * sizeof(word_t));
+  if(l12 == NULL) { errno = ENOMEM; return 0; }
+  rs->l12 = l12;
+
+  memset(rs->l0, 0, num_l0 * sizeof(word_t));
+  memset(rs->l12, 0, MAX(1, num_of_blocks) * sizeof(word_t));
+  rs->num_of_bits = arr->num_of_bits;
+  rs->num_of_blocks = num_of_blocks;
+  rs->num_bits_set = 0;
+
+  return num_of_blocks ? _rank_recount(rs, 0, num_of_blocks-1)
+                       : _rank_recount(rs, 0, 0);
+}
+
+// Returns NULL if cannot malloc
+BIT_ARRAY_RANK* bit_array_rank_create(const BIT_ARRAY* bitarr)
+{
+  BIT_ARRAY_RANK *rs = (BIT_ARRAY_RANK*)calloc(1, sizeof(BIT_ARRAY_RANK));
+  if(rs == NULL) { errno = ENOMEM; return NULL; }
+
+  rs->bitarr = bitarr;
+
+  if(!bit_array_rank_rebuild(rs))
+  {
+    bit_array_rank_free(rs);
+    return NULL;
+  }
+
+  return rs;
+}
+
+void bit_array_rank_free(BIT_ARRAY_RANK* rs)
+{
+  free(rs->l0);
+  free(rs->l12);
+  free(rs->samples);
+  free(rs);
+}
+
+// Update the index after bits [start, start+len) were changed (e.g. with
+// bit_array_set_region). Only the 2048 bit blocks touched are recounted.
+// The array length must not have changed -- use bit_array_rank_rebuild()
+// Returns 1 on success, 0 if out of memory
+char bit_array_rank_update(BIT_ARRAY_RANK* rs, bit_index_t start, bit_index_t len)
+{
+  assert(rs->num_of_bits == rs->bitarr->num_of_bits);
+  assert(start + len <= rs->num_of_bits);
+  if(len == 0) return 1;
+  return _rank_recount(rs, start / RANK_BLOCK_BITS,
+                       (start + len - 1) / RANK_BLOCK_BITS);
+}
+
+// Number of bits set in positions [0, i)
+bit_index_t bit_array_rank1(const BIT_ARRAY_RANK* rs, bit_index_t i)
+{
+  assert(i <= rs->num_of_bits);
+  if(i == rs->num_of_bits) return rs->num_bits_set;
+
+  const word_t *words = rs->bitarr->words;
+  word_addr_t j = i / RANK_BLOCK_BITS;
+  word_t e = rs->l12[j];
+  bit_index_t count = rs->l0[j >> RANK_L0_SHIFT] + (e >> 32);
+  unsigned int s, sub = (i / (RANK_SUB_WORDS * WORD_SIZE)) & 3;
+
+  for(s = 0; s < sub; s++) count += (e >> (10 * s)) & 0x3ff;
+
+  word_addr_t w = j * RANK_BLOCK_WORDS + sub * RANK_SUB_WORDS;
+  for(; w < bitset64_wrd(i); w++) count += POPCOUNT(words[w]);
+
+  return count + POPCOUNT(words[w] & bitmask64(bitset64_idx(i)));
+}
+
+// Number of bits not set in positions [0, i)
+bit_index_t bit_array_rank0(const BIT_ARRAY_RANK* rs, bit_index_t i)
+{
+  return i - bit_array_rank1(rs, i);
+}
+
+// Find the position of the k-th set bit (counting from zero)
+// Returns 1 on success, 0 if fewer than k+1 bits are set
+char bit_array_select1(const BIT_ARRAY_RANK* rs, bit_index_t k,
+                       bit_index_t* result)
+{
+  if(k >= rs->num_bits_set) return 0;
+
+  // Binary search for the last block starting at or before the k-th bit,
+  // between the blocks of the samples either side of k
+  size_t sample = k / RANK_SAMPLE_RATE;
+  word_addr_t lo = rs->samples[sample];
+  word_addr_t hi = sample + 1 < rs->num_samples ? rs->samples[sample+1]
+                                                : rs->num_of_blocks - 1;
+  while(lo < hi)
+  {
+    word_addr_t mid = lo + (hi - lo + 1) / 2;
+    if(_rank_cum(rs, mid) <= k) lo = mid;
+    else hi = mid - 1;
+  }
+
+  const word_t *words = rs->bitarr->words;
+  word_t e = rs->l12[lo];
+  bit_index_t r = k - _rank_cum(rs, lo);
+  unsigned int s;
+  word_t c;
+
+  for(s = 0; s < 3 && r >= (c = (e >> (10 * s)) & 0x3ff); s++) r -= c;
+
+  word_addr_t w = lo * RANK_BLOCK_WORDS + s * RANK_SUB_WORDS;
+  while(r >= (c = POPCOUNT(words[w]))) { r -= c; w++; }
+
+  *result = w * WORD_SIZE + _select_in_word(words[w], (unsigned int)r);
+  return 1;
+}
+
+//
+// "Sorting" bits
+//
+
+// Put all the 0s before all the 1s
+void bit_array_sort_bits(BIT_ARRAY* bitarr)
+{
+  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
+  bit_index_t num_of_bits_cleared = bitarr->num_of_bits - num_of_bits_set;
+  bit_array_set_all(bitarr);
+  CLEAR_REGION(bitarr, 0, num_of_bits_cleared);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Put all the 1s before all the 0s
+void bit_array_sort_bits_rev(BIT_ARRAY* bitarr)
+{
+  bit_index_t num_of_bits_set = bit_array_num_bits_set(bitarr);
+  bit_array_clear_all(bitarr);
+  SET_REGION(bitarr, 0, num_of_bits_set);
+  DEBUG_VALIDATE(bitarr);
+}
+
+
+//
+// Strings and printing
+//
+
+// Words converted per call to the text kernels when they have to be gathered
+// from an unaligned offset
+#define TEXT_BUF_WORDS 64
+
+// Write length bits from start as chars. Full words go through the text
+// kernels, reading straight from words[] when start is word aligned.
+static void _bits_to_chars(const BIT_ARRAY* bitarr,
+                           bit_index_t start, bit_index_t length,
+                           char* str, char on, char off, char left_to_right)
+{
+  word_addr_t nwords = length / WORD_SIZE, i, j, n;
+  word_offset_t rem = (word_offset_t)(length - (bit_index_t)nwords * WORD_SIZE), k;
+  word_t buf[TEXT_BUF_WORDS], w;
+
+  if(left_to_right && bitset64_idx(start) == 0)
+  {
+    text_kernels->words_to_chars(str, bitarr->words + bitset64_wrd(start),
+                                 nwords, on, off);
+  }
+  else
+  {
+    for(i = 0; i < nwords; i += n)
+    {
+      n = MIN(TEXT_BUF_WORDS, nwords - i);
+
+      // Right to left: word i is the i-th 64 bits down from the end, reversed
+      for(j = 0; j < n; j++) {
+        buf[j] = left_to_right
+                 ? _get_word(bitarr, start + (bit_index_t)(i+j) * WORD_SIZE)
+                 : _reverse_word(_get_word(bitarr, start + length -
+                                           (bit_index_t)(i+j+1) * WORD_SIZE));
+      }
+
+      text_kernels->words_to_chars(str + i * WORD_SIZE, buf, n, on, off);
+    }
+  }
+
+  if(rem > 0)
+  {
+    str += (size_t)nwords * WORD_SIZE;
+
+    if(left_to_right) {
+      w = _get_word(bitarr, start + (bit_index_t)nwords * WORD_SIZE);
+      for(k = 0; k < rem; k++) str[k] = (w >> k) & 1 ? on : off;
+    }
+    else {
+      w = _get_word(bitarr, start);
+      for(k = 0; k < rem; k++) str[k] = (w >> (rem - k - 1)) & 1 ? on : off;
+    }
+  }
+}
+
+// Construct a BIT_ARRAY from a substring with given on and off characters.
+void bit_array_from_substr(BIT_ARRAY* bitarr, bit_index_t offset,
+                           const char *str, size_t len,
+                           const char *on, const char *off,
+                           char left_to_right)
+{
+  bit_array_ensure_size(bitarr, offset + len);
+  bit_array_clear_region(bitarr, offset, len);
+
+  // BitArray region is now all 0s -- just set the 1s
+  size_t i = 0;
+  bit_index_t j;
+
+  if(left_to_right && on[0] != '\0' && on[1] == '\0' &&
+     off[0] != '\0' && off[1] == '\0')
+  {
+    // One on and one off char: decode 64 chars per word with the text kernels
+    word_addr_t nwords = len / WORD_SIZE, w, n, k;
+    word_t buf[TEXT_BUF_WORDS];
+#ifndef NDEBUG
+    word_t offbuf[TEXT_BUF_WORDS];
+#endif
+
+    for(w = 0; w < nwords; w += n)
+    {
+      n = MIN(TEXT_BUF_WORDS, nwords - w);
+      text_kernels->chars_to_words(buf, str + w * WORD_SIZE, n, on[0]);
+
+#ifndef NDEBUG
+      text_kernels->chars_to_words(offbuf, str + w * WORD_SIZE, n, off[0]);
+      for(k = 0; k < n; k++) assert((buf[k] ^ offbuf[k]) == WORD_MAX);
+#endif
+
+      if(bitset64_idx(offset) == 0) {
+        memcpy(bitarr->words + bitset64_wrd(offset) + w, buf, n * sizeof(word_t));
+      }
+      else {
+        for(k = 0; k < n; k++)
+          _set_word(bitarr, offset + (bit_index_t)(w+k) * WORD_SIZE, buf[k]);
+      }
+    }
+
+    i = (size_t)nwords * WORD_SIZE;
+  }
+
+  for(; i < len; i++)
+  {
+    if(strchr(on, str[i]) != NULL)
+    {
+      j = offset + (left_to_right ? i : len - i - 1);
+      bit_array_set(bitarr, j);
+    }
+    else { assert(strchr(off, str[i]) != NULL); }
+  }
+
+  DEBUG_VALIDATE(bitarr);
+}
+
+// From string method
+void bit_array_from_str(BIT_ARRAY* bitarr, const char* str)
+{
+  bit_array_from_substr(bitarr, 0, str, strlen(str), "1", "0", 1);
+}
+
+// Number of chars needed to write length bits as '0's and '1's, including '\0'
+size_t bit_array_str_size(bit_index_t length)
+{
+  return (size_t)length + 1;
+}
+
+// Takes a char array to write to.  `str` must be bitarr->num_of_bits+1 in length
+// Terminates string with '\0'
+char* bit_array_to_str(const BIT_ARRAY* bitarr, char* str)
+{
+  _bits_to_chars(bitarr, 0, bitarr->num_of_bits, str, '1', '0', 1);
+  str[bitarr->num_of_bits] = '\0';
+  return str;
+}
+
+char* bit_array_to_str_rev(const BIT_ARRAY* bitarr, char* str)
+{
+  _bits_to_chars(bitarr, 0, bitarr->num_of_bits, str, '1', '0', 0);
+  str[bitarr->num_of_bits] = '\0';
+  return str;
+}
+
+
+// Get a string representations for a given region, using given on/off characters.
+// Note: does not null-terminate
+void bit_array_to_substr(const BIT_ARRAY* bitarr,
+                         bit_index_t start, bit_index_t length,
+                         char* str, char on, char off,
+                         char left_to_right)
+{
+  assert(start + length <= bitarr->num_of_bits);
+  _bits_to_chars(bitarr, start, length, str, on, off, left_to_right);
+}
+
+// Print this array to a file stream.  Prints '0's and '1'.  Doesn't print newline.
+void bit_array_print(const BIT_ARRAY* bitarr, FILE* fout)
+{
+  bit_index_t i;
+
+  for(i = 0; i < bitarr->num_of_bits; i++)
+  {
+    fprintf(fout, "%c", bit_array_get(bitarr, i) ? '1' : '0');
+  }
+}
+
+// Print a string representations for a given region, using given on/off characters.
+void bit_array_print_substr(const BIT_ARRAY* bitarr,
+                            bit_index_t start, bit_index_t length,
+                            FILE* fout, char on, char off,
+                            char left_to_right)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  bit_index_t i, j;
+  bit_index_t end = start + length - 1;
+
+  for(i = 0; i < length; i++)
+  {
+    j = (left_to_right ? start + i : end - i);
+    fprintf(fout, "%c", bit_array_get(bitarr, j) ? on : off);
+  }
+}
+
+//
+// Word level arithmetic
+// Numbers are little endian arrays of words. Word products use 128 bit
+// integers when the compiler has them.
+//
+
+// Use schoolbook multiplication below this many words, Karatsuba above.
+// Tuned with `make bench BENCH_ARGS=--filter=multiply`
+#define KARATSUBA_THRESHOLD 32
+
+// Aborts if out of memory
+static word_t* _alloc_words(word_addr_t n, const char *func)
+{
+  word_t *w = (word_t*)malloc((n ? n : 1) * sizeof(word_t));
+  if(w == NULL) {
+    fprintf(stderr, "[%s()] Ran out of memory [%zu words]", func, (size_t)n);
+    abort();
+  }
+  return w;
+}
+
+// Returns the low word of a*b, sets hi to the high word
+static inline word_t _mul_word(word_t a, word_t b, word_t *hi)
+{
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 p = (unsigned __int128)a * b;
+  *hi = (word_t)(p >> 64);
+  return (word_t)p;
+#else
+  uint64_t a0 = a & 0xffffffff, a1 = a >> 32, b0 = b & 0xffffffff, b1 = b >> 32;
+  uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0;
+  uint64_t mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+  *hi = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+  return (mid << 32) | (p00 & 0xffffffff);
+#endif
+}
+
+// r[0..n) += a[0..n) * b, returns the carry word
+static word_t _words_mul_add_word(word_t *r, const word_t *a, word_addr_t n,
+                                  word_t b)
+{
+  word_t carry = 0, hi, lo;
+  word_addr_t i;
+
+  for(i = 0; i < n; i++)
+  {
+    lo = _mul_word(a[i], b, &hi);
+    lo += carry;
+    hi += (lo < carry);
+    r[i] += lo;
+    carry = hi + (r[i] < lo);
+  }
+
+  return carry;
+}
+
+// r[0..na) = a[0..na) + b[0..nb), na >= nb, r may be a. Returns the carry
+static word_t _words_add(word_t *r, const word_t *a, word_addr_t na,
+                         const word_t *b, word_addr_t nb)
+{
+  word_t carry = 0, s;
+  word_addr_t i;
+
+  for(i = 0; i < nb; i++)
+  {
+    s = a[i] + carry;
+    carry = (s < carry);
+    r[i] = s + b[i];
+    carry += (r[i] < s);
+  }
+
+  for(; i < na; i++)
+  {
+    r[i] = a[i] + carry;
+    carry = (r[i] < carry);
+  }
+
+  return carry;
+}
+
+// r[0..na) = a[0..na) - b[0..nb), na >= nb, r may be a. Returns the borrow
+static word_t _words_sub(word_t *r, const word_t *a, word_addr_t na,
+                         const word_t *b, word_addr_t nb)
+{
+  word_t borrow = 0, d;
+  word_addr_t i;
+
+  for(i = 0; i < nb; i++)
+  {
+    d = a[i] - b[i];
+    word_t under = (a[i] < b[i]) + (d < borrow);
+    r[i] = d - borrow;
+    borrow = under;
+  }
+
+  for(; i < na; i++)
+  {
+    d = a[i];
+    r[i] = d - borrow;
+    borrow = (d < borrow);
+  }
+
+  return borrow;
+}
+
+// r[0..na) = |a[0..na) - b[0..nb)|, na >= nb
+// Returns 1 if a < b, 0 otherwise
+static char _words_absdiff(word_t *r, const word_t *a, word_addr_t na,
+                           const word_t *b, word_addr_t nb)
+{
+  word_addr_t i;
+  char less = 0;
+
+  for(i = nb; i < na && a[i] == 0; i++) {}
+
+  if(i == na)
+  {
+    // a has no words above nb, compare from the top
+    for(i = nb; i > 0 && a[i-1] == b[i-1]; i--) {}
+    less = (i > 0 && a[i-1] < b[i-1]);
+  }
+
+  if(less) {
+    _words_sub(r, b, nb, a, nb);
+    memset(r + nb, 0, (na - nb) * sizeof(word_t));
+  }
+  else _words_sub(r, a, na, b, nb);
+
+  return less;
+}
+
+// r[0..na+nb) = a * b, r must not overlap a or b
+static void _words_mul_schoolbook(word_t *r, const word_t *a, word_addr_t na,
+                                  const word_t *b, word_addr_t nb)
+{
+  word_addr_t j;
+  memset(r, 0, na * sizeof(word_t));
+  for(j = 0; j < nb; j++)
+    r[na+j] = _words_mul_add_word(r+j, a, na, b[j]);
+}
+
+// Number of scratch words _karatsuba() needs for n word operands
+static word_addr_t _karatsuba_scratch(word_addr_t n)
+{
+  word_addr_t total = 0, h;
+  for(; n >= KARATSUBA_THRESHOLD; n = h) {
+    h = (n + 1) / 2;
+    total += 6 * h + 1;
+  }
+  return total;
+}
+
+// r[0..2n) = a[0..n) * b[0..n)
+// With a = a1*B^h + a0, b = b1*B^h + b0 (h words in the low halves):
+//   a*b = a1b1*B^2h + (a0b0 + a1b1 - (a0-a1)(b0-b1))*B^h + a0b0
+static void _karatsuba(word_t *r, const word_t *a, const word_t *b,
+                       word_addr_t n, word_t *scratch)
+{
+  if(n < KARATSUBA_THRESHOLD)
+  {
+    _words_mul_schoolbook(r, a, n, b, n);
+    return;
+  }
+
+  word_addr_t h = (n + 1) / 2, l = n - h;
+  word_t *da = scratch, *db = da + h, *m = db + h, *z1 = m + 2*h;
+  word_t *next = z1 + 2*h + 1;
+
+  // Signs of (a0-a1) and (b0-b1) differ: (a0-a1)(b0-b1) is negative
+  char neg = _words_absdiff(da, a, h, a+h, l) != _words_absdiff(db, b, h, b+h, l);
+
+  _karatsuba(r, a, b, h, next); // a0b0
+  _karatsuba(r+2*h, a+h, b+h, l, next); // a1b1
+  _karatsuba(m, da, db, h, next); // |a0-a1||b0-b1|
+
+  memcpy(z1, r, 2 * h * sizeof(word_t));
+  z1[2*h] = 0;
+  _words_add(z1, z1, 2*h+1, r+2*h, 2*l);
+  if(neg) _words_add(z1, z1, 2*h+1, m, 2*h);
+  else _words_sub(z1, z1, 2*h+1, m, 2*h);
+
+  // Top word of z1 may not fit in r, but is zero if it doesn't
+  word_addr_t rlen = 2*n - h;
+  _words_add(r+h, r+h, rlen, z1, MIN(2*h+1, rlen));
+}
+
+// r[0..na+nb) = a * b, r must not overlap a or b
+static void _words_mul(word_t *r, const word_t *a, word_addr_t na,
+                       const word_t *b, word_addr_t nb)
+{
+  if(na < nb) {
+    const word_t *tmp_ptr = a; a = b; b = tmp_ptr;
+    word_addr_t tmp_len = na; na = nb; nb = tmp_len;
+  }
+
+  if(nb < KARATSUBA_THRESHOLD)
+  {
+    _words_mul_schoolbook(r, a, na, b, nb);
+    return;
+  }
+
+  // Multiply nb word slices of a by b
+  word_addr_t scratch_words = 2 * nb + _karatsuba_scratch(nb), off, len;
+  word_t *tmp = _alloc_words(scratch_words, __func__);
+
+  memset(r, 0, (na + nb) * sizeof(word_t));
+
+  for(off = 0; off < na; off += nb)
+  {
+    len = MIN(nb, na - off);
+    if(len == nb) _karatsuba(tmp, a+off, b, nb, tmp + 2*nb);
+    else _words_mul(tmp, b, nb, a+off, len);
+    _words_add(r+off, r+off, na+nb-off, tmp, len+nb);
+  }
+
+  free(tmp);
+}
+
+// Returns (hi:lo) / d, sets rem to (hi:lo) % d. hi must be less than d
+static inline word_t _div_word(word_t hi, word_t lo, word_t d, word_t *rem)
+{
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  word_t q, r;
+  __asm__("divq %4" : "=a"(q), "=d"(r) : "a"(lo), "d"(hi), "rm"(d));
+  *rem = r;
+  return q;
+#elif defined(__SIZEOF_INT128__)
+  unsigned __int128 n = ((unsigned __int128)hi << 64) | lo;
+  *rem = (word_t)(n % d);
+  return (word_t)(n / d);
+#else
+  // Hacker's Delight divlu: two steps of 32 bit digits
+  const uint64_t b = 1ULL << 32;
+  int s = leading_zeros(d);
+  d <<= s;
+  uint64_t vn1 = d >> 32, vn0 = d & 0xffffffff;
+  uint64_t un32 = (hi << s) | (s ? lo >> (64 - s) : 0), un10 = lo << s;
+  uint64_t un1 = un10 >> 32, un0 = un10 & 0xffffffff;
+
+  uint64_t q1 = un32 / vn1, rhat = un32 - q1 * vn1;
+  while(q1 >= b || q1 * vn0 > b * rhat + un1) {
+    q1--; rhat += vn1;
+    if(rhat >= b) break;
+  }
+
+  uint64_t un21 = un32 * b + un1 - q1 * d;
+  uint64_t q0 = un21 / vn1;
+  rhat = un21 - q0 * vn1;
+  while(q0 >= b || q0 * vn0 > b * rhat + un0) {
+    q0--; rhat += vn1;
+    if(rhat >= b) break;
+  }
+
+  *rem = (un21 * b + un0 - q0 * d) >> s;
+  return q1 * b + q0;
+#endif
+}
+
+// q[0..n) = u[0..n) / d, returns u % d. q may be u
+static word_t _words_div_word(word_t *q, const word_t *u, word_addr_t n,
+                              word_t d)
+{
+  word_t rem = 0;
+  word_addr_t i;
+  for(i = n; i > 0; i--) q[i-1] = _div_word(rem, u[i-1], d, &rem);
+  return rem;
+}
+
+static inline void _words_trim(const word_t *w, word_addr_t *n)
+{
+  while(*n > 0 && w[*n-1] == 0) (*n)--;
+}
+
+// Compare a[0..na) with b[0..nb), both trimmed
+static int _words_cmp(const word_t *a, word_addr_t na,
+                      const word_t *b, word_addr_t nb)
+{
+  if(na != nb) return na > nb ? 1 : -1;
+  for(; na > 0; na--)
+    if(a[na-1] != b[na-1]) return a[na-1] > b[na-1] ? 1 : -1;
+  return 0;
+}
+
+// Knuth's Algorithm D (TAOCP vol 2, 4.3.1)
+// q[0..nu-nv+1) = u / v, r[0..nv) = u % v
+// Requires nu >= nv > 0 and v[nv-1] != 0. q and r must not overlap u or v
+static void _words_divmod(word_t *q, word_t *r,
+                          const word_t *u, word_addr_t nu,
+                          const word_t *v, word_addr_t nv)
+{
+  if(nv == 1) {
+    r[0] = _words_div_word(q, u, nu, v[0]);
+    return;
+  }
+
+  // Normalise so the top bit of the divisor is set
+  int s = leading_zeros(v[nv-1]);
+  word_t *un = _alloc_words(nu + 1 + nv, __func__), *vn = un + nu + 1;
+  word_addr_t i, j;
+
+  for(i = nv-1; i > 0; i--) vn[i] = (v[i] << s) | (s ? v[i-1] >> (WORD_SIZE-s) : 0);
+  vn[0] = v[0] << s;
+
+  un[nu] = s ? u[nu-1] >> (WORD_SIZE-s) : 0;
+  for(i = nu-1; i > 0; i--) un[i] = (u[i] << s) | (s ? u[i-1] >> (WORD_SIZE-s) : 0);
+  un[0] = u[0] << s;
+
+  word_t vtop = vn[nv-1], vnext = vn[nv-2];
+
+  for(j = nu - nv + 1; j > 0; j--)
+  {
+    word_t *uj = un + j - 1, qhat, rhat, hi, lo;
+    char rhat_overflow = 0;
+
+    // Estimate the quotient digit from the top two words, it is at most 2 too big
+    if(uj[nv] >= vtop) {
+      qhat = WORD_MAX;
+      rhat = uj[nv-1] + vtop;
+      rhat_overflow = (rhat < vtop);
+    }
+    else qhat = _div_word(uj[nv], uj[nv-1], vtop, &rhat);
+
+    while(!rhat_overflow) {
+      lo = _mul_word(qhat, vnext, &hi);
+      if(hi < rhat || (hi == rhat && lo <= uj[nv-2])) break;
+      qhat--;
+      rhat += vtop;
+      rhat_overflow = (rhat < vtop);
+    }
+
+    // uj -= qhat * vn
+    word_t carry = 0, d;
+    for(i = 0; i < nv; i++) {
+      lo = _mul_word(qhat, vn[i], &hi);
+      lo += carry;
+      hi += (lo < carry);
+      d = uj[i] - lo;
+      carry = hi + (uj[i] < lo);
+      uj[i] = d;
+    }
+
+    d = uj[nv] - carry;
+    char negative = (uj[nv] < carry);
+    uj[nv] = d;
+
+    if(negative) {
+      // qhat was one too big, add back
+      qhat--;
+      uj[nv] += _words_add(uj, uj, nv, vn, nv);
+    }
+
+    q[j-1] = qhat;
+  }
+
+  // Un-normalise the remainder
+  for(i = 0; i < nv-1; i++) r[i] = (un[i] >> s) | (s ? un[i+1] << (WORD_SIZE-s) : 0);
+  r[nv-1] = un[nv-1] >> s;
+
+  free(un);
+}
+
+// Number of words needed to hold the set bits of arr
+static word_addr_t _num_used_words(const BIT_ARRAY *arr)
+{
+  word_addr_t n = arr->num_of_words;
+  while(n > 0 && arr->words[n-1] == 0) n--;
+  return n;
+}
+
+//
+// Decimal
+// Converted 19 digits (one word) at a time, and by divide and conquer with
+// powers 10^(19*2^k) for large numbers
+//
+
+#define DEC_CHUNK_DIGITS 19
+#define DEC_CHUNK 10000000000000000000ULL
+
+// Below this many words convert to decimal by repeated division by 10^19
+#define DEC_DIVIDE_THRESHOLD 32
+
+typedef struct
+{
+  word_t *words;
+  word_addr_t n;
+} DecPower;
+
+// Set pw[k] = 10^(19*2^k), from pw[k-1]
+static void _dec_power(DecPower *pw, size_t k)
+{
+  if(k == 0) {
+    pw[0].words = _alloc_words(1, __func__);
+    pw[0].words[0] = DEC_CHUNK;
+    pw[0].n = 1;
+  }
+  else {
+    pw[k].n = 2 * pw[k-1].n;
+    pw[k].words = _alloc_words(pw[k].n, __func__);
+    _words_mul(pw[k].words, pw[k-1].words, pw[k-1].n, pw[k-1].words, pw[k-1].n);
+    _words_trim(pw[k].words, &pw[k].n);
+  }
+}
+
+static void _dec_powers_free(DecPower *pw, size_t num)
+{
+  size_t k;
+  for(k = 0; k < num; k++) free(pw[k].words);
+}
+
+// Write v < 10^19 as 19 digits
+static void _dec_write_chunk(word_t v, char *out)
+{
+  int i;
+  for(i = DEC_CHUNK_DIGITS; i > 0; i--, v /= 10) out[i-1] = '0' + (char)(v % 10);
+}
+
+// Write u < pw[k] as exactly 19*2^k digits, with leading zeros
+static void _dec_write(const word_t *u, word_addr_t n, size_t k,
+                       const DecPower *pw, char *out)
+{
+  _words_trim(u, &n);
+
+  if(k == 0 || n <= DEC_DIVIDE_THRESHOLD)
+  {
+    word_t *tmp = _alloc_words(n, __func__);
+    size_t c;
+    memcpy(tmp, u, n * sizeof(word_t));
+
+    for(c = (size_t)1 << k; c > 0; c--) {
+      word_t rem = n ? _words_div_word(tmp, tmp, n, DEC_CHUNK) : 0;
+      _words_trim(tmp, &n);
+      _dec_write_chunk(rem, out + (c-1) * DEC_CHUNK_DIGITS);
+    }
+
+    free(tmp);
+    return;
+  }
+
+  // u = q * 10^(19*2^(k-1)) + r
+  const DecPower *p = &pw[k-1];
+  size_t half = (size_t)DEC_CHUNK_DIGITS << (k-1);
+
+  if(_words_cmp(u, n, p->words, p->n) < 0) {
+    memset(out, '0', half);
+    _dec_write(u, n, k-1, pw, out + half);
+    return;
+  }
+
+  word_t *q = _alloc_words(n - p->n + 1, __func__), *r = _alloc_words(p->n, __func__);
+  _words_divmod(q, r, u, n, p->words, p->n);
+  _dec_write(q, n - p->n + 1, k-1, pw, out);
+  _dec_write(r, p->n, k-1, pw, out + half);
+  free(q);
+  free(r);
+}
+
+// Get bit array as decimal str (e.g. 0b1101 -> "13")
+// len is the length of str char array -- will write at most len-1 chars
+// returns the number of characters needed
+// return is the same as strlen(str)
+size_t bit_array_to_decimal(const BIT_ARRAY *bitarr, char *str, size_t len)
+{
+  word_addr_t n = _num_used_words(bitarr);
+
+  if(n == 0)
+  {
+    if(len >= 2)
+    {
+      *str = '0';
+      *(str+1) = '\0';
+    }
+
+    return 1;
+  }
+
+  // Smallest k with 10^(19*2^k) > bitarr
+  DecPower pw[64];
+  size_t k = 0;
+
+  for(_dec_power(pw, 0); _words_cmp(pw[k].words, pw[k].n, bitarr->words, n) <= 0; )
+    _dec_power(pw, ++k);
+
+  size_t width = (size_t)DEC_CHUNK_DIGITS << k, skip, num_digits;
+  char *digits = (char*)malloc(width);
+
+  if(digits == NULL) {
+    fprintf(stderr, "[%s()] Ran out of memory [%zu digits]", __func__, width);
+    abort();
+  }
+
+  _dec_write(bitarr->words, n, k, pw, digits);
+  _dec_powers_free(pw, k+1);
+
+  for(skip = 0; digits[skip] == '0'; skip++) {}
+  num_digits = width - skip;
+
+  // If str is too short, it gets the least significant digits
+  size_t num_copy = MIN(num_digits, len-1);
+  memcpy(str, digits + width - num_copy, num_copy);
+  str[num_copy] = '\0';
+
+  free(digits);
+
+  return num_digits;
+}
+
+// Get bit array from decimal str (e.g. "13" -> 0b1101)
+// Returns number of characters used
+size_t bit_array_from_decimal(BIT_ARRAY *bitarr, const char* decimal)
+{
+  bit_array_clear_all(bitarr);
+
+  size_t num_digits = 0, c, num_chunks, num_slots, levels, blk, t;
+
+  while(decimal[num_digits] >= '0' && decimal[num_digits] <= '9') num_digits++;
+
+  if(num_digits == 0) return 0;
+
+  // Words of 19 digits, least significant first, padded to a power of two
+  num_chunks = (num_digits + DEC_CHUNK_DIGITS - 1) / DEC_CHUNK_DIGITS;
+  for(levels = 0; ((size_t)1 << levels) < num_chunks; levels++) {}
+  num_slots = (size_t)1 << levels;
+
+  word_t *words = _alloc_words(2 * num_slots, __func__), *tmp = words + num_slots;
+  memset(words, 0, num_slots * sizeof(word_t));
+
+  for(c = 0; c < num_chunks; c++)
+  {
+    size_t end = num_digits - c * DEC_CHUNK_DIGITS, i;
+    size_t start = end > DEC_CHUNK_DIGITS ? end - DEC_CHUNK_DIGITS : 0;
+    for(i = start; i < end; i++) words[c] = words[c] * 10 + (decimal[i] - '0');
+  }
+
+  // Merge pairs of blocks of blk words: hi * 10^(19*blk) + lo
+  // Both parts are < 10^(19*blk) < 2^(64*blk), so the result fits in 2*blk words
+  DecPower pw[64];
+
+  for(t = 0; t < levels; t++)
+  {
+    _dec_power(pw, t);
+    blk = (size_t)1 << t;
+
+    for(c = 0; c < num_slots; c += 2 * blk)
+    {
+      word_t *lo = words + c, *hi = lo + blk;
+      word_addr_t nh = blk;
+      _words_trim(hi, &nh);
+      if(nh == 0) continue;
+
+      memset(tmp, 0, 2 * blk * sizeof(word_t));
+      _words_mul(tmp, hi, nh, pw[t].words, pw[t].n);
+      _words_add(tmp, tmp, 2 * blk, lo, blk);
+      memcpy(lo, tmp, 2 * blk * sizeof(word_t));
+    }
+  }
+
+  _dec_powers_free(pw, levels);
+
+  word_addr_t nwords = num_slots;
+  _words_trim(words, &nwords);
+
+  if(nwords > 0)
+  {
+    bit_index_t top_bits = (bit_index_t)nwords * WORD_SIZE
+                           - leading_zeros(words[nwords-1]);
+    if(top_bits > bitarr->num_of_bits) bit_array_resize_critical(bitarr, top_bits);
+    _before_write(bitarr, 0, nwords);
+    memcpy(bitarr->words, words, nwords * sizeof(word_t));
+  }
+
+  free(words);
+
+  DEBUG_VALIDATE(bitarr);
+
+  return num_digits;
+}
+
+//
+// Hexidecimal
+//
+
+char bit_array_hex_to_nibble(char c, uint8_t *b)
+{
+  uint8_t v = _hex_value(c);
+  if(v > 0xf) return 0;
+  *b = v;
+  return 1;
+}
+
+char bit_array_nibble_to_hex(uint8_t b, char uppercase)
+{
+  return (uppercase ? hex_digits_upper : hex_digits_lower)[b & 0xf];
+}
+
+// Loads array from hex string
+// Returns the number of bits loaded (will be chars rounded up to multiple of 4)
+// (0 on failure)
+bit_index_t bit_array_from_hex(BIT_ARRAY* bitarr, bit_index_t offset,
+                               const char* str, size_t len)
+{
+  if(str[0] == '0' && tolower(str[1]) == 'x')
+  {
+    str += 2;
+    len -= 2;
+  }
+
+  // 16 chars per word with the text kernels, until a non-hex char
+  word_t buf[TEXT_BUF_WORDS];
+  word_addr_t n, got, k;
+  size_t i = 0;
+
+  while((n = MIN(TEXT_BUF_WORDS, (len - i) / 16)) > 0)
+  {
+    got = text_kernels->hex_to_words(buf, str + i, n);
+    if(got == 0) break;
+
+    bit_array_ensure_size(bitarr, offset + 4 * (i + 16 * got));
+    _before_write_bits(bitarr, offset + 4 * i, 64 * got);
+
+    if(bitset64_idx(offset) == 0) {
+      memcpy(bitarr->words + bitset64_wrd(offset) + i / 16, buf, got * sizeof(word_t));
+    }
+    else {
+      for(k = 0; k < got; k++)
+        _set_word(bitarr, offset + 4 * (i + 16 * k), buf[k]);
+    }
+
+    i += 16 * got;
+    if(got < n) break;
+  }
+
+  for(; i < len; i++)
+  {
+    uint8_t b;
+    if(bit_array_hex_to_nibble(str[i], &b))
+    {
+      bit_array_ensure_size(bitarr, offset + 4 * (i + 1));
+      _before_write_bits(bitarr, offset + 4 * i, 4);
+      _set_nibble(bitarr, offset + 4 * i, b);
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  return 4 * i;
+}
+
+// Number of chars needed to write length bits as hex, including '\0'
+size_t bit_array_hex_size(bit_index_t length)
+{
+  return (size_t)((length + 3) / 4) + 1;
+}
+
+// Returns number of characters written
+size_t bit_array_to_hex(const BIT_ARRAY* bitarr,
+                        bit_index_t start, bit_index_t length,
+                        char* str, char uppercase)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  word_addr_t nwords = length / WORD_SIZE, i, j, n;
+  word_t buf[TEXT_BUF_WORDS];
+  size_t k = (size_t)nwords * 16;
+  bit_index_t offset = start + (bit_index_t)nwords * WORD_SIZE, end = start + length;
+
+  if(bitset64_idx(start) == 0)
+  {
+    text_kernels->words_to_hex(str, bitarr->words + bitset64_wrd(start),
+                               nwords, uppercase);
+  }
+  else
+  {
+    for(i = 0; i < nwords; i += n) {
+      n = MIN(TEXT_BUF_WORDS, nwords - i);
+      for(j = 0; j < n; j++)
+        buf[j] = _get_word(bitarr, start + (bit_index_t)(i+j) * WORD_SIZE);
+      text_kernels->words_to_hex(str + i * 16, buf, n, uppercase);
+    }
+  }
+
+  if(offset < end)
+  {
+    // Remaining full nibbles (4 bits)
+    word_t w = _get_word(bitarr, offset);
+
+    for(; offset + 4 <= end; offset += 4)
+    {
+      str[k++] = bit_array_nibble_to_hex(w & 0xf, uppercase);
+      w >>= 4;
+    }
+
+    if(offset < end)
+    {
+      // Remaining bits
+      str[k++] = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
+    }
+  }
+
+  str[k] = '\0';
+
+  // Return number of characters written
+  return k;
+}
+
+// Print bit array as hex
+size_t bit_array_print_hex(const BIT_ARRAY* bitarr,
+                           bit_index_t start, bit_index_t length,
+                           FILE* fout, char uppercase)
+{
+  assert(start + length <= bitarr->num_of_bits);
+
+  size_t k = 0;
+  bit_index_t offset, end = start + length;
+
+  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  {
+    word_t w = _get_word(bitarr, offset);
+
+    word_offset_t j;
+    for(j = 0; j < 64; j += 4)
+    {
+      fprintf(fout, "%c", bit_array_nibble_to_hex((w>>j) & 0xf, uppercase));
+      k++;
+    }
+  }
+
+  if(offset < end)
+  {
+    // Remaining full nibbles (4 bits)
+    word_t w = _get_word(bitarr, offset);
+
+    for(; offset + 4 <= end; offset += 4)
+    {
+      fprintf(fout, "%c", bit_array_nibble_to_hex(w & 0xf, uppercase));
+      w >>= 4;
+      k++;
+    }
+
+    if(offset < end)
+    {
+      // Remaining bits
+      char hex = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
+      fprintf(fout, "%c", hex);
+      k++;
+    }
+  }
+
+  return k;
+}
+
+//
+// Clone and copy
+//
+
+// Returns NULL if cannot malloc
+BIT_ARRAY* bit_array_clone(const BIT_ARRAY* bitarr)
+{
+  STAT_SCOPE(clone, bitarr, bitarr->num_of_words * 2 * sizeof(word_t));
+  BIT_ARRAY* cpy = bit_array_create_with(bitarr->num_of_bits, _copy_allocator(bitarr));
+
+  if(cpy == NULL)
+  {
+    return NULL;
+  }
+
+  // Copy across bits
+  memcpy(cpy->words, bitarr->words, bitarr->num_of_words * sizeof(word_t));
+
+  DEBUG_VALIDATE(cpy);
+  return cpy;
+}
+
+// destination and source may be the same bit_array
+// and src/dst regions may overlap
+static void _array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
+                        const BIT_ARRAY* src, bit_index_t srcindx,
+                        bit_index_t length)
+{
+  DEBUG_PRINT("bit_array_copy(dst: %zu, src: %zu, length: %zu)\n",
+              (size_t)dstindx, (size_t)srcindx, (size_t)length);
+
+  _before_write_bits(dst, dstindx, length);
+
+  // Num of full words to copy
+  word_addr_t num_of_full_words = length / WORD_SIZE;
+  word_addr_t i;
+
+  word_offset_t bits_in_last_word = bits_in_top_word(length);
+
+  if(dst == src && srcindx > dstindx)
+  {
+    // Work left to right
+    DEBUG_PRINT("work left to right\n");
+
+    for(i = 0; i < num_of_full_words; i++)
+    {
+      word_t word = _get_word(src, srcindx+i*WORD_SIZE);
+      _set_word(dst, dstindx+i*WORD_SIZE, word);
+    }
+
+    if(bits_in_last_word > 0)
+    {
+      word_t src_word = _get_word(src, srcindx+i*WORD_SIZE);
+      word_t dst_word = _get_word(dst, dstindx+i*WORD_SIZE);
+
+      word_t mask = bitmask64(bits_in_last_word);
+      word_t word = bitmask_merge(src_word, dst_word, mask);
+
+      _set_word(dst, dstindx+num_of_full_words*WORD_SIZE, word);
+    }
+  }
+  else
+  {
+    // Work right to left
+    DEBUG_PRINT("work right to left\n");
+
+    for(i = 0; i < num_of_full_words; i++)
+    {
+      word_t word = _get_word(src, srcindx+length-(i+1)*WORD_SIZE);
+      _set_word(dst, dstindx+length-(i+1)*WORD_SIZE, word);
+    }
+
+    DEBUG_PRINT("Copy %i,%i to %i\n", (int)srcindx, (int)bits_in_last_word,
+                                      (int)dstindx);
+
+    if(bits_in_last_word > 0)
+    {
+      word_t src_word = _get_word(src, srcindx);
+      word_t dst_word = _get_word(dst, dstindx);
+
+      word_t mask = bitmask64(bits_in_last_word);
+      word_t word = bitmask_merge(src_word, dst_word, mask);
+      _set_word(dst, dstindx, word);
+    }
+  }
+
+  _mask_top_word(dst);
+}
+
+// destination and source may be the same bit_array
+// and src/dst regions may overlap
+void bit_array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
+                    const BIT_ARRAY* src, bit_index_t srcindx,
+                    bit_index_t length)
+{
+  STAT_SCOPE(copy, dst, roundup_bits2bytes(length) * 2);
+  assert(srcindx + length <= src->num_of_bits);
+  assert(dstindx <= dst->num_of_bits);
+  _array_copy(dst, dstindx, src, srcindx, length);
+  DEBUG_VALIDATE(dst);
+}
+
+// Clone `src` into `dst`. Resizes `dst`.
+void bit_array_copy_all(BIT_ARRAY* dst, const BIT_ARRAY* src)
+{
+  STAT_SCOPE(copy_all, dst, src->num_of_words * 2 * sizeof(word_t));
+  bit_array_resize_critical(dst, src->num_of_bits);
+  _before_write(dst, 0, src->num_of_words);
+  memmove(dst->words, src->words, src->num_of_words * sizeof(word_t));
+  DEBUG_VALIDATE(dst);
+}
+
+void bit_array_prepare_write(BIT_ARRAY* bitarr, bit_index_t start,
+                             bit_index_t len)
+{
+  assert(start + len <= bitarr->num_of_bits);
+  _before_write_bits(bitarr, start, len);
+}
+
+#ifdef BIT_ARRAY_COW_MMAP
+
+#ifndef MFD_CLOEXEC
+  #define MFD_CLOEXEC 1U
+#endif
+
+// Move the words of bitarr into a memfd that clones can map
+// Returns 1 on success, 0 on failure
+static char _cow_make_source(BIT_ARRAY *bitarr)
+{
+  if(bitarr->cow != NULL && bitarr->cow->fd >= 0) return 1;
+
+  size_t nbytes = _cow_num_pages(bitarr->capacity_in_words * sizeof(word_t)) *
+                  _cow_page();
+  struct BIT_ARRAY_COW *cow;
+  word_t *map = (word_t*)MAP_FAILED;
+  int fd = (int)syscall(SYS_memfd_create, "bit_array", MFD_CLOEXEC);
+
+  if(fd < 0) return 0;
+  if(ftruncate(fd, (off_t)nbytes) != 0 ||
+     (map = _cow_map(fd, nbytes, MAP_SHARED)) == MAP_FAILED ||
+     (cow = (struct BIT_ARRAY_COW*)calloc(1, sizeof(*cow))) == NULL)
+  {
+    if(map != MAP_FAILED) munmap(map, nbytes);
+    close(fd);
+    return 0;
+  }
+
+  // The rest of the file is already zero
+  memcpy(map, bitarr->words, bitarr->num_of_words * sizeof(word_t));
+  _words_free(bitarr);
+
+  cow->fd = fd;
+  cow->map = bitarr->words = map;
+  cow->map_bytes = nbytes;
+  bitarr->capacity_in_words = nbytes / sizeof(word_t);
+  bitarr->cow = cow;
+  return 1;
+}
+
+// Map the words of src (which must be a source) into dst
+// Returns 1 on success, 0 on failure
+static char _cow_clone_into(BIT_ARRAY *dst, BIT_ARRAY *src)
+{
+  struct BIT_ARRAY_COW *source = src->cow, *clone;
+  size_t num_pages = _cow_num_pages(src->num_of_words * sizeof(word_t));
+  size_t nbytes = num_pages * _cow_page(), i;
+  size_t bitmap_words = roundup_bits2words64(num_pages);
+  uint64_t *shared = source->shared;
+  word_t *map;
+
+  if(num_pages > source->shared_pages) {
+    size_t old_words = roundup_bits2words64(source->shared_pages);
+    shared = (uint64_t*)realloc(shared, bitmap_words * sizeof(uint64_t));
+    if(shared == NULL) return 0;
+    memset(shared + old_words, 0, (bitmap_words - old_words) * sizeof(uint64_t));
+    source->shared = shared;
+    source->shared_pages = num_pages;
+  }
+
+  if((clone = (struct BIT_ARRAY_COW*)calloc(1, sizeof(*clone))) == NULL ||
+     (clone->detached = (uint64_t*)calloc(bitmap_words, sizeof(uint64_t))) == NULL ||
+     (map = _cow_map(source->fd, nbytes, MAP_PRIVATE)) == MAP_FAILED)
+  {
+    if(clone != NULL) free(clone->detached);
+    free(clone);
+    return 0;
+  }
+
+  // All pages of this clone are shared until someone writes them
+  for(i = 0; i < num_pages / 64; i++) shared[i] = WORD_MAX;
+  if(num_pages % 64) shared[i] |= bitmask64(num_pages % 64);
+
+  if(dst->track != NULL)
+    _track_write(dst, 0, MAX(dst->num_of_words, src->num_of_words));
+
+  _words_free(dst);
+  clone->fd = -1;
+  clone->map = dst->words = map;
+  clone->map_bytes = nbytes;
+  dst->num_of_bits = src->num_of_bits;
+  dst->num_of_words = src->num_of_words;
+  dst->capacity_in_words = nbytes / sizeof(word_t);
+  dst->cow = clone;
+
+  bitlock_acquire(cow_lock, 0);
+  clone->source = source;
+  clone->next = source->clones;
+  source->clones = clone;
+  bitlock_release(cow_lock, 0);
+  return 1;
+}
+
+#endif
+
+void bit_array_copy_all_cow(BIT_ARRAY* dst, BIT_ARRAY* src)
+{
+  assert(dst != src);
+
+#ifdef BIT_ARRAY_COW_MMAP
+  // Words of a view can't be moved into or out of shared memory
+  if(src->num_of_words * sizeof(word_t) >= COW_MIN_BYTES &&
+     !_is_view(src) && !_is_view(dst) && _cow_make_source(src) && _cow_clone_into(dst, src))
+  {
+    DEBUG_VALIDATE(dst);
+    return;
+  }
+#endif
+
+  bit_array_copy_all(dst, src);
+}
+
+// Returns NULL if cannot malloc
+BIT_ARRAY* bit_array_clone_cow(BIT_ARRAY* src)
+{
+  BIT_ARRAY* cpy = bit_array_create_with(0, _copy_allocator(src));
+  if(cpy != NULL) bit_array_copy_all_cow(cpy, src);
+  return cpy;
+}
 
-  str[bitarr->num_of_bits] = '\0';
 
-  return str;
-}
+//
+// Logic operators
+//
 
-char* bit_array_to_str_rev(const BIT_ARRAY* bitarr, char* str)
+// Bytes read and written by a binary operator on src1 and src2
+#define _logic_bytes(src1,src2) ((src1)->num_of_words + (src2)->num_of_words + \
+  MAX((src1)->num_of_words, (src2)->num_of_words)) * sizeof(word_t)
+
+// Destination can be the same as one or both of the sources
+void bit_array_and(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
 {
-  bit_index_t i;
+  STAT_SCOPE(logical_and, dst, _logic_bytes(src1, src2));
+  // Ensure dst array is big enough
+  word_addr_t max_bits = MAX(src1->num_of_bits, src2->num_of_bits);
+  bit_array_ensure_size_critical(dst, max_bits);
+  _before_write(dst, 0, dst->num_of_words);
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
-  {
-    str[i] = bit_array_get(bitarr, bitarr->num_of_bits-i-1) ? '1' : '0';
-  }
+  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
 
-  str[bitarr->num_of_bits] = '\0';
+  kernels->and_words(dst->words, src1->words, src2->words, min_words);
 
-  return str;
-}
+  // Set remaining bits to zero
+  memset(dst->words + min_words, 0,
+         (dst->num_of_words - min_words) * sizeof(word_t));
 
+  DEBUG_VALIDATE(dst);
+}
 
-// Get a string representations for a given region, using given on/off characters.
-// Note: does not null-terminate
-void bit_array_to_substr(const BIT_ARRAY* bitarr,
-                         bit_index_t start, bit_index_t length,
-                         char* str, char on, char off,
-                         char left_to_right)
+// Destination can be the same as one or both of the sources
+static void _logical_or_xor(BIT_ARRAY* dst,
+                            const BIT_ARRAY* src1,
+                            const BIT_ARRAY* src2,
+                            char use_xor)
 {
-  assert(start + length <= bitarr->num_of_bits);
+  // Ensure dst array is big enough
+  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+  _before_write(dst, 0, dst->num_of_words);
 
-  bit_index_t i, j;
-  bit_index_t end = start + length - 1;
+  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
+  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
 
-  for(i = 0; i < length; i++)
+  if(use_xor)
+    kernels->xor_words(dst->words, src1->words, src2->words, min_words);
+  else
+    kernels->or_words(dst->words, src1->words, src2->words, min_words);
+
+  // Copy remaining bits from longer src array
+  if(min_words != max_words)
   {
-    j = (left_to_right ? start + i : end - i);
-    str[i] = bit_array_get(bitarr, j) ? on : off;
+    const BIT_ARRAY* longer = src1->num_of_words > src2->num_of_words ? src1 : src2;
+
+    if(longer != dst)
+    {
+      memcpy(dst->words + min_words, longer->words + min_words,
+             (max_words - min_words) * sizeof(word_t));
+    }
   }
 
-//  str[length] = '\0';
+  // Set remaining bits to zero
+  size_t size = (dst->num_of_words - max_words) * sizeof(word_t);
+  memset(dst->words + max_words, 0, size);
+
+  DEBUG_VALIDATE(dst);
 }
 
-// Print this array to a file stream.  Prints '0's and '1'.  Doesn't print newline.
-void bit_array_print(const BIT_ARRAY* bitarr, FILE* fout)
+void bit_array_or(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
 {
-  bit_index_t i;
+  STAT_SCOPE(logical_or, dst, _logic_bytes(src1, src2));
+  _logical_or_xor(dst, src1, src2, 0);
+}
 
-  for(i = 0; i < bitarr->num_of_bits; i++)
-  {
-    fprintf(fout, "%c", bit_array_get(bitarr, i) ? '1' : '0');
-  }
+// Destination can be the same as one or both of the sources
+void bit_array_xor(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+{
+  STAT_SCOPE(logical_xor, dst, _logic_bytes(src1, src2));
+  _logical_or_xor(dst, src1, src2, 1);
 }
 
-// Print a string representations for a given region, using given on/off characters.
-void bit_array_print_substr(const BIT_ARRAY* bitarr,
-                            bit_index_t start, bit_index_t length,
-                            FILE* fout, char on, char off,
-                            char left_to_right)
+// If dst is longer than src, top bits are set to 1
+void bit_array_not(BIT_ARRAY* dst, const BIT_ARRAY* src)
 {
-  assert(start + length <= bitarr->num_of_bits);
+  STAT_SCOPE(logical_not, dst, src->num_of_words * 2 * sizeof(word_t));
+  bit_array_ensure_size_critical(dst, src->num_of_bits);
+  _before_write(dst, 0, dst->num_of_words);
 
-  bit_index_t i, j;
-  bit_index_t end = start + length - 1;
+  kernels->not_words(dst->words, src->words, src->num_of_words);
 
-  for(i = 0; i < length; i++)
-  {
-    j = (left_to_right ? start + i : end - i);
-    fprintf(fout, "%c", bit_array_get(bitarr, j) ? on : off);
-  }
+  // Set remaining words to 1s
+  memset(dst->words + src->num_of_words, 0xFF,
+         (dst->num_of_words - src->num_of_words) * sizeof(word_t));
+
+  _mask_top_word(dst);
+
+  DEBUG_VALIDATE(dst);
 }
 
 //
-// Decimal
+// Fused logic expressions
 //
 
-// Get bit array as decimal str (e.g. 0b1101 -> "13")
-// len is the length of str char array -- will write at most len-1 chars
-// returns the number of characters needed
-// return is the same as strlen(str)
-size_t bit_array_to_decimal(const BIT_ARRAY *bitarr, char *str, size_t len)
+// Number of words evaluated per pass of the program. One buffer of this size
+// per stack slot -- BIT_EXPR_MAX_DEPTH of them fit comfortably in L1 cache
+#define EXPR_BLOCK_WORDS 128
+
+// Check a program is well formed: arguments are valid input indices, every
+// operator has enough operands, the stack never gets deeper than
+// BIT_EXPR_MAX_DEPTH and exactly one value is left at the end
+char bit_array_eval_valid(const BIT_EXPR *prog, size_t nops, size_t ninputs)
 {
-  size_t i = 0;
+  size_t i, depth = 0;
 
-  if(bit_array_cmp_uint64(bitarr, 0) == 0)
+  for(i = 0; i < nops; i++)
   {
-    if(len >= 2)
+    switch(prog[i].op)
     {
-      *str = '0';
-      *(str+1) = '\0';
+      case BIT_EXPR_IN:
+        if(prog[i].arg >= ninputs || ++depth > BIT_EXPR_MAX_DEPTH) return 0;
+        break;
+      case BIT_EXPR_NOT:
+        if(depth < 1) return 0;
+        break;
+      case BIT_EXPR_AND:
+      case BIT_EXPR_OR:
+      case BIT_EXPR_XOR:
+      case BIT_EXPR_ANDNOT:
+        if(depth < 2) return 0;
+        depth--;
+        break;
+      default:
+        return 0;
     }
-
-    return 1;
   }
 
-  BIT_ARRAY *tmp = bit_array_clone(bitarr);
-  uint64_t rem;
+  return depth == 1;
+}
 
-  str[len-1] = '\0';
+// Evaluate words [start, start+n) of the expression.  Inputs that cover the
+// whole block are read in place, shorter inputs are zero padded into `bufs`.
+// Returns a pointer to the result, which may point into one of the inputs.
+// Bits beyond the end of the longest input are NOT masked.
+static const word_t* _expr_eval_block(const BIT_EXPR *prog, size_t nops,
+                                      const BIT_ARRAY **inputs,
+                                      word_addr_t start, word_addr_t n,
+                                      word_t (*bufs)[EXPR_BLOCK_WORDS])
+{
+  const word_t *stack[BIT_EXPR_MAX_DEPTH];
+  const BIT_ARRAY *in;
+  word_addr_t avail;
+  size_t i, top = 0;
 
-  while(bit_array_cmp_uint64(tmp, 0) != 0)
+  for(i = 0; i < nops; i++)
   {
-    bit_array_div_uint64(tmp, 10, &rem);
-
-    if(i < len-1)
+    switch(prog[i].op)
     {
-      str[len-2-i] = '0' + rem;
+      case BIT_EXPR_IN:
+        in = inputs[prog[i].arg];
+        if(start + n <= in->num_of_words) {
+          stack[top] = in->words + start;
+        }
+        else {
+          avail = in->num_of_words > start ? in->num_of_words - start : 0;
+          if(avail) memcpy(bufs[top], in->words + start, avail * sizeof(word_t));
+          memset(bufs[top] + avail, 0, (n - avail) * sizeof(word_t));
+          stack[top] = bufs[top];
+        }
+        top++;
+        break;
+      case BIT_EXPR_NOT:
+        kernels->not_words(bufs[top-1], stack[top-1], n);
+        stack[top-1] = bufs[top-1];
+        break;
+      case BIT_EXPR_AND:
+        top--;
+        kernels->and_words(bufs[top-1], stack[top-1], stack[top], n);
+        stack[top-1] = bufs[top-1];
+        break;
+      case BIT_EXPR_OR:
+        top--;
+        kernels->or_words(bufs[top-1], stack[top-1], stack[top], n);
+        stack[top-1] = bufs[top-1];
+        break;
+      case BIT_EXPR_XOR:
+        top--;
+        kernels->xor_words(bufs[top-1], stack[top-1], stack[top], n);
+        stack[top-1] = bufs[top-1];
+        break;
+      case BIT_EXPR_ANDNOT:
+        top--;
+        kernels->andnot_words(bufs[top-1], stack[top-1], stack[top], n);
+        stack[top-1] = bufs[top-1];
+        break;
     }
-
-    i++;
   }
 
-  if(i < len-1)
+  return stack[0];
+}
+
+static bit_index_t _expr_max_bits(const BIT_ARRAY **inputs, size_t ninputs)
+{
+  bit_index_t max_bits = 0;
+  size_t i;
+  for(i = 0; i < ninputs; i++) max_bits = MAX(max_bits, inputs[i]->num_of_bits);
+  return max_bits;
+}
+
+// dst = result of running postfix program `prog` over `inputs`
+// dst is enlarged to the length of the longest input if it is too short.
+// Inputs shorter than dst read as zeros past their end, so (as with
+// bit_array_not) a NOT sets the remaining top bits of dst
+// dst may be one of the inputs
+void bit_array_eval(BIT_ARRAY* dst, const BIT_EXPR *prog, size_t nops,
+                    const BIT_ARRAY **inputs, size_t ninputs)
+{
+  word_t bufs[BIT_EXPR_MAX_DEPTH][EXPR_BLOCK_WORDS];
+  const word_t *res;
+  word_addr_t start, n;
+
+  assert(bit_array_eval_valid(prog, nops, ninputs));
+
+  bit_array_ensure_size_critical(dst, _expr_max_bits(inputs, ninputs));
+  _before_write(dst, 0, dst->num_of_words);
+
+  for(start = 0; start < dst->num_of_words; start += n)
   {
-    // Moves null-terminator as well
-    memmove(str, str+len-i-1, i+1);
+    n = MIN(EXPR_BLOCK_WORDS, dst->num_of_words - start);
+    res = _expr_eval_block(prog, nops, inputs, start, n, bufs);
+    if(res != dst->words + start)
+      memcpy(dst->words + start, res, n * sizeof(word_t));
   }
 
-  bit_array_free(tmp);
-
-  return i;
+  _mask_top_word(dst);
+  DEBUG_VALIDATE(dst);
 }
 
-// Get bit array from decimal str (e.g. "13" -> 0b1101)
-// Returns number of characters used
-size_t bit_array_from_decimal(BIT_ARRAY *bitarr, const char* decimal)
+// Number of bits set in the result of `prog`, without storing the result.
+// Result is as long as the longest input
+bit_index_t bit_array_eval_num_bits_set(const BIT_EXPR *prog, size_t nops,
+                                        const BIT_ARRAY **inputs, size_t ninputs)
 {
-  bit_array_clear_all(bitarr);
-  size_t i = 0;
+  word_t bufs[BIT_EXPR_MAX_DEPTH][EXPR_BLOCK_WORDS];
+  const word_t *res;
+  word_addr_t start, n;
+  bit_index_t num_of_bits = _expr_max_bits(inputs, ninputs);
+  word_addr_t num_of_words = roundup_bits2words64(num_of_bits);
+  word_t top_mask = bitmask64(bits_in_top_word(num_of_bits));
+  bit_index_t count = 0;
+
+  assert(bit_array_eval_valid(prog, nops, ninputs));
 
-  if(decimal[0] == '\0' || decimal[0] < '0' || decimal[0] > '9')
+  for(start = 0; start < num_of_words; start += n)
   {
-    return 0;
+    n = MIN(EXPR_BLOCK_WORDS, num_of_words - start);
+    res = _expr_eval_block(prog, nops, inputs, start, n, bufs);
+    if(start + n < num_of_words) {
+      count += kernels->popcount(res, n);
+    } else {
+      count += kernels->popcount(res, n-1) + POPCOUNT(res[n-1] & top_mask);
+    }
   }
 
-  bit_array_add_uint64(bitarr, decimal[i] - '0');
-  i++;
+  return count;
+}
+
+// Find the first bit set in the result of `prog`, stopping at the first
+// block with a bit set.  Returns 1 if a bit is set, otherwise 0
+// Index of first set bit is stored in the integer pointed to by `result`
+// If no bit is set result is not changed
+char bit_array_eval_find_first_set_bit(const BIT_EXPR *prog, size_t nops,
+                                       const BIT_ARRAY **inputs, size_t ninputs,
+                                       bit_index_t* result)
+{
+  word_t bufs[BIT_EXPR_MAX_DEPTH][EXPR_BLOCK_WORDS];
+  const word_t *res;
+  word_addr_t start, n, i;
+  bit_index_t num_of_bits = _expr_max_bits(inputs, ninputs);
+  word_addr_t num_of_words = roundup_bits2words64(num_of_bits);
+  word_t top_mask = bitmask64(bits_in_top_word(num_of_bits));
+  word_t w;
+
+  assert(bit_array_eval_valid(prog, nops, ninputs));
 
-  while(decimal[i] != '\0' && decimal[i] >= '0' && decimal[i] <= '9')
+  for(start = 0; start < num_of_words; start += n)
   {
-    bit_array_mul_uint64(bitarr, 10);
-    bit_array_add_uint64(bitarr, decimal[i] - '0');
-    i++;
+    n = MIN(EXPR_BLOCK_WORDS, num_of_words - start);
+    res = _expr_eval_block(prog, nops, inputs, start, n, bufs);
+    for(i = 0; i < n; i++) {
+      w = start + i + 1 < num_of_words ? res[i] : res[i] & top_mask;
+      if(w) {
+        *result = (start + i) * WORD_SIZE + trailing_zeros(w);
+        return 1;
+      }
+    }
   }
 
-  return i;
+  return 0;
 }
 
 //
-// Hexidecimal
+// Comparisons
 //
 
-char bit_array_hex_to_nibble(char c, uint8_t *b)
+// Compare two bit arrays by value stored, with index 0 being the Least
+// Significant Bit (LSB). Arrays do not have to be the same length.
+// Example: ..0101 (5) > ...0011 (3) [index 0 is LSB at right hand side]
+// Sorts on length if all zeros: (0,0) < (0,0,0)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
 {
-  c = tolower(c);
+  STAT_SCOPE(cmp, bitarr1,
+             (bitarr1->num_of_words + bitarr2->num_of_words) * sizeof(word_t));
+  word_addr_t i;
+  word_t word1, word2;
+  word_addr_t min_words = bitarr1->num_of_words;
 
-  if(c >= '0' && c <= '9')
-  {
-    *b = c - '0';
-    return 1;
+  // i is unsigned so break when i == 0
+  if(bitarr1->num_of_words > bitarr2->num_of_words) {
+    min_words = bitarr2->num_of_words;
+    for(i = bitarr1->num_of_words-1; ; i--) {
+      if(bitarr1->words[i]) return 1;
+      if(i == bitarr2->num_of_words) break;
+    }
   }
-  else if(c >= 'a' && c <= 'f')
-  {
-    *b = 0xa + (c - 'a');
-    return 1;
+  else if(bitarr1->num_of_words < bitarr2->num_of_words) {
+    for(i = bitarr2->num_of_words-1; ; i--) {
+      if(bitarr2->words[i]) return 1;
+      if(i == bitarr1->num_of_words) break;
+    }
   }
-  else
+
+  if(min_words == 0) return 0;
+
+  for(i = min_words-1; ; i--)
   {
-    return 0;
+    word1 = bitarr1->words[i];
+    word2 = bitarr2->words[i];
+    if(word1 != word2) return (word1 > word2 ? 1 : -1);
+    if(i == 0) break;
   }
+
+  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
+  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
 }
 
-char bit_array_nibble_to_hex(uint8_t b, char uppercase)
+// Compare two bit arrays by value stored, with index 0 being the Most
+// Significant Bit (MSB). Arrays do not have to be the same length.
+// Example: 10.. > 01.. [index 0 is MSB at left hand side]
+// Sorts on length if all zeros: (0,0) < (0,0,0)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp_big_endian(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
 {
-  if(b <= 9)
-  {
-    return '0' + b;
-  }
-  else
-  {
-    return (uppercase ? 'A' : 'a') + (b - 0xa);
+  word_addr_t min_words = MAX(bitarr1->num_of_words, bitarr2->num_of_words);
+
+  word_addr_t i;
+  word_t word1, word2;
+
+  for(i = 0; i < min_words; i++) {
+    word1 = _reverse_word(bitarr1->words[i]);
+    word2 = _reverse_word(bitarr2->words[i]);
+    if(word1 != word2) return (word1 > word2 ? 1 : -1);
   }
+
+  // Check remaining words. Only one of these loops will execute
+  for(; i < bitarr1->num_of_words; i++)
+    if(bitarr1->words[i]) return 1;
+  for(; i < bitarr2->num_of_words; i++)
+    if(bitarr2->words[i]) return -1;
+
+  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
+  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
 }
 
-// Loads array from hex string
-// Returns the number of bits loaded (will be chars rounded up to multiple of 4)
-// (0 on failure)
-bit_index_t bit_array_from_hex(BIT_ARRAY* bitarr, bit_index_t offset,
-                               const char* str, size_t len)
+// compare bitarr with (bitarr2 << pos)
+// bit_array_cmp(bitarr1, bitarr2<<pos)
+// returns:
+//  >0 iff bitarr1 > bitarr2
+//   0 iff bitarr1 == bitarr2
+//  <0 iff bitarr1 < bitarr2
+int bit_array_cmp_words(const BIT_ARRAY *arr1,
+                        bit_index_t pos, const BIT_ARRAY *arr2)
 {
-  if(str[0] == '0' && tolower(str[1]) == 'x')
-  {
-    str += 2;
-    len -= 2;
-  }
-
-  size_t i;
-  for(i = 0; i < len; i++, offset += 4)
+  if(arr1->num_of_bits == 0 && arr2->num_of_bits == 0)
   {
-    uint8_t b;
-    if(bit_array_hex_to_nibble(str[i], &b))
-    {
-      bit_array_ensure_size(bitarr, offset + 4);
-      _set_nibble(bitarr, offset, b);
-    }
-    else
-    {
-      break;
-    }
+    return 0;
   }
 
-  return 4 * i;
-}
+  bit_index_t top_bit1 = 0, top_bit2 = 0;
 
-// Returns number of characters written
-size_t bit_array_to_hex(const BIT_ARRAY* bitarr,
-                        bit_index_t start, bit_index_t length,
-                        char* str, char uppercase)
-{
-  assert(start + length <= bitarr->num_of_bits);
+  char arr1_zero = !bit_array_find_last_set_bit(arr1, &top_bit1);
+  char arr2_zero = !bit_array_find_last_set_bit(arr2, &top_bit2);
 
-  size_t k = 0;
-  bit_index_t offset, end = start + length;
+  if(arr1_zero && arr2_zero) return 0;
+  if(arr1_zero) return -1;
+  if(arr2_zero) return 1;
 
-  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
-  {
-    word_t w = _get_word(bitarr, offset);
+  bit_index_t top_bit2_offset = top_bit2 + pos;
 
-    word_offset_t j;
-    for(j = 0; j < 64; j += 4)
-    {
-      str[k++] = bit_array_nibble_to_hex((w>>j) & 0xf, uppercase);
-    }
+  if(top_bit1 != top_bit2_offset) {
+    return top_bit1 > top_bit2_offset ? 1 : -1;
   }
 
-  if(offset < end)
-  {
-    // Remaining full nibbles (4 bits)
-    word_t w = _get_word(bitarr, offset);
+  word_addr_t i;
+  word_t word1, word2;
 
-    for(; offset + 4 <= end; offset += 4)
-    {
-      str[k++] = bit_array_nibble_to_hex(w & 0xf, uppercase);
-      w >>= 4;
-    }
+  for(i = top_bit2 / WORD_SIZE; i > 0; i--)
+  {
+    word1 = _get_word(arr1, pos + i * WORD_SIZE);
+    word2 = arr2->words[i];
 
-    if(offset < end)
-    {
-      // Remaining bits
-      str[k++] = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
-    }
+    if(word1 > word2) return 1;
+    if(word1 < word2) return -1;
   }
 
-  str[k] = '\0';
+  word1 = _get_word(arr1, pos);
+  word2 = arr2->words[0];
 
-  // Return number of characters written
-  return k;
-}
+  if(word1 > word2) return 1;
+  if(word1 < word2) return -1;
 
-// Print bit array as hex
-size_t bit_array_print_hex(const BIT_ARRAY* bitarr,
-                           bit_index_t start, bit_index_t length,
-                           FILE* fout, char uppercase)
-{
-  assert(start + length <= bitarr->num_of_bits);
+  // return 1 if arr1[0..pos] != 0, 0 otherwise
 
-  size_t k = 0;
-  bit_index_t offset, end = start + length;
+  // Whole words
+  word_addr_t num_words = pos / WORD_SIZE;
 
-  for(offset = start; offset + WORD_SIZE <= end; offset += WORD_SIZE)
+  for(i = 0; i < num_words; i++)
   {
-    word_t w = _get_word(bitarr, offset);
-
-    word_offset_t j;
-    for(j = 0; j < 64; j += 4)
+    if(arr1->words[i] > 0)
     {
-      fprintf(fout, "%c", bit_array_nibble_to_hex((w>>j) & 0xf, uppercase));
-      k++;
+      return 1;
     }
   }
 
-  if(offset < end)
-  {
-    // Remaining full nibbles (4 bits)
-    word_t w = _get_word(bitarr, offset);
-
-    for(; offset + 4 <= end; offset += 4)
-    {
-      fprintf(fout, "%c", bit_array_nibble_to_hex(w & 0xf, uppercase));
-      w >>= 4;
-      k++;
-    }
+  word_offset_t bits_remaining = pos - num_words * WORD_SIZE;
 
-    if(offset < end)
-    {
-      // Remaining bits
-      char hex = bit_array_nibble_to_hex(w & bitmask64(end - offset), uppercase);
-      fprintf(fout, "%c", hex);
-      k++;
-    }
+  if(arr1->words[num_words] & bitmask64(bits_remaining))
+  {
+    return 1;
   }
 
-  return k;
+  return 0;
 }
 
+
 //
-// Clone and copy
+// Reverse -- coords may wrap around
 //
 
-// Returns NULL if cannot malloc
-BIT_ARRAY* bit_array_clone(const BIT_ARRAY* bitarr)
+// No bounds checking
+// length cannot be zero
+static void _reverse_region(BIT_ARRAY* bitarr,
+                            bit_index_t start,
+                            bit_index_t length)
 {
-  BIT_ARRAY* cpy = bit_array_create(bitarr->num_of_bits);
+  bit_index_t left = start;
 
-  if(cpy == NULL)
+  _before_write_bits(bitarr, start, length);
+  bit_index_t right = (start + length - WORD_SIZE) % bitarr->num_of_bits;
+
+  while(length >= 2 * WORD_SIZE)
   {
-    return NULL;
+    // Swap entire words
+    word_t left_word = _get_word_cyclic(bitarr, left);
+    word_t right_word = _get_word_cyclic(bitarr, right);
+
+    // reverse words individually
+    left_word = _reverse_word(left_word);
+    right_word = _reverse_word(right_word);
+
+    // Swap
+    _set_word_cyclic(bitarr, left, right_word);
+    _set_word_cyclic(bitarr, right, left_word);
+
+    // Update
+    left = (left + WORD_SIZE) % bitarr->num_of_bits;
+    right = (right < WORD_SIZE ? right + bitarr->num_of_bits : right) - WORD_SIZE;
+    length -= 2 * WORD_SIZE;
   }
 
-  // Copy across bits
-  memcpy(cpy->words, bitarr->words, bitarr->num_of_words * sizeof(word_t));
+  word_t word, rev;
 
-  DEBUG_VALIDATE(cpy);
-  return cpy;
+  if(length == 0)
+  {
+    return;
+  }
+  else if(length > WORD_SIZE)
+  {
+    // Words overlap
+    word_t left_word = _get_word_cyclic(bitarr, left);
+    word_t right_word = _get_word_cyclic(bitarr, right);
+
+    rev = _reverse_word(left_word);
+    right_word = _reverse_word(right_word);
+
+    // fill left 64 bits with right word rev
+    _set_word_cyclic(bitarr, left, right_word);
+
+    // Now do remaining bits (length is between 1 and 64 bits)
+    left += WORD_SIZE;
+    length -= WORD_SIZE;
+
+    word = _get_word_cyclic(bitarr, left);
+  }
+  else
+  {
+    word = _get_word_cyclic(bitarr, left);
+    rev = _reverse_word(word);
+  }
+
+  rev >>= WORD_SIZE - length;
+  word_t mask = bitmask64(length);
+
+  word = bitmask_merge(rev, word, mask);
+
+  _set_word_cyclic(bitarr, left, word);
 }
 
-// destination and source may be the same bit_array
-// and src/dst regions may overlap
-static void _array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
-                        const BIT_ARRAY* src, bit_index_t srcindx,
-                        bit_index_t length)
+void bit_array_reverse_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
 {
-  DEBUG_PRINT("bit_array_copy(dst: %zu, src: %zu, length: %zu)\n",
-              (size_t)dstindx, (size_t)srcindx, (size_t)length);
+  assert(start + len <= bitarr->num_of_bits);
+  if(len > 0) _reverse_region(bitarr, start, len);
+  DEBUG_VALIDATE(bitarr);
+}
 
-  // Num of full words to copy
-  word_addr_t num_of_full_words = length / WORD_SIZE;
-  word_addr_t i;
+void bit_array_reverse(BIT_ARRAY* bitarr)
+{
+  if(bitarr->num_of_bits > 0) _reverse_region(bitarr, 0, bitarr->num_of_bits);
+  DEBUG_VALIDATE(bitarr);
+}
 
-  word_offset_t bits_in_last_word = bits_in_top_word(length);
+//
+// Shift left / right
+//
+// Shifts move whole words with memmove then do one funnel shift pass for the
+// remaining 0-63 bits (shl_words / shr_words kernels)
+//
 
-  if(dst == src && srcindx > dstindx)
-  {
-    // Work left to right
-    DEBUG_PRINT("work left to right\n");
+// Move bits dist places towards the top, shifting in zeros. dist < num_of_bits
+static void _shift_words_up(BIT_ARRAY *bitarr, bit_index_t dist)
+{
+  word_addr_t n = bitarr->num_of_words, q = dist / WORD_SIZE;
+  word_offset_t r = dist % WORD_SIZE;
 
-    for(i = 0; i < num_of_full_words; i++)
-    {
-      word_t word = _get_word(src, srcindx+i*WORD_SIZE);
-      _set_word(dst, dstindx+i*WORD_SIZE, word);
-    }
+  memmove(bitarr->words + q, bitarr->words, (n - q) * sizeof(word_t));
+  memset(bitarr->words, 0, q * sizeof(word_t));
+  if(r) kernels->shl_words(bitarr->words + q, n - q, r);
+  _mask_top_word(bitarr);
+}
 
-    if(bits_in_last_word > 0)
-    {
-      word_t src_word = _get_word(src, srcindx+i*WORD_SIZE);
-      word_t dst_word = _get_word(dst, dstindx+i*WORD_SIZE);
+// Move bits dist places towards index 0, shifting in zeros. dist < num_of_bits
+static void _shift_words_down(BIT_ARRAY *bitarr, bit_index_t dist)
+{
+  word_addr_t n = bitarr->num_of_words, q = dist / WORD_SIZE;
+  word_offset_t r = dist % WORD_SIZE;
 
-      word_t mask = bitmask64(bits_in_last_word);
-      word_t word = bitmask_merge(src_word, dst_word, mask);
+  // Bits above num_of_bits are zero, so zeros are shifted in at the top
+  memmove(bitarr->words, bitarr->words + q, (n - q) * sizeof(word_t));
+  memset(bitarr->words + n - q, 0, q * sizeof(word_t));
+  if(r) kernels->shr_words(bitarr->words, n - q, r);
+}
 
-      _set_word(dst, dstindx+num_of_full_words*WORD_SIZE, word);
-    }
+// Shift towards MSB / higher index
+void bit_array_shift_left(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+{
+  STAT_SCOPE(shift_left, bitarr, bitarr->num_of_words * 2 * sizeof(word_t));
+  if(shift_dist >= bitarr->num_of_bits)
+  {
+    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
+    return;
   }
-  else
+  else if(shift_dist == 0)
   {
-    // Work right to left
-    DEBUG_PRINT("work right to left\n");
-
-    for(i = 0; i < num_of_full_words; i++)
-    {
-      word_t word = _get_word(src, srcindx+length-(i+1)*WORD_SIZE);
-      _set_word(dst, dstindx+length-(i+1)*WORD_SIZE, word);
-    }
+    return;
+  }
 
-    DEBUG_PRINT("Copy %i,%i to %i\n", (int)srcindx, (int)bits_in_last_word,
-                                      (int)dstindx);
+  _before_write(bitarr, 0, bitarr->num_of_words);
 
-    if(bits_in_last_word > 0)
-    {
-      word_t src_word = _get_word(src, srcindx);
-      word_t dst_word = _get_word(dst, dstindx);
+  _shift_words_up(bitarr, shift_dist);
+  if(fill) _set_region(bitarr, 0, shift_dist, FILL_REGION);
+  DEBUG_VALIDATE(bitarr);
+}
 
-      word_t mask = bitmask64(bits_in_last_word);
-      word_t word = bitmask_merge(src_word, dst_word, mask);
-      _set_word(dst, dstindx, word);
-    }
+// shift left extend - don't truncate bits when shifting UP, instead
+// make room for them.
+void bit_array_shift_left_extend(BIT_ARRAY* bitarr, bit_index_t shift_dist,
+                                 char fill)
+{
+  if(shift_dist == 0)
+  {
+    return;
   }
 
-  _mask_top_word(dst);
-}
+  bit_array_resize_critical(bitarr, bitarr->num_of_bits + shift_dist);
+  _before_write(bitarr, 0, bitarr->num_of_words);
 
-// destination and source may be the same bit_array
-// and src/dst regions may overlap
-void bit_array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
-                    const BIT_ARRAY* src, bit_index_t srcindx,
-                    bit_index_t length)
-{
-  assert(srcindx + length <= src->num_of_bits);
-  assert(dstindx <= dst->num_of_bits);
-  _array_copy(dst, dstindx, src, srcindx, length);
-  DEBUG_VALIDATE(dst);
+  _shift_words_up(bitarr, shift_dist);
+  if(fill) _set_region(bitarr, 0, shift_dist, FILL_REGION);
+  DEBUG_VALIDATE(bitarr);
 }
 
-// Clone `src` into `dst`. Resizes `dst`.
-void bit_array_copy_all(BIT_ARRAY* dst, const BIT_ARRAY* src)
+// Shift towards LSB / lower index
+void bit_array_shift_right(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
 {
-  bit_array_resize_critical(dst, src->num_of_bits);
-  memmove(dst->words, src->words, src->num_of_words * sizeof(word_t));
-  DEBUG_VALIDATE(dst);
-}
+  STAT_SCOPE(shift_right, bitarr, bitarr->num_of_words * 2 * sizeof(word_t));
+  if(shift_dist >= bitarr->num_of_bits)
+  {
+    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
+    return;
+  }
+  else if(shift_dist == 0)
+  {
+    return;
+  }
 
+  _before_write(bitarr, 0, bitarr->num_of_words);
+
+  _shift_words_down(bitarr, shift_dist);
+  if(fill)
+    _set_region(bitarr, bitarr->num_of_bits - shift_dist, shift_dist, FILL_REGION);
+  DEBUG_VALIDATE(bitarr);
+}
 
 //
-// Logic operators
+// Cycle
 //
 
-// Destination can be the same as one or both of the sources
-void bit_array_and(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
-{
-  // Ensure dst array is big enough
-  word_addr_t max_bits = MAX(src1->num_of_bits, src2->num_of_bits);
-  bit_array_ensure_size_critical(dst, max_bits);
+// Cycles save the bits that wrap round, move the rest with a shift, then put
+// the saved bits back. Up to this many words are kept on the stack.
+#define CYCLE_BUF_WORDS 64
 
-  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
+// Cycle bits dist places towards the top, 0 < dist < num_of_bits
+static void _cycle_up(BIT_ARRAY *bitarr, bit_index_t dist)
+{
+  bit_index_t nbits = bitarr->num_of_bits, down = nbits - dist;
 
-  word_addr_t i;
+  // The bits that wrap round: [down, nbits) to [0, dist) if that is shorter,
+  // otherwise [0, down) to [dist, nbits)
+  bit_index_t len = MIN(dist, down);
+  bit_index_t from = dist <= down ? down : 0, to = dist <= down ? 0 : dist;
+  word_offset_t from_offset = from % WORD_SIZE, to_offset = to % WORD_SIZE;
+  word_addr_t nwords = roundup_bits2words64(len) + 1, n;
+  word_t stack_buf[CYCLE_BUF_WORDS], *buf = stack_buf;
 
-  for(i = 0; i < min_words; i++)
+  if(nwords > CYCLE_BUF_WORDS &&
+     (buf = (word_t*)malloc(nwords * sizeof(word_t))) == NULL)
   {
-    dst->words[i] = src1->words[i] & src2->words[i];
+    // No memory: reverse both parts, then the whole array
+    _reverse_region(bitarr, 0, down);
+    _reverse_region(bitarr, down, dist);
+    _reverse_region(bitarr, 0, nbits);
+    return;
   }
 
-  // Set remaining bits to zero
-  for(i = min_words; i < dst->num_of_words; i++)
-  {
-    dst->words[i] = (word_t)0;
-  }
+  // Save the bits that wrap round, at their offset in the destination word
+  n = roundup_bits2words64(from_offset + len);
+  memcpy(buf, bitarr->words + from / WORD_SIZE, n * sizeof(word_t));
+  if(from_offset) kernels->shr_words(buf, n, from_offset);
+  n = roundup_bits2words64(len);
+  buf[n-1] &= bitmask64(bits_in_top_word(len));
+  buf[n] = 0;
+  if(to_offset) kernels->shl_words(buf, n + 1, to_offset);
 
-  DEBUG_VALIDATE(dst);
+  // Shifting leaves zeros where the saved bits go
+  if(dist <= down) _shift_words_up(bitarr, dist);
+  else _shift_words_down(bitarr, down);
+
+  n = roundup_bits2words64(to_offset + len);
+  kernels->or_words(bitarr->words + to / WORD_SIZE,
+                    bitarr->words + to / WORD_SIZE, buf, n);
+
+  if(buf != stack_buf) free(buf);
 }
 
-// Destination can be the same as one or both of the sources
-static void _logical_or_xor(BIT_ARRAY* dst,
-                            const BIT_ARRAY* src1,
-                            const BIT_ARRAY* src2,
-                            char use_xor)
+// Cycle towards index 0
+void bit_array_cycle_right(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
 {
-  // Ensure dst array is big enough
-  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
-
-  word_addr_t min_words = MIN(src1->num_of_words, src2->num_of_words);
-  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+  if(bitarr->num_of_bits == 0)
+  {
+    return;
+  }
 
-  word_addr_t i;
+  cycle_dist = cycle_dist % bitarr->num_of_bits;
 
-  if(use_xor)
+  if(cycle_dist == 0)
   {
-    for(i = 0; i < min_words; i++)
-      dst->words[i] = src1->words[i] ^ src2->words[i];
+    return;
   }
-  else
+
+  _before_write(bitarr, 0, bitarr->num_of_words);
+  _cycle_up(bitarr, bitarr->num_of_bits - cycle_dist);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Cycle away from index 0
+void bit_array_cycle_left(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+{
+  if(bitarr->num_of_bits == 0)
   {
-    for(i = 0; i < min_words; i++)
-      dst->words[i] = src1->words[i] | src2->words[i];
+    return;
   }
 
-  // Copy remaining bits from longer src array
-  if(min_words != max_words)
-  {
-    const BIT_ARRAY* longer = src1->num_of_words > src2->num_of_words ? src1 : src2;
+  cycle_dist = cycle_dist % bitarr->num_of_bits;
 
-    for(i = min_words; i < max_words; i++)
-    {
-      dst->words[i] = longer->words[i];
-    }
+  if(cycle_dist == 0)
+  {
+    return;
   }
 
-  // Set remaining bits to zero
-  size_t size = (dst->num_of_words - max_words) * sizeof(word_t);
-  memset(dst->words + max_words, 0, size);
-
-  DEBUG_VALIDATE(dst);
+  _before_write(bitarr, 0, bitarr->num_of_words);
+  _cycle_up(bitarr, cycle_dist);
+  DEBUG_VALIDATE(bitarr);
 }
 
-void bit_array_or(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
-{
-  _logical_or_xor(dst, src1, src2, 0);
-}
+//
+// Next permutation
+//
 
-// Destination can be the same as one or both of the sources
-void bit_array_xor(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+static word_t _next_permutation(word_t v)
 {
-  _logical_or_xor(dst, src1, src2, 1);
+  assert(v);
+  // From http://graphics.stanford.edu/~seander/bithacks.html#NextBitPermutation
+  word_t t = v | (v - 1); // t gets v's least significant 0 bits set to 1
+  // Next set to 1 the most significant bit to change,
+  // set to 0 the least significant ones, and add the necessary 1 bits.
+  return (t+1) | (((~t & (t+1)) - 1) >> (trailing_zeros(v) + 1));
 }
 
-// If dst is longer than src, top bits are set to 1
-void bit_array_not(BIT_ARRAY* dst, const BIT_ARRAY* src)
+// Get the next permutation of an array with a fixed size and given number of
+// bits set.  Also known as next lexicographic permutation.
+// Given a bit array find the next lexicographic orginisation of the bits
+// Number of possible combinations given by (size choose bits_set) i.e. nCk
+// 00011 -> 00101 -> 00110 -> 01001 -> 01010 ->
+// 01100 -> 10001 -> 10010 -> 10100 -> 11000 -> 00011 (back to start)
+void bit_array_next_permutation(BIT_ARRAY* bitarr)
 {
-  bit_array_ensure_size_critical(dst, src->num_of_bits);
-
-  word_addr_t i;
-
-  for(i = 0; i < src->num_of_words; i++)
+  if(bitarr->num_of_bits == 0)
   {
-    dst->words[i] = ~(src->words[i]);
+    return;
   }
 
-  // Set remaining words to 1s
-  for(i = src->num_of_words; i < dst->num_of_words; i++)
+  word_addr_t w;
+
+  char carry = 0;
+  word_offset_t top_bits = bitset64_idx(bitarr->num_of_bits);
+
+  _before_write(bitarr, 0, bitarr->num_of_words);
+
+  for(w = 0; w < bitarr->num_of_words; w++)
   {
-    dst->words[i] = WORD_MAX;
-  }
+    word_t mask
+      = (w < bitarr->num_of_words - 1 || top_bits == 0) ? WORD_MAX
+                                                        : bitmask64(top_bits);
 
-  _mask_top_word(dst);
+    if(bitarr->words[w] > 0 &&
+       (bitarr->words[w] | (bitarr->words[w]-1)) == mask)
+    {
+      // Bits in this word cannot be moved forward
+      carry = 1;
+    }
+    else if(carry)
+    {
+      // 0111 -> 1000, 1000 -> 1001
+      word_t tmp = bitarr->words[w] + 1;
 
-  DEBUG_VALIDATE(dst);
-}
+      // Count bits previously set
+      bit_index_t bits_previously_set = POPCOUNT(bitarr->words[w]);
 
-//
-// Comparisons
-//
+      // set new word
+      bitarr->words[w] = tmp;
 
-// Compare two bit arrays by value stored, with index 0 being the Least
-// Significant Bit (LSB). Arrays do not have to be the same length.
-// Example: ..0101 (5) > ...0011 (3) [index 0 is LSB at right hand side]
-// Sorts on length if all zeros: (0,0) < (0,0,0)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
-{
-  word_addr_t i;
-  word_t word1, word2;
-  word_addr_t min_words = bitarr1->num_of_words;
+      // note: w is unsigned
+      // Zero words while counting bits set
+      while(w > 0)
+      {
+        bits_previously_set += POPCOUNT(bitarr->words[w-1]);
+        bitarr->words[w-1] = 0;
+        w--;
+      }
 
-  // i is unsigned so break when i == 0
-  if(bitarr1->num_of_words > bitarr2->num_of_words) {
-    min_words = bitarr2->num_of_words;
-    for(i = bitarr1->num_of_words-1; ; i--) {
-      if(bitarr1->words[i]) return 1;
-      if(i == bitarr2->num_of_words) break;
+      // Set bits at the beginning
+      SET_REGION(bitarr, 0, bits_previously_set - POPCOUNT(tmp));
+
+      carry = 0;
+      break;
     }
-  }
-  else if(bitarr1->num_of_words < bitarr2->num_of_words) {
-    for(i = bitarr2->num_of_words-1; ; i--) {
-      if(bitarr2->words[i]) return 1;
-      if(i == bitarr1->num_of_words) break;
+    else if(bitarr->words[w] > 0)
+    {
+      bitarr->words[w] = _next_permutation(bitarr->words[w]);
+      break;
     }
   }
 
-  if(min_words == 0) return 0;
-
-  for(i = min_words-1; ; i--)
+  if(carry)
   {
-    word1 = bitarr1->words[i];
-    word2 = bitarr2->words[i];
-    if(word1 != word2) return (word1 > word2 ? 1 : -1);
-    if(i == 0) break;
+    // Loop around
+    bit_index_t num_bits_set = bit_array_num_bits_set(bitarr);
+    bit_array_clear_all(bitarr);
+    SET_REGION(bitarr, 0, num_bits_set);
   }
 
-  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
-  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
+  DEBUG_VALIDATE(bitarr);
 }
 
-// Compare two bit arrays by value stored, with index 0 being the Most
-// Significant Bit (MSB). Arrays do not have to be the same length.
-// Example: 10.. > 01.. [index 0 is MSB at left hand side]
-// Sorts on length if all zeros: (0,0) < (0,0,0)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp_big_endian(const BIT_ARRAY* bitarr1, const BIT_ARRAY* bitarr2)
-{
-  word_addr_t min_words = MAX(bitarr1->num_of_words, bitarr2->num_of_words);
-
-  word_addr_t i;
-  word_t word1, word2;
-
-  for(i = 0; i < min_words; i++) {
-    word1 = _reverse_word(bitarr1->words[i]);
-    word2 = _reverse_word(bitarr2->words[i]);
-    if(word1 != word2) return (word1 > word2 ? 1 : -1);
-  }
 
-  // Check remaining words. Only one of these loops will execute
-  for(; i < bitarr1->num_of_words; i++)
-    if(bitarr1->words[i]) return 1;
-  for(; i < bitarr2->num_of_words; i++)
-    if(bitarr2->words[i]) return -1;
+//
+// Interleave
+//
 
-  if(bitarr1->num_of_bits == bitarr2->num_of_bits) return 0;
-  return bitarr1->num_of_bits > bitarr2->num_of_bits ? 1 : -1;
+// dst cannot point to the same bit array as src1 or src2
+// src1, src2 may point to the same bit array
+// abcd 1234 -> a1b2c3d4
+// 0011 0000 -> 00001010
+// 1111 0000 -> 10101010
+// 0101 1010 -> 01100110
+void bit_array_interleave(BIT_ARRAY* dst,
+                          const BIT_ARRAY* src1,
+                          const BIT_ARRAY* src2)
+{
+  const BIT_ARRAY *srcs[2] = {src1, src2};
+  bit_array_interleave_n(dst, srcs, 2);
 }
 
-// compare bitarr with (bitarr2 << pos)
-// bit_array_cmp(bitarr1, bitarr2<<pos)
-// returns:
-//  >0 iff bitarr1 > bitarr2
-//   0 iff bitarr1 == bitarr2
-//  <0 iff bitarr1 < bitarr2
-int bit_array_cmp_words(const BIT_ARRAY *arr1,
-                        bit_index_t pos, const BIT_ARRAY *arr2)
+// Run the kernel for word groups [0, ngroups) with k sources / outputs
+static inline void _interleave_words(word_t *dst, const word_t **src,
+                                     size_t k, word_addr_t ngroups)
 {
-  if(arr1->num_of_bits == 0 && arr2->num_of_bits == 0)
-  {
-    return 0;
-  }
-
-  bit_index_t top_bit1 = 0, top_bit2 = 0;
+  if(ngroups == 0) return;
+  if(k == 2) morton_kernels->interleave2(dst, src[0], src[1], ngroups);
+  else morton_kernels->interleave_k(dst, src, k, ngroups);
+}
 
-  char arr1_zero = !bit_array_find_last_set_bit(arr1, &top_bit1);
-  char arr2_zero = !bit_array_find_last_set_bit(arr2, &top_bit2);
+static inline void _deinterleave_words(word_t **dst, const word_t *src,
+                                       size_t k, word_addr_t ngroups)
+{
+  if(ngroups == 0) return;
+  if(k == 2) morton_kernels->deinterleave2(dst[0], dst[1], src, ngroups);
+  else morton_kernels->deinterleave_k(dst, src, k, ngroups);
+}
 
-  if(arr1_zero && arr2_zero) return 0;
-  if(arr1_zero) return -1;
-  if(arr2_zero) return 1;
+// Bit i of srcs[j] goes to bit n*i+j of dst
+void bit_array_interleave_n(BIT_ARRAY* dst, const BIT_ARRAY** srcs, size_t n)
+{
+  const word_t *in[BIT_ARRAY_INTERLEAVE_MAX];
+  word_t tail_in[BIT_ARRAY_INTERLEAVE_MAX], tail_out[BIT_ARRAY_INTERLEAVE_MAX];
+  size_t j;
 
-  bit_index_t top_bit2_offset = top_bit2 + pos;
+  assert(n >= 1 && n <= BIT_ARRAY_INTERLEAVE_MAX);
+  STAT_SCOPE(interleave, dst,
+             srcs[0]->num_of_words * n * 2 * sizeof(word_t));
 
-  if(top_bit1 != top_bit2_offset) {
-    return top_bit1 > top_bit2_offset ? 1 : -1;
+  for(j = 0; j < n; j++) {
+    assert(srcs[j] != dst);
+    assert(srcs[j]->num_of_bits == srcs[0]->num_of_bits);
+    in[j] = srcs[j]->words;
   }
 
-  word_addr_t i;
-  word_t word1, word2;
+  const word_addr_t src_words = srcs[0]->num_of_words;
+  bit_array_resize_critical(dst, srcs[0]->num_of_bits * n);
+  _before_write(dst, 0, dst->num_of_words);
 
-  for(i = top_bit2 / WORD_SIZE; i > 0; i--)
-  {
-    word1 = _get_word(arr1, pos + i * WORD_SIZE);
-    word2 = arr2->words[i];
+  // Groups of n words that fit in dst. At most one more, cut short: it only
+  // has zeros past the end of dst, as the top word of each src is masked
+  word_addr_t full = MIN(src_words, dst->num_of_words / n);
+  _interleave_words(dst->words, in, n, full);
 
-    if(word1 > word2) return 1;
-    if(word1 < word2) return -1;
+  if(full < src_words) {
+    for(j = 0; j < n; j++) { tail_in[j] = in[j][full]; in[j] = tail_in + j; }
+    _interleave_words(tail_out, in, n, 1);
+    memcpy(dst->words + full*n, tail_out,
+           (dst->num_of_words - full*n) * sizeof(word_t));
   }
 
-  word1 = _get_word(arr1, pos);
-  word2 = arr2->words[0];
+  DEBUG_VALIDATE(dst);
+}
 
-  if(word1 > word2) return 1;
-  if(word1 < word2) return -1;
+// Bit n*i+j of src goes to bit i of dsts[j]
+void bit_array_deinterleave_n(BIT_ARRAY** dsts, const BIT_ARRAY* src, size_t n)
+{
+  word_t *out[BIT_ARRAY_INTERLEAVE_MAX];
+  word_t tail_in[BIT_ARRAY_INTERLEAVE_MAX], tail_out[BIT_ARRAY_INTERLEAVE_MAX];
+  size_t j, k;
+  STAT_SCOPE(deinterleave, src, src->num_of_words * 2 * sizeof(word_t));
 
-  // return 1 if arr1[0..pos] != 0, 0 otherwise
+  assert(n >= 1 && n <= BIT_ARRAY_INTERLEAVE_MAX);
+  assert(src->num_of_bits % n == 0);
 
-  // Whole words
-  word_addr_t num_words = pos / WORD_SIZE;
+  const bit_index_t len = src->num_of_bits / n;
 
-  for(i = 0; i < num_words; i++)
-  {
-    if(arr1->words[i] > 0)
-    {
-      return 1;
-    }
+  for(j = 0; j < n; j++) {
+    assert(dsts[j] != src);
+    for(k = 0; k < j; k++) assert(dsts[k] != dsts[j]);
+    bit_array_resize_critical(dsts[j], len);
+    _before_write(dsts[j], 0, dsts[j]->num_of_words);
+    out[j] = dsts[j]->words;
   }
 
-  word_offset_t bits_remaining = pos - num_words * WORD_SIZE;
+  // Each dst word comes from a group of n src words, the last may be cut short
+  const word_addr_t dst_words = dsts[0]->num_of_words;
+  word_addr_t full = MIN(dst_words, src->num_of_words / n);
+  _deinterleave_words(out, src->words, n, full);
 
-  if(arr1->words[num_words] & bitmask64(bits_remaining))
-  {
-    return 1;
+  if(full < dst_words) {
+    memset(tail_in, 0, sizeof(tail_in));
+    memcpy(tail_in, src->words + full*n,
+           (src->num_of_words - full*n) * sizeof(word_t));
+    for(j = 0; j < n; j++) out[j] = tail_out + j;
+    _deinterleave_words(out, tail_in, n, 1);
+    for(j = 0; j < n; j++) dsts[j]->words[full] = tail_out[j];
   }
 
-  return 0;
+  for(j = 0; j < n; j++) DEBUG_VALIDATE(dsts[j]);
 }
 
+void bit_array_deinterleave(BIT_ARRAY* dst1, BIT_ARRAY* dst2,
+                            const BIT_ARRAY* src)
+{
+  BIT_ARRAY *dsts[2] = {dst1, dst2};
+  bit_array_deinterleave_n(dsts, src, 2);
+}
 
 //
-// Reverse -- coords may wrap around
+// Random
 //
 
-// No bounds checking
-// length cannot be zero
-static void _reverse_region(BIT_ARRAY* bitarr,
-                            bit_index_t start,
-                            bit_index_t length)
+// xoshiro256** by David Blackman and Sebastiano Vigna (public domain)
+// https://prng.di.unimi.it/
+
+static inline uint64_t _rotl64(uint64_t x, int k)
 {
-  bit_index_t left = start;
-  bit_index_t right = (start + length - WORD_SIZE) % bitarr->num_of_bits;
+  return (x << k) | (x >> (64 - k));
+}
 
-  while(length >= 2 * WORD_SIZE)
-  {
-    // Swap entire words
-    word_t left_word = _get_word_cyclic(bitarr, left);
-    word_t right_word = _get_word_cyclic(bitarr, right);
+static inline uint64_t _rng_next(BIT_ARRAY_RNG *rng)
+{
+  uint64_t *s = rng->s;
+  uint64_t result = _rotl64(s[1] * 5, 7) * 9, t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = _rotl64(s[3], 45);
+  return result;
+}
 
-    // reverse words individually
-    left_word = _reverse_word(left_word);
-    right_word = _reverse_word(right_word);
+void bit_array_rng_seed(BIT_ARRAY_RNG *rng, uint64_t seed)
+{
+  // splitmix64, never gives the all zero state
+  int i;
+  for(i = 0; i < 4; i++) {
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    rng->s[i] = z ^ (z >> 31);
+  }
+}
 
-    // Swap
-    _set_word_cyclic(bitarr, left, right_word);
-    _set_word_cyclic(bitarr, right, left_word);
+uint64_t bit_array_rng_next(BIT_ARRAY_RNG *rng)
+{
+  return _rng_next(rng);
+}
 
-    // Update
-    left = (left + WORD_SIZE) % bitarr->num_of_bits;
-    right = (right < WORD_SIZE ? right + bitarr->num_of_bits : right) - WORD_SIZE;
-    length -= 2 * WORD_SIZE;
+uint64_t bit_array_rng_below(BIT_ARRAY_RNG *rng, uint64_t n)
+{
+  assert(n > 0);
+  // Reject the lowest (2^64 % n) values so every remainder is equally likely
+  uint64_t r, t = (0 - n) % n;
+  do { r = _rng_next(rng); } while(r < t);
+  return r % n;
+}
+
+void bit_array_rng_jump(BIT_ARRAY_RNG *rng)
+{
+  static const uint64_t jump[4] = {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+                                   0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL};
+  uint64_t s[4] = {0, 0, 0, 0};
+  int i, b, j;
+
+  for(i = 0; i < 4; i++) {
+    for(b = 0; b < 64; b++) {
+      if(jump[i] & ((uint64_t)1 << b))
+        for(j = 0; j < 4; j++) s[j] ^= rng->s[j];
+      _rng_next(rng);
+    }
   }
 
-  word_t word, rev;
+  memcpy(rng->s, s, sizeof(s));
+}
 
-  if(length == 0)
+// Random word with each bit set with probability threshold / 2^32.
+// Bits of the threshold are read from the lowest set bit up: each 1 ORs in a
+// random word, each 0 ANDs one. After the bits of t, a bit is set with
+// probability 0.t, so this takes at most 32 random words (1 for p = 0.5)
+static inline word_t _random_word(BIT_ARRAY_RNG *rng, uint32_t threshold)
+{
+  word_t word = 0;
+  int i;
+  if(threshold == 0) return 0;
+  for(i = trailing_zeros(threshold); i < 32; i++) {
+    word_t r = _rng_next(rng);
+    word = ((threshold >> i) & 1) ? word | r : word & r;
+  }
+  return word;
+}
+
+void bit_array_random_rng(BIT_ARRAY* bitarr, float prob, BIT_ARRAY_RNG *rng)
+{
+  assert(prob >= 0 && prob <= 1);
+
+  if(bitarr->num_of_bits == 0)
   {
     return;
   }
-  else if(length > WORD_SIZE)
+  else if(prob == 1)
   {
-    // Words overlap
-    word_t left_word = _get_word_cyclic(bitarr, left);
-    word_t right_word = _get_word_cyclic(bitarr, right);
+    bit_array_set_all(bitarr);
+    return;
+  }
 
-    rev = _reverse_word(left_word);
-    right_word = _reverse_word(right_word);
+  uint32_t threshold = (uint32_t)(prob * 4294967296.0);
+  word_addr_t w;
 
-    // fill left 64 bits with right word rev
-    _set_word_cyclic(bitarr, left, right_word);
+  _before_write(bitarr, 0, bitarr->num_of_words);
 
-    // Now do remaining bits (length is between 1 and 64 bits)
-    left += WORD_SIZE;
-    length -= WORD_SIZE;
+  for(w = 0; w < bitarr->num_of_words; w++)
+    bitarr->words[w] = _random_word(rng, threshold);
 
-    word = _get_word_cyclic(bitarr, left);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+}
+
+// Set bits randomly with probability prob : 0 <= prob <= 1
+void bit_array_random(BIT_ARRAY* bitarr, float prob)
+{
+  bit_array_random_rng(bitarr, prob, _seed_rand());
+}
+
+static int _cmp_uint64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Fill ranks with m distinct sorted values in [0, total), m <= total / 2
+static void _random_ranks(uint64_t *ranks, size_t m, uint64_t total,
+                          BIT_ARRAY_RNG *rng)
+{
+  size_t n = 0, i, j;
+  while(n < m) {
+    for(i = n; i < m; i++) ranks[i] = bit_array_rng_below(rng, total);
+    qsort(ranks, m, sizeof(uint64_t), _cmp_uint64);
+    for(i = j = 1; i < m; i++)
+      if(ranks[i] != ranks[j-1]) ranks[j++] = ranks[i];
+    n = j;
   }
-  else
+}
+
+// Flip bits equal to value whose rank among those bits (0 for the first) is
+// in sorted ranks[0..m). If invert, flip the ones not in ranks instead.
+static void _flip_ranks(BIT_ARRAY *bitarr, char value, const uint64_t *ranks,
+                        size_t m, char invert)
+{
+  word_addr_t w;
+  uint64_t seen = 0;
+  size_t r = 0;
+
+  for(w = 0; w < bitarr->num_of_words; w++)
   {
-    word = _get_word_cyclic(bitarr, left);
-    rev = _reverse_word(word);
-  }
+    word_t v = value ? bitarr->words[w] : ~bitarr->words[w], sel = 0, x;
+    if(w + 1 == bitarr->num_of_words)
+      v &= bitmask64(bits_in_top_word(bitarr->num_of_bits));
 
-  rev >>= WORD_SIZE - length;
-  word_t mask = bitmask64(length);
+    unsigned pc = POPCOUNT(v), k;
 
-  word = bitmask_merge(rev, word, mask);
+    // Select the bits whose ranks are in this word
+    for(; r < m && ranks[r] < seen + pc; r++) {
+      for(x = v, k = (unsigned)(ranks[r] - seen); k > 0; k--) x &= x - 1;
+      sel |= x & -x;
+    }
 
-  _set_word_cyclic(bitarr, left, word);
+    bitarr->words[w] ^= invert ? v & ~sel : sel;
+    seen += pc;
+  }
 }
 
-void bit_array_reverse_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len)
+void bit_array_random_adjust(BIT_ARRAY* bitarr, bit_index_t k,
+                             BIT_ARRAY_RNG *rng)
 {
-  assert(start + len <= bitarr->num_of_bits);
-  if(len > 0) _reverse_region(bitarr, start, len);
+  assert(k <= bitarr->num_of_bits);
+
+  bit_index_t c = bit_array_num_bits_set(bitarr);
+  if(c == k) return;
+
+  // Clear some set bits, or set some clear bits, picked uniformly
+  char value = c > k;
+  uint64_t total = value ? c : bitarr->num_of_bits - c;
+  uint64_t m = value ? c - k : k - c, r;
+
+  // Pick the shorter list: bits to flip or (invert) bits to keep
+  char invert = m > total / 2;
+  uint64_t n = invert ? total - m : m;
+  uint64_t *ranks = n ? (uint64_t*)malloc(n * sizeof(uint64_t)) : NULL;
+
+  _before_write(bitarr, 0, bitarr->num_of_words);
+
+  if(n > 0 && ranks == NULL) {
+    // Out of memory: flip one random bit at a time
+    for(; m > 0; m--, total--) {
+      r = bit_array_rng_below(rng, total);
+      _flip_ranks(bitarr, value, &r, 1, 0);
+    }
+  }
+  else {
+    _random_ranks(ranks, n, total, rng);
+    _flip_ranks(bitarr, value, ranks, n, invert);
+    free(ranks);
+  }
+
   DEBUG_VALIDATE(bitarr);
 }
 
-void bit_array_reverse(BIT_ARRAY* bitarr)
+// Any way of choosing bits that does not depend on their position gives each
+// set of k positions the same probability: set bits with prob k/n then
+// correct the count
+void bit_array_random_k(BIT_ARRAY* bitarr, bit_index_t k, BIT_ARRAY_RNG *rng)
 {
-  if(bitarr->num_of_bits > 0) _reverse_region(bitarr, 0, bitarr->num_of_bits);
-  DEBUG_VALIDATE(bitarr);
+  assert(k <= bitarr->num_of_bits);
+  if(bitarr->num_of_bits == 0) return;
+  bit_array_random_rng(bitarr, (float)((double)k / bitarr->num_of_bits), rng);
+  bit_array_random_adjust(bitarr, k, rng);
+}
+
+// Shuffle the bits in an array randomly
+// A shuffle keeps the number of bits set and is otherwise uniformly random, so
+// it is done by refilling a word at a time (bit_array_random_k)
+void bit_array_shuffle_rng(BIT_ARRAY* bitarr, BIT_ARRAY_RNG *rng)
+{
+  bit_array_random_k(bitarr, bit_array_num_bits_set(bitarr), rng);
+}
+
+void bit_array_shuffle(BIT_ARRAY* bitarr)
+{
+  bit_array_shuffle_rng(bitarr, _seed_rand());
 }
 
 //
-// Shift left / right
+// Arithmetic
 //
 
-// Shift towards MSB / higher index
-void bit_array_shift_left(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
+// Returns 1 on sucess, 0 if value in array is too big
+char bit_array_as_num(const BIT_ARRAY* bitarr, uint64_t* result)
 {
-  if(shift_dist >= bitarr->num_of_bits)
+  if(bitarr->num_of_bits == 0)
   {
-    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
+    *result = 0;
+    return 1;
+  }
+
+  word_addr_t w;
+
+  for(w = bitarr->num_of_words-1; w > 0; w--)
+  {
+    if(bitarr->words[w] > 0)
+    {
+      return 0;
+    }
+  }
+
+  *result = bitarr->words[0];
+  return 1;
+}
+
+
+// 1 iff bitarr > value
+// 0 iff bitarr == value
+// -1 iff bitarr < value
+int bit_array_cmp_uint64(const BIT_ARRAY* bitarr, uint64_t value)
+{
+  uint64_t arr_num = 0;
+
+  // If cannot put bitarr in uint64, it is > value
+  if(!bit_array_as_num(bitarr, &arr_num)) return 1;
+
+  if(arr_num > value)      return  1;
+  else if(arr_num < value) return -1;
+  else                     return  0;
+}
+
+// If value is zero, no change is made
+void bit_array_add_uint64(BIT_ARRAY* bitarr, uint64_t value)
+{
+  _before_write_all(bitarr);
+
+  if(value == 0)
+  {
+    return;
+  }
+  else if(bitarr->num_of_bits == 0)
+  {
+    bit_array_resize_critical(bitarr, WORD_SIZE - leading_zeros(value));
+    bitarr->words[0] = (word_t)value;
     return;
   }
-  else if(shift_dist == 0)
+
+  char carry = 0;
+  word_addr_t i;
+
+  for(i = 0; i < bitarr->num_of_words; i++)
+  {
+    if(WORD_MAX - bitarr->words[i] < value)
+    {
+      carry = 1;
+      bitarr->words[i] += value;
+      value = 1;
+    }
+    else
+    {
+      // Carry is absorbed
+      bitarr->words[i] += value;
+      carry = 0;
+      break;
+    }
+  }
+
+  if(carry)
   {
-    return;
-  }
+    // Bit array full, need another bit after all words filled
+    bit_array_resize_critical(bitarr, bitarr->num_of_words * WORD_SIZE + 1);
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+    // Set top word to 1
+    bitarr->words[bitarr->num_of_words-1] = 1;
+  }
+  else
+  {
+    word_t final_word = bitarr->words[bitarr->num_of_words-1];
+    word_offset_t expected_bits = bits_in_top_word(bitarr->num_of_bits);
+    word_offset_t actual_bits = WORD_SIZE - leading_zeros(final_word);
 
-  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
-  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
-  _set_region(bitarr, 0, shift_dist, action);
+    if(actual_bits > expected_bits)
+    {
+      // num_of_bits has increased -- num_of_words has not
+      bitarr->num_of_bits += (actual_bits - expected_bits);
+    }
+  }
 }
 
-// shift left extend - don't truncate bits when shifting UP, instead
-// make room for them.
-void bit_array_shift_left_extend(BIT_ARRAY* bitarr, bit_index_t shift_dist,
-                                 char fill)
+// If value is greater than bitarr, bitarr is not changed and 0 is returned
+// Returns 1 on success, 0 if value > bitarr
+char bit_array_sub_uint64(BIT_ARRAY* bitarr, uint64_t value)
 {
-   bit_index_t newlen = bitarr->num_of_bits + shift_dist;
-   bit_index_t cpy_length = bitarr->num_of_bits;
+  _before_write_all(bitarr);
 
-  if(shift_dist == 0)
+  if(value == 0)
   {
-    return;
+    return 1;
+  }
+  else if(bitarr->words[0] >= value)
+  {
+    bitarr->words[0] -= value;
+    return 1;
   }
 
-  bit_array_resize_critical(bitarr, newlen);
+  value -= bitarr->words[0];
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
-  _array_copy(bitarr, shift_dist, bitarr, 0, cpy_length);
-  _set_region(bitarr, 0, shift_dist, action);
-}
+  word_addr_t i;
 
-// Shift towards LSB / lower index
-void bit_array_shift_right(BIT_ARRAY* bitarr, bit_index_t shift_dist, char fill)
-{
-  if(shift_dist >= bitarr->num_of_bits)
-  {
-    fill ? bit_array_set_all(bitarr) : bit_array_clear_all(bitarr);
-    return;
-  }
-  else if(shift_dist == 0)
+  for(i = 1; i < bitarr->num_of_words; i++)
   {
-    return;
-  }
+    if(bitarr->words[i] > 0)
+    {
+      // deduct one
+      bitarr->words[i]--;
+
+      for(; i > 0; i--)
+      {
+        bitarr->words[i] = WORD_MAX;
+      }
 
-  FillAction action = fill ? FILL_REGION : ZERO_REGION;
+      // -1 since we've already deducted 1
+      bitarr->words[0] = WORD_MAX - value - 1;
 
-  bit_index_t cpy_length = bitarr->num_of_bits - shift_dist;
-  bit_array_copy(bitarr, 0, bitarr, shift_dist, cpy_length);
+      return 1;
+    }
+  }
 
-  _set_region(bitarr, cpy_length, shift_dist, action);
+  // subtract value is greater than array
+  return 0;
 }
 
 //
-// Cycle
+// Arithmetic between bit arrays
 //
 
-// Cycle towards index 0
-void bit_array_cycle_right(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
+// src1, src2 and dst can all be the same BIT_ARRAY
+static void _arithmetic(BIT_ARRAY* dst,
+                        const BIT_ARRAY* src1,
+                        const BIT_ARRAY* src2,
+                        char subtract)
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
-  }
+  _before_write_all(dst);
 
-  cycle_dist = cycle_dist % bitarr->num_of_bits;
+  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
 
-  if(cycle_dist == 0)
+  // Adding: dst_words >= max(src1 words, src2 words)
+  // Subtracting: dst_words is >= src1->num_of_words
+
+  char carry = subtract ? 1 : 0;
+
+  word_addr_t i;
+  word_t word1, word2;
+
+  for(i = 0; i < max_words; i++)
   {
-    return;
-  }
+    word1 = (i < src1->num_of_words ? src1->words[i] : 0);
+    word2 = (i < src2->num_of_words ? src2->words[i] : 0);
 
-  bit_index_t len1 = cycle_dist;
-  bit_index_t len2 = bitarr->num_of_bits - cycle_dist;
+    if(subtract)
+      word2 = ~word2;
 
-  _reverse_region(bitarr, 0, len1);
-  _reverse_region(bitarr, len1, len2);
-  bit_array_reverse(bitarr);
-}
+    dst->words[i] = word1 + word2 + carry;
+    // Update carry
+    carry = WORD_MAX - word1 < word2 || WORD_MAX - word1 - word2 < (word_t)carry;
+  }
 
-// Cycle away from index 0
-void bit_array_cycle_left(BIT_ARRAY* bitarr, bit_index_t cycle_dist)
-{
-  if(bitarr->num_of_bits == 0)
+  if(subtract)
   {
-    return;
+    carry = 0;
   }
+  else
+  {
+    // Check last word
+    word_offset_t bits_on_last_word = bits_in_top_word(dst->num_of_bits);
 
-  cycle_dist = cycle_dist % bitarr->num_of_bits;
+    if(bits_on_last_word < WORD_SIZE)
+    {
+      word_t mask = bitmask64(bits_on_last_word);
 
-  if(cycle_dist == 0)
-  {
-    return;
+      if(dst->words[max_words-1] > mask)
+      {
+        // Array has overflowed, increase size
+        dst->num_of_bits++;
+      }
+    }
+    else if(carry)
+    {
+      // Carry onto a new word
+      if(dst->num_of_words == max_words)
+      {
+        // Need to resize for the carry bit
+        bit_array_resize_critical(dst, dst->num_of_bits+1);
+      }
+
+      dst->words[max_words] = (word_t)1;
+    }
   }
 
-  bit_index_t len1 = bitarr->num_of_bits - cycle_dist;
-  bit_index_t len2 = cycle_dist;
+  // Zero the rest of dst array
+  for(i = max_words+carry; i < dst->num_of_words; i++)
+  {
+    dst->words[i] = (word_t)0;
+  }
 
-  _reverse_region(bitarr, 0, len1);
-  _reverse_region(bitarr, len1, len2);
-  bit_array_reverse(bitarr);
+  DEBUG_VALIDATE(dst);
 }
 
-//
-// Next permutation
-//
-
-static word_t _next_permutation(word_t v)
+// src1, src2 and dst can all be the same BIT_ARRAY
+// If dst is shorter than either of src1, src2, it is enlarged
+void bit_array_add(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
 {
-  assert(v);
-  // From http://graphics.stanford.edu/~seander/bithacks.html#NextBitPermutation
-  word_t t = v | (v - 1); // t gets v's least significant 0 bits set to 1
-  // Next set to 1 the most significant bit to change,
-  // set to 0 the least significant ones, and add the necessary 1 bits.
-  return (t+1) | (((~t & (t+1)) - 1) >> (trailing_zeros(v) + 1));
+  STAT_SCOPE(add, dst, _logic_bytes(src1, src2));
+  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+  _arithmetic(dst, src1, src2, 0);
 }
 
-// Get the next permutation of an array with a fixed size and given number of
-// bits set.  Also known as next lexicographic permutation.
-// Given a bit array find the next lexicographic orginisation of the bits
-// Number of possible combinations given by (size choose bits_set) i.e. nCk
-// 00011 -> 00101 -> 00110 -> 01001 -> 01010 ->
-// 01100 -> 10001 -> 10010 -> 10100 -> 11000 -> 00011 (back to start)
-void bit_array_next_permutation(BIT_ARRAY* bitarr)
+// dst = src1 - src2
+// src1, src2 and dst can all be the same BIT_ARRAY
+// If dst is shorter than src1, it will be extended to be as long as src1
+// src1 must be greater than or equal to src2 (src1 >= src2)
+void bit_array_subtract(BIT_ARRAY* dst,
+                          const BIT_ARRAY* src1, const BIT_ARRAY* src2)
 {
-  if(bitarr->num_of_bits == 0)
-  {
-    return;
-  }
+  // subtraction by method of complements:
+  // a - b = a + ~b + 1 = src1 + ~src2 +1
 
-  word_addr_t w;
+  assert(bit_array_cmp(src1, src2) >= 0); // Require src1 >= src2
 
-  char carry = 0;
-  word_offset_t top_bits = bitset64_idx(bitarr->num_of_bits);
+  bit_array_ensure_size_critical(dst, src1->num_of_bits);
+  _arithmetic(dst, src1, src2, 1);
+}
 
-  for(w = 0; w < bitarr->num_of_words; w++)
-  {
-    word_t mask
-      = (w < bitarr->num_of_words - 1 || top_bits == 0) ? WORD_MAX
-                                                        : bitmask64(top_bits);
 
-    if(bitarr->words[w] > 0 &&
-       (bitarr->words[w] | (bitarr->words[w]-1)) == mask)
-    {
-      // Bits in this word cannot be moved forward
-      carry = 1;
-    }
-    else if(carry)
-    {
-      // 0111 -> 1000, 1000 -> 1001
-      word_t tmp = bitarr->words[w] + 1;
+// Add `add` to `bitarr` at `pos`
+// Bounds checking not needed as out of bounds is valid
+void bit_array_add_word(BIT_ARRAY *bitarr, bit_index_t pos, uint64_t add)
+{
+  DEBUG_VALIDATE(bitarr);
+  _before_write_from(bitarr, bitset64_wrd(pos));
 
-      // Count bits previously set
-      bit_index_t bits_previously_set = POPCOUNT(bitarr->words[w]);
+  if(add == 0)
+  {
+    return;
+  }
+  else if(pos >= bitarr->num_of_bits)
+  {
+    // Resize and add!
+    bit_index_t num_bits_required = pos + (WORD_SIZE - leading_zeros(add));
+    bit_array_resize_critical(bitarr, num_bits_required);
+    _set_word(bitarr, pos, (word_t)add);
+    return;
+  }
 
-      // set new word
-      bitarr->words[w] = tmp;
+  /*
+  char str[1000];
+  printf(" add_word: %s\n", bit_array_to_str_rev(bitarr, str));
+  printf("     word: %s [pos: %i]\n", _word_to_str(add, str), (int)pos);
+  */
 
-      // note: w is unsigned
-      // Zero words while counting bits set
-      while(w > 0)
-      {
-        bits_previously_set += POPCOUNT(bitarr->words[w-1]);
-        bitarr->words[w-1] = 0;
-        w--;
-      }
+  word_t w = _get_word(bitarr, pos);
+  word_t sum = w + add;
+  char carry = WORD_MAX - w < add;
 
-      // Set bits at the beginning
-      SET_REGION(bitarr, 0, bits_previously_set - POPCOUNT(tmp));
+  // Ensure array is big enough
+  bit_index_t num_bits_required = pos + (carry ? WORD_SIZE + 1
+                                               : (WORD_SIZE - leading_zeros(sum)));
 
-      carry = 0;
-      break;
-    }
-    else if(bitarr->words[w] > 0)
-    {
-      bitarr->words[w] = _next_permutation(bitarr->words[w]);
-      break;
-    }
-  }
+  bit_array_ensure_size(bitarr, num_bits_required);
+
+  _set_word(bitarr, pos, sum);
+  pos += WORD_SIZE;
 
   if(carry)
   {
-    // Loop around
-    bit_index_t num_bits_set = bit_array_num_bits_set(bitarr);
-    bit_array_clear_all(bitarr);
-    SET_REGION(bitarr, 0, num_bits_set);
-  }
-
-  DEBUG_VALIDATE(bitarr);
-}
-
+    word_offset_t offset = pos % WORD_SIZE;
+    word_addr_t addr = bitset64_wrd(pos);
 
-//
-// Interleave
-//
+    add = (word_t)0x1 << offset;
+    carry = (WORD_MAX - bitarr->words[addr] < add);
+    sum = bitarr->words[addr] + add;
 
-// dst cannot point to the same bit array as src1 or src2
-// src1, src2 may point to the same bit array
-// abcd 1234 -> a1b2c3d4
-// 0011 0000 -> 00001010
-// 1111 0000 -> 10101010
-// 0101 1010 -> 01100110
-void bit_array_interleave(BIT_ARRAY* dst,
-                          const BIT_ARRAY* src1,
-                          const BIT_ARRAY* src2)
-{
-  // dst cannot be either src1 or src2
-  assert(dst != src1 && dst != src2);
-  // Behaviour undefined when src1 length != src2 length",
-  assert(src1->num_of_bits == src2->num_of_bits);
+    num_bits_required = addr * WORD_SIZE +
+                        (carry ? WORD_SIZE + 1 : (WORD_SIZE - leading_zeros(sum)));
 
-  // Need at least src1->num_of_words + src2->num_of_words
-  size_t nwords = MIN(src1->num_of_words + src2->num_of_words, 2);
-  _bit_array_ensure_nwords(dst, nwords, __FILE__, __LINE__, __func__);
-  dst->num_of_bits = src1->num_of_bits + src2->num_of_bits;
-  dst->num_of_words = roundup_bits2words64(dst->num_of_bits);
+    bit_array_ensure_size(bitarr, num_bits_required);
 
-  word_addr_t i, j;
+    bitarr->words[addr++] = sum;
 
-  for(i = 0, j = 0; i < src1->num_of_words; i++)
-  {
-    word_t a = src1->words[i];
-    word_t b = src2->words[i];
+    if(carry)
+    {
+      while(addr < bitarr->num_of_words && bitarr->words[addr] == WORD_MAX)
+      {
+        bitarr->words[addr++] = 0;
+      }
 
-    dst->words[j++] =  morton_table0[(a      ) & 0xff] |
-                       morton_table1[(b      ) & 0xff] |
-                      (morton_table0[(a >>  8) & 0xff] << 16) |
-                      (morton_table1[(b >>  8) & 0xff] << 16) |
-                      (morton_table0[(a >> 16) & 0xff] << 32) |
-                      (morton_table1[(b >> 16) & 0xff] << 32) |
-                      (morton_table0[(a >> 24) & 0xff] << 48) |
-                      (morton_table1[(b >> 24) & 0xff] << 48);
+      if(addr == bitarr->num_of_words)
+      {
+        bit_array_resize_critical(bitarr, addr * WORD_SIZE + 1);
+      }
+      else if(addr == bitarr->num_of_words-1 &&
+              bitarr->words[addr] == bitmask64(bits_in_top_word(bitarr->num_of_bits)))
+      {
+        bit_array_resize_critical(bitarr, bitarr->num_of_bits + 1);
+      }
 
-    dst->words[j++] =  morton_table0[(a >> 32) & 0xff] |
-                       morton_table1[(b >> 32) & 0xff] |
-                      (morton_table0[(a >> 40) & 0xff] << 16) |
-                      (morton_table1[(b >> 40) & 0xff] << 16) |
-                      (morton_table0[(a >> 48) & 0xff] << 32) |
-                      (morton_table1[(b >> 48) & 0xff] << 32) |
-                      (morton_table0[(a >> 56)       ] << 48) |
-                      (morton_table1[(b >> 56)       ] << 48);
+      bitarr->words[addr]++;
+    }
   }
 
-  DEBUG_VALIDATE(dst);
+  DEBUG_VALIDATE(bitarr);
 }
 
-//
-// Random
-//
-
-// Set bits randomly with probability prob : 0 <= prob <= 1
-void bit_array_random(BIT_ARRAY* bitarr, float prob)
+// Add `add` to `bitarr` at `pos`
+// Bounds checking not needed as out of bounds is valid
+void bit_array_add_words(BIT_ARRAY *bitarr, bit_index_t pos, const BIT_ARRAY *add)
 {
-  assert(prob >= 0 && prob <= 1);
+  assert(bitarr != add); // bitarr and add cannot point to the same bit array
+  _before_write_from(bitarr, bitset64_wrd(pos));
 
-  if(bitarr->num_of_bits == 0)
+  bit_index_t add_top_bit_set;
+
+  if(!bit_array_find_last_set_bit(add, &add_top_bit_set))
   {
+    // No bits set in add
     return;
   }
-  else if(prob == 1)
+  else if(pos >= bitarr->num_of_bits)
   {
-    bit_array_set_all(bitarr);
+    // Just resize and copy!
+    bit_index_t num_bits_required = pos + add_top_bit_set + 1;
+    bit_array_resize_critical(bitarr, num_bits_required);
+    _array_copy(bitarr, pos, add, 0, add->num_of_bits);
+    return;
+  }
+  else if(pos == 0)
+  {
+    bit_array_add(bitarr, bitarr, add);
     return;
   }
 
-  // rand() generates number between 0 and RAND_MAX inclusive
-  // therefore we want to check if rand() <= p
-  long p = RAND_MAX * prob;
+  /*
+  char str[1000];
+  printf(" add_words1: %s\n", bit_array_to_str_rev(bitarr, str));
+  printf(" add_words2: %s\n", bit_array_to_str_rev(add, str));
+  printf(" [pos: %i]\n", (int)pos);
+  */
 
-  _seed_rand();
+  bit_index_t num_bits_required = pos + add_top_bit_set + 1;
+  bit_array_ensure_size(bitarr, num_bits_required);
 
-  word_addr_t w;
-  word_offset_t o;
+  word_addr_t first_word = bitset64_wrd(pos);
+  word_offset_t first_offset = bitset64_idx(pos);
 
-  // Initialise to zero
-  memset(bitarr->words, 0, bitarr->num_of_words * sizeof(word_t));
+  word_t w = add->words[0] << first_offset;
+  unsigned char carry = (WORD_MAX - bitarr->words[first_word] < w);
+
+  bitarr->words[first_word] += w;
 
-  for(w = 0; w < bitarr->num_of_words - 1; w++)
+  word_addr_t i = first_word + 1;
+  bit_index_t offset = WORD_SIZE - first_offset;
+
+  for(; carry || offset <= add_top_bit_set; i++, offset += WORD_SIZE)
   {
-    for(o = 0; o < WORD_SIZE; o++)
+    w = offset < add->num_of_bits ? _get_word(add, offset) : (word_t)0;
+
+    if(i >= bitarr->num_of_words)
     {
-      if(rand() <= p)
-      {
-        bitarr->words[w] |= ((word_t)0x1 << o);
-      }
+      // Extend by a word
+      bit_array_resize_critical(bitarr, (bit_index_t)(i+1)*WORD_SIZE+1);
     }
+
+    word_t prev = bitarr->words[i];
+
+    bitarr->words[i] += w + carry;
+
+    carry = (WORD_MAX - prev < w || (carry && prev + w == WORD_MAX)) ? 1 : 0;
   }
 
-  // Top word
-  word_offset_t bits_in_last_word = bits_in_top_word(bitarr->num_of_bits);
-  w = bitarr->num_of_words - 1;
+  word_offset_t top_bits
+    = WORD_SIZE - leading_zeros(bitarr->words[bitarr->num_of_words-1]);
+
+  bit_index_t min_bits = (bitarr->num_of_words-1)*WORD_SIZE + top_bits;
 
-  for(o = 0; o < bits_in_last_word; o++)
+  if(bitarr->num_of_bits < min_bits)
   {
-    if(rand() <= p)
-    {
-      bitarr->words[w] |= ((word_t)0x1 << o);
-    }
+    // Extend within the last word
+    bitarr->num_of_bits = min_bits;
   }
 
   DEBUG_VALIDATE(bitarr);
 }
 
-// Shuffle the bits in an array randomly
-void bit_array_shuffle(BIT_ARRAY* bitarr)
+char bit_array_sub_word(BIT_ARRAY* bitarr, bit_index_t pos, word_t minus)
 {
-  if(bitarr->num_of_bits == 0)
-    return;
-
-  _seed_rand();
-
-  bit_index_t i, j;
+  DEBUG_VALIDATE(bitarr);
+  _before_write_from(bitarr, bitset64_wrd(pos));
 
-  for(i = bitarr->num_of_bits - 1; i > 0; i--)
+  if(minus == 0)
   {
-    j = (bit_index_t)rand() % i;
-
-    // Swap i and j
-    char x = (bitarr->words[bitset64_wrd(i)] >> bitset64_idx(i)) & 0x1;
-    char y = (bitarr->words[bitset64_wrd(j)] >> bitset64_idx(j)) & 0x1;
-
-    if(!y)
-      bitarr->words[bitset64_wrd(i)] &= ~((word_t)0x1 << bitset64_idx(i));
-    else
-      bitarr->words[bitset64_wrd(i)] |= (word_t)0x1 << bitset64_idx(i);
-
-    if(!x)
-      bitarr->words[bitset64_wrd(j)] &= ~((word_t)0x1 << bitset64_idx(j));
-    else
-      bitarr->words[bitset64_wrd(j)] |= (word_t)0x1 << bitset64_idx(j);
+    return 1;
   }
 
-  DEBUG_VALIDATE(bitarr);
-}
-
-//
-// Arithmetic
-//
+  word_t w = _get_word(bitarr, pos);
 
-// Returns 1 on sucess, 0 if value in array is too big
-char bit_array_as_num(const BIT_ARRAY* bitarr, uint64_t* result)
-{
-  if(bitarr->num_of_bits == 0)
+  if(w >= minus)
   {
-    *result = 0;
+    _set_word(bitarr, pos, w - minus);
+    DEBUG_VALIDATE(bitarr);
     return 1;
   }
 
-  word_addr_t w;
+  minus -= w;
 
-  for(w = bitarr->num_of_words-1; w > 0; w--)
+  bit_index_t offset;
+  for(offset = pos + WORD_SIZE; offset < bitarr->num_of_bits; offset += WORD_SIZE)
   {
-    if(bitarr->words[w] > 0)
+    w = _get_word(bitarr, offset);
+
+    if(w > 0)
     {
-      return 0;
-    }
-  }
+      // deduct one
+      _set_word(bitarr, offset, w - 1);
 
-  *result = bitarr->words[0];
-  return 1;
-}
+      SET_REGION(bitarr, pos, offset-pos);
 
+      // -1 since we've already deducted 1
+      minus--;
 
-// 1 iff bitarr > value
-// 0 iff bitarr == value
-// -1 iff bitarr < value
-int bit_array_cmp_uint64(const BIT_ARRAY* bitarr, uint64_t value)
-{
-  uint64_t arr_num = 0;
+      _set_word(bitarr, pos, WORD_MAX - minus);
 
-  // If cannot put bitarr in uint64, it is > value
-  if(!bit_array_as_num(bitarr, &arr_num)) return 1;
+      DEBUG_VALIDATE(bitarr);
+      return 1;
+    }
+  }
 
-  if(arr_num > value)      return  1;
-  else if(arr_num < value) return -1;
-  else                     return  0;
+  DEBUG_VALIDATE(bitarr);
+
+  return 0;
 }
 
-// If value is zero, no change is made
-void bit_array_add_uint64(BIT_ARRAY* bitarr, uint64_t value)
+char bit_array_sub_words(BIT_ARRAY* bitarr, bit_index_t pos, BIT_ARRAY* minus)
 {
-  if(value == 0)
+  assert(bitarr != minus); // bitarr and minus cannot point to the same bit array
+
+  int cmp = bit_array_cmp_words(bitarr, pos, minus);
+
+  if(cmp == 0)
   {
-    return;
+    bit_array_clear_all(bitarr);
+    return 1;
   }
-  else if(bitarr->num_of_bits == 0)
+  else if(cmp < 0)
   {
-    bit_array_resize_critical(bitarr, WORD_SIZE - leading_zeros(value));
-    bitarr->words[0] = (word_t)value;
-    return;
+    return 0;
   }
 
-  char carry = 0;
-  word_addr_t i;
+  bit_index_t bitarr_length = bitarr->num_of_bits;
 
-  for(i = 0; i < bitarr->num_of_words; i++)
-  {
-    if(WORD_MAX - bitarr->words[i] < value)
-    {
-      carry = 1;
-      bitarr->words[i] += value;
-      value = 1;
-    }
-    else
-    {
-      // Carry is absorbed
-      bitarr->words[i] += value;
-      carry = 0;
-      break;
-    }
-  }
+  bit_index_t bitarr_top_bit_set;
+  bit_array_find_last_set_bit(bitarr, &bitarr_top_bit_set);
 
-  if(carry)
-  {
-    // Bit array full, need another bit after all words filled
-    bit_array_resize_critical(bitarr, bitarr->num_of_words * WORD_SIZE + 1);
+  // subtraction by method of complements:
+  // a - b = a + ~b + 1 = src1 + ~src2 +1
 
-    // Set top word to 1
-    bitarr->words[bitarr->num_of_words-1] = 1;
-  }
-  else
-  {
-    word_t final_word = bitarr->words[bitarr->num_of_words-1];
-    word_offset_t expected_bits = bits_in_top_word(bitarr->num_of_bits);
-    word_offset_t actual_bits = WORD_SIZE - leading_zeros(final_word);
+  bit_array_not(minus, minus);
+
+  bit_array_add_words(bitarr, pos, minus);
+  bit_array_add_word(bitarr, pos, (word_t)1);
+
+  bit_array_sub_word(bitarr, pos+minus->num_of_bits, 1);
+  bit_array_resize(bitarr, bitarr_length);
 
-    if(actual_bits > expected_bits)
-    {
-      // num_of_bits has increased -- num_of_words has not
-      bitarr->num_of_bits += (actual_bits - expected_bits);
-    }
-  }
+  bit_array_not(minus, minus);
+
+  DEBUG_VALIDATE(bitarr);
+
+  return 1;
 }
 
-// If value is greater than bitarr, bitarr is not changed and 0 is returned
-// Returns 1 on success, 0 if value > bitarr
-char bit_array_sub_uint64(BIT_ARRAY* bitarr, uint64_t value)
+void bit_array_mul_uint64(BIT_ARRAY *bitarr, uint64_t multiplier)
 {
-  if(value == 0)
+  if(bitarr->num_of_bits == 0 || multiplier == 1)
   {
-    return 1;
+    return;
   }
-  else if(bitarr->words[0] >= value)
+  else if(multiplier == 0)
   {
-    bitarr->words[0] -= value;
-    return 1;
+    bit_array_clear_all(bitarr);
+    return;
   }
 
-  value -= bitarr->words[0];
+  word_addr_t i, n = _num_used_words(bitarr);
+  word_t carry = 0, hi, lo;
 
-  word_addr_t i;
+  _before_write_all(bitarr);
 
-  for(i = 1; i < bitarr->num_of_words; i++)
+  for(i = 0; i < n; i++)
   {
-    if(bitarr->words[i] > 0)
-    {
-      // deduct one
-      bitarr->words[i]--;
+    lo = _mul_word(bitarr->words[i], multiplier, &hi);
+    lo += carry;
+    bitarr->words[i] = lo;
+    carry = hi + (lo < carry);
+  }
 
-      for(; i > 0; i--)
-      {
-        bitarr->words[i] = WORD_MAX;
-      }
+  // The product may use bits above the current length
+  bit_index_t top_bits = 0;
 
-      // -1 since we've already deducted 1
-      bitarr->words[0] = WORD_MAX - value - 1;
+  if(carry) top_bits = (bit_index_t)(n+1) * WORD_SIZE - leading_zeros(carry);
+  else if(n > 0) top_bits = (bit_index_t)n * WORD_SIZE - leading_zeros(bitarr->words[n-1]);
 
-      return 1;
-    }
-  }
+  if(top_bits > bitarr->num_of_bits) bit_array_resize_critical(bitarr, top_bits);
+  if(carry) bitarr->words[n] = carry;
 
-  // subtract value is greater than array
-  return 0;
+  DEBUG_VALIDATE(bitarr);
 }
 
-//
-// Arithmetic between bit arrays
-//
-
-// src1, src2 and dst can all be the same BIT_ARRAY
-static void _arithmetic(BIT_ARRAY* dst,
-                        const BIT_ARRAY* src1,
-                        const BIT_ARRAY* src2,
-                        char subtract)
+void bit_array_multiply(BIT_ARRAY *dst, BIT_ARRAY *src1, BIT_ARRAY *src2)
 {
-  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
-
-  // Adding: dst_words >= max(src1 words, src2 words)
-  // Subtracting: dst_words is >= src1->num_of_words
-
-  char carry = subtract ? 1 : 0;
+  // Cannot pass the same array as dst, src1 AND src2
+  assert(dst != src1 || dst != src2);
 
-  word_addr_t i;
-  word_t word1, word2;
+  word_addr_t n1 = _num_used_words(src1), n2 = _num_used_words(src2);
 
-  for(i = 0; i < max_words; i++)
+  if(n1 == 0 || n2 == 0)
   {
-    word1 = (i < src1->num_of_words ? src1->words[i] : 0);
-    word2 = (i < src2->num_of_words ? src2->words[i] : 0);
-
-    if(subtract)
-      word2 = ~word2;
-
-    dst->words[i] = word1 + word2 + carry;
-    // Update carry
-    carry = WORD_MAX - word1 < word2 || WORD_MAX - word1 - word2 < (word_t)carry;
+    bit_array_clear_all(dst);
+    return;
   }
 
-  if(subtract)
-  {
-    carry = 0;
-  }
-  else
-  {
-    // Check last word
-    word_offset_t bits_on_last_word = bits_in_top_word(dst->num_of_bits);
+  // dst may be src1 or src2, so work in a separate buffer
+  word_addr_t nwords = n1 + n2;
+  word_t *product = _alloc_words(nwords, __func__);
 
-    if(bits_on_last_word < WORD_SIZE)
-    {
-      word_t mask = bitmask64(bits_on_last_word);
+  _words_mul(product, src1->words, n1, src2->words, n2);
 
-      if(dst->words[max_words-1] > mask)
-      {
-        // Array has overflowed, increase size
-        dst->num_of_bits++;
-      }
-    }
-    else if(carry)
-    {
-      // Carry onto a new word
-      if(dst->num_of_words == max_words)
-      {
-        // Need to resize for the carry bit
-        bit_array_resize_critical(dst, dst->num_of_bits+1);
-      }
+  while(product[nwords-1] == 0) nwords--;
+  bit_index_t top_bits = (bit_index_t)nwords * WORD_SIZE
+                         - leading_zeros(product[nwords-1]);
 
-      dst->words[max_words] = (word_t)1;
-    }
-  }
+  // dst keeps its length unless it needs to grow to hold the product
+  if(top_bits > dst->num_of_bits) bit_array_resize_critical(dst, top_bits);
+  _before_write(dst, 0, dst->num_of_words);
 
-  // Zero the rest of dst array
-  for(i = max_words+carry; i < dst->num_of_words; i++)
-  {
-    dst->words[i] = (word_t)0;
-  }
+  memcpy(dst->words, product, nwords * sizeof(word_t));
+  memset(dst->words + nwords, 0, (dst->num_of_words - nwords) * sizeof(word_t));
+
+  free(product);
 
   DEBUG_VALIDATE(dst);
 }
 
-// src1, src2 and dst can all be the same BIT_ARRAY
-// If dst is shorter than either of src1, src2, it is enlarged
-void bit_array_add(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+// bitarr = round_down(bitarr / divisor)
+// rem = bitarr % divisor
+void bit_array_div_uint64(BIT_ARRAY *bitarr, uint64_t divisor, uint64_t *rem)
 {
-  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
-  _arithmetic(dst, src1, src2, 0);
+  assert(divisor != 0); // cannot divide by zero
+  _before_write_all(bitarr);
+
+  *rem = _words_div_word(bitarr->words, bitarr->words,
+                         _num_used_words(bitarr), divisor);
+
+  DEBUG_VALIDATE(bitarr);
 }
 
-// dst = src1 - src2
-// src1, src2 and dst can all be the same BIT_ARRAY
-// If dst is shorter than src1, it will be extended to be as long as src1
-// src1 must be greater than or equal to src2 (src1 >= src2)
-void bit_array_subtract(BIT_ARRAY* dst,
-                          const BIT_ARRAY* src1, const BIT_ARRAY* src2)
+// Results in:
+//   quotient = dividend / divisor
+//   dividend = dividend % divisor
+// (dividend is used to return the remainder)
+void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divisor)
 {
-  // subtraction by method of complements:
-  // a - b = a + ~b + 1 = src1 + ~src2 +1
+  word_addr_t nu = _num_used_words(dividend), nv = _num_used_words(divisor);
 
-  assert(bit_array_cmp(src1, src2) >= 0); // Require src1 >= src2
+  assert(nv > 0); // Cannot divide by zero
+  assert(quotient != dividend && quotient != divisor);
 
-  bit_array_ensure_size_critical(dst, src1->num_of_bits);
-  _arithmetic(dst, src1, src2, 1);
+  bit_array_clear_all(quotient);
+
+  if(_words_cmp(dividend->words, nu, divisor->words, nv) < 0)
+  {
+    // dividend is < divisor, quotient is zero -- done
+    return;
+  }
+
+  // Word level long division, the remainder is at most nv words
+  word_addr_t nq = nu - nv + 1;
+  word_t *q = _alloc_words(nq + nv, __func__), *r = q + nq;
+
+  _words_divmod(q, r, dividend->words, nu, divisor->words, nv);
+
+  // quotient keeps its length unless it needs to grow to hold the result
+  _words_trim(q, &nq);
+  bit_index_t top_bits = (bit_index_t)nq * WORD_SIZE - leading_zeros(q[nq-1]);
+  if(top_bits > quotient->num_of_bits) bit_array_resize_critical(quotient, top_bits);
+  _before_write(quotient, 0, nq);
+  _before_write(dividend, 0, nu);
+  memcpy(quotient->words, q, nq * sizeof(word_t));
+
+  memcpy(dividend->words, r, nv * sizeof(word_t));
+  memset(dividend->words + nv, 0, (nu - nv) * sizeof(word_t));
+
+  free(q);
+
+  DEBUG_VALIDATE(quotient);
+  DEBUG_VALIDATE(dividend);
 }
 
+//
+// Read/Write from files
+//
+// file format is [8 bytes: for number of elements in array][data]
+// data is written in little endian order (least sig byte first)
+//
 
-// Add `add` to `bitarr` at `pos`
-// Bounds checking not needed as out of bounds is valid
-void bit_array_add_word(BIT_ARRAY *bitarr, bit_index_t pos, uint64_t add)
+// Saves bit array to a file. Returns the number of bytes written
+// number of bytes returned should be 8+(bitarr->num_of_bits+7)/8
+bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f)
 {
-  DEBUG_VALIDATE(bitarr);
+  STAT_SCOPE(save, bitarr, roundup_bits2bytes(bitarr->num_of_bits));
+  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
+  bit_index_t bytes_written = 0;
 
-  if(add == 0)
+  const int endian = 1;
+  if(*(uint8_t*)&endian == 1)
   {
-    return;
+    // Little endian machine
+    // Write 8 bytes to store the number of bits in the array
+    bytes_written += fwrite(&bitarr->num_of_bits, 1, 8, f);
+
+    // Write the array
+    bytes_written += fwrite(bitarr->words, 1, num_of_bytes, f);
   }
-  else if(pos >= bitarr->num_of_bits)
+  else
   {
-    // Resize and add!
-    bit_index_t num_bits_required = pos + (WORD_SIZE - leading_zeros(add));
-    bit_array_resize_critical(bitarr, num_bits_required);
-    _set_word(bitarr, pos, (word_t)add);
-    return;
+    // Big endian machine
+    uint64_t i, w, whole_words = num_of_bytes/sizeof(word_t);
+    uint64_t rem_bytes = num_of_bytes - whole_words*sizeof(word_t);
+    uint64_t n_bits = byteswap64(bitarr->num_of_bits);
+
+    // Write 8 bytes to store the number of bits in the array
+    bytes_written += fwrite(&n_bits, 1, 8, f);
+
+    // Write the array
+    for(i = 0; i < whole_words; i++) {
+      w = byteswap64(bitarr->words[i]);
+      bytes_written += fwrite(&w, 1, 8, f);
+    }
+
+    if(rem_bytes > 0) {
+      w = byteswap64(bitarr->words[whole_words]);
+      bytes_written += fwrite(&w, 1, rem_bytes, f);
+    }
   }
 
-  /*
-  char str[1000];
-  printf(" add_word: %s\n", bit_array_to_str_rev(bitarr, str));
-  printf("     word: %s [pos: %i]\n", _word_to_str(add, str), (int)pos);
-  */
+  return bytes_written;
+}
 
-  word_t w = _get_word(bitarr, pos);
-  word_t sum = w + add;
-  char carry = WORD_MAX - w < add;
+// Load a uint64 from little endian format.
+// Works for both big and little endian architectures
+static inline uint64_t le64_to_cpu(const uint8_t *x)
+{
+  return (((uint64_t)(x[0]))       | ((uint64_t)(x[1]) << 8)  |
+          ((uint64_t)(x[2]) << 16) | ((uint64_t)(x[3]) << 24) |
+          ((uint64_t)(x[4]) << 32) | ((uint64_t)(x[5]) << 40) |
+          ((uint64_t)(x[6]) << 48) | ((uint64_t)(x[7]) << 56));
+}
 
-  // Ensure array is big enough
-  bit_index_t num_bits_required = pos + (carry ? WORD_SIZE + 1
-                                               : (WORD_SIZE - leading_zeros(sum)));
+static char _load_aligned(BIT_ARRAY* bitarr, FILE* f);
+static char _load_compressed(BIT_ARRAY* bitarr, FILE* f);
 
-  bit_array_ensure_size(bitarr, num_bits_required);
+#define ALIGNED_MAGIC "BITARRAY"
+#define COMPRESSED_MAGIC "BITARRCZ"
 
-  _set_word(bitarr, pos, sum);
-  pos += WORD_SIZE;
+// Reads bit array from a file. bitarr is resized and filled.
+// Also reads files written by bit_array_save_aligned() and
+// bit_array_save_compressed().
+// Returns 1 on success, 0 on failure
+char bit_array_load(BIT_ARRAY* bitarr, FILE* f)
+{
+  STAT_SCOPE(load, bitarr, 0);
+  // Read in number of bits, return 0 if we can't read in
+  bit_index_t num_bits;
+  if(fread(&num_bits, 1, 8, f) != 8) return 0;
 
-  if(carry)
-  {
-    word_offset_t offset = pos % WORD_SIZE;
-    word_addr_t addr = bitset64_wrd(pos);
+  _before_write_all(bitarr);
 
-    add = (word_t)0x1 << offset;
-    carry = (WORD_MAX - bitarr->words[addr] < add);
-    sum = bitarr->words[addr] + add;
+  // File written by bit_array_save_aligned()
+  if(memcmp(&num_bits, ALIGNED_MAGIC, 8) == 0) return _load_aligned(bitarr, f);
+
+  // File written by bit_array_save_compressed()
+  if(memcmp(&num_bits, COMPRESSED_MAGIC, 8) == 0) return _load_compressed(bitarr, f);
+
+  num_bits = le64_to_cpu((uint8_t*)&num_bits);
+
+  // Resize
+  bit_array_resize_critical(bitarr, num_bits);
+
+  // Have to calculate how many bytes are needed for the file
+  // (Note: this may be different from num_of_words * sizeof(word_t))
+  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
+  STAT_BYTES(num_of_bytes);
+  if(fread(bitarr->words, 1, num_of_bytes, f) != num_of_bytes) return 0;
+
+  // Fix endianness
+  word_addr_t i;
+  for(i = 0; i < bitarr->num_of_words; i++)
+    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
 
-    num_bits_required = addr * WORD_SIZE +
-                        (carry ? WORD_SIZE + 1 : (WORD_SIZE - leading_zeros(sum)));
+  // Mask top word
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
+}
 
-    bit_array_ensure_size(bitarr, num_bits_required);
+//
+// Aligned file format, can be memory mapped
+//
+// [64 bytes: header][num_of_words x 8 bytes: data]
+// header is:
+//   [8 bytes: "BITARRAY"][4 bytes: version][4 bytes: header size]
+//   [8 bytes: number of bits][8 bytes: number of words][32 bytes: zero]
+// All values are little endian. The header size is a multiple of 64 so the
+// data is 64 byte aligned in the file (and in memory when mapped).
+//
 
-    bitarr->words[addr++] = sum;
+#define ALIGNED_VERSION 1
+#define ALIGNED_HDR_SIZE 64
 
-    if(carry)
-    {
-      while(addr < bitarr->num_of_words && bitarr->words[addr] == WORD_MAX)
-      {
-        bitarr->words[addr++] = 0;
-      }
+// Store a uint64 in little endian format
+static inline void cpu_to_le64(uint8_t *x, uint64_t v)
+{
+  int i;
+  for(i = 0; i < 8; i++) x[i] = (uint8_t)(v >> (8*i));
+}
 
-      if(addr == bitarr->num_of_words)
-      {
-        bit_array_resize_critical(bitarr, addr * WORD_SIZE + 1);
-      }
-      else if(addr == bitarr->num_of_words-1 &&
-              bitarr->words[addr] == bitmask64(bits_in_top_word(bitarr->num_of_bits)))
-      {
-        bit_array_resize_critical(bitarr, bitarr->num_of_bits + 1);
-      }
+// Check a header, get number of bits and header size
+// Returns 1 if valid, 0 otherwise
+static char _aligned_header_parse(const uint8_t *hdr, bit_index_t *num_bits,
+                                  uint64_t *hdr_size)
+{
+  if(memcmp(hdr, ALIGNED_MAGIC, 8) != 0 ||
+     le32_to_cpu(hdr+8) != ALIGNED_VERSION) return 0;
 
-      bitarr->words[addr]++;
-    }
-  }
+  *hdr_size = le32_to_cpu(hdr+12);
+  *num_bits = le64_to_cpu(hdr+16);
 
-  DEBUG_VALIDATE(bitarr);
+  return *hdr_size >= ALIGNED_HDR_SIZE && *hdr_size % ALIGNED_HDR_SIZE == 0 &&
+         le64_to_cpu(hdr+24) == roundup_bits2words64(*num_bits);
 }
 
-// Add `add` to `bitarr` at `pos`
-// Bounds checking not needed as out of bounds is valid
-void bit_array_add_words(BIT_ARRAY *bitarr, bit_index_t pos, const BIT_ARRAY *add)
+// Saves bit array in the aligned format. Returns the number of bytes written
+// number of bytes returned should be 64+8*bitarr->num_of_words
+bit_index_t bit_array_save_aligned(const BIT_ARRAY* bitarr, FILE* f)
 {
-  assert(bitarr != add); // bitarr and add cannot point to the same bit array
+  uint8_t hdr[ALIGNED_HDR_SIZE];
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, ALIGNED_MAGIC, 8);
+  hdr[8] = ALIGNED_VERSION;
+  hdr[12] = ALIGNED_HDR_SIZE;
+  cpu_to_le64(hdr+16, bitarr->num_of_bits);
+  cpu_to_le64(hdr+24, bitarr->num_of_words);
 
-  bit_index_t add_top_bit_set;
+  bit_index_t bytes_written = fwrite(hdr, 1, sizeof(hdr), f);
 
-  if(!bit_array_find_last_set_bit(add, &add_top_bit_set))
-  {
-    // No bits set in add
-    return;
-  }
-  else if(pos >= bitarr->num_of_bits)
+  const int endian = 1;
+  if(*(uint8_t*)&endian == 1)
   {
-    // Just resize and copy!
-    bit_index_t num_bits_required = pos + add_top_bit_set + 1;
-    bit_array_resize_critical(bitarr, num_bits_required);
-    _array_copy(bitarr, pos, add, 0, add->num_of_bits);
-    return;
+    // Little endian machine
+    bytes_written += fwrite(bitarr->words, 1, bitarr->num_of_words * 8, f);
   }
-  else if(pos == 0)
+  else
   {
-    bit_array_add(bitarr, bitarr, add);
-    return;
+    // Big endian machine
+    word_addr_t i;
+    word_t w;
+    for(i = 0; i < bitarr->num_of_words; i++) {
+      w = byteswap64(bitarr->words[i]);
+      bytes_written += fwrite(&w, 1, 8, f);
+    }
   }
 
-  /*
-  char str[1000];
-  printf(" add_words1: %s\n", bit_array_to_str_rev(bitarr, str));
-  printf(" add_words2: %s\n", bit_array_to_str_rev(add, str));
-  printf(" [pos: %i]\n", (int)pos);
-  */
+  return bytes_written;
+}
 
-  bit_index_t num_bits_required = pos + add_top_bit_set + 1;
-  bit_array_ensure_size(bitarr, num_bits_required);
+// Read the rest of an aligned file, after the 8 byte magic
+static char _load_aligned(BIT_ARRAY* bitarr, FILE* f)
+{
+  uint8_t hdr[ALIGNED_HDR_SIZE];
+  bit_index_t num_bits;
+  uint64_t hdr_size, skip;
 
-  word_addr_t first_word = bitset64_wrd(pos);
-  word_offset_t first_offset = bitset64_idx(pos);
+  memcpy(hdr, ALIGNED_MAGIC, 8);
+  if(fread(hdr+8, 1, ALIGNED_HDR_SIZE-8, f) != ALIGNED_HDR_SIZE-8 ||
+     !_aligned_header_parse(hdr, &num_bits, &hdr_size)) return 0;
 
-  word_t w = add->words[0] << first_offset;
-  unsigned char carry = (WORD_MAX - bitarr->words[first_word] < w);
+  // Skip padding from larger headers (future versions)
+  for(skip = hdr_size - ALIGNED_HDR_SIZE; skip > 0; skip -= MIN(skip, sizeof(hdr)))
+    if(fread(hdr, 1, MIN(skip, sizeof(hdr)), f) != MIN(skip, sizeof(hdr))) return 0;
 
-  bitarr->words[first_word] += w;
+  bit_array_resize_critical(bitarr, num_bits);
 
-  word_addr_t i = first_word + 1;
-  bit_index_t offset = WORD_SIZE - first_offset;
+  if(fread(bitarr->words, 1, bitarr->num_of_words * 8, f) != bitarr->num_of_words * 8)
+    return 0;
 
-  for(; carry || offset <= add_top_bit_set; i++, offset += WORD_SIZE)
-  {
-    w = offset < add->num_of_bits ? _get_word(add, offset) : (word_t)0;
+  word_addr_t i;
+  for(i = 0; i < bitarr->num_of_words; i++)
+    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
 
-    if(i >= bitarr->num_of_words)
-    {
-      // Extend by a word
-      bit_array_resize_critical(bitarr, (bit_index_t)(i+1)*WORD_SIZE+1);
-    }
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
+}
 
-    word_t prev = bitarr->words[i];
+//
+// Compressed file format
+//
+// [64 bytes: header][(num_blocks+1) x 8 bytes: block index][blocks]
+// header is:
+//   [8 bytes: "BITARRCZ"][4 bytes: version][4 bytes: header size]
+//   [8 bytes: number of bits][8 bytes: number of words]
+//   [4 bytes: words per block][4 bytes: block encoding]
+//   [8 bytes: number of blocks][16 bytes: zero]
+// index[b] is the byte offset of block b from the end of the index, and
+// index[num_blocks] is the total size of the blocks. All values little endian.
+//
+// Each block of words is coded separately so word ranges can be read without
+// decoding the whole file. The only encoding so far is word aligned run
+// length coding (EWAH): a marker word
+//   [bit 0: fill bit][bits 1-32: number of fill words][bits 33-63: literals]
+// followed by that many literal words. Fill words are all 0s or all 1s.
+//
 
-    bitarr->words[i] += w + carry;
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_HDR_SIZE 64
+#define COMPRESSED_BLOCK_WORDS 4096
+#define COMPRESSED_MAX_BLOCK_WORDS (1UL<<24)
+#define COMPRESSED_EWAH 1
 
-    carry = (WORD_MAX - prev < w || (carry && prev + w == WORD_MAX)) ? 1 : 0;
-  }
+// Code n words into out (if not NULL). Returns number of words of output,
+// at most n+1
+static size_t _ewah_encode(const word_t *words, word_addr_t n, word_t *out)
+{
+  word_addr_t i = 0, run, lits;
+  size_t len = 0;
+  word_t fill;
 
-  word_offset_t top_bits
-    = WORD_SIZE - leading_zeros(bitarr->words[bitarr->num_of_words-1]);
+  while(i < n)
+  {
+    fill = words[i] == WORD_MAX ? WORD_MAX : 0;
+    for(run = 0; i < n && words[i] == fill; run++, i++) {}
+    for(lits = 0; i+lits < n && words[i+lits] != 0 && words[i+lits] != WORD_MAX;
+        lits++) {}
 
-  bit_index_t min_bits = (bitarr->num_of_words-1)*WORD_SIZE + top_bits;
+    if(out != NULL) {
+      out[len] = (fill & 1) | (run << 1) | (lits << 33);
+      memcpy(out+len+1, words+i, lits * sizeof(word_t));
+    }
 
-  if(bitarr->num_of_bits < min_bits)
-  {
-    // Extend within the last word
-    bitarr->num_of_bits = min_bits;
+    len += 1 + lits;
+    i += lits;
   }
 
-  DEBUG_VALIDATE(bitarr);
+  return len;
 }
 
-char bit_array_sub_word(BIT_ARRAY* bitarr, bit_index_t pos, word_t minus)
+// Returns 1 if in[0..n_in) decodes to exactly n words, 0 otherwise
+static char _ewah_decode(const word_t *in, size_t n_in, word_t *out,
+                         word_addr_t n)
 {
-  DEBUG_VALIDATE(bitarr);
+  size_t i = 0;
+  word_addr_t o = 0, run, lits;
 
-  if(minus == 0)
+  while(i < n_in)
   {
-    return 1;
+    run = (in[i] >> 1) & 0xffffffff;
+    lits = in[i] >> 33;
+    if(run > n - o || lits > n - o - run || lits > n_in - i - 1) return 0;
+
+    memset(out+o, (in[i] & 1) ? 0xff : 0, run * sizeof(word_t));
+    memcpy(out+o+run, in+i+1, lits * sizeof(word_t));
+    o += run + lits;
+    i += 1 + lits;
   }
 
-  word_t w = _get_word(bitarr, pos);
+  return o == n;
+}
 
-  if(w >= minus)
-  {
-    _set_word(bitarr, pos, w - minus);
-    DEBUG_VALIDATE(bitarr);
-    return 1;
-  }
+// Convert words between little endian and cpu, in place
+static inline void _words_le_swap(word_t *words, size_t n)
+{
+  const int endian = 1;
+  size_t i;
+  if(*(uint8_t*)&endian != 1)
+    for(i = 0; i < n; i++) words[i] = byteswap64(words[i]);
+}
 
-  minus -= w;
+// Saves bit array in the compressed format
+// Returns the number of bytes written
+bit_index_t bit_array_save_compressed(const BIT_ARRAY* bitarr, FILE* f)
+{
+  word_addr_t nwords = bitarr->num_of_words, b;
+  word_addr_t nblocks = (nwords + COMPRESSED_BLOCK_WORDS - 1) / COMPRESSED_BLOCK_WORDS;
+  word_addr_t start, len;
 
-  bit_index_t offset;
-  for(offset = pos + WORD_SIZE; offset < bitarr->num_of_bits; offset += WORD_SIZE)
-  {
-    w = _get_word(bitarr, offset);
+  uint64_t *index = (uint64_t*)malloc((nblocks+1) * sizeof(uint64_t));
+  word_t *buf = (word_t*)malloc((COMPRESSED_BLOCK_WORDS+1) * sizeof(word_t));
 
-    if(w > 0)
-    {
-      // deduct one
-      _set_word(bitarr, offset, w - 1);
+  if(index == NULL || buf == NULL) {
+    fprintf(stderr, "[%s:%i] Error: Out of memory\n", __FILE__, __LINE__);
+    abort();
+  }
 
-      SET_REGION(bitarr, pos, offset-pos);
+  // First pass just sizes the blocks, so the index can go before them
+  index[0] = 0;
+  for(b = 0; b < nblocks; b++) {
+    start = b * COMPRESSED_BLOCK_WORDS;
+    len = MIN(COMPRESSED_BLOCK_WORDS, nwords - start);
+    index[b+1] = index[b] + 8 * _ewah_encode(bitarr->words + start, len, NULL);
+  }
 
-      // -1 since we've already deducted 1
-      minus--;
+  uint8_t hdr[COMPRESSED_HDR_SIZE];
+  memset(hdr, 0, sizeof(hdr));
+  memcpy(hdr, COMPRESSED_MAGIC, 8);
+  hdr[8] = COMPRESSED_VERSION;
+  hdr[12] = COMPRESSED_HDR_SIZE;
+  cpu_to_le64(hdr+16, bitarr->num_of_bits);
+  cpu_to_le64(hdr+24, nwords);
+  cpu_to_le64(hdr+32, COMPRESSED_BLOCK_WORDS | ((uint64_t)COMPRESSED_EWAH << 32));
+  cpu_to_le64(hdr+40, nblocks);
 
-      _set_word(bitarr, pos, WORD_MAX - minus);
+  bit_index_t bytes_written = fwrite(hdr, 1, sizeof(hdr), f);
 
-      DEBUG_VALIDATE(bitarr);
-      return 1;
-    }
-  }
+  _words_le_swap(index, nblocks+1);
+  bytes_written += fwrite(index, 1, (nblocks+1) * sizeof(uint64_t), f);
 
-  DEBUG_VALIDATE(bitarr);
+  for(b = 0; b < nblocks; b++) {
+    start = b * COMPRESSED_BLOCK_WORDS;
+    len = _ewah_encode(bitarr->words + start,
+                       MIN(COMPRESSED_BLOCK_WORDS, nwords - start), buf);
+    _words_le_swap(buf, len);
+    bytes_written += fwrite(buf, 1, len * sizeof(word_t), f);
+  }
 
-  return 0;
+  free(index);
+  free(buf);
+  return bytes_written;
 }
 
-char bit_array_sub_words(BIT_ARRAY* bitarr, bit_index_t pos, BIT_ARRAY* minus)
+typedef struct
 {
-  assert(bitarr != minus); // bitarr and minus cannot point to the same bit array
+  bit_index_t num_bits;
+  word_addr_t num_words, num_blocks;
+  uint64_t hdr_size;
+  uint32_t block_words;
+} CompressedHeader;
+
+// Read the rest of the header after the 8 byte magic and check it
+// Returns 1 if valid, 0 otherwise
+static char _compressed_header_read(CompressedHeader *ch, FILE* f)
+{
+  uint8_t hdr[COMPRESSED_HDR_SIZE];
+  uint64_t skip;
+
+  if(fread(hdr+8, 1, COMPRESSED_HDR_SIZE-8, f) != COMPRESSED_HDR_SIZE-8 ||
+     le32_to_cpu(hdr+8) != COMPRESSED_VERSION ||
+     le32_to_cpu(hdr+36) != COMPRESSED_EWAH) return 0;
+
+  ch->hdr_size = le32_to_cpu(hdr+12);
+  ch->num_bits = le64_to_cpu(hdr+16);
+  ch->num_words = le64_to_cpu(hdr+24);
+  ch->block_words = le32_to_cpu(hdr+32);
+  ch->num_blocks = le64_to_cpu(hdr+40);
+
+  if(ch->hdr_size < COMPRESSED_HDR_SIZE ||
+     ch->num_words != roundup_bits2words64(ch->num_bits) ||
+     ch->block_words == 0 || ch->block_words > COMPRESSED_MAX_BLOCK_WORDS ||
+     ch->num_blocks != (ch->num_words + ch->block_words - 1) / ch->block_words)
+    return 0;
 
-  int cmp = bit_array_cmp_words(bitarr, pos, minus);
+  // Skip padding from larger headers (future versions)
+  for(skip = ch->hdr_size - COMPRESSED_HDR_SIZE; skip > 0; skip -= MIN(skip, sizeof(hdr)))
+    if(fread(hdr, 1, MIN(skip, sizeof(hdr)), f) != MIN(skip, sizeof(hdr))) return 0;
 
-  if(cmp == 0)
-  {
-    bit_array_clear_all(bitarr);
-    return 1;
-  }
-  else if(cmp < 0)
-  {
-    return 0;
-  }
+  return 1;
+}
 
-  bit_index_t bitarr_length = bitarr->num_of_bits;
+// Read and decode block b, of size bytes, into out
+// buf must have space for block_words+1 words
+static char _compressed_block_read(const CompressedHeader *ch, word_addr_t b,
+                                   uint64_t size, word_t *buf, word_t *out,
+                                   FILE* f)
+{
+  word_addr_t nwords = MIN(ch->block_words, ch->num_words - b * ch->block_words);
 
-  bit_index_t bitarr_top_bit_set;
-  bit_array_find_last_set_bit(bitarr, &bitarr_top_bit_set);
+  if(size % 8 != 0 || size > (uint64_t)(ch->block_words+1) * 8 ||
+     fread(buf, 1, size, f) != size) return 0;
 
-  // subtraction by method of complements:
-  // a - b = a + ~b + 1 = src1 + ~src2 +1
+  _words_le_swap(buf, size / 8);
+  return _ewah_decode(buf, size / 8, out, nwords);
+}
 
-  bit_array_not(minus, minus);
+// Read the rest of a compressed file, after the 8 byte magic
+static char _load_compressed(BIT_ARRAY* bitarr, FILE* f)
+{
+  CompressedHeader ch;
+  if(!_compressed_header_read(&ch, f)) return 0;
 
-  bit_array_add_words(bitarr, pos, minus);
-  bit_array_add_word(bitarr, pos, (word_t)1);
+  uint64_t *index = (uint64_t*)malloc((ch.num_blocks+1) * sizeof(uint64_t));
+  word_t *buf = (word_t*)malloc((ch.block_words+1) * sizeof(word_t));
+  char success = 0;
+  word_addr_t b;
 
-  bit_array_sub_word(bitarr, pos+minus->num_of_bits, 1);
-  bit_array_resize(bitarr, bitarr_length);
+  if(index == NULL || buf == NULL) {
+    fprintf(stderr, "[%s:%i] Error: Out of memory\n", __FILE__, __LINE__);
+    abort();
+  }
 
-  bit_array_not(minus, minus);
+  if(fread(index, sizeof(uint64_t), ch.num_blocks+1, f) == ch.num_blocks+1)
+  {
+    _words_le_swap(index, ch.num_blocks+1);
+    bit_array_resize_critical(bitarr, ch.num_bits);
+
+    for(b = 0; b < ch.num_blocks; b++) {
+      if(index[b+1] < index[b] ||
+         !_compressed_block_read(&ch, b, index[b+1] - index[b], buf,
+                                 bitarr->words + b * ch.block_words, f)) break;
+    }
 
+    success = (b == ch.num_blocks);
+    _mask_top_word(bitarr);
+  }
+
+  free(index);
+  free(buf);
   DEBUG_VALIDATE(bitarr);
+  return success;
+}
 
-  return 1;
+#if defined(_WIN32)
+  #define fseeko _fseeki64
+  #define ftello _ftelli64
+#endif
+
+// Clip a word range to an array of num_bits and resize bitarr to hold it
+// Returns number of words in the range
+static word_addr_t _range_resize(BIT_ARRAY* bitarr, bit_index_t num_bits,
+                                 word_addr_t first_word, word_addr_t num_words)
+{
+  word_addr_t nwords = roundup_bits2words64(num_bits);
+  if(first_word >= nwords) num_words = 0;
+  else num_words = MIN(num_words, nwords - first_word);
+
+  bit_array_resize_critical(bitarr, num_words == 0 ? 0 :
+                            MIN(num_words * 64, num_bits - first_word * 64));
+  return num_words;
 }
 
-void bit_array_mul_uint64(BIT_ARRAY *bitarr, uint64_t multiplier)
+// Read words [first_word, first_word+num_words) of a compressed file, with
+// f just after the magic. start is the offset of the start of the file
+static char _load_range_compressed(BIT_ARRAY* bitarr, FILE* f, int64_t start,
+                                   word_addr_t first_word, word_addr_t num_words)
 {
-  if(bitarr->num_of_bits == 0 || multiplier == 1)
-  {
-    return;
-  }
-  else if(multiplier == 0)
-  {
-    bit_array_clear_all(bitarr);
-    return;
-  }
+  CompressedHeader ch;
+  if(!_compressed_header_read(&ch, f)) return 0;
 
-  bit_index_t i;
+  num_words = _range_resize(bitarr, ch.num_bits, first_word, num_words);
+  if(num_words == 0) return 1;
 
-  for(i = bitarr->num_of_bits; i > 0; i--)
+  word_addr_t b0 = first_word / ch.block_words;
+  word_addr_t b1 = (first_word + num_words - 1) / ch.block_words;
+  word_addr_t b, nb = b1 - b0 + 1, offset, len;
+  int64_t index_start = start + (int64_t)ch.hdr_size;
+  int64_t data_start = index_start + (int64_t)(ch.num_blocks+1) * 8;
+
+  uint64_t *index = (uint64_t*)malloc((nb+1) * sizeof(uint64_t));
+  word_t *buf = (word_t*)malloc((ch.block_words+1) * sizeof(word_t));
+  word_t *block = (word_t*)malloc(ch.block_words * sizeof(word_t));
+  char success = 0;
+
+  if(index == NULL || buf == NULL || block == NULL) {
+    fprintf(stderr, "[%s:%i] Error: Out of memory\n", __FILE__, __LINE__);
+    abort();
+  }
+
+  if(fseeko(f, index_start + (int64_t)b0 * 8, SEEK_SET) == 0 &&
+     fread(index, sizeof(uint64_t), nb+1, f) == nb+1)
   {
-    if(bit_array_get(bitarr, i-1))
+    _words_le_swap(index, nb+1);
+
+    if(fseeko(f, data_start + (int64_t)index[0], SEEK_SET) == 0)
     {
-      bit_array_clear(bitarr, i-1);
-      bit_array_add_word(bitarr, i-1, multiplier);
+      for(b = 0; b < nb; b++)
+      {
+        if(index[b+1] < index[b] ||
+           !_compressed_block_read(&ch, b0+b, index[b+1] - index[b], buf,
+                                   block, f)) break;
+
+        // Copy the part of this block in the range
+        offset = (b0+b) * ch.block_words;
+        word_addr_t from = MAX(first_word, offset);
+        len = MIN(offset + ch.block_words, first_word + num_words) - from;
+        memcpy(bitarr->words + (from - first_word), block + (from - offset),
+               len * sizeof(word_t));
+      }
+
+      success = (b == nb);
     }
   }
 
+  _mask_top_word(bitarr);
+  free(index);
+  free(buf);
+  free(block);
   DEBUG_VALIDATE(bitarr);
+  return success;
 }
 
-void bit_array_multiply(BIT_ARRAY *dst, BIT_ARRAY *src1, BIT_ARRAY *src2)
+// Reads words [first_word, first_word+num_words) from a file written by any
+// of the save functions. f must be seekable and at the start of the array.
+// Returns 1 on success, 0 on failure
+char bit_array_load_range(BIT_ARRAY* bitarr, FILE* f,
+                          word_addr_t first_word, word_addr_t num_words)
 {
-  if(src1->num_of_bits == 0 || src2->num_of_bits == 0)
-  {
-    bit_array_clear_all(dst);
-    return;
-  }
+  uint8_t hdr[ALIGNED_HDR_SIZE];
+  int64_t start = (int64_t)ftello(f), data_start;
+  bit_index_t num_bits, num_bytes;
+  uint64_t hdr_size;
 
-  // Cannot pass the same array as dst, src1 AND src2
-  assert(dst != src1 || dst != src2);
+  _before_write_all(bitarr);
 
-  // Dev: multiplier == 1?
+  if(start < 0 || fread(hdr, 1, 8, f) != 8) return 0;
 
-  BIT_ARRAY *read_arr, *add_arr;
+  if(memcmp(hdr, COMPRESSED_MAGIC, 8) == 0)
+    return _load_range_compressed(bitarr, f, start, first_word, num_words);
 
-  if(src1 == dst)
+  if(memcmp(hdr, ALIGNED_MAGIC, 8) == 0)
   {
-    read_arr = src1;
-    add_arr = src2;
+    if(fread(hdr+8, 1, ALIGNED_HDR_SIZE-8, f) != ALIGNED_HDR_SIZE-8 ||
+       !_aligned_header_parse(hdr, &num_bits, &hdr_size)) return 0;
+    data_start = start + (int64_t)hdr_size;
+    num_bytes = roundup_bits2words64(num_bits) * 8;
   }
   else
   {
-    read_arr = src2;
-    add_arr = src1;
+    num_bits = le64_to_cpu(hdr);
+    data_start = start + 8;
+    num_bytes = roundup_bits2bytes(num_bits);
   }
 
-  if(dst != src1 && dst != src2)
+  num_words = _range_resize(bitarr, num_bits, first_word, num_words);
+  if(num_words == 0) return 1;
+
+  num_bytes = MIN(num_words * 8, num_bytes - first_word * 8);
+  if(fseeko(f, data_start + (int64_t)first_word * 8, SEEK_SET) != 0 ||
+     fread(bitarr->words, 1, num_bytes, f) != num_bytes) return 0;
+
+  _words_le_swap(bitarr->words, num_words);
+  _mask_top_word(bitarr);
+  DEBUG_VALIDATE(bitarr);
+  return 1;
+}
+
+// A mapped file and the BIT_ARRAY pointing into it
+typedef struct
+{
+  BIT_ARRAY bitarr; // must be first
+  void *map;
+  size_t map_len;
+} BIT_ARRAY_MAPPED;
+
+#if !defined(_WIN32)
+
+BIT_ARRAY* bit_array_mmap(const char* path, char copy_on_write)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return NULL;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0) { close(fd); return NULL; }
+
+  size_t map_len = (size_t)st.st_size;
+  if(map_len < ALIGNED_HDR_SIZE) { close(fd); errno = EINVAL; return NULL; }
+
+  const int endian = 1;
+  char little_endian = *(uint8_t*)&endian == 1;
+  int prot = copy_on_write || !little_endian ? PROT_READ|PROT_WRITE : PROT_READ;
+
+  if(!little_endian && !copy_on_write) { close(fd); errno = ENOTSUP; return NULL; }
+
+  void *map = mmap(NULL, map_len, prot, MAP_PRIVATE, fd, 0);
+  close(fd); // mapping keeps the file open
+  if(map == MAP_FAILED) return NULL;
+
+  bit_index_t num_bits;
+  uint64_t hdr_size;
+  word_addr_t num_words;
+
+  if(!_aligned_header_parse((const uint8_t*)map, &num_bits, &hdr_size) ||
+     hdr_size > map_len ||
+     (num_words = roundup_bits2words64(num_bits)) > (map_len - hdr_size) / 8)
   {
-    bit_array_clear_all(dst);
+    munmap(map, map_len);
+    errno = EINVAL;
+    return NULL;
   }
 
-  bit_index_t i;
+  BIT_ARRAY_MAPPED *mapped = (BIT_ARRAY_MAPPED*)malloc(sizeof(BIT_ARRAY_MAPPED));
+  if(mapped == NULL) { munmap(map, map_len); errno = ENOMEM; return NULL; }
+
+  mapped->map = map;
+  mapped->map_len = map_len;
+  mapped->bitarr.words = (word_t*)((uint8_t*)map + hdr_size);
+  mapped->bitarr.num_of_bits = num_bits;
+  mapped->bitarr.num_of_words = num_words;
+  mapped->bitarr.capacity_in_words = num_words;
+  mapped->bitarr.allocator = &view_allocator;
+  mapped->bitarr.cow = NULL;
+  mapped->bitarr.track = NULL;
+
+  // Big endian machine: swap in our private copy of the pages
+  word_addr_t i;
+  if(!little_endian)
+    for(i = 0; i < num_words; i++)
+      mapped->bitarr.words[i] = byteswap64(mapped->bitarr.words[i]);
 
-  for(i = read_arr->num_of_bits; i > 0; i--)
+  // Top word must be clean -- we can't fix it in a read-only mapping
+  if(num_words > 0 &&
+     (mapped->bitarr.words[num_words-1] & ~bitmask64(bits_in_top_word(num_bits))))
   {
-    if(bit_array_get(read_arr, i-1))
-    {
-      bit_array_clear(dst, i-1);
-      bit_array_add_words(dst, i-1, add_arr);
-    }
+    bit_array_munmap(&mapped->bitarr);
+    errno = EINVAL;
+    return NULL;
   }
 
-  DEBUG_VALIDATE(dst);
+  DEBUG_VALIDATE(&mapped->bitarr);
+  return &mapped->bitarr;
 }
 
-// bitarr = round_down(bitarr / divisor)
-// rem = bitarr % divisor
-void bit_array_div_uint64(BIT_ARRAY *bitarr, uint64_t divisor, uint64_t *rem)
+void bit_array_munmap(BIT_ARRAY* bitarr)
 {
-  assert(divisor != 0); // cannot divide by zero
+  BIT_ARRAY_MAPPED *mapped = (BIT_ARRAY_MAPPED*)bitarr;
+  _track_free(bitarr);
+  munmap(mapped->map, mapped->map_len);
+  free(mapped);
+}
 
-  bit_index_t div_top_bit = 63 - leading_zeros(divisor);
-  bit_index_t bitarr_top_bit;
+#else
 
-  if(!bit_array_find_last_set_bit(bitarr, &bitarr_top_bit))
-  {
-    *rem = 0;
-    return;
-  }
+BIT_ARRAY* bit_array_mmap(const char* path, char copy_on_write)
+{
+  (void)path; (void)copy_on_write;
+  errno = ENOSYS;
+  return NULL;
+}
 
-  if(bitarr_top_bit < div_top_bit)
-  {
-    *rem = bitarr->words[0];
-    bit_array_clear_all(bitarr);
-    return;
-  }
+void bit_array_munmap(BIT_ARRAY* bitarr)
+{
+  (void)bitarr;
+}
 
-  // When div is shifted by offset, their top set bits are aligned
-  bit_index_t offset = bitarr_top_bit - div_top_bit;
+#endif
 
-  uint64_t tmp = _get_word(bitarr, offset);
-  _set_word(bitarr, offset, (word_t)0);
+//
+// Streaming save/load
+//
+// A stream is laid out exactly as bit_array_save() writes a file:
+//   [8 bytes: number of bits][data][optional 4 bytes: CRC32C]
+// Encoder and decoder positions are byte offsets into that file, so a range
+// stream just starts and stops in the middle of the data.
+//
 
-  // Carry if 1 if the top bit was set before left shift
-  char carry = 0;
+#define STREAM_HDR_SIZE 8
+#define STREAM_CRC_SIZE 4
 
-  // offset unsigned so break when offset == 0
-  while(1)
-  {
-    if(carry)
-    {
-      // (carry:tmp) - divisor = (WORD_MAX+1+tmp)-divisor
-      tmp = WORD_MAX - divisor + tmp + 1;
-      bit_array_set(bitarr, offset);
-    }
-    else if(tmp >= divisor)
-    {
-      tmp -= divisor;
-      bit_array_set(bitarr, offset);
-    }
-    else
-    {
-      bit_array_clear(bitarr, offset);
-    }
+uint32_t bit_array_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+  return ~crc32c_kernel(~crc, (const uint8_t*)buf, len);
+}
 
-    if(offset == 0)
-      break;
+bit_index_t bit_array_stream_num_bits(const uint8_t hdr[8])
+{
+  return le64_to_cpu(hdr);
+}
 
-    offset--;
+// Offset of the end of the data
+static inline uint64_t _stream_data_end(bit_index_t num_bits)
+{
+  return STREAM_HDR_SIZE + roundup_bits2bytes(num_bits);
+}
 
-    // Is the top bit set (that we're about to shift off)?
-    carry = tmp & 0x8000000000000000;
+uint64_t bit_array_stream_offset(bit_index_t num_bits, word_addr_t word)
+{
+  return word >= roundup_bits2words64(num_bits) ? _stream_data_end(num_bits)
+                                                : STREAM_HDR_SIZE + word * 8;
+}
 
-    tmp <<= 1;
-    tmp |= bit_array_get(bitarr, offset);
-  }
+uint64_t bit_array_stream_size(bit_index_t num_bits, int flags)
+{
+  return _stream_data_end(num_bits) +
+         ((flags & BIT_STREAM_CRC) ? STREAM_CRC_SIZE : 0);
+}
 
-  *rem = tmp;
+// Copy n bytes out of / into words[], starting at byte i, little endian
+static void _words_read_le(const word_t *words, uint64_t i, uint8_t *out,
+                           size_t n)
+{
+  const int endian = 1;
+  if(n == 0) return;
+  if(*(uint8_t*)&endian == 1) memcpy(out, (const uint8_t*)words + i, n);
+  else for(; n > 0; n--, i++) *out++ = (uint8_t)(words[i/8] >> (8*(i%8)));
 }
 
-// Results in:
-//   quotient = dividend / divisor
-//   dividend = dividend % divisor
-// (dividend is used to return the remainder)
-void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divisor)
+static void _words_write_le(word_t *words, uint64_t i, const uint8_t *in,
+                            size_t n)
 {
-  assert(bit_array_cmp_uint64(divisor, 0) != 0); // Cannot divide by zero
+  const int endian = 1;
+  word_offset_t s;
+  if(n == 0) return;
+  if(*(uint8_t*)&endian == 1) memcpy((uint8_t*)words + i, in, n);
+  else {
+    for(; n > 0; n--, i++) {
+      s = (word_offset_t)(8*(i%8));
+      words[i/8] = (words[i/8] & ~((word_t)0xff << s)) | ((word_t)*in++ << s);
+    }
+  }
+}
 
-  bit_array_clear_all(quotient);
+void bit_array_encoder_init_range(BIT_ARRAY_ENCODER *enc,
+                                  const BIT_ARRAY *bitarr,
+                                  word_addr_t first_word, word_addr_t num_words,
+                                  int flags)
+{
+  word_addr_t last_word = num_words > WORD_MAX - first_word ? WORD_MAX
+                                                            : first_word + num_words;
+  enc->bitarr = bitarr;
+  enc->pos = bit_array_stream_offset(bitarr->num_of_bits, first_word);
+  enc->stop = bit_array_stream_offset(bitarr->num_of_bits, last_word);
+  enc->use_crc = (flags & BIT_STREAM_CRC) != 0;
+  enc->end = enc->stop + (enc->use_crc ? STREAM_CRC_SIZE : 0);
+  enc->crc = 0;
+}
 
-  int cmp = bit_array_cmp(dividend, divisor);
+void bit_array_encoder_init(BIT_ARRAY_ENCODER *enc, const BIT_ARRAY *bitarr,
+                            int flags)
+{
+  bit_array_encoder_init_range(enc, bitarr, 0, WORD_MAX, flags);
+  enc->pos = 0; // include the header
+}
 
-  if(cmp == 0)
-  {
-    bit_array_ensure_size(quotient, 1);
-    bit_array_set(quotient, 0);
-    bit_array_clear_all(dividend);
-    return;
+size_t bit_array_encoder_drain(BIT_ARRAY_ENCODER *enc, void *buf, size_t len)
+{
+  uint8_t *out = (uint8_t*)buf, hdr[STREAM_HDR_SIZE];
+  size_t n = 0, k;
+
+  if(enc->pos < STREAM_HDR_SIZE && len > 0) {
+    cpu_to_le64(hdr, enc->bitarr->num_of_bits);
+    n = (size_t)MIN(len, STREAM_HDR_SIZE - enc->pos);
+    memcpy(out, hdr + enc->pos, n);
+    enc->pos += n;
   }
-  else if(cmp < 0)
-  {
-    // dividend is < divisor, quotient is zero -- done
-    return;
+
+  if(enc->pos < enc->stop && n < len) {
+    k = (size_t)MIN(len - n, enc->stop - enc->pos);
+    _words_read_le(enc->bitarr->words, enc->pos - STREAM_HDR_SIZE, out + n, k);
+    enc->pos += k;
+    n += k;
   }
 
-  // now we know: dividend > divisor, quotient is zero'd,
-  //              dividend != 0, divisor != 0
-  bit_index_t dividend_top_bit = 0, div_top_bit = 0;
+  if(enc->use_crc) enc->crc = bit_array_crc32c(enc->crc, out, n);
 
-  bit_array_find_last_set_bit(dividend, &dividend_top_bit);
-  bit_array_find_last_set_bit(divisor, &div_top_bit);
+  // Trailer
+  for(; n < len && enc->pos < enc->end; n++, enc->pos++)
+    out[n] = (uint8_t)(enc->crc >> (8 * (enc->pos - enc->stop)));
 
-  // When divisor is shifted by offset, their top set bits are aligned
-  bit_index_t offset = dividend_top_bit - div_top_bit;
+  return n;
+}
 
-  // offset unsigned so break when offset == 0
-  for(; ; offset--)
-  {
-    if(bit_array_cmp_words(dividend, offset, divisor) >= 0)
-    {
-      bit_array_sub_words(dividend, offset, divisor);
-      bit_array_ensure_size(quotient, offset+1);
-      bit_array_set(quotient, offset);
-    }
+char bit_array_encoder_done(const BIT_ARRAY_ENCODER *enc)
+{
+  return enc->pos == enc->end;
+}
 
-    if(offset == 0)
-      break;
-  }
+void bit_array_decoder_init(BIT_ARRAY_DECODER *dec, BIT_ARRAY *bitarr,
+                            int flags)
+{
+  dec->bitarr = bitarr;
+  // stop and end are set once we have the header
+  dec->pos = 0;
+  dec->stop = dec->end = dec->data_start = STREAM_HDR_SIZE;
+  dec->crc = dec->crc_read = 0;
+  dec->use_crc = (flags & BIT_STREAM_CRC) != 0;
 }
 
-//
-// Read/Write from files
-//
-// file format is [8 bytes: for number of elements in array][data]
-// data is written in little endian order (least sig byte first)
-//
+void bit_array_decoder_init_range(BIT_ARRAY_DECODER *dec, BIT_ARRAY *bitarr,
+                                  bit_index_t num_bits,
+                                  word_addr_t first_word, word_addr_t num_words,
+                                  int flags)
+{
+  word_addr_t last_word = num_words > WORD_MAX - first_word ? WORD_MAX
+                                                            : first_word + num_words;
+  dec->bitarr = bitarr;
+  dec->pos = dec->data_start = bit_array_stream_offset(num_bits, first_word);
+  dec->stop = bit_array_stream_offset(num_bits, last_word);
+  dec->use_crc = (flags & BIT_STREAM_CRC) != 0;
+  dec->end = dec->stop + (dec->use_crc ? STREAM_CRC_SIZE : 0);
+  dec->crc = dec->crc_read = 0;
 
-// Saves bit array to a file. Returns the number of bytes written
-// number of bytes returned should be 8+(bitarr->num_of_bits+7)/8
-bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f)
+  // Range may end part way through the top word of the saved array
+  bit_index_t start_bit = (dec->data_start - STREAM_HDR_SIZE) * 8;
+  bit_array_resize_critical(bitarr, MIN((dec->stop - dec->pos) * 8,
+                                        num_bits - MIN(num_bits, start_bit)));
+}
+
+size_t bit_array_decoder_feed(BIT_ARRAY_DECODER *dec, const void *buf,
+                              size_t len)
 {
-  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
-  bit_index_t bytes_written = 0;
+  const uint8_t *in = (const uint8_t*)buf;
+  size_t n = 0, k;
 
-  const int endian = 1;
-  if(*(uint8_t*)&endian == 1)
+  if(dec->pos < STREAM_HDR_SIZE && len > 0)
   {
-    // Little endian machine
-    // Write 8 bytes to store the number of bits in the array
-    bytes_written += fwrite(&bitarr->num_of_bits, 1, 8, f);
+    n = (size_t)MIN(len, STREAM_HDR_SIZE - dec->pos);
+    memcpy(dec->hdr + dec->pos, in, n);
+    dec->pos += n;
 
-    // Write the array
-    bytes_written += fwrite(bitarr->words, 1, num_of_bytes, f);
+    if(dec->pos == STREAM_HDR_SIZE) {
+      bit_index_t num_bits = bit_array_stream_num_bits(dec->hdr);
+      bit_array_resize_critical(dec->bitarr, num_bits);
+      dec->stop = _stream_data_end(num_bits);
+      dec->end = dec->stop + (dec->use_crc ? STREAM_CRC_SIZE : 0);
+    }
   }
-  else
-  {
-    // Big endian machine
-    uint64_t i, w, whole_words = num_of_bytes/sizeof(word_t);
-    uint64_t rem_bytes = num_of_bytes - whole_words*sizeof(word_t);
-    uint64_t n_bits = byteswap64(bitarr->num_of_bits);
 
-    // Write 8 bytes to store the number of bits in the array
-    bytes_written += fwrite(&n_bits, 1, 8, f);
+  if(dec->pos < dec->stop && n < len)
+  {
+    k = (size_t)MIN(len - n, dec->stop - dec->pos);
+    uint64_t i = dec->pos - dec->data_start;
+    _before_write(dec->bitarr, i / 8, (i + k + 7) / 8 - i / 8);
+    _words_write_le(dec->bitarr->words, i, in + n, k);
+    dec->pos += k;
+    n += k;
+    // Last byte may have bits past the end
+    if(dec->pos == dec->stop) _mask_top_word(dec->bitarr);
+  }
 
-    // Write the array
-    for(i = 0; i < whole_words; i++) {
-      w = byteswap64(bitarr->words[i]);
-      bytes_written += fwrite(&w, 1, 8, f);
-    }
+  if(dec->use_crc) dec->crc = bit_array_crc32c(dec->crc, in, n);
 
-    if(rem_bytes > 0) {
-      w = byteswap64(bitarr->words[whole_words]);
-      bytes_written += fwrite(&w, 1, rem_bytes, f);
-    }
-  }
+  // Trailer
+  for(; n < len && dec->pos < dec->end && dec->pos >= dec->stop; n++, dec->pos++)
+    dec->crc_read |= (uint32_t)in[n] << (8 * (dec->pos - dec->stop));
 
-  return bytes_written;
+  DEBUG_VALIDATE(dec->bitarr);
+  return n;
 }
 
-// Load a uint64 from little endian format.
-// Works for both big and little endian architectures
-static inline uint64_t le64_to_cpu(const uint8_t *x)
+char bit_array_decoder_finish(const BIT_ARRAY_DECODER *dec)
 {
-  return (((uint64_t)(x[0]))       | ((uint64_t)(x[1]) << 8)  |
-          ((uint64_t)(x[2]) << 16) | ((uint64_t)(x[3]) << 24) |
-          ((uint64_t)(x[4]) << 32) | ((uint64_t)(x[5]) << 40) |
-          ((uint64_t)(x[6]) << 48) | ((uint64_t)(x[7]) << 56));
+  return dec->pos >= STREAM_HDR_SIZE && dec->pos == dec->end &&
+         (!dec->use_crc || dec->crc == dec->crc_read);
 }
 
-// Reads bit array from a file. bitarr is resized and filled.
-// Returns 1 on success, 0 on failure
-char bit_array_load(BIT_ARRAY* bitarr, FILE* f)
-{
-  // Read in number of bits, return 0 if we can't read in
-  bit_index_t num_bits;
-  if(fread(&num_bits, 1, 8, f) != 8) return 0;
-  num_bits = le64_to_cpu((uint8_t*)&num_bits);
-
-  // Resize
-  bit_array_resize_critical(bitarr, num_bits);
-
-  // Have to calculate how many bytes are needed for the file
-  // (Note: this may be different from num_of_words * sizeof(word_t))
-  bit_index_t num_of_bytes = roundup_bits2bytes(bitarr->num_of_bits);
-  if(fread(bitarr->words, 1, num_of_bytes, f) != num_of_bytes) return 0;
-
-  // Fix endianness
-  word_addr_t i;
-  for(i = 0; i < bitarr->num_of_words; i++)
-    bitarr->words[i] = le64_to_cpu((uint8_t*)&bitarr->words[i]);
-
-  // Mask top word
-  _mask_top_word(bitarr);
-  DEBUG_VALIDATE(bitarr);
-  return 1;
-}
 
 //
 // Hash function
@@ -3130,12 +8204,14 @@ uint32_t       *pb)               /* IN: more seed OUT: secondary hash value */
 // Using bob jenkins hash lookup3
 uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed)
 {
+  STAT_SCOPE(hash, bitarr, bitarr->num_of_words * sizeof(word_t));
   uint32_t seed32[2];
   memcpy(seed32, &seed, sizeof(uint32_t)*2);
 
   // Round up length to number 32bit words
   hashword2((uint32_t*)bitarr->words, (bitarr->num_of_bits + 31) / 32,
             &seed32[0], &seed32[1]);
+  memcpy(&seed, seed32, sizeof(uint32_t)*2);
 
   // XOR with array length. This ensures arrays with different length but same
   // contents have different hash values
@@ -3144,6 +8220,258 @@ uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed)
   return seed;
 }
 
+//
+// Write tracking queries
+//
+
+// Index of the first bit in [start, end) of a bitmap equal to value,
+// or end if there isn't one
+static size_t _bitmap_next(const uint64_t *bits, size_t start, size_t end,
+                           char value)
+{
+  uint64_t w;
+  while(start < end) {
+    w = value ? bits[start / 64] : ~bits[start / 64];
+    w &= WORD_MAX << (start % 64);
+    if(w != 0) return MIN(end, (start & ~(size_t)63) + trailing_zeros(w));
+    start = (start & ~(size_t)63) + 64;
+  }
+  return end;
+}
+
+static uint64_t _track_node_hash(uint64_t left, uint64_t right)
+{
+  uint32_t k[4] = {(uint32_t)left, (uint32_t)(left >> 32),
+                   (uint32_t)right, (uint32_t)(right >> 32)};
+  uint32_t pc = 0, pb = 0;
+  hashword2(k, 4, &pc, &pb);
+  return ((uint64_t)pb << 32) | pc;
+}
+
+// lookup3 of the words of block b, seeded with b
+static uint64_t _track_block_hash(const BIT_ARRAY *bitarr, size_t b)
+{
+  word_addr_t start = (word_addr_t)b << TRACK_BLOCK_SHIFT;
+  word_addr_t n = MIN(TRACK_BLOCK_WORDS, bitarr->num_of_words - start);
+  uint32_t pc = (uint32_t)b, pb = (uint32_t)((uint64_t)b >> 32);
+  hashword2((uint32_t*)(bitarr->words + start), n * 2, &pc, &pb);
+  return ((uint64_t)pb << 32) | pc;
+}
+
+static void _track_set_leaf(struct BIT_ARRAY_TRACK *t, size_t b, uint64_t hash,
+                            char rebuild)
+{
+  size_t i = t->leaves + b;
+  t->tree[i] = hash;
+  if(!rebuild)
+    for(i /= 2; i > 0; i /= 2)
+      t->tree[i] = _track_node_hash(t->tree[2*i], t->tree[2*i+1]);
+}
+
+// Bring the cached popcount and hash tree up to date by rescanning only the
+// blocks written since the last update
+static void _track_update(BIT_ARRAY *bitarr)
+{
+  struct BIT_ARRAY_TRACK *t = bitarr->track;
+  size_t nblocks = _track_num_blocks(bitarr->num_of_words);
+  size_t leaves = nblocks > 1 ? roundup2pow(nblocks - 1) : 1, b, i;
+  char rebuild = 0;
+  uint64_t w;
+
+  assert(nblocks <= t->cap_blocks);
+
+  // Number of leaves changed: copy the leaves over and rebuild the nodes
+  if(leaves != t->leaves)
+  {
+    uint64_t *tree = (uint64_t*)calloc(2 * leaves, sizeof(uint64_t));
+    if(tree == NULL) {
+      fprintf(stderr, "Ran out of memory for hash tree [%zu leaves]\n", leaves);
+      abort();
+    }
+    if(t->tree != NULL)
+      memcpy(tree + leaves, t->tree + t->leaves,
+             MIN(leaves, t->leaves) * sizeof(uint64_t));
+    free(t->tree);
+    t->tree = tree;
+    t->leaves = leaves;
+    rebuild = 1;
+  }
+
+  // Blocks cut off the end
+  for(b = nblocks; b < t->num_blocks; b++) {
+    t->pop -= t->block_pop[b];
+    t->block_pop[b] = 0;
+    if(b < leaves) _track_set_leaf(t, b, 0, rebuild);
+  }
+  t->num_blocks = nblocks;
+
+  for(i = 0; i < t->cap_blocks / 64; i++)
+  {
+    for(w = t->stale[i]; w != 0; w &= w - 1)
+    {
+      b = i * 64 + trailing_zeros(w);
+      if(b >= nblocks) break;
+
+      word_addr_t start = (word_addr_t)b << TRACK_BLOCK_SHIFT;
+      t->pop -= t->block_pop[b];
+      t->block_pop[b] = (uint32_t)kernels->popcount(bitarr->words + start,
+                          MIN(TRACK_BLOCK_WORDS, bitarr->num_of_words - start));
+      t->pop += t->block_pop[b];
+      _track_set_leaf(t, b, _track_block_hash(bitarr, b), rebuild);
+    }
+    t->stale[i] = 0;
+  }
+
+  if(rebuild)
+    for(i = leaves - 1; i > 0; i--)
+      t->tree[i] = _track_node_hash(t->tree[2*i], t->tree[2*i+1]);
+}
+
+// Returns 1 on success, 0 if out of memory (sets errno to ENOMEM)
+char bit_array_track_start(BIT_ARRAY* bitarr)
+{
+  if(bitarr->track != NULL) return 1;
+
+  size_t nblocks = _track_num_blocks(bitarr->num_of_words);
+  bitarr->track = (struct BIT_ARRAY_TRACK*)calloc(1, sizeof(struct BIT_ARRAY_TRACK));
+
+  if(bitarr->track == NULL || !_track_reserve(bitarr->track, nblocks)) {
+    _track_free(bitarr);
+    errno = ENOMEM;
+    return 0;
+  }
+
+  // Nothing is dirty yet, but the caches need a full scan
+  _bitmap_set_range(bitarr->track->stale, 0, nblocks);
+  return 1;
+}
+
+void bit_array_track_stop(BIT_ARRAY* bitarr)
+{
+  _track_free(bitarr);
+}
+
+char bit_array_dirty_next(const BIT_ARRAY* bitarr, word_addr_t *word,
+                          word_addr_t *num_words)
+{
+  const struct BIT_ARRAY_TRACK *t = bitarr->track;
+  assert(t != NULL);
+
+  if(*word >= bitarr->num_of_words) return 0;
+
+  size_t nblocks = MIN(t->cap_blocks, _track_num_blocks(bitarr->num_of_words));
+  size_t start = _bitmap_next(t->dirty, *word >> TRACK_BLOCK_SHIFT, nblocks, 1);
+  if(start == nblocks) return 0;
+  size_t end = _bitmap_next(t->dirty, start, nblocks, 0);
+
+  word_addr_t first = MAX(*word, (word_addr_t)start << TRACK_BLOCK_SHIFT);
+  word_addr_t last = MIN(bitarr->num_of_words, (word_addr_t)end << TRACK_BLOCK_SHIFT);
+  *word = first;
+  *num_words = last - first;
+  return 1;
+}
+
+size_t bit_array_dirty_num_blocks(const BIT_ARRAY* bitarr)
+{
+  const struct BIT_ARRAY_TRACK *t = bitarr->track;
+  assert(t != NULL);
+
+  size_t nblocks = MIN(t->cap_blocks, _track_num_blocks(bitarr->num_of_words));
+  size_t i, count = 0;
+  for(i = 0; i < nblocks / 64; i++) count += POPCOUNT(t->dirty[i]);
+  if(nblocks % 64) count += POPCOUNT(t->dirty[i] & bitmask64(nblocks % 64));
+  return count;
+}
+
+void bit_array_dirty_clear(BIT_ARRAY* bitarr)
+{
+  struct BIT_ARRAY_TRACK *t = bitarr->track;
+  assert(t != NULL);
+  if(t->cap_blocks > 0) memset(t->dirty, 0, t->cap_blocks / 8);
+}
+
+bit_index_t bit_array_track_num_bits_set(BIT_ARRAY* bitarr)
+{
+  assert(bitarr->track != NULL);
+  _track_update(bitarr);
+  return bitarr->track->pop;
+}
+
+uint64_t bit_array_track_hash(BIT_ARRAY* bitarr)
+{
+  assert(bitarr->track != NULL);
+  _track_update(bitarr);
+  return _track_node_hash(bitarr->track->tree[1], bitarr->num_of_bits);
+}
+
+bit_index_t bit_array_save_dirty(const BIT_ARRAY* bitarr, FILE* f)
+{
+  uint8_t hdr[ALIGNED_HDR_SIZE], buf[4096];
+  bit_index_t num_bits, bytes_written;
+  uint64_t data_start, data_end, pos, end;
+  word_addr_t w = 0, n;
+  size_t k;
+
+  long base = ftell(f);
+  if(base < 0 || fread(hdr, 1, 8, f) != 8) return 0;
+
+  if(memcmp(hdr, ALIGNED_MAGIC, 8) == 0)
+  {
+    if(fread(hdr+8, 1, ALIGNED_HDR_SIZE-8, f) != ALIGNED_HDR_SIZE-8 ||
+       !_aligned_header_parse(hdr, &num_bits, &data_start)) return 0;
+    cpu_to_le64(hdr+16, bitarr->num_of_bits);
+    cpu_to_le64(hdr+24, bitarr->num_of_words);
+    data_end = bitarr->num_of_words * 8;
+    k = ALIGNED_HDR_SIZE;
+  }
+  else
+  {
+    cpu_to_le64(hdr, bitarr->num_of_bits);
+    data_start = 8;
+    data_end = roundup_bits2bytes(bitarr->num_of_bits);
+    k = 8;
+  }
+
+  if(fseek(f, base, SEEK_SET) != 0 || fwrite(hdr, 1, k, f) != k) return 0;
+  bytes_written = k;
+
+  for(; bit_array_dirty_next(bitarr, &w, &n); w += n)
+  {
+    pos = w * 8;
+    end = MIN(data_end, (w + n) * 8);
+    if(fseek(f, base + (long)(data_start + pos), SEEK_SET) != 0) return 0;
+
+    for(; pos < end; pos += k) {
+      k = (size_t)MIN(end - pos, sizeof(buf));
+      _words_read_le(bitarr->words, pos, buf, k);
+      if(fwrite(buf, 1, k, f) != k) return 0;
+      bytes_written += k;
+    }
+  }
+
+  return bytes_written;
+}
+
+bit_index_t bit_array_dirty_hamming_distance(const BIT_ARRAY* bitarr,
+                                             const BIT_ARRAY* other)
+{
+  bit_index_t dist = 0;
+  word_addr_t w = 0, n, both;
+
+  for(; bit_array_dirty_next(bitarr, &w, &n); w += n) {
+    both = w < other->num_of_words ? MIN(n, other->num_of_words - w) : 0;
+    dist += kernels->xor_popcount(bitarr->words + w, other->words + w, both);
+    dist += kernels->popcount(bitarr->words + w + both, n - both);
+  }
+
+  // other is longer: bits past our end differ if set
+  if(other->num_of_words > bitarr->num_of_words)
+    dist += kernels->popcount(other->words + bitarr->num_of_words,
+                              other->num_of_words - bitarr->num_of_words);
+
+  return dist;
+}
+
 
 //
 // Generally useful functions
@@ -32,6 +32,21 @@ extern "C" {
 // Structs
 //
 
+// Memory for arrays comes from an allocator. NULL means malloc/realloc/free.
+// Sizes passed to realloc and free are the sizes the block was allocated with.
+// Memory from alloc and realloc does not need to be zeroed.
+typedef struct
+{
+  void* (*alloc)(void *ctx, size_t size);
+  // Only called with a block from alloc or realloc
+  void* (*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+  void (*free)(void *ctx, void *ptr, size_t size);
+  void *ctx;
+} BIT_ARRAY_ALLOCATOR;
+
+// Words stored in the struct before using the allocator (256 bits)
+#define BIT_ARRAY_INLINE_WORDS 4
+
 struct BIT_ARRAY
 {
   word_t* words;
@@ -42,6 +57,16 @@ struct BIT_ARRAY
   // For more efficient allocation we use realloc only to double size --
   // not for adding every word.  Initial size is INIT_CAPACITY_WORDS.
   word_addr_t capacity_in_words;
+  // Where words (and this struct, if from bit_array_create) came from
+  const BIT_ARRAY_ALLOCATOR *allocator;
+  // Set if words are shared copy-on-write with clones (see bit_array_clone_cow)
+  struct BIT_ARRAY_COW *cow;
+  // Set if writes are being tracked (see bit_array_track_start)
+  struct BIT_ARRAY_TRACK *track;
+  // Arrays of up to BIT_ARRAY_INLINE_WORDS words keep them here, with words
+  // pointing at inline_words. So a BIT_ARRAY must not be copied by value
+  // (struct assignment or memcpy) -- use bit_array_copy_all() instead.
+  word_t inline_words[BIT_ARRAY_INLINE_WORDS];
 };
 
 //
@@ -58,9 +83,77 @@ void bit_array_free(BIT_ARRAY* bitarray);
 BIT_ARRAY* bit_array_alloc(BIT_ARRAY* bitarr, bit_index_t nbits);
 void bit_array_dealloc(BIT_ARRAY* bitarr);
 
+//
+// Allocators
+//
+
+// As bit_array_create() / bit_array_alloc() using the given allocator, which
+// must outlive the array. allocator may be NULL for malloc
+BIT_ARRAY* bit_array_create_with(bit_index_t nbits,
+                                 const BIT_ARRAY_ALLOCATOR *allocator);
+BIT_ARRAY* bit_array_alloc_with(BIT_ARRAY* bitarr, bit_index_t nbits,
+                                const BIT_ARRAY_ALLOCATOR *allocator);
+
+// Allocator used by bit_array_create() and bit_array_alloc(). NULL (the
+// default) is malloc; on Linux blocks of 1MB or more are mmap()ed instead and
+// grown with mremap(), so big arrays grow without copying. Arrays keep the
+// allocator they were created with.
+// Not thread safe: set it before creating arrays.
+void bit_array_set_default_allocator(const BIT_ARRAY_ALLOCATOR *allocator);
+const BIT_ARRAY_ALLOCATOR* bit_array_get_default_allocator(void);
+
+// 64 byte aligned memory. Blocks of 2MB or more are mmap()ed and use
+// transparent huge pages where the OS supports them
+const BIT_ARRAY_ALLOCATOR* bit_array_aligned_allocator(void);
+
+// Arena with free lists of small blocks (up to BIT_ARENA_MAX_SMALL bytes),
+// carved from 64KB slabs. Bigger blocks come from the aligned allocator.
+// Freeing the arena releases everything allocated from it -- arrays from an
+// arena can be dropped without bit_array_free(). Not thread safe: use one
+// arena per thread.
+typedef struct BIT_ARRAY_ARENA BIT_ARRAY_ARENA;
+
+#define BIT_ARENA_MAX_SMALL 4096
+
+// Returns NULL if cannot malloc
+BIT_ARRAY_ARENA* bit_array_arena_create(void);
+void bit_array_arena_free(BIT_ARRAY_ARENA *arena);
+const BIT_ARRAY_ALLOCATOR* bit_array_arena_allocator(BIT_ARRAY_ARENA *arena);
+
+//
+// Views
+//
+
+// Use words owned by the caller as the nbits of a bit array, without copying.
+// view is a struct owned by the caller, words must outlive it; words may be
+// NULL if nbits is 0. The length of a view is fixed: bit_array_resize()
+// returns 0 and sets errno to EPERM. bit_array_dealloc() and bit_array_free()
+// free neither words nor view. Clones of a view are ordinary arrays.
+// Views can be passed as a source to any function, or as the destination of
+// functions that do not change its length.
+// Bits past nbits in the top word must be zero, otherwise returns NULL and
+// sets errno to EINVAL.
+BIT_ARRAY* bit_array_view(BIT_ARRAY* view, word_t* words, bit_index_t nbits);
+
+// View of bits [start, start+len) of src. start must be a multiple of 64, and
+// start+len either a multiple of 64 or the end of src, otherwise returns NULL
+// and sets errno to EINVAL. The view is invalid once src is resized or freed.
+// Writes through the view skip copy-on-write and write tracking of src: call
+// bit_array_prepare_write() on src first.
+BIT_ARRAY* bit_array_view_range(BIT_ARRAY* view, const BIT_ARRAY* src,
+                                bit_index_t start, bit_index_t len);
+
+// Returns 1 if bitarr is a view (from bit_array_view*() or bit_array_mmap())
+char bit_array_is_view(const BIT_ARRAY* bitarr);
+
 // Get length of bit array
 bit_index_t bit_array_length(const BIT_ARRAY* bit_arr);
 
+// Name of the SIMD kernels selected at startup for logic operators and
+// popcounts: "avx512", "avx512f", "avx2", "sse2", "neon" or "scalar".
+// Build with -DBIT_ARRAY_NO_SIMD to force "scalar".
+const char* bit_array_simd_name(void);
+
 // Change the size of a bit array. Enlarging an array will add zeros
 // to the end of it. Returns 1 on success, 0 on failure (e.g. not enough memory)
 char bit_array_resize(BIT_ARRAY* bitarr, bit_index_t new_num_of_bits);
@@ -72,6 +165,65 @@ char bit_array_ensure_size(BIT_ARRAY* bitarr, bit_index_t ensure_num_of_bits);
 void bit_array_resize_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits);
 void bit_array_ensure_size_critical(BIT_ARRAY* bitarr, bit_index_t num_of_bits);
 
+// Bits the array can hold before its words are reallocated
+bit_index_t bit_array_capacity(const BIT_ARRAY* bitarr);
+
+// Make the capacity at least nbits (exactly, if it grows), without changing
+// the length, so resizing up to nbits does not reallocate.
+// Returns 1 on success, 0 on failure and sets errno (ENOMEM, or EPERM for a
+// view smaller than nbits)
+char bit_array_reserve(BIT_ARRAY* bitarr, bit_index_t nbits);
+
+// Reduce the capacity to the length, moving small arrays back into the
+// struct. Views and copy-on-write arrays are left as they are.
+// Returns 1 on success, 0 if out of memory (sets errno to ENOMEM)
+char bit_array_shrink_to_fit(BIT_ARRAY* bitarr);
+
+// How the capacity grows when an array outgrows it. GROW_DOUBLE (the
+// default) rounds up to a power of two, GROW_1_5X grows by half the old
+// capacity, GROW_CHUNK rounds up to a multiple of chunk_bits and GROW_EXACT
+// grows to the length needed. chunk_bits is only used by GROW_CHUNK.
+// Not thread safe: set it before creating arrays.
+typedef enum
+{
+  BIT_ARRAY_GROW_DOUBLE,
+  BIT_ARRAY_GROW_1_5X,
+  BIT_ARRAY_GROW_CHUNK,
+  BIT_ARRAY_GROW_EXACT
+} BIT_ARRAY_GROWTH;
+
+void bit_array_set_growth(BIT_ARRAY_GROWTH growth, bit_index_t chunk_bits);
+BIT_ARRAY_GROWTH bit_array_get_growth(void);
+
+//
+// Statistics
+//
+
+// Built with -DBIT_ARRAY_STATS (make STATS=1), bulk functions (logic
+// operators, popcounts, copies, shifts, resize, save/load, ...) count their
+// calls, the bytes of words they read and write, and cycles (TSC ticks on
+// x86, nanoseconds elsewhere, including functions they call). Counters are
+// per thread and summed when read. "grow" and "shrink" count reallocations
+// of word storage, their bytes are the change in capacity.
+// Built with -DBIT_ARRAY_USDT (make USDT=1, needs <sys/sdt.h>), the same
+// functions have USDT probes "bit_array:<function>" for perf / bpftrace.
+typedef struct
+{
+  const char *name;
+  uint64_t calls, bytes, cycles;
+} BIT_ARRAY_STAT;
+
+// Fill stats with up to max counters, one per function. Returns the number of
+// counters there are, 0 if built without BIT_ARRAY_STATS
+size_t bit_array_stats(BIT_ARRAY_STAT *stats, size_t max);
+
+// Zero the counters. May be called while other threads are counting; a call
+// counted during the reset may be left partly cleared
+void bit_array_stats_reset(void);
+
+// Print a table of the functions called
+void bit_array_stats_dump(FILE *f);
+
 
 //
 // Macros
@@ -125,6 +277,13 @@ bit_index_t bit_array_get_bits(const BIT_ARRAY* bitarr,
                                bit_index_t start, bit_index_t end,
                                bit_index_t* dst);
 
+// Get the offsets of the bits NOT set (for offsets start<=offset<end)
+// Returns the number of bits not set
+// It is assumed that dst is at least of length (end-start)
+bit_index_t bit_array_get_clear_bits(const BIT_ARRAY* bitarr,
+                                     bit_index_t start, bit_index_t end,
+                                     bit_index_t* dst);
+
 // Set multiple bits at once.
 // e.g. set bits 1, 20 & 31: bit_array_set_bits(bitarr, 3, 1,20,31);
 // Note: variable args are of type unsigned int
@@ -140,6 +299,34 @@ void bit_array_clear_bits(BIT_ARRAY* bitarr, size_t n, ...);
 // Note: variable args are of type unsigned int
 void bit_array_toggle_bits(BIT_ARRAY* bitarr, size_t n, ...);
 
+//
+// Get, set, clear and toggle a batch of bits given as an array of indices
+// Faster than a loop over bit_array_set_bit() etc. for large batches: upcoming
+// words are prefetched, and sorted indices in the same word are merged.
+// Bounds are checked with assert() once per batch.
+//
+
+// idx is in ascending order
+#define BIT_BATCH_SORTED 1
+
+// flags is 0 or BIT_BATCH_SORTED. Indices may repeat
+void bit_array_set_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                         int flags);
+void bit_array_clear_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                           int flags);
+// Toggling a bit twice leaves it unchanged
+void bit_array_toggle_batch(BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                            int flags);
+
+// Returns how many of idx[0..n) are set (repeats are counted each time)
+bit_index_t bit_array_test_batch(const BIT_ARRAY* bitarr, const bit_index_t* idx,
+                                 size_t n);
+
+// out is resized to length n, bit i of out is set to bit idx[i] of bitarr
+// out must not be bitarr
+void bit_array_gather(const BIT_ARRAY* bitarr, const bit_index_t* idx, size_t n,
+                      BIT_ARRAY* out);
+
 //
 // Set, clear and toggle all bits in a region
 //
@@ -203,6 +390,34 @@ bit_index_t bit_array_num_bits_cleared(const BIT_ARRAY* bitarr);
 bit_index_t bit_array_hamming_distance(const BIT_ARRAY* arr1,
                                        const BIT_ARRAY* arr2);
 
+// Set algebra counts, without storing the result. Arrays can be of different
+// lengths (missing bits are zero).
+// |arr1 & arr2|
+bit_index_t bit_array_and_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2);
+// |arr1 | arr2|
+bit_index_t bit_array_or_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2);
+// |arr1 & ~arr2|, the bits of arr1 not in arr2
+bit_index_t bit_array_andnot_count(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2);
+// Returns 1 iff arr1 and arr2 have a set bit in common, stopping at the first
+char bit_array_intersects(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2);
+// Jaccard similarity |arr1 & arr2| / |arr1 | arr2|, 1.0 if both are empty
+double bit_array_jaccard(const BIT_ARRAY* arr1, const BIT_ARRAY* arr2);
+
+typedef enum
+{
+  BIT_ARRAY_COUNT_AND,    // |query & arr|
+  BIT_ARRAY_COUNT_OR,     // |query | arr|
+  BIT_ARRAY_COUNT_XOR,    // |query ^ arr|, the hamming distance
+  BIT_ARRAY_COUNT_ANDNOT  // |query & ~arr|
+} BIT_ARRAY_COUNT_OP;
+
+// Compare one query against m arrays: counts[j] = |query op arrs[j]|.
+// The query is read a block at a time and compared against every array while
+// it is in cache, so this is faster than m calls for long queries.
+void bit_array_count_many(BIT_ARRAY_COUNT_OP op, const BIT_ARRAY* query,
+                          const BIT_ARRAY** arrs, size_t m,
+                          bit_index_t* counts);
+
 // Parity - returns 1 if odd number of bits set, 0 if even
 char bit_array_parity(const BIT_ARRAY* bitarr);
 
@@ -238,6 +453,32 @@ char bit_array_find_prev_set_bit(const BIT_ARRAY* bitarr, bit_index_t offset,
 char bit_array_find_prev_clear_bit(const BIT_ARRAY* bitarr, bit_index_t offset,
                                    bit_index_t* result);
 
+//
+// Iterate over set (or clear) bits in [start, end)
+// Much faster than calling bit_array_find_next_set_bit() repeatedly, especially
+// the bulk decode functions. The array must not be changed while iterating.
+//
+
+typedef struct
+{
+  const word_t *words;
+  word_t word, flip, last_mask; // bits left in current word
+  word_addr_t wrd, last_wrd;    // current and last word
+} BIT_ARRAY_ITER;
+
+// If clear_bits is set, iterate over the bits that are NOT set
+void bit_array_iter_init(BIT_ARRAY_ITER *it, const BIT_ARRAY *bitarr,
+                         bit_index_t start, bit_index_t end, char clear_bits);
+
+// Returns 1 and sets *result to the next position, or returns 0 at the end
+char bit_array_iter_next(BIT_ARRAY_ITER *it, bit_index_t *result);
+
+// Write the next (up to) n positions to dst. Returns the number written,
+// which is less than n only at the end. Can be mixed with
+// bit_array_iter_next(). decode32 requires that end <= 2^32
+size_t bit_array_iter_decode64(BIT_ARRAY_ITER *it, uint64_t *dst, size_t n);
+size_t bit_array_iter_decode32(BIT_ARRAY_ITER *it, uint32_t *dst, size_t n);
+
 // Find the index of the first bit that is set.
 // Returns 1 if a bit is set, otherwise 0
 // Index of first set bit is stored in the integer pointed to by `result`
@@ -263,6 +504,42 @@ char bit_array_find_last_set_bit(const BIT_ARRAY* bitarr, bit_index_t* result);
 char bit_array_find_last_clear_bit(const BIT_ARRAY* bitarr, bit_index_t* result);
 
 
+//
+// Rank / select index
+//
+// Optional side structure over a BIT_ARRAY for O(1) rank and near-O(1)
+// select. Costs ~3.2% of the array's memory. The index points to `bitarr` --
+// after changing bits call bit_array_rank_update() for the region changed, or
+// bit_array_rank_rebuild() if the array has been resized.
+//
+
+typedef struct
+{
+  const BIT_ARRAY *bitarr;
+  word_t *l0, *l12;
+  word_addr_t *samples;
+  bit_index_t num_of_bits, num_bits_set;
+  word_addr_t num_of_blocks;
+  size_t num_samples, capacity_samples;
+} BIT_ARRAY_RANK;
+
+// Returns NULL if cannot malloc
+BIT_ARRAY_RANK* bit_array_rank_create(const BIT_ARRAY* bitarr);
+void bit_array_rank_free(BIT_ARRAY_RANK* rs);
+
+// Returns 1 on success, 0 if out of memory
+char bit_array_rank_rebuild(BIT_ARRAY_RANK* rs);
+char bit_array_rank_update(BIT_ARRAY_RANK* rs, bit_index_t start, bit_index_t len);
+
+// Number of bits set / not set in positions [0, i), where i <= length
+bit_index_t bit_array_rank1(const BIT_ARRAY_RANK* rs, bit_index_t i);
+bit_index_t bit_array_rank0(const BIT_ARRAY_RANK* rs, bit_index_t i);
+
+// Find the position of the k-th set bit (k=0 is the first)
+// Returns 1 on success, 0 if fewer than k+1 bits are set
+char bit_array_select1(const BIT_ARRAY_RANK* rs, bit_index_t k,
+                       bit_index_t* result);
+
 //
 // Sorting
 //
@@ -286,6 +563,10 @@ void bit_array_from_substr(BIT_ARRAY* bitarr, bit_index_t offset,
                            const char* str, size_t len,
                            const char *on, const char *off, char left_to_right);
 
+// Number of chars needed to write `length` bits with bit_array_to_str(),
+// including the '\0' -- i.e. length+1
+size_t bit_array_str_size(bit_index_t length);
+
 // Takes a char array to write to.  `str` must be bitarr->num_of_bits+1 in
 // length. Terminates string with '\0'
 char* bit_array_to_str(const BIT_ARRAY* bitarr, char* str);
@@ -329,6 +610,10 @@ size_t bit_array_from_decimal(BIT_ARRAY *bitarr, const char* decimal);
 bit_index_t bit_array_from_hex(BIT_ARRAY* bitarr, bit_index_t offset,
                                const char* str, size_t len);
 
+// Number of chars needed to write `length` bits with bit_array_to_hex(),
+// including the '\0'
+size_t bit_array_hex_size(bit_index_t length);
+
 // Returns number of characters written
 size_t bit_array_to_hex(const BIT_ARRAY* bitarr,
                         bit_index_t start, bit_index_t length,
@@ -358,6 +643,27 @@ void bit_array_copy(BIT_ARRAY* dst, bit_index_t dstindx,
 // copy all of src to dst. dst is resized to match src.
 void bit_array_copy_all(BIT_ARRAY* dst, const BIT_ARRAY* src);
 
+// Copy-on-write clones: the clone shares src's memory, and only pages that are
+// later written by either array get copied, so cloning a large array costs
+// almost nothing. The first COW clone of an array moves its words into a
+// shared memory file (one copy); after that clones are free.
+// Writes to src through bit_array_* functions keep clones unchanged. Writing
+// the words of src directly (e.g. the bit_array_set() macro) must be preceded
+// by bit_array_prepare_write(). Arrays under 64KB are simply copied, as are all
+// arrays on systems other than Linux.
+// Not thread safe with respect to src, but clones may be read and freed in
+// other threads while src is written.
+// Returns NULL if cannot malloc
+BIT_ARRAY* bit_array_clone_cow(BIT_ARRAY* src);
+// As bit_array_copy_all(), dst shares src's memory until either writes it
+void bit_array_copy_all_cow(BIT_ARRAY* dst, BIT_ARRAY* src);
+
+// Call before writing bits [start, start+len) of an array directly through its
+// words. Only needed if the array may have copy-on-write clones or is tracked
+// (see bit_array_track_start).
+void bit_array_prepare_write(BIT_ARRAY* bitarr, bit_index_t start,
+                             bit_index_t len);
+
 //
 // Logic operators
 //
@@ -370,6 +676,56 @@ void bit_array_or (BIT_ARRAY* dest, const BIT_ARRAY* src1, const BIT_ARRAY* src2
 void bit_array_xor(BIT_ARRAY* dest, const BIT_ARRAY* src1, const BIT_ARRAY* src2);
 void bit_array_not(BIT_ARRAY* dest, const BIT_ARRAY* src);
 
+//
+// Fused logic expressions
+//
+// Evaluate a postfix program over several input arrays in a single
+// cache-blocked pass, without temporary BIT_ARRAYs.
+// e.g. popcount((A & B) | ~C):
+//   BIT_EXPR prog[] = {{BIT_EXPR_IN,0}, {BIT_EXPR_IN,1}, {BIT_EXPR_AND,0},
+//                      {BIT_EXPR_IN,2}, {BIT_EXPR_NOT,0}, {BIT_EXPR_OR,0}};
+//   const BIT_ARRAY *in[] = {A, B, C};
+//   bit_array_eval_num_bits_set(prog, 6, in, 3);
+// Inputs do not have to be the same length -- missing bits read as zero
+//
+
+typedef enum
+{
+  BIT_EXPR_IN,     // push inputs[arg]
+  BIT_EXPR_AND,    // pop b, a; push a & b
+  BIT_EXPR_OR,     // pop b, a; push a | b
+  BIT_EXPR_XOR,    // pop b, a; push a ^ b
+  BIT_EXPR_ANDNOT, // pop b, a; push a & ~b
+  BIT_EXPR_NOT     // pop a; push ~a
+} BitExprOp;
+
+typedef struct
+{
+  BitExprOp op;
+  uint32_t arg; // input index for BIT_EXPR_IN, otherwise ignored
+} BIT_EXPR;
+
+// Maximum stack depth of a program
+#define BIT_EXPR_MAX_DEPTH 16
+
+// Returns 1 if prog is a valid program over ninputs arrays, 0 otherwise
+char bit_array_eval_valid(const BIT_EXPR *prog, size_t nops, size_t ninputs);
+
+// dst = result of prog. dst is enlarged to the longest input if too short. If
+// dst is longer than all inputs, a NOT sets its top bits (as bit_array_not).
+// dst may be one of the inputs
+void bit_array_eval(BIT_ARRAY* dst, const BIT_EXPR *prog, size_t nops,
+                    const BIT_ARRAY **inputs, size_t ninputs);
+
+// Reductions over the result of prog, which is as long as the longest input
+bit_index_t bit_array_eval_num_bits_set(const BIT_EXPR *prog, size_t nops,
+                                        const BIT_ARRAY **inputs, size_t ninputs);
+
+// Returns 1 and sets *result if a bit is set in the result, otherwise 0
+char bit_array_eval_find_first_set_bit(const BIT_EXPR *prog, size_t nops,
+                                       const BIT_ARRAY **inputs, size_t ninputs,
+                                       bit_index_t* result);
+
 //
 // Comparisons
 //
@@ -418,12 +774,27 @@ void bit_array_cycle_left (BIT_ARRAY* bitarr, bit_index_t dist);
 // 0011 0000 -> 00001010
 // 1111 0000 -> 10101010
 // 0101 1010 -> 01100110
-// Extends dst if it is too short, but does not shrink it if it is too long
-// if dst is longer than length(src1)+length(src2), the end bits are not altered
+// src1 and src2 must be the same length, dst is resized to the sum of lengths
 void bit_array_interleave(BIT_ARRAY* dst,
                           const BIT_ARRAY* src1,
                           const BIT_ARRAY* src2);
 
+// Inverse of bit_array_interleave: even bits of src to dst1, odd bits to dst2.
+// src length must be even, dst1 and dst2 are resized to half of it
+void bit_array_deinterleave(BIT_ARRAY* dst1, BIT_ARRAY* dst2,
+                            const BIT_ARRAY* src);
+
+// Most arrays bit_array_interleave_n / bit_array_deinterleave_n can take
+#define BIT_ARRAY_INTERLEAVE_MAX 16
+
+// Interleave n arrays of the same length: bit i of srcs[j] is bit n*i+j of
+// dst, which is resized to n times the length. dst cannot be one of srcs.
+void bit_array_interleave_n(BIT_ARRAY* dst, const BIT_ARRAY** srcs, size_t n);
+
+// Inverse of bit_array_interleave_n. The length of src must be a multiple of
+// n, each of dsts is resized to length/n
+void bit_array_deinterleave_n(BIT_ARRAY** dsts, const BIT_ARRAY* src, size_t n);
+
 // Reverse the whole array or part of it
 void bit_array_reverse(BIT_ARRAY* bitarr);
 void bit_array_reverse_region(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len);
@@ -499,6 +870,8 @@ void bit_array_multiply(BIT_ARRAY *dst, BIT_ARRAY *src1, BIT_ARRAY *src2);
 //   quotient = dividend / divisor
 //   dividend = dividend % divisor
 // (dividend is used to return the remainder)
+// quotient must not be dividend or divisor. Uses word level long division
+// (Knuth's Algorithm D)
 void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divisor);
 
 //
@@ -513,9 +886,142 @@ void bit_array_divide(BIT_ARRAY *dividend, BIT_ARRAY *quotient, BIT_ARRAY *divis
 bit_index_t bit_array_save(const BIT_ARRAY* bitarr, FILE* f);
 
 // Reads bit array from a file. bitarr is resized and filled.
+// Also reads files written by bit_array_save_aligned() and
+// bit_array_save_compressed().
 // Returns 1 on success, 0 on failure
 char bit_array_load(BIT_ARRAY* bitarr, FILE* f);
 
+// Reads words [first_word, first_word+num_words) from a file written by any of
+// the save functions. bitarr is resized to the bits in the range (clipped to
+// the end of the array). f must be seekable and at the start of the saved
+// array. Only the blocks needed are read from compressed files.
+// Returns 1 on success, 0 on failure
+char bit_array_load_range(BIT_ARRAY* bitarr, FILE* f,
+                          word_addr_t first_word, word_addr_t num_words);
+
+//
+// Compressed files
+//
+// File format is [64 bytes: header][block index][blocks] where header is
+//   ["BITARRCZ"][4 bytes: version][4 bytes: header size]
+//   [8 bytes: number of bits][8 bytes: number of words]
+//   [4 bytes: words per block][4 bytes: block encoding]
+//   [8 bytes: number of blocks][16 bytes: zero]
+// Blocks of 4096 words are run length coded (EWAH) separately, and the index
+// gives the offset of each so word ranges can be read on their own.
+//
+
+// Saves bit array in the compressed format
+// returns the number of bytes written
+bit_index_t bit_array_save_compressed(const BIT_ARRAY* bitarr, FILE* f);
+
+//
+// Streaming save/load
+//
+// Encode to / decode from caller buffers a piece at a time, in the format of
+// bit_array_save(), so arrays can be sent over sockets without a FILE* or a
+// second copy. With BIT_STREAM_CRC the stream ends with a 4 byte little endian
+// CRC32C of all the bytes before it (bit_array_load() ignores the trailer).
+//
+// A range stream is just the data bytes of words
+// [first_word, first_word+num_words), found at
+// bit_array_stream_offset(num_bits, first_word) in a saved file. Decoding a
+// range gives an array of only those bits, starting at first_word*64.
+//
+
+#define BIT_STREAM_CRC 1
+
+typedef struct
+{
+  const BIT_ARRAY *bitarr;
+  uint64_t pos, stop, end; // byte offsets in the saved file
+  uint32_t crc;
+  char use_crc;
+} BIT_ARRAY_ENCODER;
+
+typedef struct
+{
+  BIT_ARRAY *bitarr;
+  uint64_t pos, stop, end, data_start; // byte offsets in the saved file
+  uint32_t crc, crc_read;
+  uint8_t hdr[8];
+  char use_crc;
+} BIT_ARRAY_DECODER;
+
+// flags is 0 or BIT_STREAM_CRC
+// bitarr must not be changed until the encoder is done
+void bit_array_encoder_init(BIT_ARRAY_ENCODER *enc, const BIT_ARRAY *bitarr,
+                            int flags);
+
+// Range is clipped to the end of the array
+void bit_array_encoder_init_range(BIT_ARRAY_ENCODER *enc,
+                                  const BIT_ARRAY *bitarr,
+                                  word_addr_t first_word, word_addr_t num_words,
+                                  int flags);
+
+// Write up to len bytes of the stream to buf. Returns number of bytes written,
+// which is less than len only at the end of the stream
+size_t bit_array_encoder_drain(BIT_ARRAY_ENCODER *enc, void *buf, size_t len);
+
+// Returns 1 once the whole stream has been drained
+char bit_array_encoder_done(const BIT_ARRAY_ENCODER *enc);
+
+// bitarr is resized when the 8 byte header has been fed
+void bit_array_decoder_init(BIT_ARRAY_DECODER *dec, BIT_ARRAY *bitarr,
+                            int flags);
+
+// num_bits is the length of the saved array (see bit_array_stream_num_bits())
+// bitarr is resized to the bits in the range straight away
+void bit_array_decoder_init_range(BIT_ARRAY_DECODER *dec, BIT_ARRAY *bitarr,
+                                  bit_index_t num_bits,
+                                  word_addr_t first_word, word_addr_t num_words,
+                                  int flags);
+
+// Read up to len bytes from buf. Returns number of bytes used, which is less
+// than len only once the end of the stream is reached
+size_t bit_array_decoder_feed(BIT_ARRAY_DECODER *dec, const void *buf,
+                              size_t len);
+
+// Returns 1 if the whole stream was fed and the CRC (if any) matched,
+// 0 if the stream is incomplete or corrupt
+char bit_array_decoder_finish(const BIT_ARRAY_DECODER *dec);
+
+// Number of bits stored in the 8 byte header of a saved array
+bit_index_t bit_array_stream_num_bits(const uint8_t hdr[8]);
+
+// Byte offset of a word in a saved array of num_bits, clipped to the end of
+// the data. bit_array_stream_offset(n, 0) is 8
+uint64_t bit_array_stream_offset(bit_index_t num_bits, word_addr_t word);
+
+// Total bytes in a stream of an array of num_bits, flags as above
+uint64_t bit_array_stream_size(bit_index_t num_bits, int flags);
+
+// CRC32C of len bytes. Pass crc as 0 at the start, or the previous result to
+// continue over more data
+uint32_t bit_array_crc32c(uint32_t crc, const void *buf, size_t len);
+
+//
+// Memory mapped files
+//
+// File format is [64 bytes: header][data] where header is
+//   ["BITARRAY"][4 bytes: version][4 bytes: header size]
+//   [8 bytes: number of bits][8 bytes: number of words][32 bytes: zero]
+// data is num_of_words x 8 bytes, little endian, starting 64 byte aligned
+//
+
+// Saves bit array in the aligned format
+// returns the number of bytes written
+bit_index_t bit_array_save_aligned(const BIT_ARRAY* bitarr, FILE* f);
+
+// Map a file written by bit_array_save_aligned() without copying it.
+// If copy_on_write is 0 the array is read-only (writing to it will crash),
+// otherwise changes are private to this process and not written to the file.
+// The array is a view (cannot be resized), and must be released with
+// bit_array_munmap()
+// Returns NULL on failure and sets errno (EINVAL if the file is not valid)
+BIT_ARRAY* bit_array_mmap(const char* path, char copy_on_write);
+void bit_array_munmap(BIT_ARRAY* bitarr);
+
 
 //
 // Hash function
@@ -526,15 +1032,93 @@ char bit_array_load(BIT_ARRAY* bitarr, FILE* f);
 // Using bob jenkins hash lookup3
 uint64_t bit_array_hash(const BIT_ARRAY* bitarr, uint64_t seed);
 
+//
+// Write tracking
+//
+// Once started, every write marks the 4KB blocks (512 words) it touches as
+// dirty. Dirty blocks can be listed, saved or diffed without reading the
+// rest of the array. Tracking also keeps a popcount per block and a hash tree
+// over the blocks, so bit_array_track_num_bits_set() and
+// bit_array_track_hash() only rescan blocks written since they were last
+// called. A tracked array is not thread safe, even for queries.
+//
+
+// Start tracking with no blocks dirty. Does nothing if already tracking.
+// Returns 1 on success, 0 if out of memory (sets errno to ENOMEM)
+char bit_array_track_start(BIT_ARRAY* bitarr);
+void bit_array_track_stop(BIT_ARRAY* bitarr);
+
+// Find the first run of dirty words at or after *word, clipped to the array.
+// Sets *word to the start of the run, *num_words to its length.
+// Returns 1 if found, 0 if there are no more. To visit all runs:
+//   for(w = 0; bit_array_dirty_next(arr, &w, &n); w += n) { ... }
+char bit_array_dirty_next(const BIT_ARRAY* bitarr, word_addr_t *word,
+                          word_addr_t *num_words);
+
+// Number of dirty blocks in the array
+size_t bit_array_dirty_num_blocks(const BIT_ARRAY* bitarr);
+
+// Mark all blocks clean e.g. after saving or copying the dirty ranges
+void bit_array_dirty_clear(BIT_ARRAY* bitarr);
+
+// Same as bit_array_num_bits_set(), updated from the blocks written
+bit_index_t bit_array_track_num_bits_set(BIT_ARRAY* bitarr);
+
+// Hash of the length and contents, updated in O(blocks written * log blocks)
+// Not the same value as bit_array_hash(). Arrays of equal length and contents
+// have the same hash, however they were written.
+uint64_t bit_array_track_hash(BIT_ARRAY* bitarr);
+
+// Update a file written by bit_array_save() or bit_array_save_aligned() with
+// the header and dirty blocks. f must be open for reading and writing ("r+b"),
+// positioned at the start of the array, and hold the array as it was when
+// dirty blocks were last cleared. A file left longer than the array is not
+// truncated (loading ignores the extra bytes).
+// Returns the number of bytes written, 0 on error
+bit_index_t bit_array_save_dirty(const BIT_ARRAY* bitarr, FILE* f);
+
+// Hamming distance to other, only reading the dirty blocks of bitarr.
+// Same as bit_array_hamming_distance() if other is a copy of bitarr from when
+// dirty blocks were last cleared.
+bit_index_t bit_array_dirty_hamming_distance(const BIT_ARRAY* bitarr,
+                                             const BIT_ARRAY* other);
+
 //
 // Randomness
 //
 
+// Random number generator (xoshiro256**). Seeded generators give the same
+// sequence on every platform. Functions taking a BIT_ARRAY_RNG are reentrant:
+// give each thread its own generator, e.g. one seed then jumps.
+typedef struct { uint64_t s[4]; } BIT_ARRAY_RNG;
+
+// Seed with any value (expanded with splitmix64)
+void bit_array_rng_seed(BIT_ARRAY_RNG *rng, uint64_t seed);
+uint64_t bit_array_rng_next(BIT_ARRAY_RNG *rng);
+// Uniform in [0, n) with no modulo bias, n > 0
+uint64_t bit_array_rng_below(BIT_ARRAY_RNG *rng, uint64_t n);
+// Skip 2^128 values: gives 2^128 non-overlapping sequences from one seed
+void bit_array_rng_jump(BIT_ARRAY_RNG *rng);
+
 // Set bits randomly with probability prob : 0 <= prob <= 1
+// Uses a generator seeded from the time and process id on first use, so is
+// not thread safe. prob is rounded to a multiple of 2^-32.
 void bit_array_random(BIT_ARRAY* bitarr, float prob);
+void bit_array_random_rng(BIT_ARRAY* bitarr, float prob, BIT_ARRAY_RNG *rng);
+
+// Set exactly k random bits and clear the rest (uniform over all choices)
+void bit_array_random_k(BIT_ARRAY* bitarr, bit_index_t k, BIT_ARRAY_RNG *rng);
+
+// Set or clear randomly chosen bits until exactly k are set.
+// If bits were independently random with any probability, they are uniform
+// over arrays with k bits set afterwards.
+void bit_array_random_adjust(BIT_ARRAY* bitarr, bit_index_t k,
+                             BIT_ARRAY_RNG *rng);
 
 // Shuffle the bits in an array randomly
+// bit_array_shuffle uses the same generator as bit_array_random
 void bit_array_shuffle(BIT_ARRAY* bitarr);
+void bit_array_shuffle_rng(BIT_ARRAY* bitarr, BIT_ARRAY_RNG *rng);
 
 // Get the next permutation of an array with a fixed size and given number of
 // bits set.  Also known as next lexicographic permutation.
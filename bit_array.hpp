@@ -0,0 +1,502 @@
+/*
+ bit_array.hpp
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// C++17 wrapper for bit_array.h. Header only, link with libbitarr.a
+//
+// bitarr::bit_array: owns a BIT_ARRAY and frees it. It can be moved but not
+//   copied, so there are no hidden clones: call clone() to copy.
+//   &, |, ^ and ~ build expressions that are evaluated in one pass over the
+//   words when assigned. d = a & b | ~c reads each word of a, b and c once
+//   and makes no temporary arrays. The result is as long as the longest
+//   operand, shorter operands are zero extended first (so ~ of a short array
+//   is all ones past its end).
+// bitarr::fixed_bit_array<N>: N bits stored inline (no heap) with constexpr
+//   loop bounds, so small masks are unrolled and vectorised by the compiler.
+//
+// Both give their words as a bitarr::span, which is std::span in C++20.
+// Out of memory throws std::bad_alloc.
+
+#ifndef BIT_ARRAY_HPP_SEEN
+#define BIT_ARRAY_HPP_SEEN
+
+#if __cplusplus < 201703L
+  #error "bit_array.hpp needs C++17 or later"
+#endif
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus > 201703L && defined(__has_include)
+  #if __has_include(<span>)
+    #include <span>
+  #endif
+#endif
+
+#include "bit_array.h"
+
+namespace bitarr {
+
+#if defined(__cpp_lib_span)
+template<class T> using span = std::span<T>;
+#else
+// The parts of std::span we use
+template<class T>
+class span
+{
+ public:
+  constexpr span() noexcept : ptr_(nullptr), len_(0) {}
+  constexpr span(T *ptr, std::size_t len) noexcept : ptr_(ptr), len_(len) {}
+  constexpr T* data() const noexcept { return ptr_; }
+  constexpr std::size_t size() const noexcept { return len_; }
+  constexpr bool empty() const noexcept { return len_ == 0; }
+  constexpr T& operator[](std::size_t i) const { return ptr_[i]; }
+  constexpr T* begin() const noexcept { return ptr_; }
+  constexpr T* end() const noexcept { return ptr_ + len_; }
+ private:
+  T *ptr_;
+  std::size_t len_;
+};
+#endif
+
+class bit_array;
+
+namespace detail {
+
+// Mask of the bits used in the top word of an nbits array
+constexpr word_t top_mask(bit_index_t nbits)
+{
+  return nbits % 64 ? ~(word_t)0 >> (64 - nbits % 64) : ~(word_t)0;
+}
+
+//
+// Expressions
+//
+// Each expression can give its length in bits and its words. word(i) may only
+// be called for i < min_words() (all operands have word i), word_ext(i) for
+// any i (zero extends).
+//
+
+struct expr_base {};
+
+template<class E>
+constexpr bool is_expr = std::is_base_of_v<expr_base, E>;
+
+template<class T>
+constexpr bool is_operand = is_expr<T> || std::is_same_v<T, bit_array>;
+
+// Words of an array
+struct leaf : expr_base
+{
+  const BIT_ARRAY *arr;
+  explicit leaf(const BIT_ARRAY *a) noexcept : arr(a) {}
+  bit_index_t num_bits() const noexcept { return arr->num_of_bits; }
+  word_addr_t min_words() const noexcept { return arr->num_of_words; }
+  word_t word(word_addr_t i) const noexcept { return arr->words[i]; }
+  word_t word_ext(word_addr_t i) const noexcept {
+    return i < arr->num_of_words ? arr->words[i] : 0;
+  }
+};
+
+struct op_and { static word_t apply(word_t a, word_t b) noexcept { return a & b; } };
+struct op_or  { static word_t apply(word_t a, word_t b) noexcept { return a | b; } };
+struct op_xor { static word_t apply(word_t a, word_t b) noexcept { return a ^ b; } };
+
+template<class Op, class L, class R>
+struct binary : expr_base
+{
+  L l;
+  R r;
+  binary(const L &a, const R &b) noexcept : l(a), r(b) {}
+  bit_index_t num_bits() const noexcept {
+    return l.num_bits() > r.num_bits() ? l.num_bits() : r.num_bits();
+  }
+  word_addr_t min_words() const noexcept {
+    return l.min_words() < r.min_words() ? l.min_words() : r.min_words();
+  }
+  word_t word(word_addr_t i) const noexcept { return Op::apply(l.word(i), r.word(i)); }
+  word_t word_ext(word_addr_t i) const noexcept {
+    return Op::apply(l.word_ext(i), r.word_ext(i));
+  }
+};
+
+template<class E>
+struct negate : expr_base
+{
+  E e;
+  explicit negate(const E &a) noexcept : e(a) {}
+  bit_index_t num_bits() const noexcept { return e.num_bits(); }
+  word_addr_t min_words() const noexcept { return e.min_words(); }
+  word_t word(word_addr_t i) const noexcept { return ~e.word(i); }
+  word_t word_ext(word_addr_t i) const noexcept { return ~e.word_ext(i); }
+};
+
+template<class E>
+const E& as_expr(const E &e) noexcept { return e; }
+inline leaf as_expr(const bit_array &a) noexcept;
+
+template<class T>
+using expr_t = std::decay_t<decltype(as_expr(std::declval<const T&>()))>;
+
+// Evaluate e into dst in one pass. dst may be one of the operands: word i of
+// the result only depends on word i of each operand.
+template<class E>
+void assign(BIT_ARRAY *dst, const E &e)
+{
+  bit_index_t nbits = e.num_bits();
+  if(!bit_array_resize(dst, nbits)) throw std::bad_alloc();
+  bit_array_prepare_write(dst, 0, nbits);
+
+  word_t *w = dst->words;
+  word_addr_t n = dst->num_of_words, m = e.min_words(), i;
+  if(m > n) m = n;
+
+  for(i = 0; i < m; i++) w[i] = e.word(i);
+  for(; i < n; i++) w[i] = e.word_ext(i);
+  if(n > 0) w[n-1] &= top_mask(nbits);
+}
+
+} // namespace detail
+
+//
+// Bit array on the heap
+//
+
+class bit_array
+{
+ public:
+  explicit bit_array(bit_index_t nbits = 0) : arr_(bit_array_create(nbits)) {
+    if(arr_ == nullptr) throw std::bad_alloc();
+  }
+
+  // From a string of '0' and '1', index 0 first
+  explicit bit_array(const char *str) : bit_array(bit_index_t(0)) {
+    bit_array_from_str(arr_, str);
+  }
+
+  // Evaluate an expression into a new array
+  template<class E, std::enable_if_t<detail::is_expr<E>, int> = 0>
+  bit_array(const E &e) : bit_array(bit_index_t(0)) { detail::assign(arr_, e); }
+
+  // Take ownership of an array made with the C API
+  static bit_array adopt(BIT_ARRAY *arr) noexcept { return bit_array(arr, 0); }
+
+  ~bit_array() { if(arr_ != nullptr) bit_array_free(arr_); }
+
+  // No hidden copies. A moved from array may only be assigned to or destroyed
+  bit_array(const bit_array&) = delete;
+  bit_array& operator=(const bit_array&) = delete;
+  bit_array(bit_array &&other) noexcept : arr_(other.arr_) { other.arr_ = nullptr; }
+  bit_array& operator=(bit_array &&other) noexcept {
+    std::swap(arr_, other.arr_);
+    return *this;
+  }
+
+  template<class E, std::enable_if_t<detail::is_expr<E>, int> = 0>
+  bit_array& operator=(const E &e) { detail::assign(arr_, e); return *this; }
+
+  template<class T, std::enable_if_t<detail::is_operand<T>, int> = 0>
+  bit_array& operator&=(const T &t) {
+    detail::assign(arr_, detail::binary<detail::op_and, detail::leaf, detail::expr_t<T>>(
+                           detail::leaf(arr_), detail::as_expr(t)));
+    return *this;
+  }
+
+  template<class T, std::enable_if_t<detail::is_operand<T>, int> = 0>
+  bit_array& operator|=(const T &t) {
+    detail::assign(arr_, detail::binary<detail::op_or, detail::leaf, detail::expr_t<T>>(
+                           detail::leaf(arr_), detail::as_expr(t)));
+    return *this;
+  }
+
+  template<class T, std::enable_if_t<detail::is_operand<T>, int> = 0>
+  bit_array& operator^=(const T &t) {
+    detail::assign(arr_, detail::binary<detail::op_xor, detail::leaf, detail::expr_t<T>>(
+                           detail::leaf(arr_), detail::as_expr(t)));
+    return *this;
+  }
+
+  bit_array clone() const {
+    BIT_ARRAY *cpy = bit_array_clone(arr_);
+    if(cpy == nullptr) throw std::bad_alloc();
+    return adopt(cpy);
+  }
+
+  // Copy-on-write clone (see bit_array_clone_cow)
+  bit_array clone_cow() {
+    BIT_ARRAY *cpy = bit_array_clone_cow(arr_);
+    if(cpy == nullptr) throw std::bad_alloc();
+    return adopt(cpy);
+  }
+
+  bit_index_t size() const noexcept { return arr_->num_of_bits; }
+  bool empty() const noexcept { return arr_->num_of_bits == 0; }
+
+  void resize(bit_index_t nbits) {
+    if(!bit_array_resize(arr_, nbits)) throw std::bad_alloc();
+  }
+
+  bool get(bit_index_t i) const { return bit_array_get_bit(arr_, i); }
+  bool operator[](bit_index_t i) const { return get(i); }
+  bit_array& set(bit_index_t i) { bit_array_set_bit(arr_, i); return *this; }
+  bit_array& clear(bit_index_t i) { bit_array_clear_bit(arr_, i); return *this; }
+  bit_array& toggle(bit_index_t i) { bit_array_toggle_bit(arr_, i); return *this; }
+  bit_array& assign(bit_index_t i, bool v) {
+    bit_array_assign_bit(arr_, i, v);
+    return *this;
+  }
+
+  bit_array& set_all() { bit_array_set_all(arr_); return *this; }
+  bit_array& clear_all() { bit_array_clear_all(arr_); return *this; }
+  bit_array& toggle_all() { bit_array_toggle_all(arr_); return *this; }
+
+  bit_index_t count() const { return bit_array_num_bits_set(arr_); }
+
+  span<const word_t> words() const noexcept {
+    return span<const word_t>(arr_->words, arr_->num_of_words);
+  }
+
+  // Words to write directly. Bits above size() in the top word must be left
+  // zero. Prepares copy-on-write clones and write tracking for the whole
+  // array, so take this once rather than per word.
+  span<word_t> mutable_words() {
+    bit_array_prepare_write(arr_, 0, arr_->num_of_bits);
+    return span<word_t>(arr_->words, arr_->num_of_words);
+  }
+
+  std::string to_string() const {
+    std::string str(arr_->num_of_bits, '0');
+    if(!str.empty()) bit_array_to_str(arr_, &str[0]);
+    return str;
+  }
+
+  // For the C API
+  BIT_ARRAY* c_ptr() noexcept { return arr_; }
+  const BIT_ARRAY* c_ptr() const noexcept { return arr_; }
+
+  // Give up ownership, to be freed with bit_array_free()
+  BIT_ARRAY* release() noexcept {
+    BIT_ARRAY *arr = arr_;
+    arr_ = nullptr;
+    return arr;
+  }
+
+  // Same length and bits
+  friend bool operator==(const bit_array &a, const bit_array &b) noexcept {
+    return a.size() == b.size() &&
+           (a.size() == 0 || std::memcmp(a.arr_->words, b.arr_->words,
+                                         a.arr_->num_of_words * sizeof(word_t)) == 0);
+  }
+  friend bool operator!=(const bit_array &a, const bit_array &b) noexcept {
+    return !(a == b);
+  }
+
+ private:
+  bit_array(BIT_ARRAY *arr, int) noexcept : arr_(arr) {}
+  BIT_ARRAY *arr_;
+};
+
+namespace detail {
+
+inline leaf as_expr(const bit_array &a) noexcept { return leaf(a.c_ptr()); }
+
+// Operators on arrays and expressions. Nothing is computed until the result
+// is assigned to a bit_array or passed to count(). They live in detail so
+// argument dependent lookup finds them for expressions too
+template<class L, class R,
+         std::enable_if_t<is_operand<L> && is_operand<R>, int> = 0>
+binary<op_and, expr_t<L>, expr_t<R>>
+operator&(const L &l, const R &r)
+{
+  return {as_expr(l), as_expr(r)};
+}
+
+template<class L, class R,
+         std::enable_if_t<is_operand<L> && is_operand<R>, int> = 0>
+binary<op_or, expr_t<L>, expr_t<R>>
+operator|(const L &l, const R &r)
+{
+  return {as_expr(l), as_expr(r)};
+}
+
+template<class L, class R,
+         std::enable_if_t<is_operand<L> && is_operand<R>, int> = 0>
+binary<op_xor, expr_t<L>, expr_t<R>>
+operator^(const L &l, const R &r)
+{
+  return {as_expr(l), as_expr(r)};
+}
+
+template<class E, std::enable_if_t<is_operand<E>, int> = 0>
+negate<expr_t<E>> operator~(const E &e)
+{
+  return negate<expr_t<E>>(as_expr(e));
+}
+
+} // namespace detail
+
+using detail::operator&;
+using detail::operator|;
+using detail::operator^;
+using detail::operator~;
+
+// Number of bits set in the result of an expression, without storing it
+template<class E, std::enable_if_t<detail::is_operand<E>, int> = 0>
+bit_index_t count(const E &expr)
+{
+  const detail::expr_t<E> &e = detail::as_expr(expr);
+  bit_index_t nbits = e.num_bits(), c = 0;
+  word_addr_t n = (nbits + 63) / 64, m = e.min_words(), i;
+  if(m > n) m = n;
+  if(n == 0) return 0;
+
+  for(i = 0; i < m && i + 1 < n; i++) c += __builtin_popcountll(e.word(i));
+  for(; i + 1 < n; i++) c += __builtin_popcountll(e.word_ext(i));
+  return c + __builtin_popcountll(e.word_ext(n-1) & detail::top_mask(nbits));
+}
+
+//
+// Fixed size bit array
+//
+
+template<std::size_t N>
+class fixed_bit_array
+{
+  static_assert(N > 0, "fixed_bit_array needs at least one bit");
+
+ public:
+  static constexpr std::size_t num_words = (N + 63) / 64;
+
+  constexpr fixed_bit_array() noexcept : w_{} {}
+
+  static constexpr std::size_t size() noexcept { return N; }
+
+  constexpr bool test(std::size_t i) const noexcept { return (w_[i / 64] >> (i % 64)) & 1; }
+  constexpr bool operator[](std::size_t i) const noexcept { return test(i); }
+
+  constexpr fixed_bit_array& set(std::size_t i) noexcept {
+    w_[i / 64] |= (word_t)1 << (i % 64);
+    return *this;
+  }
+  constexpr fixed_bit_array& clear(std::size_t i) noexcept {
+    w_[i / 64] &= ~((word_t)1 << (i % 64));
+    return *this;
+  }
+  constexpr fixed_bit_array& toggle(std::size_t i) noexcept {
+    w_[i / 64] ^= (word_t)1 << (i % 64);
+    return *this;
+  }
+  constexpr fixed_bit_array& assign(std::size_t i, bool v) noexcept {
+    return v ? set(i) : clear(i);
+  }
+
+  constexpr fixed_bit_array& set_all() noexcept {
+    for(std::size_t i = 0; i < num_words; i++) w_[i] = ~(word_t)0;
+    w_[num_words-1] &= detail::top_mask(N);
+    return *this;
+  }
+  constexpr fixed_bit_array& clear_all() noexcept {
+    for(std::size_t i = 0; i < num_words; i++) w_[i] = 0;
+    return *this;
+  }
+
+  constexpr std::size_t count() const noexcept {
+    std::size_t c = 0;
+    for(std::size_t i = 0; i < num_words; i++) c += __builtin_popcountll(w_[i]);
+    return c;
+  }
+
+  constexpr bool any() const noexcept {
+    word_t x = 0;
+    for(std::size_t i = 0; i < num_words; i++) x |= w_[i];
+    return x != 0;
+  }
+  constexpr bool none() const noexcept { return !any(); }
+  constexpr bool all() const noexcept { return count() == N; }
+
+  constexpr fixed_bit_array& operator&=(const fixed_bit_array &o) noexcept {
+    for(std::size_t i = 0; i < num_words; i++) w_[i] &= o.w_[i];
+    return *this;
+  }
+  constexpr fixed_bit_array& operator|=(const fixed_bit_array &o) noexcept {
+    for(std::size_t i = 0; i < num_words; i++) w_[i] |= o.w_[i];
+    return *this;
+  }
+  constexpr fixed_bit_array& operator^=(const fixed_bit_array &o) noexcept {
+    for(std::size_t i = 0; i < num_words; i++) w_[i] ^= o.w_[i];
+    return *this;
+  }
+
+  // Shift towards higher / lower indices, shifting in zeros
+  constexpr fixed_bit_array& operator<<=(std::size_t dist) noexcept {
+    std::size_t q = dist / 64, r = dist % 64;
+    for(std::size_t i = num_words; i-- > 0; ) {
+      word_t hi = i >= q ? w_[i - q] : 0;
+      word_t lo = i >= q + 1 && r ? w_[i - q - 1] >> (64 - r) : 0;
+      w_[i] = (hi << r) | lo;
+    }
+    w_[num_words-1] &= detail::top_mask(N);
+    return *this;
+  }
+  constexpr fixed_bit_array& operator>>=(std::size_t dist) noexcept {
+    std::size_t q = dist / 64, r = dist % 64;
+    for(std::size_t i = 0; i < num_words; i++) {
+      word_t lo = i + q < num_words ? w_[i + q] : 0;
+      word_t hi = i + q + 1 < num_words && r ? w_[i + q + 1] << (64 - r) : 0;
+      w_[i] = (lo >> r) | hi;
+    }
+    return *this;
+  }
+
+  friend constexpr fixed_bit_array operator&(fixed_bit_array a, const fixed_bit_array &b) noexcept { return a &= b; }
+  friend constexpr fixed_bit_array operator|(fixed_bit_array a, const fixed_bit_array &b) noexcept { return a |= b; }
+  friend constexpr fixed_bit_array operator^(fixed_bit_array a, const fixed_bit_array &b) noexcept { return a ^= b; }
+  friend constexpr fixed_bit_array operator<<(fixed_bit_array a, std::size_t d) noexcept { return a <<= d; }
+  friend constexpr fixed_bit_array operator>>(fixed_bit_array a, std::size_t d) noexcept { return a >>= d; }
+
+  friend constexpr fixed_bit_array operator~(fixed_bit_array a) noexcept {
+    for(std::size_t i = 0; i < num_words; i++) a.w_[i] = ~a.w_[i];
+    a.w_[num_words-1] &= detail::top_mask(N);
+    return a;
+  }
+
+  friend constexpr bool operator==(const fixed_bit_array &a, const fixed_bit_array &b) noexcept {
+    word_t x = 0;
+    for(std::size_t i = 0; i < num_words; i++) x |= a.w_[i] ^ b.w_[i];
+    return x == 0;
+  }
+  friend constexpr bool operator!=(const fixed_bit_array &a, const fixed_bit_array &b) noexcept {
+    return !(a == b);
+  }
+
+  constexpr span<const word_t> words() const noexcept {
+    return span<const word_t>(w_.data(), num_words);
+  }
+  // Bits above N in the top word must be left zero
+  constexpr span<word_t> words() noexcept { return span<word_t>(w_.data(), num_words); }
+
+  // A view of these words (see bit_array_view), for the C API
+  BIT_ARRAY c_view() noexcept {
+    BIT_ARRAY view;
+    bit_array_view(&view, w_.data(), N);
+    return view;
+  }
+
+ private:
+  std::array<word_t, num_words> w_;
+};
+
+} // namespace bitarr
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ bit_array_atomic.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Segment 0 holds words [0, SEG), segment k > 0 holds words
+// [SEG << (k-1), SEG << k).  A segment is installed with a CAS before
+// num_of_bits is raised to cover it, so any index below the length a thread
+// has loaded points into memory that is already there.
+//
+// Bits at or above num_of_bits are always zero: claims never take a bit past
+// the length, and other writes must stay below it. Those checks are assert()s,
+// so with NDEBUG an out of range write is not caught.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "bit_array_atomic.h"
+
+#define SEG BIT_ARRAY_ATOMIC_SEG_WORDS
+#define WORD_SIZE 64
+#define WORD_MAX  (~(word_t)0)
+
+#define MIN(a, b)  (((a) <= (b)) ? (a) : (b))
+
+#define _length(arr) __atomic_load_n(&(arr)->num_of_bits, __ATOMIC_ACQUIRE)
+
+static inline size_t _seg_index(word_addr_t w)
+{
+  return w < SEG ? 0 : (size_t)(WORD_SIZE - leading_zeros(w / SEG));
+}
+
+static inline word_addr_t _seg_start(size_t k)
+{
+  return k == 0 ? 0 : (word_addr_t)SEG << (k-1);
+}
+
+static inline word_addr_t _seg_words(size_t k)
+{
+  return k == 0 ? SEG : (word_addr_t)SEG << (k-1);
+}
+
+// Pointer to word w, which must be below the length
+static inline word_t* _word_ptr(const BIT_ARRAY_ATOMIC* arr, word_addr_t w)
+{
+  size_t k = _seg_index(w);
+  word_t *seg = __atomic_load_n(&arr->segments[k], __ATOMIC_ACQUIRE);
+  assert(seg != NULL);
+  return seg + (w - _seg_start(k));
+}
+
+BIT_ARRAY_ATOMIC* bit_array_atomic_create(bit_index_t nbits)
+{
+  BIT_ARRAY_ATOMIC *arr = (BIT_ARRAY_ATOMIC*)calloc(1, sizeof(BIT_ARRAY_ATOMIC));
+  if(arr == NULL) { errno = ENOMEM; return NULL; }
+
+  if(!bit_array_atomic_ensure_size(arr, nbits)) {
+    bit_array_atomic_free(arr);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  return arr;
+}
+
+void bit_array_atomic_free(BIT_ARRAY_ATOMIC* arr)
+{
+  size_t k;
+  for(k = 0; k < BIT_ARRAY_ATOMIC_NUM_SEGS; k++) free(arr->segments[k]);
+  free(arr);
+}
+
+bit_index_t bit_array_atomic_length(const BIT_ARRAY_ATOMIC* arr)
+{
+  return _length(arr);
+}
+
+char bit_array_atomic_ensure_size(BIT_ARRAY_ATOMIC* arr, bit_index_t nbits)
+{
+  word_addr_t nwords = roundup_bits2words64(nbits);
+  size_t k, nsegs = nwords ? _seg_index(nwords - 1) + 1 : 0;
+  bit_index_t old;
+
+  // Install missing segments -- if another thread beats us, use theirs
+  for(k = 0; k < nsegs; k++)
+  {
+    if(__atomic_load_n(&arr->segments[k], __ATOMIC_ACQUIRE) != NULL) continue;
+
+    void *mem;
+    if(posix_memalign(&mem, 64, _seg_words(k) * sizeof(word_t)) != 0) return 0;
+    memset(mem, 0, _seg_words(k) * sizeof(word_t));
+
+    if(!__sync_bool_compare_and_swap(&arr->segments[k], NULL, (word_t*)mem))
+      free(mem);
+  }
+
+  // Raise the length
+  while((old = _length(arr)) < nbits &&
+        !__sync_bool_compare_and_swap(&arr->num_of_bits, old, nbits)) {}
+
+  return 1;
+}
+
+//
+// Bit operations
+//
+
+char bit_array_atomic_get(const BIT_ARRAY_ATOMIC* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = _word_ptr(arr, bitset64_wrd(b));
+  return bitset2_get_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_atomic_set(BIT_ARRAY_ATOMIC* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = _word_ptr(arr, bitset64_wrd(b));
+  return bitset2_set_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_atomic_clear(BIT_ARRAY_ATOMIC* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = _word_ptr(arr, bitset64_wrd(b));
+  return bitset2_del_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_atomic_toggle(BIT_ARRAY_ATOMIC* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = _word_ptr(arr, bitset64_wrd(b));
+  return bitset2_tgl_mt(ptr, 0, bitset64_idx(b));
+}
+
+// Mask of bits in word w that are below nbits
+static inline word_t _word_mask(word_addr_t w, bit_index_t nbits)
+{
+  bit_index_t start = w * WORD_SIZE;
+  return nbits >= start + WORD_SIZE ? WORD_MAX : bitmask64(nbits - start);
+}
+
+void bit_array_atomic_or_words(BIT_ARRAY_ATOMIC* arr, word_addr_t w,
+                               const word_t* src, word_addr_t nwords)
+{
+  bit_index_t nbits = _length(arr);
+  word_addr_t i;
+  assert(w + nwords <= roundup_bits2words64(nbits));
+
+  for(i = 0; i < nwords; i++)
+    __sync_fetch_and_or(_word_ptr(arr, w+i), src[i] & _word_mask(w+i, nbits));
+}
+
+void bit_array_atomic_and_words(BIT_ARRAY_ATOMIC* arr, word_addr_t w,
+                                const word_t* src, word_addr_t nwords)
+{
+  word_addr_t i;
+  assert(w + nwords <= roundup_bits2words64(_length(arr)));
+
+  for(i = 0; i < nwords; i++)
+    __sync_fetch_and_and(_word_ptr(arr, w+i), src[i]);
+}
+
+char bit_array_atomic_find_next_clear_bit_and_claim(BIT_ARRAY_ATOMIC* arr,
+                                                    bit_index_t offset,
+                                                    bit_index_t* result)
+{
+  bit_index_t nbits = _length(arr);
+  if(offset >= nbits) return 0;
+
+  word_addr_t w, nwords = roundup_bits2words64(nbits), seg_end;
+  word_t *ptr, old, clear, mask = ~bitmask64(bitset64_idx(offset));
+
+  for(w = bitset64_wrd(offset); w < nwords; )
+  {
+    // Walk a segment at a time
+    ptr = _word_ptr(arr, w);
+    seg_end = MIN(nwords, _seg_start(_seg_index(w)) + _seg_words(_seg_index(w)));
+
+    for(; w < seg_end; w++, ptr++, mask = WORD_MAX)
+    {
+      old = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+
+      while((clear = ~old & mask & _word_mask(w, nbits)) != 0)
+      {
+        word_t bit = clear & -clear;
+        if(__atomic_compare_exchange_n(ptr, &old, old | bit, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+          *result = w * WORD_SIZE + trailing_zeros(bit);
+          return 1;
+        }
+        // lost the race: old now holds the current value, try again
+      }
+    }
+  }
+
+  return 0;
+}
+
+bit_index_t bit_array_atomic_num_bits_set(const BIT_ARRAY_ATOMIC* arr)
+{
+  word_addr_t w, nwords = roundup_bits2words64(_length(arr));
+  bit_index_t count = 0;
+
+  for(w = 0; w < nwords; w++)
+    count += (bit_index_t)__builtin_popcountll(__atomic_load_n(_word_ptr(arr, w),
+                                                               __ATOMIC_RELAXED));
+
+  return count;
+}
+
+void bit_array_atomic_to_array(const BIT_ARRAY_ATOMIC* src, BIT_ARRAY* dst)
+{
+  bit_array_resize_critical(dst, _length(src));
+  bit_array_prepare_write(dst, 0, dst->num_of_bits);
+
+  word_addr_t w;
+  for(w = 0; w < dst->num_of_words; w++)
+    dst->words[w] = __atomic_load_n(_word_ptr(src, w), __ATOMIC_RELAXED);
+
+  // src may have grown (and had bits set) since we read the length
+  if(dst->num_of_words > 0)
+    dst->words[dst->num_of_words-1] &= _word_mask(dst->num_of_words-1, dst->num_of_bits);
+}
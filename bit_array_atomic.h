@@ -0,0 +1,87 @@
+/*
+ bit_array_atomic.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Concurrent bit array: any number of threads may get, set, clear, claim and
+// grow at the same time without a lock.
+//
+// Words are stored in segments that double in size (64 words, 64, 128, 256,
+// ...). Growing only adds segments, words never move, so there is no
+// realloc and nothing to reclaim while other threads are reading.
+// The array can grow but not shrink.
+
+#ifndef BIT_ARRAY_ATOMIC_HEADER_SEEN
+#define BIT_ARRAY_ATOMIC_HEADER_SEEN
+
+#include "bit_array.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Words in the first segment -- segments are 64 byte aligned
+#define BIT_ARRAY_ATOMIC_SEG_WORDS 64
+#define BIT_ARRAY_ATOMIC_NUM_SEGS 64
+
+typedef struct
+{
+  word_t *segments[BIT_ARRAY_ATOMIC_NUM_SEGS];
+  bit_index_t num_of_bits; // only access atomically
+} BIT_ARRAY_ATOMIC;
+
+// Returns NULL if cannot malloc
+BIT_ARRAY_ATOMIC* bit_array_atomic_create(bit_index_t nbits);
+
+// Not thread safe: no other thread may be using the array
+void bit_array_atomic_free(BIT_ARRAY_ATOMIC* arr);
+
+bit_index_t bit_array_atomic_length(const BIT_ARRAY_ATOMIC* arr);
+
+// Grow to at least nbits. New bits are zero. Safe to call from many threads.
+// Returns 1 on success, 0 if out of memory
+char bit_array_atomic_ensure_size(BIT_ARRAY_ATOMIC* arr, bit_index_t nbits);
+
+//
+// Atomic bit operations ("safe": use assert() to check bounds, so indices are
+// not checked when built with NDEBUG)
+// set/clear/toggle return the value of the bit before it was changed,
+// so bit_array_atomic_set() is test-and-set
+//
+
+char bit_array_atomic_get(const BIT_ARRAY_ATOMIC* arr, bit_index_t b);
+char bit_array_atomic_set(BIT_ARRAY_ATOMIC* arr, bit_index_t b);
+char bit_array_atomic_clear(BIT_ARRAY_ATOMIC* arr, bit_index_t b);
+char bit_array_atomic_toggle(BIT_ARRAY_ATOMIC* arr, bit_index_t b);
+
+// OR / AND `nwords` words from `src` into the array, starting at word `w`
+// Each word is updated atomically, the range as a whole is not
+void bit_array_atomic_or_words(BIT_ARRAY_ATOMIC* arr, word_addr_t w,
+                               const word_t* src, word_addr_t nwords);
+void bit_array_atomic_and_words(BIT_ARRAY_ATOMIC* arr, word_addr_t w,
+                                const word_t* src, word_addr_t nwords);
+
+// Find a bit that is not set at or after `offset`, and set it.
+// Lock-free: if another thread takes the bit first we move on to the next one.
+// Returns 1 and sets result if we claimed a bit, 0 if all bits are set
+// To use as a slot allocator, grow with bit_array_atomic_ensure_size() when
+// this returns 0, and release slots with bit_array_atomic_clear()
+char bit_array_atomic_find_next_clear_bit_and_claim(BIT_ARRAY_ATOMIC* arr,
+                                                    bit_index_t offset,
+                                                    bit_index_t* result);
+
+// Counting and copying are not a snapshot if other threads are writing
+bit_index_t bit_array_atomic_num_bits_set(const BIT_ARRAY_ATOMIC* arr);
+
+// dst is resized to the length of src
+void bit_array_atomic_to_array(const BIT_ARRAY_ATOMIC* src, BIT_ARRAY* dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,630 @@
+/*
+ bit_array_mt.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Each task works on whole words of a chunk, wrapped in a BIT_ARRAY that
+// points into the caller's array, so the work itself is done by the single
+// threaded (SIMD) functions in bit_array.c.
+//
+// Chunks that write to the array start on a 64 byte boundary of the
+// destination, so no two threads write to the same cache line. Chunks that
+// feed a result (random, hash) are at fixed word offsets so the result does
+// not depend on where the array is in memory.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h> // sysconf()
+#include <pthread.h>
+
+#include "bit_array_mt.h"
+
+#define MIN(a, b)  (((a) <= (b)) ? (a) : (b))
+#define MAX(a, b)  (((a) >= (b)) ? (a) : (b))
+
+#define CHUNK BIT_ARRAY_MT_CHUNK_WORDS
+#define WORD_SIZE 64
+#define WORDS_PER_LINE 8
+
+//
+// Built-in pthread pool
+//
+
+typedef struct
+{
+  BIT_ARRAY_POOL pool; // must be first
+  pthread_t *threads;
+  unsigned num_of_threads; // worker threads (excludes caller)
+  pthread_mutex_t run_lock, lock;
+  pthread_cond_t work_cond, done_cond;
+  bit_array_task_t fn;
+  void *arg;
+  size_t num_tasks, next_task, num_done;
+  char quit;
+} PTHREAD_POOL;
+
+static void* _pool_worker(void *ptr)
+{
+  PTHREAD_POOL *p = (PTHREAD_POOL*)ptr;
+  size_t i;
+
+  pthread_mutex_lock(&p->lock);
+  while(1)
+  {
+    while(!p->quit && p->next_task >= p->num_tasks)
+      pthread_cond_wait(&p->work_cond, &p->lock);
+
+    if(p->quit) break;
+
+    i = p->next_task++;
+    pthread_mutex_unlock(&p->lock);
+    p->fn(p->arg, i);
+    pthread_mutex_lock(&p->lock);
+
+    if(++p->num_done == p->num_tasks) pthread_cond_signal(&p->done_cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void _pool_run(BIT_ARRAY_POOL *pool, size_t n, bit_array_task_t fn, void *arg)
+{
+  PTHREAD_POOL *p = (PTHREAD_POOL*)pool;
+  size_t i;
+
+  pthread_mutex_lock(&p->run_lock);
+  pthread_mutex_lock(&p->lock);
+
+  p->fn = fn;
+  p->arg = arg;
+  p->num_tasks = n;
+  p->next_task = p->num_done = 0;
+  pthread_cond_broadcast(&p->work_cond);
+
+  // Calling thread works too
+  while(p->next_task < p->num_tasks) {
+    i = p->next_task++;
+    pthread_mutex_unlock(&p->lock);
+    fn(arg, i);
+    pthread_mutex_lock(&p->lock);
+    p->num_done++;
+  }
+
+  while(p->num_done < p->num_tasks)
+    pthread_cond_wait(&p->done_cond, &p->lock);
+
+  p->num_tasks = p->next_task = 0;
+
+  pthread_mutex_unlock(&p->lock);
+  pthread_mutex_unlock(&p->run_lock);
+}
+
+BIT_ARRAY_POOL* bit_array_pool_create(unsigned nthreads)
+{
+  if(nthreads == 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpus > 0 ? (unsigned)ncpus : 1;
+  }
+
+  PTHREAD_POOL *p = (PTHREAD_POOL*)calloc(1, sizeof(PTHREAD_POOL));
+  if(p == NULL) { errno = ENOMEM; return NULL; }
+
+  p->threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+  if(p->threads == NULL) { free(p); errno = ENOMEM; return NULL; }
+
+  p->pool.run = _pool_run;
+  p->pool.ctx = NULL;
+  pthread_mutex_init(&p->run_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_cond, NULL);
+  pthread_cond_init(&p->done_cond, NULL);
+
+  for(p->num_of_threads = 0; p->num_of_threads < nthreads - 1; p->num_of_threads++)
+  {
+    int err = pthread_create(&p->threads[p->num_of_threads], NULL, _pool_worker, p);
+    if(err != 0) {
+      bit_array_pool_free(&p->pool);
+      errno = err;
+      return NULL;
+    }
+  }
+
+  return &p->pool;
+}
+
+void bit_array_pool_free(BIT_ARRAY_POOL *pool)
+{
+  PTHREAD_POOL *p = (PTHREAD_POOL*)pool;
+  unsigned i;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->work_cond);
+  pthread_mutex_unlock(&p->lock);
+
+  for(i = 0; i < p->num_of_threads; i++)
+    pthread_join(p->threads[i], NULL);
+
+  pthread_mutex_destroy(&p->run_lock);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work_cond);
+  pthread_cond_destroy(&p->done_cond);
+  free(p->threads);
+  free(p);
+}
+
+//
+// Chunks
+//
+
+static void _run_tasks(BIT_ARRAY_POOL *pool, size_t n, bit_array_task_t fn, void *arg)
+{
+  size_t i;
+  if(pool == NULL || n < 2) {
+    for(i = 0; i < n; i++) fn(arg, i);
+  }
+  else pool->run(pool, n, fn, arg);
+}
+
+// Number of words from `words` to the start of its cache line
+static inline word_addr_t _line_offset(const word_t *words)
+{
+  return ((uintptr_t)words / sizeof(word_t)) % WORDS_PER_LINE;
+}
+
+// Chunk boundaries are at i*CHUNK - offset
+static inline size_t _num_chunks(word_addr_t nwords, word_addr_t offset)
+{
+  return (nwords + offset + CHUNK - 1) / CHUNK;
+}
+
+static inline void _chunk(size_t i, word_addr_t nwords, word_addr_t offset,
+                          word_addr_t *start, word_addr_t *end)
+{
+  *start = i == 0 ? 0 : i * CHUNK - offset;
+  *end = MIN(nwords, (i + 1) * CHUNK - offset);
+}
+
+// View of nwords full words, pointing into another array
+static inline BIT_ARRAY* _view(BIT_ARRAY *view, const word_t *words,
+                               word_addr_t nwords)
+{
+  return bit_array_view(view, (word_t*)words, nwords * WORD_SIZE);
+}
+
+typedef enum {MT_AND, MT_OR, MT_XOR} MtOp;
+
+typedef struct
+{
+  BIT_ARRAY *dst;
+  const BIT_ARRAY *src1, *src2;
+  BIT_ARRAY **outputs; // interleave
+  const BIT_ARRAY **inputs;
+  size_t ways;
+  word_t *words;
+  word_addr_t num_of_words, offset;
+  bit_index_t start, len;
+  uint64_t seed, *results;
+  uint32_t threshold;
+  MtOp op;
+} MT_JOB;
+
+//
+// Count
+//
+
+static void _count_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  word_addr_t s, e;
+  _chunk(i, job->num_of_words, job->offset, &s, &e);
+  BIT_ARRAY view;
+  _view(&view, job->words + s, e - s);
+  job->results[i] = bit_array_num_bits_set(&view);
+}
+
+bit_index_t bit_array_num_bits_set_mt(const BIT_ARRAY* bitarr, BIT_ARRAY_POOL *pool)
+{
+  if(pool == NULL || bitarr->num_of_words < BIT_ARRAY_MT_MIN_WORDS)
+    return bit_array_num_bits_set(bitarr);
+
+  MT_JOB job;
+  job.words = bitarr->words;
+  job.num_of_words = bitarr->num_of_words;
+  job.offset = _line_offset(bitarr->words);
+
+  size_t i, n = _num_chunks(job.num_of_words, job.offset);
+  job.results = (uint64_t*)malloc(n * sizeof(uint64_t));
+  if(job.results == NULL) return bit_array_num_bits_set(bitarr);
+
+  _run_tasks(pool, n, _count_task, &job);
+
+  bit_index_t count = 0;
+  for(i = 0; i < n; i++) count += job.results[i];
+
+  free(job.results);
+  return count;
+}
+
+//
+// Logic operators
+//
+
+static void _logic_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  word_addr_t s, e, a, b;
+  word_addr_t min_words = MIN(job->src1->num_of_words, job->src2->num_of_words);
+  word_addr_t max_words = MAX(job->src1->num_of_words, job->src2->num_of_words);
+  word_t *dwords = job->dst->words;
+
+  _chunk(i, job->num_of_words, job->offset, &s, &e);
+
+  // Words in both sources
+  if(s < min_words)
+  {
+    b = MIN(e, min_words);
+    BIT_ARRAY vdst, v1, v2;
+    _view(&vdst, dwords + s, b - s);
+    _view(&v1, job->src1->words + s, b - s);
+    _view(&v2, job->src2->words + s, b - s);
+    switch(job->op) {
+      case MT_AND: bit_array_and(&vdst, &v1, &v2); break;
+      case MT_OR:  bit_array_or (&vdst, &v1, &v2); break;
+      case MT_XOR: bit_array_xor(&vdst, &v1, &v2); break;
+    }
+  }
+
+  // Words in the longer source only
+  a = MAX(s, min_words);
+  b = MIN(e, max_words);
+  if(job->op != MT_AND && a < b)
+  {
+    const BIT_ARRAY *longer = job->src1->num_of_words > job->src2->num_of_words
+                            ? job->src1 : job->src2;
+    if(longer != job->dst)
+      memcpy(dwords + a, longer->words + a, (b - a) * sizeof(word_t));
+    a = b;
+  }
+
+  // Remaining words are zero
+  if(a < e) memset(dwords + a, 0, (e - a) * sizeof(word_t));
+}
+
+static void _logic_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                      BIT_ARRAY_POOL *pool, MtOp op)
+{
+  word_addr_t max_words = MAX(src1->num_of_words, src2->num_of_words);
+
+  if(pool == NULL || max_words < BIT_ARRAY_MT_MIN_WORDS)
+  {
+    switch(op) {
+      case MT_AND: bit_array_and(dst, src1, src2); break;
+      case MT_OR:  bit_array_or (dst, src1, src2); break;
+      case MT_XOR: bit_array_xor(dst, src1, src2); break;
+    }
+    return;
+  }
+
+  bit_array_ensure_size_critical(dst, MAX(src1->num_of_bits, src2->num_of_bits));
+  // Copy-on-write clones take their copy here, before threads write
+  bit_array_prepare_write(dst, 0, dst->num_of_bits);
+
+  MT_JOB job;
+  job.dst = dst;
+  job.src1 = src1;
+  job.src2 = src2;
+  job.num_of_words = dst->num_of_words;
+  job.offset = _line_offset(dst->words);
+  job.op = op;
+
+  _run_tasks(pool, _num_chunks(job.num_of_words, job.offset), _logic_task, &job);
+}
+
+void bit_array_and_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                      BIT_ARRAY_POOL *pool)
+{
+  _logic_mt(dst, src1, src2, pool, MT_AND);
+}
+
+void bit_array_or_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                     BIT_ARRAY_POOL *pool)
+{
+  _logic_mt(dst, src1, src2, pool, MT_OR);
+}
+
+void bit_array_xor_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                      BIT_ARRAY_POOL *pool)
+{
+  _logic_mt(dst, src1, src2, pool, MT_XOR);
+}
+
+//
+// Set region
+//
+
+// job->words is the first word of the region, job->start is the offset of the
+// region in that word
+static void _set_region_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  word_addr_t s, e;
+  _chunk(i, job->num_of_words, job->offset, &s, &e);
+
+  bit_index_t first = MAX(job->start, s * WORD_SIZE);
+  bit_index_t last = MIN(job->start + job->len, e * WORD_SIZE);
+
+  BIT_ARRAY view;
+  _view(&view, job->words + s, e - s);
+  bit_array_set_region(&view, first - s * WORD_SIZE, last - first);
+}
+
+void bit_array_set_region_mt(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len,
+                             BIT_ARRAY_POOL *pool)
+{
+  assert(start + len <= bitarr->num_of_bits);
+
+  if(pool == NULL || len / WORD_SIZE < BIT_ARRAY_MT_MIN_WORDS) {
+    bit_array_set_region(bitarr, start, len);
+    return;
+  }
+
+  word_addr_t first_word = start / WORD_SIZE;
+  word_addr_t last_word = (start + len - 1) / WORD_SIZE;
+  bit_array_prepare_write(bitarr, start, len);
+
+  MT_JOB job;
+  job.words = bitarr->words + first_word;
+  job.num_of_words = last_word - first_word + 1;
+  job.offset = _line_offset(job.words);
+  job.start = start - first_word * WORD_SIZE;
+  job.len = len;
+
+  _run_tasks(pool, _num_chunks(job.num_of_words, job.offset), _set_region_task, &job);
+}
+
+//
+// Random
+//
+
+// splitmix64 -- used to seed each chunk's generator
+static inline uint64_t _splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static void _random_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  word_addr_t s, e, w;
+  uint64_t state = job->seed ^ ((uint64_t)i * 0xD1B54A32D192ED03ULL), r;
+  word_t word;
+  int o;
+
+  _chunk(i, job->num_of_words, 0, &s, &e);
+
+  for(w = s; w < e; w++)
+  {
+    if(job->threshold == 0x80000000U) {
+      // prob 0.5: use random words
+      job->words[w] = _splitmix64(&state);
+      continue;
+    }
+
+    for(word = 0, o = 0; o < WORD_SIZE; o += 2) {
+      r = _splitmix64(&state);
+      word |= (word_t)((uint32_t)r < job->threshold) << o;
+      word |= (word_t)((uint32_t)(r >> 32) < job->threshold) << (o+1);
+    }
+    job->words[w] = word;
+  }
+}
+
+void bit_array_random_mt(BIT_ARRAY* bitarr, float prob, uint64_t seed,
+                         BIT_ARRAY_POOL *pool)
+{
+  assert(prob >= 0 && prob <= 1);
+
+  if(bitarr->num_of_bits == 0) return;
+  else if(prob <= 0) { bit_array_clear_all(bitarr); return; }
+  else if(prob >= 1) { bit_array_set_all(bitarr); return; }
+
+  bit_array_prepare_write(bitarr, 0, bitarr->num_of_bits);
+
+  MT_JOB job;
+  job.words = bitarr->words;
+  job.num_of_words = bitarr->num_of_words;
+  job.seed = seed;
+  job.threshold = (uint32_t)(prob * 4294967296.0);
+
+  if(job.num_of_words < BIT_ARRAY_MT_MIN_WORDS) pool = NULL;
+  _run_tasks(pool, _num_chunks(job.num_of_words, 0), _random_task, &job);
+
+  // Mask top word
+  word_offset_t bits_active = bitset64_idx(bitarr->num_of_bits - 1) + 1;
+  bitarr->words[bitarr->num_of_words-1] &= bitmask64(bits_active);
+}
+
+// Bits set independently with prob k/n, then a serial pass sets or clears a
+// few bits to get back to k (see bit_array_random_adjust)
+void bit_array_shuffle_mt(BIT_ARRAY* bitarr, uint64_t seed, BIT_ARRAY_POOL *pool)
+{
+  if(bitarr->num_of_bits == 0) return;
+
+  bit_index_t k = bit_array_num_bits_set_mt(bitarr, pool);
+  BIT_ARRAY_RNG rng;
+
+  bit_array_random_mt(bitarr, (float)((double)k / bitarr->num_of_bits), seed, pool);
+  bit_array_rng_seed(&rng, seed);
+  bit_array_random_adjust(bitarr, k, &rng);
+}
+
+//
+// Hash
+//
+
+static void _hash_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  word_addr_t s, e;
+  _chunk(i, job->num_of_words, 0, &s, &e);
+
+  BIT_ARRAY view;
+  bit_array_view(&view, (word_t*)job->words + s,
+                 MIN((e - s) * WORD_SIZE, job->len - s * WORD_SIZE));
+  job->results[i] = bit_array_hash(&view, job->seed);
+}
+
+uint64_t bit_array_hash_mt(const BIT_ARRAY* bitarr, uint64_t seed,
+                           BIT_ARRAY_POOL *pool)
+{
+  size_t n = _num_chunks(bitarr->num_of_words, 0);
+
+  if(n <= 1) return bit_array_hash(bitarr, seed);
+
+  MT_JOB job;
+  job.words = bitarr->words;
+  job.num_of_words = bitarr->num_of_words;
+  job.len = bitarr->num_of_bits;
+  job.seed = seed;
+  job.results = (uint64_t*)malloc(n * sizeof(uint64_t));
+
+  if(job.results == NULL) {
+    fprintf(stderr, "[%s:%i:%s()] Ran out of memory [%zu chunks]\n",
+            __FILE__, __LINE__, __func__, n);
+    abort();
+  }
+
+  if(bitarr->num_of_words < BIT_ARRAY_MT_MIN_WORDS) pool = NULL;
+  _run_tasks(pool, n, _hash_task, &job);
+
+  // Hash the chunk hashes
+  BIT_ARRAY view;
+  _view(&view, job.results, n);
+  uint64_t hash = bit_array_hash(&view, seed) ^ bitarr->num_of_bits;
+
+  free(job.results);
+  return hash;
+}
+
+//
+// Interleave
+//
+
+// Each task does up to CHUNK words of the interleaved array: _interleave_groups
+// words of each of the n separate arrays. bit_array_view needs the top word to
+// be masked, which it is in the last chunk, all other chunks are whole words.
+
+// Words of each separate array per task. A whole number of cache lines, so
+// tasks don't share lines of the separate or the interleaved arrays
+static inline word_addr_t _interleave_groups(size_t n)
+{
+  return CHUNK / n / WORDS_PER_LINE * WORDS_PER_LINE;
+}
+
+static void _interleave_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  BIT_ARRAY in[BIT_ARRAY_INTERLEAVE_MAX], out;
+  const BIT_ARRAY *ins[BIT_ARRAY_INTERLEAVE_MAX];
+  bit_index_t nbits;
+  word_addr_t groups = _interleave_groups(job->ways), s = i * groups;
+  size_t j;
+
+  nbits = MIN(groups * WORD_SIZE, job->len - s * WORD_SIZE);
+  for(j = 0; j < job->ways; j++) {
+    ins[j] = bit_array_view(&in[j], (word_t*)job->inputs[j]->words + s, nbits);
+  }
+  bit_array_view(&out, job->dst->words + s * job->ways, nbits * job->ways);
+  bit_array_interleave_n(&out, ins, job->ways);
+}
+
+static void _deinterleave_task(void *arg, size_t i)
+{
+  MT_JOB *job = (MT_JOB*)arg;
+  BIT_ARRAY in, out[BIT_ARRAY_INTERLEAVE_MAX], *outs[BIT_ARRAY_INTERLEAVE_MAX];
+  bit_index_t nbits;
+  word_addr_t groups = _interleave_groups(job->ways), s = i * groups;
+  size_t j;
+
+  nbits = MIN(groups * WORD_SIZE, job->len - s * WORD_SIZE);
+  for(j = 0; j < job->ways; j++) {
+    outs[j] = bit_array_view(&out[j], job->outputs[j]->words + s, nbits);
+  }
+  bit_array_view(&in, (word_t*)job->src1->words + s * job->ways,
+                 nbits * job->ways);
+  bit_array_deinterleave_n(outs, &in, job->ways);
+}
+
+// Number of tasks for arrays of len bits interleaved n ways
+static inline size_t _interleave_tasks(bit_index_t len, size_t n)
+{
+  word_addr_t groups = _interleave_groups(n);
+  return (roundup_bits2words64(len) + groups - 1) / groups;
+}
+
+void bit_array_interleave_mt(BIT_ARRAY* dst, const BIT_ARRAY** srcs, size_t n,
+                             BIT_ARRAY_POOL *pool)
+{
+  assert(n >= 1 && n <= BIT_ARRAY_INTERLEAVE_MAX);
+
+  if(pool == NULL || srcs[0]->num_of_words * n < BIT_ARRAY_MT_MIN_WORDS) {
+    bit_array_interleave_n(dst, srcs, n);
+    return;
+  }
+
+  size_t j;
+  for(j = 0; j < n; j++) {
+    assert(srcs[j] != dst);
+    assert(srcs[j]->num_of_bits == srcs[0]->num_of_bits);
+  }
+
+  bit_array_resize_critical(dst, srcs[0]->num_of_bits * n);
+  bit_array_prepare_write(dst, 0, dst->num_of_bits);
+
+  MT_JOB job;
+  job.dst = dst;
+  job.inputs = srcs;
+  job.ways = n;
+  job.len = srcs[0]->num_of_bits;
+
+  _run_tasks(pool, _interleave_tasks(job.len, n), _interleave_task, &job);
+}
+
+void bit_array_deinterleave_mt(BIT_ARRAY** dsts, const BIT_ARRAY* src, size_t n,
+                               BIT_ARRAY_POOL *pool)
+{
+  assert(n >= 1 && n <= BIT_ARRAY_INTERLEAVE_MAX);
+  assert(src->num_of_bits % n == 0);
+
+  if(pool == NULL || src->num_of_words < BIT_ARRAY_MT_MIN_WORDS) {
+    bit_array_deinterleave_n(dsts, src, n);
+    return;
+  }
+
+  size_t j;
+  for(j = 0; j < n; j++) {
+    assert(dsts[j] != src);
+    bit_array_resize_critical(dsts[j], src->num_of_bits / n);
+    bit_array_prepare_write(dsts[j], 0, dsts[j]->num_of_bits);
+  }
+
+  MT_JOB job;
+  job.src1 = src;
+  job.outputs = dsts;
+  job.ways = n;
+  job.len = src->num_of_bits / n;
+
+  _run_tasks(pool, _interleave_tasks(job.len, n), _deinterleave_task, &job);
+}
@@ -0,0 +1,97 @@
+/*
+ bit_array_mt.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Multithreaded bulk operations on large bit arrays.
+// words[] is split into chunks of BIT_ARRAY_MT_CHUNK_WORDS, which are run on a
+// thread pool. Arrays smaller than BIT_ARRAY_MT_MIN_WORDS, or a NULL pool,
+// use the single threaded functions. Results never depend on the number of
+// threads. Link with -lpthread.
+
+#ifndef BIT_ARRAY_MT_HEADER_SEEN
+#define BIT_ARRAY_MT_HEADER_SEEN
+
+#include "bit_array.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 128KB per task, a multiple of a 64 byte cache line
+#define BIT_ARRAY_MT_CHUNK_WORDS (1UL<<14)
+
+// Below this (256KB) threads cost more than they save
+#define BIT_ARRAY_MT_MIN_WORDS (1UL<<15)
+
+typedef void (*bit_array_task_t)(void *arg, size_t i);
+
+// A thread pool. To use your own pool, fill in `run` (and `ctx` if needed).
+// run() must call fn(arg, i) for every i in [0, n), in any order and from any
+// threads, and return once all calls have finished.
+typedef struct BIT_ARRAY_POOL BIT_ARRAY_POOL;
+
+struct BIT_ARRAY_POOL
+{
+  void (*run)(BIT_ARRAY_POOL *pool, size_t n, bit_array_task_t fn, void *arg);
+  void *ctx;
+};
+
+// Built-in pthread pool. nthreads includes the calling thread, which also runs
+// tasks. Pass 0 to use one thread per online CPU.
+// Returns NULL and sets errno on failure
+BIT_ARRAY_POOL* bit_array_pool_create(unsigned nthreads);
+void bit_array_pool_free(BIT_ARRAY_POOL *pool);
+
+//
+// Parallel versions of bulk operations
+// pool may be NULL to run on the calling thread
+//
+
+bit_index_t bit_array_num_bits_set_mt(const BIT_ARRAY* bitarr, BIT_ARRAY_POOL *pool);
+
+// dst is resized to the longer of src1, src2 (as bit_array_and/or/xor)
+// Destination can be the same as one or both of the sources
+void bit_array_and_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                      BIT_ARRAY_POOL *pool);
+void bit_array_or_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                     BIT_ARRAY_POOL *pool);
+void bit_array_xor_mt(BIT_ARRAY* dst, const BIT_ARRAY* src1, const BIT_ARRAY* src2,
+                      BIT_ARRAY_POOL *pool);
+
+void bit_array_set_region_mt(BIT_ARRAY* bitarr, bit_index_t start, bit_index_t len,
+                             BIT_ARRAY_POOL *pool);
+
+// Set bits randomly with probability prob. Each chunk has its own generator
+// seeded from `seed` and the chunk index, so the same seed always gives the
+// same bits.
+void bit_array_random_mt(BIT_ARRAY* bitarr, float prob, uint64_t seed,
+                         BIT_ARRAY_POOL *pool);
+
+// Shuffle the bits of an array: same as bit_array_shuffle_rng, but the
+// random words are made in parallel. The same seed gives the same result.
+void bit_array_shuffle_mt(BIT_ARRAY* bitarr, uint64_t seed, BIT_ARRAY_POOL *pool);
+
+// Hash of an array. Arrays of up to BIT_ARRAY_MT_CHUNK_WORDS words give the
+// same value as bit_array_hash(). Longer arrays are hashed a chunk at a time
+// and the chunk hashes are then hashed, so the value differs from
+// bit_array_hash() but does not depend on the pool or number of threads.
+uint64_t bit_array_hash_mt(const BIT_ARRAY* bitarr, uint64_t seed,
+                           BIT_ARRAY_POOL *pool);
+
+// Interleave / deinterleave n arrays (see bit_array_interleave_n and
+// bit_array_deinterleave_n), a range of words per task
+void bit_array_interleave_mt(BIT_ARRAY* dst, const BIT_ARRAY** srcs, size_t n,
+                             BIT_ARRAY_POOL *pool);
+void bit_array_deinterleave_mt(BIT_ARRAY** dsts, const BIT_ARRAY* src, size_t n,
+                               BIT_ARRAY_POOL *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ bit_array_shm.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Segment layout:
+//   [64 byte header][lock lines: 64 bytes each][capacity words]
+// The creator sizes the segment (zero filled by the OS), fills in the header
+// and stores the magic number last, so a process that sees the magic sees
+// the rest of the header.
+//
+// Bits at or above num_of_bits are always zero, so raising the length needs
+// no clearing. This relies on writes staying below the length: the checks are
+// assert()s, so with NDEBUG a write out of range is not caught and can leave
+// bits set past the length (or write past the segment) for every process.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bit_array_shm.h"
+
+#define WORD_SIZE 64
+#define WORD_MAX  (~(word_t)0)
+
+#define SHM_MAGIC 0x4d48535241544942ULL // "BITARSHM"
+// Wait up to a second for a segment being created
+#define SHM_OPEN_TRIES 1000
+
+struct BIT_ARRAY_SHM_HEADER
+{
+  uint64_t magic; // written last by the creator
+  bit_index_t num_of_bits; // only access atomically
+  word_addr_t capacity_in_words;
+  uint64_t num_of_locks, num_of_lines;
+  uint64_t _pad[3];
+};
+
+#define _length(arr) __atomic_load_n(&(arr)->hdr->num_of_bits, __ATOMIC_ACQUIRE)
+
+// One lock per line, rounded up to a power of two lines (see bit_locks.h)
+static size_t _num_lines(size_t num_of_locks)
+{
+  size_t lines = 1;
+  if(num_of_locks == 0) return 0;
+  while(lines < num_of_locks) lines *= 2;
+  return lines;
+}
+
+static size_t _map_len(word_addr_t capacity_in_words, size_t num_of_lines)
+{
+  return sizeof(struct BIT_ARRAY_SHM_HEADER) +
+         num_of_lines * BITLOCK_LINE_BYTES + capacity_in_words * sizeof(word_t);
+}
+
+// Handle for a mapped segment with a valid header. Unmaps on failure
+static BIT_ARRAY_SHM* _shm_handle(void *map, size_t map_len)
+{
+  struct BIT_ARRAY_SHM_HEADER *hdr = (struct BIT_ARRAY_SHM_HEADER*)map;
+  BIT_ARRAY_SHM *arr = (BIT_ARRAY_SHM*)malloc(sizeof(BIT_ARRAY_SHM));
+  if(arr == NULL) { munmap(map, map_len); errno = ENOMEM; return NULL; }
+
+  arr->hdr = hdr;
+  arr->map_len = map_len;
+  arr->words = (word_t*)((uint8_t*)(hdr + 1) +
+                         hdr->num_of_lines * BITLOCK_LINE_BYTES);
+
+  arr->locks.words = (uint64_t*)(hdr + 1);
+  arr->locks.num_of_locks = hdr->num_of_locks;
+  arr->locks.num_of_lines = hdr->num_of_lines;
+  for(arr->locks.line_shift = 0;
+      ((size_t)1 << arr->locks.line_shift) < hdr->num_of_lines;
+      arr->locks.line_shift++) {}
+
+  arr->words_per_lock = 0;
+  if(hdr->num_of_locks > 0) {
+    arr->words_per_lock = (hdr->capacity_in_words + hdr->num_of_locks - 1) /
+                          hdr->num_of_locks;
+    if(arr->words_per_lock == 0) arr->words_per_lock = 1;
+  }
+
+  return arr;
+}
+
+BIT_ARRAY_SHM* bit_array_shm_create(const char *name, bit_index_t nbits,
+                                    bit_index_t capacity_bits,
+                                    size_t num_of_locks)
+{
+  if(capacity_bits < nbits) capacity_bits = nbits;
+
+  word_addr_t capacity_in_words = roundup_bits2words64(capacity_bits);
+  size_t num_of_lines = _num_lines(num_of_locks);
+  size_t map_len = _map_len(capacity_in_words, num_of_lines);
+
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0) return NULL;
+
+  void *map = MAP_FAILED;
+  if(ftruncate(fd, (off_t)map_len) == 0)
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // mapping keeps the segment open
+
+  if(map == MAP_FAILED) {
+    int err = errno;
+    shm_unlink(name);
+    errno = err;
+    return NULL;
+  }
+
+  struct BIT_ARRAY_SHM_HEADER *hdr = (struct BIT_ARRAY_SHM_HEADER*)map;
+  hdr->num_of_bits = nbits;
+  hdr->capacity_in_words = capacity_in_words;
+  hdr->num_of_locks = num_of_locks;
+  hdr->num_of_lines = num_of_lines;
+  __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+  BIT_ARRAY_SHM *arr = _shm_handle(map, map_len);
+  if(arr == NULL) shm_unlink(name);
+  return arr;
+}
+
+BIT_ARRAY_SHM* bit_array_shm_open(const char *name)
+{
+  int fd = shm_open(name, O_RDWR, 0);
+  if(fd < 0) return NULL;
+
+  struct BIT_ARRAY_SHM_HEADER *hdr;
+  struct stat st;
+  size_t map_len;
+  void *map;
+  int tries;
+
+  for(tries = 0; tries < SHM_OPEN_TRIES; tries++)
+  {
+    if(fstat(fd, &st) != 0) { close(fd); return NULL; }
+    map_len = (size_t)st.st_size;
+
+    if(map_len >= sizeof(struct BIT_ARRAY_SHM_HEADER))
+    {
+      map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(map == MAP_FAILED) { close(fd); return NULL; }
+      hdr = (struct BIT_ARRAY_SHM_HEADER*)map;
+
+      uint64_t magic = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE);
+      if(magic == SHM_MAGIC)
+      {
+        close(fd);
+        if(hdr->num_of_lines != _num_lines(hdr->num_of_locks) ||
+           _map_len(hdr->capacity_in_words, hdr->num_of_lines) > map_len ||
+           hdr->num_of_bits > hdr->capacity_in_words * WORD_SIZE)
+        {
+          munmap(map, map_len);
+          errno = EINVAL;
+          return NULL;
+        }
+        return _shm_handle(map, map_len);
+      }
+
+      munmap(map, map_len);
+      if(magic != 0) break; // something else
+    }
+
+    // Still being created
+    usleep(1000);
+  }
+
+  close(fd);
+  errno = EINVAL;
+  return NULL;
+}
+
+BIT_ARRAY_SHM* bit_array_shm_attach(const char *name, bit_index_t nbits,
+                                    bit_index_t capacity_bits,
+                                    size_t num_of_locks)
+{
+  BIT_ARRAY_SHM *arr;
+  int tries;
+
+  // Retry if the segment is unlinked between our create and open
+  for(tries = 0; tries < 3; tries++)
+  {
+    if((arr = bit_array_shm_create(name, nbits, capacity_bits, num_of_locks)) != NULL ||
+       errno != EEXIST ||
+       (arr = bit_array_shm_open(name)) != NULL ||
+       errno != ENOENT) break;
+  }
+
+  return arr;
+}
+
+void bit_array_shm_close(BIT_ARRAY_SHM* arr)
+{
+  munmap(arr->hdr, arr->map_len);
+  free(arr);
+}
+
+int bit_array_shm_unlink(const char *name)
+{
+  return shm_unlink(name);
+}
+
+bit_index_t bit_array_shm_length(const BIT_ARRAY_SHM* arr)
+{
+  return _length(arr);
+}
+
+bit_index_t bit_array_shm_capacity(const BIT_ARRAY_SHM* arr)
+{
+  return arr->hdr->capacity_in_words * WORD_SIZE;
+}
+
+char bit_array_shm_ensure_size(BIT_ARRAY_SHM* arr, bit_index_t nbits)
+{
+  bit_index_t old;
+
+  if(nbits > bit_array_shm_capacity(arr)) { errno = ENOMEM; return 0; }
+
+  while((old = _length(arr)) < nbits &&
+        !__sync_bool_compare_and_swap(&arr->hdr->num_of_bits, old, nbits)) {}
+
+  return 1;
+}
+
+//
+// Bit operations
+//
+
+char bit_array_shm_get(const BIT_ARRAY_SHM* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = arr->words + bitset64_wrd(b);
+  return bitset2_get_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_shm_set(BIT_ARRAY_SHM* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = arr->words + bitset64_wrd(b);
+  return bitset2_set_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_shm_clear(BIT_ARRAY_SHM* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = arr->words + bitset64_wrd(b);
+  return bitset2_del_mt(ptr, 0, bitset64_idx(b));
+}
+
+char bit_array_shm_toggle(BIT_ARRAY_SHM* arr, bit_index_t b)
+{
+  assert(b < _length(arr));
+  word_t *ptr = arr->words + bitset64_wrd(b);
+  return bitset2_tgl_mt(ptr, 0, bitset64_idx(b));
+}
+
+// Mask of bits in word w that are below nbits
+static inline word_t _word_mask(word_addr_t w, bit_index_t nbits)
+{
+  bit_index_t start = w * WORD_SIZE;
+  return nbits >= start + WORD_SIZE ? WORD_MAX : bitmask64(nbits - start);
+}
+
+void bit_array_shm_or_words(BIT_ARRAY_SHM* arr, word_addr_t w,
+                            const word_t* src, word_addr_t nwords)
+{
+  bit_index_t nbits = _length(arr);
+  word_addr_t i;
+  assert(w + nwords <= roundup_bits2words64(nbits));
+
+  for(i = 0; i < nwords; i++)
+    __sync_fetch_and_or(arr->words + w + i, src[i] & _word_mask(w+i, nbits));
+}
+
+void bit_array_shm_and_words(BIT_ARRAY_SHM* arr, word_addr_t w,
+                             const word_t* src, word_addr_t nwords)
+{
+  word_addr_t i;
+  assert(w + nwords <= roundup_bits2words64(_length(arr)));
+
+  for(i = 0; i < nwords; i++)
+    __sync_fetch_and_and(arr->words + w + i, src[i]);
+}
+
+bit_index_t bit_array_shm_num_bits_set(const BIT_ARRAY_SHM* arr)
+{
+  word_addr_t w, nwords = roundup_bits2words64(_length(arr));
+  bit_index_t count = 0;
+
+  for(w = 0; w < nwords; w++)
+    count += (bit_index_t)__builtin_popcountll(__atomic_load_n(arr->words + w,
+                                                               __ATOMIC_RELAXED));
+
+  return count;
+}
+
+void bit_array_shm_to_array(const BIT_ARRAY_SHM* src, BIT_ARRAY* dst)
+{
+  bit_array_resize_critical(dst, _length(src));
+  bit_array_prepare_write(dst, 0, dst->num_of_bits);
+
+  word_addr_t w;
+  for(w = 0; w < dst->num_of_words; w++)
+    dst->words[w] = __atomic_load_n(src->words + w, __ATOMIC_RELAXED);
+
+  // src may have grown (and had bits set) since we read the length
+  if(dst->num_of_words > 0)
+    dst->words[dst->num_of_words-1] &= _word_mask(dst->num_of_words-1, dst->num_of_bits);
+}
+
+//
+// Region locks
+//
+
+void bit_array_shm_lock(BIT_ARRAY_SHM* arr, bit_index_t start, bit_index_t len)
+{
+  assert(arr->locks.num_of_locks > 0);
+  assert(start + len <= bit_array_shm_capacity(arr));
+  if(len == 0) return;
+
+  size_t i, first = bitset64_wrd(start) / arr->words_per_lock;
+  size_t last = bitset64_wrd(start + len - 1) / arr->words_per_lock;
+
+  for(i = first; i <= last; i++) bitlock_table_acquire(&arr->locks, i);
+}
+
+void bit_array_shm_unlock(BIT_ARRAY_SHM* arr, bit_index_t start, bit_index_t len)
+{
+  assert(arr->locks.num_of_locks > 0);
+  assert(start + len <= bit_array_shm_capacity(arr));
+  if(len == 0) return;
+
+  size_t i, first = bitset64_wrd(start) / arr->words_per_lock;
+  size_t last = bitset64_wrd(start + len - 1) / arr->words_per_lock;
+
+  for(i = last + 1; i-- > first; ) bitlock_table_release(&arr->locks, i);
+}
+
+BIT_ARRAY* bit_array_shm_view(BIT_ARRAY_SHM* arr, BIT_ARRAY* view)
+{
+  return bit_array_view(view, arr->words, _length(arr));
+}
@@ -0,0 +1,122 @@
+/*
+ bit_array_shm.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Bit array in a named POSIX shared memory segment (shm_open + mmap), so the
+// processes on a host share one copy.
+//
+// The segment is sized for a capacity fixed at creation, so the words never
+// move and every process can map all of them. Pages of shared memory are only
+// used once written. The length can be raised (not lowered) up to the
+// capacity, by any process.
+//
+// Bit operations are atomic, using the _mt macros from bit_macros.h.
+// For operations on many words, the array can have striped locks in the
+// segment (bitlocks, one per cache line): each lock covers a range of words.
+// Locks are spin locks: a process that dies holding one leaves it locked.
+
+#ifndef BIT_ARRAY_SHM_HEADER_SEEN
+#define BIT_ARRAY_SHM_HEADER_SEEN
+
+#include "bit_array.h"
+#include "bit_locks.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Start of the segment, shared by all processes
+struct BIT_ARRAY_SHM_HEADER;
+
+// Each process has its own handle
+typedef struct
+{
+  struct BIT_ARRAY_SHM_HEADER *hdr; // start of the mapping
+  word_t *words; // capacity words, 64 byte aligned
+  BITLOCK_TABLE locks; // words are in the segment, no locks if num_of_locks 0
+  word_addr_t words_per_lock;
+  size_t map_len;
+} BIT_ARRAY_SHM;
+
+// Create segment `name` ("/name", as for shm_open) of nbits, which can grow to
+// capacity_bits (raised to nbits if less). num_of_locks may be 0 for no locks.
+// Returns NULL on failure and sets errno (EEXIST if the name is taken)
+BIT_ARRAY_SHM* bit_array_shm_create(const char *name, bit_index_t nbits,
+                                    bit_index_t capacity_bits,
+                                    size_t num_of_locks);
+
+// Attach to an existing segment. Waits briefly if it is still being created.
+// Returns NULL on failure and sets errno (ENOENT if there is no segment,
+// EINVAL if it is not a bit array)
+BIT_ARRAY_SHM* bit_array_shm_open(const char *name);
+
+// Create the segment, or attach to it if it already exists (in which case the
+// sizes are those it was created with)
+BIT_ARRAY_SHM* bit_array_shm_attach(const char *name, bit_index_t nbits,
+                                    bit_index_t capacity_bits,
+                                    size_t num_of_locks);
+
+// Unmap. The segment remains until unlinked and no process has it mapped
+void bit_array_shm_close(BIT_ARRAY_SHM* arr);
+
+// Remove the name. Returns 0 on success, -1 on failure and sets errno
+int bit_array_shm_unlink(const char *name);
+
+bit_index_t bit_array_shm_length(const BIT_ARRAY_SHM* arr);
+bit_index_t bit_array_shm_capacity(const BIT_ARRAY_SHM* arr);
+
+// Grow to at least nbits, new bits are zero. Safe to call from many processes.
+// Returns 1 on success, 0 if nbits is over capacity (sets errno to ENOMEM)
+char bit_array_shm_ensure_size(BIT_ARRAY_SHM* arr, bit_index_t nbits);
+
+//
+// Atomic bit operations ("safe": use assert() to check bounds, so indices are
+// not checked when built with NDEBUG; callers must keep them below the length)
+// set/clear/toggle return the value of the bit before it was changed,
+// so bit_array_shm_set() is test-and-set
+//
+
+char bit_array_shm_get(const BIT_ARRAY_SHM* arr, bit_index_t b);
+char bit_array_shm_set(BIT_ARRAY_SHM* arr, bit_index_t b);
+char bit_array_shm_clear(BIT_ARRAY_SHM* arr, bit_index_t b);
+char bit_array_shm_toggle(BIT_ARRAY_SHM* arr, bit_index_t b);
+
+// OR / AND `nwords` words from `src` into the array, starting at word `w`
+// (w + nwords must not pass the length; checked with assert() only)
+// Each word is updated atomically, the range as a whole is not
+void bit_array_shm_or_words(BIT_ARRAY_SHM* arr, word_addr_t w,
+                            const word_t* src, word_addr_t nwords);
+void bit_array_shm_and_words(BIT_ARRAY_SHM* arr, word_addr_t w,
+                             const word_t* src, word_addr_t nwords);
+
+// Counting and copying are not a snapshot if other processes are writing
+bit_index_t bit_array_shm_num_bits_set(const BIT_ARRAY_SHM* arr);
+
+// dst is resized to the length of src
+void bit_array_shm_to_array(const BIT_ARRAY_SHM* src, BIT_ARRAY* dst);
+
+//
+// Region locks
+//
+
+// Take / release the locks covering bits [start, start+len), in order of
+// address so overlapping regions cannot deadlock. Only excludes other
+// processes that lock an overlapping region. Needs num_of_locks > 0.
+void bit_array_shm_lock(BIT_ARRAY_SHM* arr, bit_index_t start, bit_index_t len);
+void bit_array_shm_unlock(BIT_ARRAY_SHM* arr, bit_index_t start, bit_index_t len);
+
+// View of the array at its current length (see bit_array_view), to use any
+// bit_array_* function that keeps the length. Not atomic: lock the region
+// being written (and read, if it must be consistent)
+BIT_ARRAY* bit_array_shm_view(BIT_ARRAY_SHM* arr, BIT_ARRAY* view);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,488 @@
+/*
+ bit_bloom.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// A key's 64 bit hash h picks everything:
+//   block:    high bits, by multiply-shift (h * num_of_blocks) >> 64
+//   rotation: bits 32-35, r -- probe i is in 32 bit lane (r + i) % 16
+//   bits:     low 32 bits, bit (h32 * salt[i]) >> 27 of lane (r + i) % 16
+// The rotation spreads keys with small k over all 16 lanes.
+// Lane j of a block is bits [32j, 32j+32), i.e. half of word j/2.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "bit_bloom.h"
+
+#if !defined(BIT_ARRAY_NO_SIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+  #define BIT_ARRAY_SIMD_X86 1
+  #include <immintrin.h>
+#endif
+
+#define BLOCK_WORDS (BIT_BLOOM_BLOCK_BITS / 64)
+#define NUM_LANES 16
+
+// Hashes ahead to prefetch in the batch functions
+#define PREFETCH_DIST 16
+
+static const uint32_t bloom_salts[NUM_LANES] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+  0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU,
+  0x165667b1U, 0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U
+};
+
+static inline uint64_t _mulhi64(uint64_t a, uint64_t b)
+{
+#if defined(__SIZEOF_INT128__)
+  return (uint64_t)(((unsigned __int128)a * b) >> 64);
+#else
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32, b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+  uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+  uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+  return hi_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+static inline word_t* _block(const BIT_BLOOM* bloom, uint64_t h)
+{
+  return bloom->bits->words + _mulhi64(h, bloom->num_of_blocks) * BLOCK_WORDS;
+}
+
+#define _rotation(h) ((unsigned)((h) >> 32) & (NUM_LANES - 1))
+
+//
+// Probe kernels
+//
+
+typedef struct
+{
+  void (*add)(word_t *block, uint64_t h, unsigned k);
+  char (*contains)(const word_t *block, uint64_t h, unsigned k);
+} BloomKernels;
+
+// Bits of a key in a block
+static inline void _key_mask(uint64_t h, unsigned k, word_t mask[BLOCK_WORDS])
+{
+  unsigned i, lane, r = _rotation(h);
+  uint32_t h32 = (uint32_t)h;
+  memset(mask, 0, BLOCK_WORDS * sizeof(word_t));
+  for(i = 0; i < k; i++) {
+    lane = (r + i) & (NUM_LANES - 1);
+    mask[lane / 2] |= (word_t)(1U << ((h32 * bloom_salts[i]) >> 27))
+                      << (32 * (lane & 1));
+  }
+}
+
+static void _add_scalar(word_t *block, uint64_t h, unsigned k)
+{
+  word_t mask[BLOCK_WORDS];
+  size_t i;
+  _key_mask(h, k, mask);
+  for(i = 0; i < BLOCK_WORDS; i++) block[i] |= mask[i];
+}
+
+static char _contains_scalar(const word_t *block, uint64_t h, unsigned k)
+{
+  word_t mask[BLOCK_WORDS], missing = 0;
+  size_t i;
+  _key_mask(h, k, mask);
+  for(i = 0; i < BLOCK_WORDS; i++) missing |= mask[i] & ~block[i];
+  return missing == 0;
+}
+
+static const BloomKernels bloom_kernels_scalar = {
+  _add_scalar, _contains_scalar
+};
+
+#if defined(BIT_ARRAY_SIMD_X86)
+
+// Lanes [8*half, 8*half+8) of a key's mask
+__attribute__((target("avx2")))
+static inline __m256i _key_mask_avx2(uint64_t h, unsigned k, int half)
+{
+  const __m256i salts_lo = _mm256_loadu_si256((const __m256i*)bloom_salts);
+  const __m256i salts_hi = _mm256_loadu_si256((const __m256i*)(bloom_salts + 8));
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  lanes = _mm256_add_epi32(lanes, _mm256_set1_epi32(8 * half));
+
+  // Probe number in each lane, active if < k
+  __m256i probe = _mm256_sub_epi32(lanes, _mm256_set1_epi32((int)_rotation(h)));
+  probe = _mm256_and_si256(probe, _mm256_set1_epi32(NUM_LANES - 1));
+  __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)k), probe);
+
+  __m256i salt = _mm256_blendv_epi8(_mm256_permutevar8x32_epi32(salts_lo, probe),
+                                    _mm256_permutevar8x32_epi32(salts_hi, probe),
+                                    _mm256_cmpgt_epi32(probe,
+                                                       _mm256_set1_epi32(7)));
+  __m256i bit = _mm256_mullo_epi32(_mm256_set1_epi32((int)(uint32_t)h), salt);
+  bit = _mm256_srli_epi32(bit, 27);
+  return _mm256_and_si256(_mm256_sllv_epi32(_mm256_set1_epi32(1), bit), active);
+}
+
+__attribute__((target("avx2")))
+static void _add_avx2(word_t *block, uint64_t h, unsigned k)
+{
+  __m256i *b = (__m256i*)block;
+  _mm256_storeu_si256(b, _mm256_or_si256(_mm256_loadu_si256(b),
+                                         _key_mask_avx2(h, k, 0)));
+  _mm256_storeu_si256(b+1, _mm256_or_si256(_mm256_loadu_si256(b+1),
+                                           _key_mask_avx2(h, k, 1)));
+}
+
+__attribute__((target("avx2")))
+static char _contains_avx2(const word_t *block, uint64_t h, unsigned k)
+{
+  const __m256i *b = (const __m256i*)block;
+  __m256i lo = _mm256_andnot_si256(_mm256_loadu_si256(b), _key_mask_avx2(h, k, 0));
+  __m256i hi = _mm256_andnot_si256(_mm256_loadu_si256(b+1), _key_mask_avx2(h, k, 1));
+  return _mm256_testz_si256(_mm256_or_si256(lo, hi), _mm256_or_si256(lo, hi));
+}
+
+static const BloomKernels bloom_kernels_avx2 = {
+  _add_avx2, _contains_avx2
+};
+
+__attribute__((target("avx512f")))
+static inline __m512i _key_mask_avx512(uint64_t h, unsigned k)
+{
+  const __m512i salts = _mm512_loadu_si512((const void*)bloom_salts);
+  const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                          8, 9, 10, 11, 12, 13, 14, 15);
+  __m512i probe = _mm512_sub_epi32(lanes, _mm512_set1_epi32((int)_rotation(h)));
+  probe = _mm512_and_si512(probe, _mm512_set1_epi32(NUM_LANES - 1));
+  __mmask16 active = _mm512_cmplt_epu32_mask(probe, _mm512_set1_epi32((int)k));
+
+  __m512i bit = _mm512_mullo_epi32(_mm512_set1_epi32((int)(uint32_t)h),
+                                   _mm512_permutexvar_epi32(probe, salts));
+  bit = _mm512_srli_epi32(bit, 27);
+  return _mm512_maskz_sllv_epi32(active, _mm512_set1_epi32(1), bit);
+}
+
+__attribute__((target("avx512f")))
+static void _add_avx512(word_t *block, uint64_t h, unsigned k)
+{
+  __m512i b = _mm512_loadu_si512((const void*)block);
+  _mm512_storeu_si512((void*)block, _mm512_or_si512(b, _key_mask_avx512(h, k)));
+}
+
+__attribute__((target("avx512f")))
+static char _contains_avx512(const word_t *block, uint64_t h, unsigned k)
+{
+  __m512i b = _mm512_loadu_si512((const void*)block);
+  __m512i missing = _mm512_andnot_si512(b, _key_mask_avx512(h, k));
+  return _mm512_test_epi32_mask(missing, missing) == 0;
+}
+
+static const BloomKernels bloom_kernels_avx512 = {
+  _add_avx512, _contains_avx512
+};
+
+#endif
+
+static const BloomKernels *bloom_kernels = &bloom_kernels_scalar;
+
+#if defined(__GNUC__)
+__attribute__((constructor))
+#endif
+static void _init_bloom_kernels(void)
+{
+#if defined(BIT_ARRAY_SIMD_X86)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) bloom_kernels = &bloom_kernels_avx512;
+  else if(__builtin_cpu_supports("avx2")) bloom_kernels = &bloom_kernels_avx2;
+#endif
+}
+
+//
+// Hash
+//
+
+#define WYP0 0xa0761d6478bd642fULL
+#define WYP1 0xe7037ed1a0b428dbULL
+#define WYP2 0x8ebc6af09c88c6e3ULL
+#define WYP3 0x589965cc75374cc3ULL
+
+static inline uint64_t _wymix(uint64_t a, uint64_t b)
+{
+  return (a * b) ^ _mulhi64(a, b);
+}
+
+// Little endian reads, so hashes match on every platform
+static inline uint64_t _read_le(const uint8_t *p, size_t nbytes)
+{
+  uint64_t x = 0;
+  size_t i;
+  for(i = 0; i < nbytes; i++) x |= (uint64_t)p[i] << (8*i);
+  return x;
+}
+
+#define _r8(p) _read_le(p, 8)
+#define _r4(p) _read_le(p, 4)
+
+uint64_t bit_bloom_hash(const void *key, size_t len, uint64_t seed)
+{
+  const uint8_t *p = (const uint8_t*)key;
+  uint64_t a, b;
+  size_t i = len;
+
+  seed ^= _wymix(seed ^ WYP0, WYP1);
+
+  if(len <= 16) {
+    if(len >= 4) {
+      a = (_r4(p) << 32) | _r4(p + ((len >> 3) << 2));
+      b = (_r4(p + len - 4) << 32) | _r4(p + len - 4 - ((len >> 3) << 2));
+    }
+    else if(len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    }
+    else a = b = 0;
+  }
+  else {
+    if(i > 48) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = _wymix(_r8(p) ^ WYP1, _r8(p + 8) ^ seed);
+        see1 = _wymix(_r8(p + 16) ^ WYP2, _r8(p + 24) ^ see1);
+        see2 = _wymix(_r8(p + 32) ^ WYP3, _r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while(i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while(i > 16) {
+      seed = _wymix(_r8(p) ^ WYP1, _r8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = _r8(p + i - 16);
+    b = _r8(p + i - 8);
+  }
+
+  a ^= WYP1;
+  b ^= seed;
+  uint64_t lo = a * b, hi = _mulhi64(a, b);
+  return _wymix(lo ^ WYP0 ^ len, hi ^ WYP1);
+}
+
+//
+// Create
+//
+
+BIT_BLOOM* bit_bloom_create(bit_index_t nbits, unsigned k, uint64_t seed)
+{
+  if(k < 1 || k > BIT_BLOOM_MAX_K) { errno = EINVAL; return NULL; }
+
+  BIT_BLOOM *bloom = (BIT_BLOOM*)malloc(sizeof(BIT_BLOOM));
+  if(bloom == NULL) { errno = ENOMEM; return NULL; }
+
+  bloom->num_of_blocks = nbits ? (nbits + BIT_BLOOM_BLOCK_BITS - 1) / BIT_BLOOM_BLOCK_BITS
+                               : 1;
+  bloom->k = k;
+  bloom->seed = seed;
+  bloom->bits = bit_array_create_with(bloom->num_of_blocks * BIT_BLOOM_BLOCK_BITS,
+                                      bit_array_aligned_allocator());
+  if(bloom->bits == NULL) { free(bloom); errno = ENOMEM; return NULL; }
+
+  return bloom;
+}
+
+// False positive rate of a split block filter with lambda keys per block:
+// a key sets a bit in a given lane with probability k/512, and the number of
+// keys in a block is Poisson. Poisson terms are built up from 1 and
+// normalised at the end, so no exp() is needed.
+static double _split_block_fp(double lambda, unsigned k)
+{
+  double p = 1, total = 0, fp = 0, unset = 1, q = 1.0 - k / 512.0, s, sk;
+  size_t x, xmax = (size_t)(lambda * 2) + 64;
+  unsigned i;
+
+  for(x = 0; x <= xmax; x++) {
+    if(x > 0) { p *= lambda / x; unset *= q; }
+    for(s = 1.0 - unset, sk = 1, i = 0; i < k; i++) sk *= s;
+    total += p;
+    fp += p * sk;
+  }
+  return fp / total;
+}
+
+static double _best_fp(double bits_per_key, unsigned *best_k)
+{
+  double fp, best = 1;
+  unsigned k;
+  for(k = 1; k <= BIT_BLOOM_MAX_K; k++) {
+    fp = _split_block_fp(BIT_BLOOM_BLOCK_BITS / bits_per_key, k);
+    if(fp < best) { best = fp; *best_k = k; }
+  }
+  return best;
+}
+
+BIT_BLOOM* bit_bloom_create_for(uint64_t num_keys, double fp_rate,
+                                uint64_t seed)
+{
+  if(!(fp_rate > 0 && fp_rate < 1)) { errno = EINVAL; return NULL; }
+
+  // Bisect bits per key in [1, 128]
+  double lo = 1, hi = 128, mid;
+  unsigned k = 1, i;
+  for(i = 0; i < 40; i++) {
+    mid = (lo + hi) / 2;
+    if(_best_fp(mid, &k) > fp_rate) lo = mid;
+    else hi = mid;
+  }
+  _best_fp(hi, &k);
+
+  return bit_bloom_create((bit_index_t)(hi * (double)num_keys) + 1, k, seed);
+}
+
+void bit_bloom_free(BIT_BLOOM* bloom)
+{
+  bit_array_free(bloom->bits);
+  free(bloom);
+}
+
+void bit_bloom_clear(BIT_BLOOM* bloom)
+{
+  bit_array_clear_all(bloom->bits);
+}
+
+//
+// Keys
+//
+
+void bit_bloom_add_hash(BIT_BLOOM* bloom, uint64_t hash)
+{
+  bloom_kernels->add(_block(bloom, hash), hash, bloom->k);
+}
+
+char bit_bloom_contains_hash(const BIT_BLOOM* bloom, uint64_t hash)
+{
+  return bloom_kernels->contains(_block(bloom, hash), hash, bloom->k);
+}
+
+void bit_bloom_add(BIT_BLOOM* bloom, const void *key, size_t len)
+{
+  bit_bloom_add_hash(bloom, bit_bloom_hash(key, len, bloom->seed));
+}
+
+char bit_bloom_contains(const BIT_BLOOM* bloom, const void *key, size_t len)
+{
+  return bit_bloom_contains_hash(bloom, bit_bloom_hash(key, len, bloom->seed));
+}
+
+void bit_bloom_add_hashes(BIT_BLOOM* bloom, const uint64_t *hashes, size_t n)
+{
+  size_t i;
+  for(i = 0; i < n; i++) {
+    if(i + PREFETCH_DIST < n)
+      __builtin_prefetch(_block(bloom, hashes[i + PREFETCH_DIST]), 1);
+    bloom_kernels->add(_block(bloom, hashes[i]), hashes[i], bloom->k);
+  }
+}
+
+size_t bit_bloom_contains_hashes(const BIT_BLOOM* bloom, const uint64_t *hashes,
+                                 size_t n, uint8_t *results)
+{
+  size_t i, count = 0;
+  char hit;
+  for(i = 0; i < n; i++) {
+    if(i + PREFETCH_DIST < n)
+      __builtin_prefetch(_block(bloom, hashes[i + PREFETCH_DIST]), 0);
+    hit = bloom_kernels->contains(_block(bloom, hashes[i]), hashes[i], bloom->k);
+    if(results != NULL) results[i] = (uint8_t)hit;
+    count += (size_t)hit;
+  }
+  return count;
+}
+
+//
+// Whole filters
+//
+
+static inline char _same_shape(const BIT_BLOOM* a, const BIT_BLOOM* b)
+{
+  if(a->num_of_blocks == b->num_of_blocks && a->k == b->k && a->seed == b->seed)
+    return 1;
+  errno = EINVAL;
+  return 0;
+}
+
+char bit_bloom_union(BIT_BLOOM* dst, const BIT_BLOOM* src)
+{
+  if(!_same_shape(dst, src)) return 0;
+  bit_array_or(dst->bits, dst->bits, src->bits);
+  return 1;
+}
+
+char bit_bloom_intersect(BIT_BLOOM* dst, const BIT_BLOOM* src)
+{
+  if(!_same_shape(dst, src)) return 0;
+  bit_array_and(dst->bits, dst->bits, src->bits);
+  return 1;
+}
+
+double bit_bloom_fp_rate(const BIT_BLOOM* bloom)
+{
+  double fill = (double)bit_array_num_bits_set(bloom->bits) /
+                (double)bit_array_length(bloom->bits), fp = 1;
+  unsigned i;
+  for(i = 0; i < bloom->k; i++) fp *= fill;
+  return fp;
+}
+
+//
+// Save / load
+//
+
+static const char bloom_magic[8] = {'B','I','T','B','L','O','O','M'};
+
+static bit_index_t _write_le(FILE *f, uint64_t x)
+{
+  uint8_t buf[8];
+  size_t i;
+  for(i = 0; i < 8; i++) buf[i] = (uint8_t)(x >> (8*i));
+  return fwrite(buf, 1, 8, f);
+}
+
+bit_index_t bit_bloom_save(const BIT_BLOOM* bloom, FILE* f)
+{
+  bit_index_t bytes = fwrite(bloom_magic, 1, 8, f);
+  bytes += _write_le(f, bloom->k);
+  bytes += _write_le(f, bloom->seed);
+  return bytes + bit_array_save(bloom->bits, f);
+}
+
+BIT_BLOOM* bit_bloom_load(FILE* f)
+{
+  uint8_t hdr[24];
+  if(fread(hdr, 1, 24, f) != 24 || memcmp(hdr, bloom_magic, 8) != 0) return NULL;
+
+  uint64_t k = _read_le(hdr + 8, 8), seed = _read_le(hdr + 16, 8);
+  if(k < 1 || k > BIT_BLOOM_MAX_K) return NULL;
+
+  BIT_BLOOM *bloom = bit_bloom_create(0, (unsigned)k, seed);
+  if(bloom == NULL) return NULL;
+
+  bit_index_t nbits;
+  if(!bit_array_load(bloom->bits, f) ||
+     (nbits = bit_array_length(bloom->bits)) == 0 ||
+     nbits % BIT_BLOOM_BLOCK_BITS != 0)
+  {
+    bit_bloom_free(bloom);
+    return NULL;
+  }
+
+  bloom->num_of_blocks = nbits / BIT_BLOOM_BLOCK_BITS;
+  return bloom;
+}
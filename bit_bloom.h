@@ -0,0 +1,106 @@
+/*
+ bit_bloom.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Blocked Bloom filter on a BIT_ARRAY.
+//
+// The bits are split into blocks of 512 bits (one cache line). A key hashes
+// to one block and sets k bits in it, so a lookup reads a single line. Each
+// of the k bits is in a different 32 bit lane of the block (a split block
+// Bloom filter), so the bits of a key are found with a few vector
+// instructions rather than k dependent loads.
+//
+// A blocked filter has a higher false positive rate than a classic filter of
+// the same size; bit_bloom_create_for() allows for this.
+
+#ifndef BIT_BLOOM_HEADER_SEEN
+#define BIT_BLOOM_HEADER_SEEN
+
+#include "bit_array.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BIT_BLOOM_BLOCK_BITS 512
+#define BIT_BLOOM_MAX_K 16
+
+typedef struct
+{
+  BIT_ARRAY *bits; // num_of_blocks * 512 bits, 64 byte aligned
+  uint64_t num_of_blocks;
+  unsigned k; // bits set per key, 1..BIT_BLOOM_MAX_K
+  uint64_t seed; // used by bit_bloom_add() and bit_bloom_contains()
+} BIT_BLOOM;
+
+// nbits is rounded up to a multiple of 512. k must be 1..BIT_BLOOM_MAX_K.
+// Returns NULL on failure and sets errno (EINVAL for a bad k)
+BIT_BLOOM* bit_bloom_create(bit_index_t nbits, unsigned k, uint64_t seed);
+
+// Sized for num_keys keys at a false positive rate of about fp_rate
+// (0 < fp_rate < 1)
+BIT_BLOOM* bit_bloom_create_for(uint64_t num_keys, double fp_rate,
+                                uint64_t seed);
+
+void bit_bloom_free(BIT_BLOOM* bloom);
+
+// Remove all keys
+void bit_bloom_clear(BIT_BLOOM* bloom);
+
+// 64 bit hash of a key, much faster than bit_array_hash() on short keys
+// (after wyhash by Wang Yi). The same on every platform.
+uint64_t bit_bloom_hash(const void *key, size_t len, uint64_t seed);
+
+//
+// Keys
+//
+
+// Hash with bit_bloom_hash(key, len, bloom->seed)
+void bit_bloom_add(BIT_BLOOM* bloom, const void *key, size_t len);
+char bit_bloom_contains(const BIT_BLOOM* bloom, const void *key, size_t len);
+
+// Add / look up a key by its 64 bit hash
+void bit_bloom_add_hash(BIT_BLOOM* bloom, uint64_t hash);
+char bit_bloom_contains_hash(const BIT_BLOOM* bloom, uint64_t hash);
+
+// Batches of hashes. The blocks of later hashes are prefetched while earlier
+// ones are done, so many lookups miss cache at the same time.
+// results may be NULL, otherwise results[i] is 1 if hashes[i] may be in the
+// filter, 0 if not. Returns the number that may be in the filter.
+void bit_bloom_add_hashes(BIT_BLOOM* bloom, const uint64_t *hashes, size_t n);
+size_t bit_bloom_contains_hashes(const BIT_BLOOM* bloom, const uint64_t *hashes,
+                                 size_t n, uint8_t *results);
+
+//
+// Whole filters
+//
+
+// Filters must have the same size, k and seed. Union is the filter of the
+// keys in either (no extra false positives), intersection contains at least
+// the keys in both. Return 1 on success, 0 if the filters do not match (sets
+// errno to EINVAL)
+char bit_bloom_union(BIT_BLOOM* dst, const BIT_BLOOM* src);
+char bit_bloom_intersect(BIT_BLOOM* dst, const BIT_BLOOM* src);
+
+// Estimate of the false positive rate from the fraction of bits set
+double bit_bloom_fp_rate(const BIT_BLOOM* bloom);
+
+// File format is ["BITBLOOM"][8 bytes: k][8 bytes: seed] followed by the bits
+// written by bit_array_save(). All values are little endian
+
+// Returns the number of bytes written
+bit_index_t bit_bloom_save(const BIT_BLOOM* bloom, FILE* f);
+
+// Returns NULL on failure
+BIT_BLOOM* bit_bloom_load(FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ bit_locks.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Locks for when the dense bitlocks in bit_macros.h are too hot.
+// Header only, like bit_macros.h.
+//
+// BITLOCK_TABLE: an array of bitlocks where neighbouring locks are on
+//   different cache lines. locks_per_line sets the trade off between memory
+//   (1 lock per 64 bytes) and density (512 locks per 64 bytes).
+//   Lock i is on line (i % num_lines), so a run of locks taken by different
+//   threads is spread over many lines. Waiting uses exponential backoff.
+//
+// ticketlock_t: a single fair (FIFO) spin lock padded to a cache line
+// mcslock_t: a queue lock, each waiter spins on its own node. Scales best
+//   for a single lock wanted by many threads.
+//
+// All the spinning waits pause the CPU and fall back to sched_yield() after a
+// long wait, so they stay usable with more threads than CPUs.
+
+#ifndef BIT_LOCKS_HEADER_SEEN
+#define BIT_LOCKS_HEADER_SEEN
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "bit_macros.h"
+
+#define BITLOCK_LINE_BYTES 64
+#define BITLOCK_LINE_BITS (BITLOCK_LINE_BYTES*8)
+
+//
+// Lock table
+//
+
+typedef struct
+{
+  uint64_t *words; // cache line aligned
+  size_t num_of_locks, num_of_lines;
+  unsigned line_shift; // num_of_lines == 1 << line_shift
+} BITLOCK_TABLE;
+
+// locks_per_line must be 1..512
+// Returns NULL if cannot malloc
+static inline BITLOCK_TABLE* bitlock_table_create(size_t num_of_locks,
+                                                  size_t locks_per_line)
+{
+  assert(locks_per_line > 0 && locks_per_line <= BITLOCK_LINE_BITS);
+
+  BITLOCK_TABLE *table = (BITLOCK_TABLE*)malloc(sizeof(BITLOCK_TABLE));
+  if(table == NULL) return NULL;
+
+  // Power of two number of lines so finding a lock needs no division
+  size_t min_lines = (num_of_locks + locks_per_line - 1) / locks_per_line;
+  for(table->line_shift = 0; ((size_t)1 << table->line_shift) < min_lines;
+      table->line_shift++) {}
+
+  table->num_of_locks = num_of_locks;
+  table->num_of_lines = (size_t)1 << table->line_shift;
+
+  void *mem;
+  size_t bytes = table->num_of_lines * BITLOCK_LINE_BYTES;
+  if(posix_memalign(&mem, BITLOCK_LINE_BYTES, bytes) != 0) {
+    free(table);
+    return NULL;
+  }
+
+  memset(mem, 0, bytes);
+  table->words = (uint64_t*)mem;
+  return table;
+}
+
+static inline void bitlock_table_free(BITLOCK_TABLE *table)
+{
+  free(table->words);
+  free(table);
+}
+
+// Bit used for lock i
+static inline size_t bitlock_table_pos(const BITLOCK_TABLE *table, size_t i)
+{
+  assert(i < table->num_of_locks);
+  size_t line = i & (table->num_of_lines - 1);
+  return line * BITLOCK_LINE_BITS + (i >> table->line_shift);
+}
+
+static inline void bitlock_table_acquire(BITLOCK_TABLE *table, size_t i)
+{
+  bitlock_backoff_acquire(table->words, bitlock_table_pos(table, i));
+}
+
+// Does not wait. Returns 1 if we got the lock, 0 otherwise
+static inline char bitlock_table_try_acquire(BITLOCK_TABLE *table, size_t i)
+{
+  size_t pos = bitlock_table_pos(table, i);
+  if(bitset_get_mt(table->words, pos)) return 0;
+  char got = !bitset_set_mt(table->words, pos);
+  __sync_synchronize(); /* Must not move commands to before acquiring lock */
+  return got;
+}
+
+// Undefined behaviour if you do not already hold the lock
+static inline void bitlock_table_release(BITLOCK_TABLE *table, size_t i)
+{
+  bitlock_release(table->words, bitlock_table_pos(table, i));
+}
+
+//
+// Ticket lock
+//
+
+typedef struct
+{
+  volatile uint32_t next, owner;
+  char _pad[BITLOCK_LINE_BYTES - 2*sizeof(uint32_t)];
+} ticketlock_t;
+
+#define TICKETLOCK_INIT {0, 0, {0}}
+
+static inline void ticketlock_acquire(ticketlock_t *lock)
+{
+  uint32_t ticket = __sync_fetch_and_add(&lock->next, 1), ahead, i, waits = 0;
+
+  // Wait in proportion to the number of threads ahead of us
+  // yield if we have waited a long time (more threads than CPUs)
+  while((ahead = ticket - lock->owner) != 0) {
+    for(i = 0; i < ahead * 16; i++) bitlock_cpu_relax();
+    if(++waits > BITLOCK_BACKOFF_MAX) sched_yield();
+  }
+
+  __sync_synchronize(); /* Must not move commands to before acquiring lock */
+}
+
+static inline void ticketlock_release(ticketlock_t *lock)
+{
+  __sync_synchronize(); /* Must get the lock before releasing it */
+  lock->owner++; // only the holder writes owner
+}
+
+//
+// MCS queue lock
+// Each thread passes its own node, which must stay valid while it holds or
+// waits for the lock. One node can be reused for any number of locks, as long
+// as it is only used for one at a time.
+//
+
+typedef struct mcslock_node_t
+{
+  struct mcslock_node_t *volatile next;
+  volatile char locked;
+} mcslock_node_t;
+
+typedef struct
+{
+  mcslock_node_t *volatile tail;
+  char _pad[BITLOCK_LINE_BYTES - sizeof(mcslock_node_t*)];
+} mcslock_t;
+
+#define MCSLOCK_INIT {NULL, {0}}
+
+// Spin on a node, yielding after a long wait
+#define _mcslock_wait(cond) do {                                               \
+  unsigned _waits = 0;                                                         \
+  while(cond) {                                                                \
+    bitlock_cpu_relax();                                                       \
+    if(++_waits > BITLOCK_BACKOFF_MAX) sched_yield();                          \
+  }                                                                            \
+} while(0)
+
+static inline void mcslock_acquire(mcslock_t *lock, mcslock_node_t *node)
+{
+  node->next = NULL;
+  node->locked = 1;
+
+  mcslock_node_t *prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+
+  if(prev != NULL) {
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+    _mcslock_wait(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE));
+  }
+}
+
+static inline void mcslock_release(mcslock_t *lock, mcslock_node_t *node)
+{
+  mcslock_node_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+  if(next == NULL)
+  {
+    // No one waiting: try to mark the lock free
+    mcslock_node_t *expected = node;
+    if(__atomic_compare_exchange_n(&lock->tail, &expected, (mcslock_node_t*)NULL,
+                                   0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return;
+
+    // Someone is joining the queue, wait for them to link in
+    _mcslock_wait((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL);
+  }
+
+  __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -162,6 +162,33 @@
   bitlock_acquire_block(arr,pos,{*(retptr)=0;break;},if(!*(retptr)){break;});  \
 } while(0)
 
+// Tell the CPU we are spinning (x86 pause / ARM yield)
+#if defined(__x86_64__) || defined(__i386__)
+  #define bitlock_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+  #define bitlock_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+  #define bitlock_cpu_relax() __sync_synchronize()
+#endif
+
+// Most pauses between two checks of a lock before we start to yield
+#ifndef BITLOCK_BACKOFF_MAX
+  #define BITLOCK_BACKOFF_MAX 1024
+#endif
+
+// Pause n times then double n (an unsigned variable), yield once n is at max
+#define bitlock_backoff(n) do {                                                \
+  unsigned _i;                                                                 \
+  for(_i = 0; _i < (n); _i++) bitlock_cpu_relax();                             \
+  if((n) < BITLOCK_BACKOFF_MAX) (n) *= 2; else sched_yield();                  \
+} while(0)
+
+// exponential backoff with pause if cannot acquire the lock
+#define bitlock_backoff_acquire(arr,pos) do {                                  \
+  unsigned _backoff = 1;                                                       \
+  bitlock_acquire_block(arr,pos,bitlock_backoff(_backoff);,{});                \
+} while(0)
+
 /*
  * Byteswapping
  */
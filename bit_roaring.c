@@ -0,0 +1,905 @@
+/*
+ bit_roaring.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Containers are kept in their cheapest form on every update:
+//   array  while card <= ROARING_MAX_ARRAY
+//   bitmap otherwise
+// Run containers are only created by bit_roaring_run_optimize() and
+// bit_roaring_from_array(); they are turned back into an array or bitmap
+// the first time they are modified.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "bit_roaring.h"
+
+#define CHUNK_BITS 65536
+#define CHUNK_WORDS 1024
+#define WORD_SIZE 64
+#define ROARING_MAX_ARRAY 4096
+
+#define MIN(a, b)  (((a) <= (b)) ? (a) : (b))
+#define MAX(a, b)  (((a) >= (b)) ? (a) : (b))
+
+#define POPCOUNT(x) (unsigned)__builtin_popcountll(x)
+
+#define chunk_key(b) ((b) >> 16)
+#define chunk_low(b) ((uint16_t)((b) & 0xffff))
+
+#define die(msg) do { \
+  fprintf(stderr, "[%s:%i:%s()] %s\n", __FILE__, __LINE__, __func__, msg); \
+  abort(); \
+} while(0)
+
+static void* _rmalloc(size_t n)
+{
+  void *ptr = malloc(n ? n : 1);
+  if(ptr == NULL) die("Out of memory");
+  return ptr;
+}
+
+static void* _rrealloc(void *ptr, size_t n)
+{
+  ptr = realloc(ptr, n ? n : 1);
+  if(ptr == NULL) die("Out of memory");
+  return ptr;
+}
+
+// Wrap a bitmap container in a BIT_ARRAY view so we can use the bit_array
+// logic operators and popcount on it
+static inline BIT_ARRAY* _bitmap_view(BIT_ARRAY *view, word_t *words)
+{
+  return bit_array_view(view, words, CHUNK_BITS);
+}
+
+static inline uint32_t _bitmap_card(const word_t *words)
+{
+  BIT_ARRAY view;
+  _bitmap_view(&view, (word_t*)words);
+  return (uint32_t)bit_array_num_bits_set(&view);
+}
+
+//
+// Containers
+//
+
+static void _container_free(BIT_ROARING_CONTAINER *c)
+{
+  free(c->data);
+  c->data = NULL;
+}
+
+// Index of the first value in `vals` >= x
+static inline uint32_t _lower_bound16(const uint16_t *vals, uint32_t n, uint16_t x)
+{
+  uint32_t lo = 0, hi = n;
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if(vals[mid] < x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Index of the first run ending at or after x
+static inline uint32_t _run_lower_bound(const uint16_t *runs, uint32_t n, uint16_t x)
+{
+  uint32_t lo = 0, hi = n;
+  while(lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if((uint32_t)runs[2*mid] + runs[2*mid+1] < x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Write the bits of any container into a 1024 word buffer
+static void _container_fill_bitmap(const BIT_ROARING_CONTAINER *c, word_t *words)
+{
+  const uint16_t *vals = (const uint16_t*)c->data;
+  uint32_t i;
+
+  switch(c->type)
+  {
+    case ROARING_BITMAP:
+      memcpy(words, c->data, CHUNK_WORDS * sizeof(word_t));
+      break;
+    case ROARING_ARRAY:
+      memset(words, 0, CHUNK_WORDS * sizeof(word_t));
+      for(i = 0; i < c->n; i++) bitset_set(words, vals[i]);
+      break;
+    case ROARING_RUN:
+    {
+      BIT_ARRAY view;
+      _bitmap_view(&view, words);
+      memset(words, 0, CHUNK_WORDS * sizeof(word_t));
+      for(i = 0; i < c->n; i++)
+        bit_array_set_region(&view, vals[2*i], (bit_index_t)vals[2*i+1] + 1);
+      break;
+    }
+  }
+}
+
+// Bitmap of a container: points at its data if it is a bitmap, otherwise
+// is written into `buf`
+static const word_t* _container_bitmap(const BIT_ROARING_CONTAINER *c, word_t *buf)
+{
+  if(c->type == ROARING_BITMAP) return (const word_t*)c->data;
+  _container_fill_bitmap(c, buf);
+  return buf;
+}
+
+// Make a container from a bitmap of `card` bits (card > 0), as an array if
+// small enough. Takes ownership of `words` if a bitmap is made.
+static void _container_from_bitmap(BIT_ROARING_CONTAINER *c, word_t *words,
+                                   uint32_t card, char owned)
+{
+  c->card = card;
+
+  if(card <= ROARING_MAX_ARRAY)
+  {
+    uint16_t *vals = (uint16_t*)_rmalloc(card * sizeof(uint16_t));
+    uint32_t i, n = 0;
+    for(i = 0; i < CHUNK_WORDS; i++) {
+      word_t w = words[i];
+      while(w) {
+        vals[n++] = (uint16_t)(i * 64 + trailing_zeros(w));
+        w &= w - 1;
+      }
+    }
+    if(owned) free(words);
+    c->type = ROARING_ARRAY;
+    c->data = vals;
+    c->n = c->cap = card;
+  }
+  else
+  {
+    if(!owned) {
+      word_t *cpy = (word_t*)_rmalloc(CHUNK_WORDS * sizeof(word_t));
+      memcpy(cpy, words, CHUNK_WORDS * sizeof(word_t));
+      words = cpy;
+    }
+    c->type = ROARING_BITMAP;
+    c->data = words;
+    c->n = c->cap = 0;
+  }
+}
+
+// Convert a container to array/bitmap form so it can be modified
+static void _container_unrun(BIT_ROARING_CONTAINER *c)
+{
+  if(c->type != ROARING_RUN) return;
+  word_t *words = (word_t*)_rmalloc(CHUNK_WORDS * sizeof(word_t));
+  _container_fill_bitmap(c, words);
+  _container_free(c);
+  _container_from_bitmap(c, words, c->card, 1);
+}
+
+// Number of runs of set bits in a bitmap
+static uint32_t _bitmap_num_runs(const word_t *words)
+{
+  uint32_t i, runs = 0;
+  word_t prev_top = 0;
+  for(i = 0; i < CHUNK_WORDS; i++) {
+    // count bits set whose lower neighbour is not set
+    runs += POPCOUNT(words[i] & ~((words[i] << 1) | prev_top));
+    prev_top = words[i] >> 63;
+  }
+  return runs;
+}
+
+static size_t _container_bytes(const BIT_ROARING_CONTAINER *c)
+{
+  switch(c->type) {
+    case ROARING_ARRAY: return c->cap * sizeof(uint16_t);
+    case ROARING_RUN: return c->cap * 2 * sizeof(uint16_t);
+    default: return CHUNK_WORDS * sizeof(word_t);
+  }
+}
+
+// Replace container with a run container if that is smaller
+static void _container_run_optimize(BIT_ROARING_CONTAINER *c, word_t *buf)
+{
+  const word_t *words = _container_bitmap(c, buf);
+  uint32_t nruns = _bitmap_num_runs(words), n = 0;
+  size_t cur_size = c->type == ROARING_ARRAY ? c->n * sizeof(uint16_t)
+                                             : CHUNK_WORDS * sizeof(word_t);
+
+  if(c->type == ROARING_RUN || nruns * 2 * sizeof(uint16_t) >= cur_size) return;
+
+  uint16_t *runs = (uint16_t*)_rmalloc(nruns * 2 * sizeof(uint16_t));
+  BIT_ARRAY view;
+  _bitmap_view(&view, (word_t*)words);
+  bit_index_t start = 0, end;
+
+  while(bit_array_find_next_set_bit(&view, start, &start))
+  {
+    if(!bit_array_find_next_clear_bit(&view, start, &end)) end = CHUNK_BITS;
+    runs[2*n] = (uint16_t)start;
+    runs[2*n+1] = (uint16_t)(end - start - 1);
+    n++;
+    if(end == CHUNK_BITS) break;
+    start = end;
+  }
+
+  assert(n == nruns);
+  _container_free(c);
+  c->type = ROARING_RUN;
+  c->data = runs;
+  c->n = c->cap = nruns;
+}
+
+static void _container_copy(BIT_ROARING_CONTAINER *dst,
+                            const BIT_ROARING_CONTAINER *src)
+{
+  size_t bytes = src->type == ROARING_BITMAP ? CHUNK_WORDS * sizeof(word_t)
+               : src->type == ROARING_ARRAY ? src->n * sizeof(uint16_t)
+                                            : src->n * 2 * sizeof(uint16_t);
+  *dst = *src;
+  dst->cap = src->n;
+  dst->data = _rmalloc(bytes);
+  memcpy(dst->data, src->data, bytes);
+}
+
+static char _container_get(const BIT_ROARING_CONTAINER *c, uint16_t x)
+{
+  const uint16_t *vals = (const uint16_t*)c->data;
+  uint32_t i;
+
+  switch(c->type)
+  {
+    case ROARING_ARRAY:
+      i = _lower_bound16(vals, c->n, x);
+      return i < c->n && vals[i] == x;
+    case ROARING_BITMAP:
+      return bitset_get((const word_t*)c->data, x);
+    default:
+      i = _run_lower_bound(vals, c->n, x);
+      return i < c->n && vals[2*i] <= x;
+  }
+}
+
+// Find next bit set at or after x. Returns 1 if found
+static char _container_next(const BIT_ROARING_CONTAINER *c, uint32_t x,
+                            uint32_t *result)
+{
+  const uint16_t *vals = (const uint16_t*)c->data;
+  uint32_t i;
+
+  if(x >= CHUNK_BITS) return 0;
+
+  switch(c->type)
+  {
+    case ROARING_ARRAY:
+      i = _lower_bound16(vals, c->n, (uint16_t)x);
+      if(i == c->n) return 0;
+      *result = vals[i];
+      return 1;
+    case ROARING_BITMAP:
+    {
+      BIT_ARRAY view;
+      _bitmap_view(&view, (word_t*)c->data);
+      bit_index_t pos;
+      if(!bit_array_find_next_set_bit(&view, x, &pos)) return 0;
+      *result = (uint32_t)pos;
+      return 1;
+    }
+    default:
+      i = _run_lower_bound(vals, c->n, (uint16_t)x);
+      if(i == c->n) return 0;
+      *result = MAX(x, vals[2*i]);
+      return 1;
+  }
+}
+
+//
+// Container list
+//
+
+// Index of the container with `key`, or where it would be inserted
+static size_t _find_container(const BIT_ROARING* rarr, uint64_t key, char *found)
+{
+  size_t lo = 0, hi = rarr->num_of_containers;
+  while(lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if(rarr->containers[mid].key < key) lo = mid + 1;
+    else hi = mid;
+  }
+  *found = lo < rarr->num_of_containers && rarr->containers[lo].key == key;
+  return lo;
+}
+
+static BIT_ROARING_CONTAINER* _insert_container(BIT_ROARING* rarr, size_t pos,
+                                                uint64_t key)
+{
+  if(rarr->num_of_containers == rarr->capacity) {
+    rarr->capacity = MAX(4, rarr->capacity * 2);
+    rarr->containers = (BIT_ROARING_CONTAINER*)
+      _rrealloc(rarr->containers, rarr->capacity * sizeof(BIT_ROARING_CONTAINER));
+  }
+  memmove(rarr->containers + pos + 1, rarr->containers + pos,
+          (rarr->num_of_containers - pos) * sizeof(BIT_ROARING_CONTAINER));
+  rarr->num_of_containers++;
+
+  BIT_ROARING_CONTAINER *c = rarr->containers + pos;
+  memset(c, 0, sizeof(*c));
+  c->key = key;
+  c->type = ROARING_ARRAY;
+  return c;
+}
+
+static void _remove_container(BIT_ROARING* rarr, size_t pos)
+{
+  _container_free(rarr->containers + pos);
+  memmove(rarr->containers + pos, rarr->containers + pos + 1,
+          (rarr->num_of_containers - pos - 1) * sizeof(BIT_ROARING_CONTAINER));
+  rarr->num_of_containers--;
+}
+
+static void _clear_containers(BIT_ROARING* rarr)
+{
+  size_t i;
+  for(i = 0; i < rarr->num_of_containers; i++)
+    _container_free(rarr->containers + i);
+  rarr->num_of_containers = 0;
+}
+
+//
+// Basics
+//
+
+BIT_ROARING* bit_roaring_create(bit_index_t nbits)
+{
+  BIT_ROARING *rarr = (BIT_ROARING*)calloc(1, sizeof(BIT_ROARING));
+  if(rarr == NULL) { errno = ENOMEM; return NULL; }
+  rarr->num_of_bits = nbits;
+  return rarr;
+}
+
+void bit_roaring_free(BIT_ROARING* rarr)
+{
+  _clear_containers(rarr);
+  free(rarr->containers);
+  free(rarr);
+}
+
+bit_index_t bit_roaring_length(const BIT_ROARING* rarr)
+{
+  return rarr->num_of_bits;
+}
+
+void bit_roaring_resize(BIT_ROARING* rarr, bit_index_t nbits)
+{
+  if(nbits < rarr->num_of_bits)
+  {
+    // Drop containers past the end, mask the last one
+    uint64_t last_key = chunk_key(nbits);
+    char found;
+    size_t pos = _find_container(rarr, last_key, &found);
+
+    while(rarr->num_of_containers > pos + found)
+      _remove_container(rarr, rarr->num_of_containers-1);
+
+    if(found)
+    {
+      BIT_ROARING_CONTAINER *c = rarr->containers + pos;
+      word_t *words = (word_t*)_rmalloc(CHUNK_WORDS * sizeof(word_t));
+      BIT_ARRAY view;
+      _bitmap_view(&view, words);
+      _container_fill_bitmap(c, words);
+      bit_array_clear_region(&view, chunk_low(nbits), CHUNK_BITS - chunk_low(nbits));
+      _container_free(c);
+      uint32_t card = _bitmap_card(words);
+      if(card) _container_from_bitmap(c, words, card, 1);
+      else { free(words); _remove_container(rarr, pos); }
+    }
+  }
+
+  rarr->num_of_bits = nbits;
+}
+
+size_t bit_roaring_size_in_bytes(const BIT_ROARING* rarr)
+{
+  size_t i, bytes = rarr->capacity * sizeof(BIT_ROARING_CONTAINER);
+  for(i = 0; i < rarr->num_of_containers; i++)
+    bytes += _container_bytes(rarr->containers + i);
+  return bytes;
+}
+
+void bit_roaring_run_optimize(BIT_ROARING* rarr)
+{
+  word_t buf[CHUNK_WORDS];
+  size_t i;
+  for(i = 0; i < rarr->num_of_containers; i++)
+    _container_run_optimize(rarr->containers + i, buf);
+}
+
+//
+// Get, set, clear
+//
+
+char bit_roaring_get_bit(const BIT_ROARING* rarr, bit_index_t b)
+{
+  assert(b < rarr->num_of_bits);
+  char found;
+  size_t pos = _find_container(rarr, chunk_key(b), &found);
+  return found ? _container_get(rarr->containers + pos, chunk_low(b)) : 0;
+}
+
+void bit_roaring_set_bit(BIT_ROARING* rarr, bit_index_t b)
+{
+  assert(b < rarr->num_of_bits);
+  char found;
+  size_t pos = _find_container(rarr, chunk_key(b), &found);
+  BIT_ROARING_CONTAINER *c = found ? rarr->containers + pos
+                                   : _insert_container(rarr, pos, chunk_key(b));
+  uint16_t x = chunk_low(b);
+
+  _container_unrun(c);
+
+  if(c->type == ROARING_BITMAP)
+  {
+    word_t *words = (word_t*)c->data;
+    if(!bitset_get(words, x)) { bitset_set(words, x); c->card++; }
+    return;
+  }
+
+  uint16_t *vals = (uint16_t*)c->data;
+  uint32_t i = _lower_bound16(vals, c->n, x);
+  if(i < c->n && vals[i] == x) return;
+
+  if(c->n == ROARING_MAX_ARRAY)
+  {
+    // Array full -- switch to a bitmap
+    word_t *words = (word_t*)_rmalloc(CHUNK_WORDS * sizeof(word_t));
+    _container_fill_bitmap(c, words);
+    _container_free(c);
+    bitset_set(words, x);
+    _container_from_bitmap(c, words, ROARING_MAX_ARRAY + 1, 1);
+    return;
+  }
+
+  if(c->n == c->cap) {
+    c->cap = MIN(ROARING_MAX_ARRAY, MAX(4, c->cap * 2));
+    c->data = vals = (uint16_t*)_rrealloc(vals, c->cap * sizeof(uint16_t));
+  }
+
+  memmove(vals + i + 1, vals + i, (c->n - i) * sizeof(uint16_t));
+  vals[i] = x;
+  c->n++;
+  c->card++;
+}
+
+void bit_roaring_clear_bit(BIT_ROARING* rarr, bit_index_t b)
+{
+  assert(b < rarr->num_of_bits);
+  char found;
+  size_t pos = _find_container(rarr, chunk_key(b), &found);
+  if(!found) return;
+
+  BIT_ROARING_CONTAINER *c = rarr->containers + pos;
+  uint16_t x = chunk_low(b);
+
+  _container_unrun(c);
+
+  if(c->type == ROARING_BITMAP)
+  {
+    word_t *words = (word_t*)c->data;
+    if(!bitset_get(words, x)) return;
+    bitset_del(words, x);
+    if(--c->card <= ROARING_MAX_ARRAY) _container_from_bitmap(c, words, c->card, 1);
+    return;
+  }
+
+  uint16_t *vals = (uint16_t*)c->data;
+  uint32_t i = _lower_bound16(vals, c->n, x);
+  if(i == c->n || vals[i] != x) return;
+
+  memmove(vals + i, vals + i + 1, (c->n - i - 1) * sizeof(uint16_t));
+  c->n--;
+  c->card--;
+  if(c->card == 0) _remove_container(rarr, pos);
+}
+
+//
+// Count and find
+//
+
+bit_index_t bit_roaring_num_bits_set(const BIT_ROARING* rarr)
+{
+  bit_index_t count = 0;
+  size_t i;
+  for(i = 0; i < rarr->num_of_containers; i++) count += rarr->containers[i].card;
+  return count;
+}
+
+char bit_roaring_find_next_set_bit(const BIT_ROARING* rarr, bit_index_t offset,
+                                   bit_index_t* result)
+{
+  if(offset >= rarr->num_of_bits) return 0;
+
+  char found;
+  size_t pos = _find_container(rarr, chunk_key(offset), &found);
+  uint32_t x = found ? chunk_low(offset) : 0, low;
+
+  for(; pos < rarr->num_of_containers; pos++, x = 0)
+  {
+    const BIT_ROARING_CONTAINER *c = rarr->containers + pos;
+    if(_container_next(c, x, &low)) {
+      *result = (c->key << 16) | low;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+char bit_roaring_find_first_set_bit(const BIT_ROARING* rarr, bit_index_t* result)
+{
+  return bit_roaring_find_next_set_bit(rarr, 0, result);
+}
+
+//
+// Logic operators
+//
+
+typedef enum {ROARING_AND, ROARING_OR, ROARING_XOR} RoaringOp;
+
+// Merge two sorted arrays of offsets. Returns number of values written
+static uint32_t _array_merge(const uint16_t *a, uint32_t na,
+                             const uint16_t *b, uint32_t nb,
+                             uint16_t *out, RoaringOp op)
+{
+  uint32_t i = 0, j = 0, n = 0;
+
+  while(i < na && j < nb)
+  {
+    if(a[i] < b[j]) { if(op != ROARING_AND) out[n++] = a[i]; i++; }
+    else if(a[i] > b[j]) { if(op != ROARING_AND) out[n++] = b[j]; j++; }
+    else { if(op != ROARING_XOR) out[n++] = a[i]; i++; j++; }
+  }
+
+  if(op != ROARING_AND) {
+    for(; i < na; i++) out[n++] = a[i];
+    for(; j < nb; j++) out[n++] = b[j];
+  }
+
+  return n;
+}
+
+// out = a OP b. Returns 0 if the result is empty (out is then unset)
+static char _container_op(BIT_ROARING_CONTAINER *out,
+                          const BIT_ROARING_CONTAINER *a,
+                          const BIT_ROARING_CONTAINER *b, RoaringOp op)
+{
+  out->key = a->key;
+
+  if(a->type == ROARING_ARRAY && b->type == ROARING_ARRAY &&
+     (op == ROARING_AND || a->n + b->n <= ROARING_MAX_ARRAY))
+  {
+    uint16_t *vals = (uint16_t*)_rmalloc((a->n + b->n) * sizeof(uint16_t));
+    uint32_t n = _array_merge((const uint16_t*)a->data, a->n,
+                              (const uint16_t*)b->data, b->n, vals, op);
+    if(n == 0) { free(vals); return 0; }
+    out->type = ROARING_ARRAY;
+    out->data = vals;
+    out->n = out->card = n;
+    out->cap = a->n + b->n;
+    return 1;
+  }
+
+  if(op == ROARING_AND && (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY))
+  {
+    // array & anything: keep offsets that are set in the other container
+    const BIT_ROARING_CONTAINER *arr = a->type == ROARING_ARRAY ? a : b;
+    const BIT_ROARING_CONTAINER *other = arr == a ? b : a;
+    const uint16_t *avals = (const uint16_t*)arr->data;
+    uint16_t *vals = (uint16_t*)_rmalloc(arr->n * sizeof(uint16_t));
+    uint32_t i, n = 0;
+    for(i = 0; i < arr->n; i++)
+      if(_container_get(other, avals[i])) vals[n++] = avals[i];
+    if(n == 0) { free(vals); return 0; }
+    out->type = ROARING_ARRAY;
+    out->data = vals;
+    out->n = out->card = n;
+    out->cap = arr->n;
+    return 1;
+  }
+
+  // General case: run on bitmaps
+  word_t bufa[CHUNK_WORDS], bufb[CHUNK_WORDS];
+  word_t *words = (word_t*)_rmalloc(CHUNK_WORDS * sizeof(word_t));
+  BIT_ARRAY va, vb, vout;
+  _bitmap_view(&va, (word_t*)_container_bitmap(a, bufa));
+  _bitmap_view(&vb, (word_t*)_container_bitmap(b, bufb));
+  _bitmap_view(&vout, words);
+
+  switch(op) {
+    case ROARING_AND: bit_array_and(&vout, &va, &vb); break;
+    case ROARING_OR:  bit_array_or (&vout, &va, &vb); break;
+    case ROARING_XOR: bit_array_xor(&vout, &va, &vb); break;
+  }
+
+  uint32_t card = (uint32_t)bit_array_num_bits_set(&vout);
+  if(card == 0) { free(words); return 0; }
+  _container_from_bitmap(out, words, card, 1);
+  return 1;
+}
+
+static void _roaring_logic(BIT_ROARING* dst, const BIT_ROARING* src1,
+                           const BIT_ROARING* src2, RoaringOp op)
+{
+  size_t i = 0, j = 0, n = 0;
+  size_t cap = src1->num_of_containers + src2->num_of_containers;
+  BIT_ROARING_CONTAINER *out
+    = (BIT_ROARING_CONTAINER*)_rmalloc(MAX(1, cap) * sizeof(BIT_ROARING_CONTAINER));
+
+  while(i < src1->num_of_containers || j < src2->num_of_containers)
+  {
+    const BIT_ROARING_CONTAINER *a = i < src1->num_of_containers ? src1->containers + i : NULL;
+    const BIT_ROARING_CONTAINER *b = j < src2->num_of_containers ? src2->containers + j : NULL;
+
+    if(a && b && a->key == b->key) {
+      if(_container_op(out + n, a, b, op)) n++;
+      i++; j++;
+    }
+    else if(b == NULL || (a && a->key < b->key)) {
+      if(op != ROARING_AND) _container_copy(out + n++, a);
+      i++;
+    }
+    else {
+      if(op != ROARING_AND) _container_copy(out + n++, b);
+      j++;
+    }
+  }
+
+  bit_index_t nbits = MAX(src1->num_of_bits, src2->num_of_bits);
+
+  // dst may be src1 or src2 -- only replace its containers once we're done
+  _clear_containers(dst);
+  free(dst->containers);
+  dst->containers = out;
+  dst->num_of_containers = n;
+  dst->capacity = MAX(1, cap);
+  dst->num_of_bits = MAX(dst->num_of_bits, nbits);
+}
+
+void bit_roaring_and(BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2)
+{
+  _roaring_logic(dst, src1, src2, ROARING_AND);
+}
+
+void bit_roaring_or(BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2)
+{
+  _roaring_logic(dst, src1, src2, ROARING_OR);
+}
+
+void bit_roaring_xor(BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2)
+{
+  _roaring_logic(dst, src1, src2, ROARING_XOR);
+}
+
+//
+// Convert to and from BIT_ARRAY
+//
+
+void bit_roaring_to_array(const BIT_ROARING* src, BIT_ARRAY* dst)
+{
+  bit_array_resize_critical(dst, src->num_of_bits);
+  bit_array_clear_all(dst);
+
+  size_t i;
+  uint32_t j;
+
+  for(i = 0; i < src->num_of_containers; i++)
+  {
+    const BIT_ROARING_CONTAINER *c = src->containers + i;
+    const uint16_t *vals = (const uint16_t*)c->data;
+    bit_index_t base = c->key << 16;
+
+    switch(c->type)
+    {
+      case ROARING_BITMAP:
+      {
+        word_addr_t w = base / 64;
+        word_addr_t nw = MIN(CHUNK_WORDS, dst->num_of_words - w);
+        memcpy(dst->words + w, c->data, nw * sizeof(word_t));
+        break;
+      }
+      case ROARING_ARRAY:
+        for(j = 0; j < c->n; j++) bit_array_set(dst, base + vals[j]);
+        break;
+      case ROARING_RUN:
+        for(j = 0; j < c->n; j++)
+          bit_array_set_region(dst, base + vals[2*j], (bit_index_t)vals[2*j+1] + 1);
+        break;
+    }
+  }
+}
+
+// Containers are stored as an array, bitmap or runs, whichever is smallest
+void bit_roaring_from_array(BIT_ROARING* dst, const BIT_ARRAY* src)
+{
+  word_t words[CHUNK_WORDS];
+  word_addr_t w, nw;
+  BIT_ARRAY view;
+
+  _clear_containers(dst);
+  dst->num_of_bits = src->num_of_bits;
+
+  for(w = 0; w < src->num_of_words; w += CHUNK_WORDS)
+  {
+    nw = MIN(CHUNK_WORDS, src->num_of_words - w);
+    bit_array_view(&view, (word_t*)src->words + w, nw * WORD_SIZE);
+
+    uint32_t card = (uint32_t)bit_array_num_bits_set(&view);
+    if(card == 0) continue;
+
+    memcpy(words, src->words + w, nw * sizeof(word_t));
+    memset(words + nw, 0, (CHUNK_WORDS - nw) * sizeof(word_t));
+
+    BIT_ROARING_CONTAINER *c
+      = _insert_container(dst, dst->num_of_containers, w / CHUNK_WORDS);
+    _container_from_bitmap(c, words, card, 0);
+    _container_run_optimize(c, words);
+  }
+}
+
+//
+// Read/Write to a file
+//
+
+static size_t _write_le(FILE *f, uint64_t x, size_t nbytes)
+{
+  uint8_t buf[8];
+  size_t i;
+  for(i = 0; i < nbytes; i++) buf[i] = (uint8_t)(x >> (8*i));
+  return fwrite(buf, 1, nbytes, f);
+}
+
+static char _read_le(FILE *f, uint64_t *x, size_t nbytes)
+{
+  uint8_t buf[8];
+  size_t i;
+  if(fread(buf, 1, nbytes, f) != nbytes) return 0;
+  for(*x = 0, i = 0; i < nbytes; i++) *x |= (uint64_t)buf[i] << (8*i);
+  return 1;
+}
+
+static const char roaring_magic[8] = {'B','I','T','R','O','A','R','1'};
+
+bit_index_t bit_roaring_save(const BIT_ROARING* rarr, FILE* f)
+{
+  bit_index_t bytes = fwrite(roaring_magic, 1, 8, f);
+  size_t i;
+  uint32_t j, nvals;
+
+  bytes += _write_le(f, rarr->num_of_bits, 8);
+  bytes += _write_le(f, rarr->num_of_containers, 8);
+
+  for(i = 0; i < rarr->num_of_containers; i++)
+  {
+    const BIT_ROARING_CONTAINER *c = rarr->containers + i;
+    bytes += _write_le(f, c->key, 8);
+    bytes += _write_le(f, c->type, 1);
+    bytes += _write_le(f, c->card, 4);
+    bytes += _write_le(f, c->n, 4);
+
+    if(c->type == ROARING_BITMAP) {
+      for(j = 0; j < CHUNK_WORDS; j++)
+        bytes += _write_le(f, ((const word_t*)c->data)[j], 8);
+    } else {
+      nvals = c->type == ROARING_ARRAY ? c->n : 2 * c->n;
+      for(j = 0; j < nvals; j++)
+        bytes += _write_le(f, ((const uint16_t*)c->data)[j], 2);
+    }
+  }
+
+  return bytes;
+}
+
+// Check a container read from a file is one we could have built: values
+// sorted and in [0, nbits), card matching the values, arrays of at most
+// ROARING_MAX_ARRAY values and bitmaps of more
+static char _container_valid(const BIT_ROARING_CONTAINER *c, bit_index_t nbits)
+{
+  const uint16_t *vals = (const uint16_t*)c->data;
+  uint64_t card = 0, end = 0, last;
+  uint32_t j;
+
+  if(nbits == 0 || c->key > chunk_key(nbits - 1)) return 0;
+  // Values must be below nbits - key * CHUNK_BITS (may be more than a chunk)
+  last = MIN(nbits - c->key * CHUNK_BITS, CHUNK_BITS);
+
+  switch(c->type)
+  {
+    case ROARING_BITMAP:
+      if(c->card <= ROARING_MAX_ARRAY || c->card != _bitmap_card((const word_t*)c->data))
+        return 0;
+      if(last < CHUNK_BITS) {
+        BIT_ARRAY view;
+        _bitmap_view(&view, (word_t*)c->data);
+        bit_index_t pos;
+        if(bit_array_find_next_set_bit(&view, last, &pos)) return 0;
+      }
+      return 1;
+    case ROARING_ARRAY:
+      if(c->n == 0 || c->n > ROARING_MAX_ARRAY || c->card != c->n) return 0;
+      for(j = 1; j < c->n; j++) if(vals[j] <= vals[j-1]) return 0;
+      return vals[c->n-1] < last;
+    default:
+      if(c->n == 0) return 0;
+      for(j = 0; j < c->n; j++) {
+        if(j > 0 && vals[2*j] < end) return 0;
+        end = (uint64_t)vals[2*j] + vals[2*j+1] + 1;
+        if(end > last) return 0;
+        card += vals[2*j+1] + 1;
+      }
+      return card == c->card;
+  }
+}
+
+// Leaves rarr empty (no containers, length 0) on failure
+static char _roaring_load(BIT_ROARING* rarr, FILE* f)
+{
+  char magic[8];
+  uint64_t nbits, ncontainers, key, type, card, n, x;
+  uint32_t j, nvals;
+  size_t i;
+
+  if(fread(magic, 1, 8, f) != 8 || memcmp(magic, roaring_magic, 8) != 0) return 0;
+  if(!_read_le(f, &nbits, 8) || !_read_le(f, &ncontainers, 8)) return 0;
+
+  rarr->num_of_bits = nbits;
+
+  for(i = 0; i < ncontainers; i++)
+  {
+    if(!_read_le(f, &key, 8) || !_read_le(f, &type, 1) ||
+       !_read_le(f, &card, 4) || !_read_le(f, &n, 4)) return 0;
+    if(type > ROARING_RUN || card == 0 || card > CHUNK_BITS || n > CHUNK_BITS ||
+       (rarr->num_of_containers && key <= rarr->containers[i-1].key)) return 0;
+
+    BIT_ROARING_CONTAINER *c = _insert_container(rarr, i, key);
+    c->type = (uint8_t)type;
+    c->card = (uint32_t)card;
+    c->n = c->cap = type == ROARING_BITMAP ? 0 : (uint32_t)n;
+
+    if(type == ROARING_BITMAP) {
+      c->data = _rmalloc(CHUNK_WORDS * sizeof(word_t));
+      for(j = 0; j < CHUNK_WORDS; j++) {
+        if(!_read_le(f, &x, 8)) return 0;
+        ((word_t*)c->data)[j] = x;
+      }
+    } else {
+      nvals = type == ROARING_ARRAY ? c->n : 2 * c->n;
+      c->data = _rmalloc(nvals * sizeof(uint16_t));
+      for(j = 0; j < nvals; j++) {
+        if(!_read_le(f, &x, 2)) return 0;
+        ((uint16_t*)c->data)[j] = (uint16_t)x;
+      }
+    }
+
+    if(!_container_valid(c, nbits)) return 0;
+  }
+
+  return 1;
+}
+
+char bit_roaring_load(BIT_ROARING* rarr, FILE* f)
+{
+  _clear_containers(rarr);
+  rarr->num_of_bits = 0;
+  if(_roaring_load(rarr, f)) return 1;
+  _clear_containers(rarr);
+  rarr->num_of_bits = 0;
+  return 0;
+}
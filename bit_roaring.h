@@ -0,0 +1,129 @@
+/*
+ bit_roaring.h
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Compressed bit array: a companion to BIT_ARRAY for sparse bit sets.
+// Bits are split into chunks of 65536. Each chunk that has any bits set is
+// stored in the smallest of three containers (as in Roaring bitmaps):
+//  - array:  sorted 16 bit offsets, for up to 4096 bits set
+//  - bitmap: 1024 words of dense bits
+//  - run:    sorted (start, length-1) pairs of 16 bit offsets
+// Empty chunks cost nothing, so a 2^32 bit universe with 10k bits set takes
+// ~20KB rather than 512MB.
+
+#ifndef BIT_ROARING_HEADER_SEEN
+#define BIT_ROARING_HEADER_SEEN
+
+#include "bit_array.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {ROARING_ARRAY, ROARING_BITMAP, ROARING_RUN} RoaringType;
+
+// Internal -- one chunk of 65536 bits
+typedef struct
+{
+  uint64_t key;  // bit index >> 16
+  uint32_t card; // number of bits set (1..65536)
+  uint32_t n;    // array: number of offsets; run: number of runs
+  uint32_t cap;  // array: offsets allocated; run: runs allocated
+  uint8_t type;  // RoaringType
+  void *data;    // uint16_t[cap] / word_t[1024] / uint16_t[2*cap]
+} BIT_ROARING_CONTAINER;
+
+typedef struct
+{
+  BIT_ROARING_CONTAINER *containers; // sorted by key
+  size_t num_of_containers, capacity;
+  bit_index_t num_of_bits;
+} BIT_ROARING;
+
+//
+// Basics
+//
+
+// Create a new compressed array of length nbits, all zero
+// Returns NULL if cannot malloc
+BIT_ROARING* bit_roaring_create(bit_index_t nbits);
+void bit_roaring_free(BIT_ROARING* rarr);
+
+bit_index_t bit_roaring_length(const BIT_ROARING* rarr);
+
+// Enlarging adds zeros, shrinking drops the top bits
+void bit_roaring_resize(BIT_ROARING* rarr, bit_index_t nbits);
+
+// Bytes of memory used by the containers (excludes the struct itself)
+size_t bit_roaring_size_in_bytes(const BIT_ROARING* rarr);
+
+// Convert containers to runs wherever that saves memory
+void bit_roaring_run_optimize(BIT_ROARING* rarr);
+
+//
+// Get, set, clear individual bits ("safe": use assert() to check bounds)
+//
+
+char bit_roaring_get_bit(const BIT_ROARING* rarr, bit_index_t b);
+void bit_roaring_set_bit(BIT_ROARING* rarr, bit_index_t b);
+void bit_roaring_clear_bit(BIT_ROARING* rarr, bit_index_t b);
+
+//
+// Count and find
+//
+
+bit_index_t bit_roaring_num_bits_set(const BIT_ROARING* rarr);
+
+// Find the index of the next bit that is set, at or after `offset`
+// Returns 1 if a bit is set, otherwise 0
+// If no next bit is set result is not changed
+char bit_roaring_find_next_set_bit(const BIT_ROARING* rarr, bit_index_t offset,
+                                   bit_index_t* result);
+char bit_roaring_find_first_set_bit(const BIT_ROARING* rarr, bit_index_t* result);
+
+//
+// Logic operators
+//
+
+// dst is resized to the longer of src1, src2
+// BIT_ROARINGs can all be different or the same object
+void bit_roaring_and(BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2);
+void bit_roaring_or (BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2);
+void bit_roaring_xor(BIT_ROARING* dst, const BIT_ROARING* src1, const BIT_ROARING* src2);
+
+//
+// Convert to and from BIT_ARRAY
+//
+
+// dst is resized to the length of src
+void bit_roaring_to_array(const BIT_ROARING* src, BIT_ARRAY* dst);
+void bit_roaring_from_array(BIT_ROARING* dst, const BIT_ARRAY* src);
+
+//
+// Read/Write to a file
+//
+// File format is ["BITROAR1"][8 bytes: number of bits][8 bytes: num containers]
+// followed by each container:
+//   [8 bytes: key][1 byte: type][4 bytes: card][4 bytes: n][data]
+// data is n x 2 bytes (array), 8192 bytes (bitmap) or n x 4 bytes (run)
+// All values are little endian
+//
+
+// Returns the number of bytes written
+bit_index_t bit_roaring_save(const BIT_ROARING* rarr, FILE* f);
+
+// Returns 1 on success, 0 on failure. Containers are checked as they are read
+// (values sorted and in range, card matching); on failure rarr is left empty
+// with length 0
+char bit_roaring_load(BIT_ROARING* rarr, FILE* f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,775 @@
+/*
+ dev/bit_array_bench.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Microbenchmarks for bit_array.c, run with `make bench`.
+// Each benchmark is timed for at least --min-time seconds at array sizes from
+// 64 bits up to --max-bits (default 64 Mbits, up to 4 Gbits), and reported as
+// ns per operation and GB/s (bytes of array touched per second).
+//
+// usage: ./bit_array_bench [options]
+//   --format=csv|json  output format (default: csv)
+//   --min-time=SECS    minimum time per benchmark (default: 0.1)
+//   --max-bits=N       largest array in bits (default: 67108864)
+//   --filter=STR       only run benchmarks with STR in their name
+//   --threads=N        threads for the _mt benchmarks (default: num CPUs)
+//
+// Compare the SIMD and scalar kernels with `make bench` and
+// `make clean && make SCALAR=1 bench`; the kernels used are in the output.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bit_array.h"
+#include "bit_array_mt.h"
+#include "bit_bloom.h"
+
+#define NUM_INDICES 4096
+
+typedef struct
+{
+  bit_index_t nbits;
+  BIT_ARRAY *a, *b, *c, *q;
+  bit_index_t indices[NUM_INDICES]; // random bit indices < nbits
+  char *str;
+  FILE *file;
+  BIT_ARRAY_POOL *pool;
+  BIT_BLOOM *bloom;
+  uint64_t hashes[NUM_INDICES]; // key hashes, half in bloom
+} BenchState;
+
+typedef struct
+{
+  const char *name;
+  void (*setup)(BenchState *st);
+  // Run iters operations
+  void (*run)(BenchState *st, size_t iters);
+  // Bytes of array read and written per op, in units of nbits/8 (0: not a
+  // bulk op, e.g. single bit get/set)
+  double bytes;
+  // Largest array size to run this benchmark at
+  bit_index_t max_bits;
+} Benchmark;
+
+// Results are written here so they can't be optimised away
+volatile uint64_t sink;
+
+//
+// Setup
+//
+
+// a, b are random, c is empty
+static void setup_random(BenchState *st)
+{
+  bit_array_resize_critical(st->a, st->nbits);
+  bit_array_resize_critical(st->b, st->nbits);
+  bit_array_resize_critical(st->c, st->nbits);
+  bit_array_random_mt(st->a, 0.5f, 1, st->pool);
+  bit_array_random_mt(st->b, 0.5f, 2, st->pool);
+  bit_array_clear_all(st->c);
+}
+
+// Only the last bit of a is set, only the first bit of b
+static void setup_sparse(BenchState *st)
+{
+  setup_random(st);
+  bit_array_clear_all(st->a);
+  bit_array_clear_all(st->b);
+  bit_array_set_bit(st->a, st->nbits-1);
+  bit_array_set_bit(st->b, 0);
+}
+
+// a, b are half length, c is full length
+static void setup_halves(BenchState *st)
+{
+  setup_random(st);
+  bit_array_resize_critical(st->a, st->nbits / 2);
+  bit_array_resize_critical(st->b, st->nbits / 2);
+}
+
+// a, b are quarter length, c is full length
+static void setup_quarters(BenchState *st)
+{
+  setup_random(st);
+  bit_array_resize_critical(st->a, st->nbits / 4);
+  bit_array_resize_critical(st->b, st->nbits / 4);
+}
+
+// Filter of nbits with half of the hashes in it
+static void setup_bloom(BenchState *st)
+{
+  size_t i;
+  if(st->bloom != NULL) bit_bloom_free(st->bloom);
+  st->bloom = bit_bloom_create(st->nbits, 8, 1);
+  for(i = 0; i < NUM_INDICES; i++)
+    st->hashes[i] = bit_bloom_hash(&st->indices[i], sizeof(bit_index_t), i);
+  bit_bloom_add_hashes(st->bloom, st->hashes, NUM_INDICES / 2);
+}
+
+// setup_random with c and q random as well
+static void setup_random_q(BenchState *st)
+{
+  setup_random(st);
+  bit_array_resize_critical(st->q, st->nbits);
+  bit_array_random_mt(st->c, 0.5f, 3, st->pool);
+  bit_array_random_mt(st->q, 0.5f, 4, st->pool);
+}
+
+// a > b for subtraction
+static void setup_sub(BenchState *st)
+{
+  setup_random(st);
+  bit_array_set_bit(st->a, st->nbits-1);
+  bit_array_clear_bit(st->b, st->nbits-1);
+}
+
+// numbers of half length, so products fit
+static void setup_mul(BenchState *st)
+{
+  setup_halves(st);
+  bit_array_set_bit(st->b, 0);
+}
+
+// a is nbits long, b half as many significant bits
+static void setup_div(BenchState *st)
+{
+  setup_random(st);
+  bit_array_set_bit(st->a, st->nbits-1);
+  bit_array_clear_region(st->b, st->nbits / 2, st->nbits - st->nbits / 2);
+  bit_array_set_bit(st->b, st->nbits / 2 - 1);
+}
+
+static void setup_hex(BenchState *st)
+{
+  setup_random(st);
+  st->str = (char*)realloc(st->str, st->nbits / 4 + 1);
+  bit_array_to_hex(st->a, 0, st->nbits, st->str, 0);
+}
+
+static void setup_decimal(BenchState *st)
+{
+  setup_random(st);
+  st->str = (char*)realloc(st->str, st->nbits / 3 + 2);
+  bit_array_to_decimal(st->a, st->str, st->nbits / 3 + 2);
+}
+
+static void setup_str(BenchState *st)
+{
+  setup_random(st);
+  st->str = (char*)realloc(st->str, st->nbits + 1);
+  bit_array_to_str(st->a, st->str);
+}
+
+//
+// Benchmarks
+//
+
+#define idx(st,i) ((st)->indices[(i) & (NUM_INDICES-1)])
+
+static void run_get_macro(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_get(st->a, idx(st,i));
+  sink = sum;
+}
+
+static void run_get_func(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_get_bit(st->a, idx(st,i));
+  sink = sum;
+}
+
+static void run_set_macro(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_set(st->a, idx(st,i));
+}
+
+static void run_set_func(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_set_bit(st->a, idx(st,i));
+}
+
+// One iteration is one bit, as for set_bit
+static void run_set_batch(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i += NUM_INDICES)
+    bit_array_set_batch(st->a, st->indices, (iters - i < NUM_INDICES ? iters - i : NUM_INDICES), 0);
+}
+
+static void run_test_batch(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i += NUM_INDICES)
+    sum += bit_array_test_batch(st->a, st->indices, (iters - i < NUM_INDICES ? iters - i : NUM_INDICES));
+  sink = sum;
+}
+
+// One iteration is one key
+static void run_bloom_contains(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++)
+    sum += bit_bloom_contains_hash(st->bloom, st->hashes[i & (NUM_INDICES-1)]);
+  sink = sum;
+}
+
+static void run_bloom_contains_batch(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i += NUM_INDICES)
+    sum += bit_bloom_contains_hashes(st->bloom, st->hashes,
+                                     (iters - i < NUM_INDICES ? iters - i : NUM_INDICES), NULL);
+  sink = sum;
+}
+
+static void run_bloom_add_batch(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i += NUM_INDICES)
+    bit_bloom_add_hashes(st->bloom, st->hashes,
+                         (iters - i < NUM_INDICES ? iters - i : NUM_INDICES));
+}
+
+// Regions start and end mid-word
+static void run_set_region(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_set_region(st->a, 3, st->nbits - 7);
+}
+
+static void run_clear_region(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_clear_region(st->a, 3, st->nbits - 7);
+}
+
+static void run_toggle_region(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_toggle_region(st->a, 3, st->nbits - 7);
+}
+
+static void run_set_region_mt(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_set_region_mt(st->a, 3, st->nbits - 7, st->pool);
+}
+
+static void run_and(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_and(st->c, st->a, st->b);
+}
+
+static void run_or(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_or(st->c, st->a, st->b);
+}
+
+static void run_xor(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_xor(st->c, st->a, st->b);
+}
+
+static void run_not(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_not(st->c, st->a);
+}
+
+static void run_and_mt(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_and_mt(st->c, st->a, st->b, st->pool);
+}
+
+static void run_num_bits_set(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_num_bits_set(st->a);
+  sink = sum;
+}
+
+static void run_num_bits_set_mt(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_num_bits_set_mt(st->a, st->pool);
+  sink = sum;
+}
+
+static void run_hamming_distance(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_hamming_distance(st->a, st->b);
+  sink = sum;
+}
+
+static void run_and_count(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) sum += bit_array_and_count(st->a, st->b);
+  sink = sum;
+}
+
+// What and_count replaces: materialise a & b, then count it
+static void run_and_then_count(BenchState *st, size_t iters)
+{
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) {
+    bit_array_and(st->c, st->a, st->b);
+    sum += bit_array_num_bits_set(st->c);
+  }
+  sink = sum;
+}
+
+// a against b, c and q (setup_random_q)
+static void run_count_many(BenchState *st, size_t iters)
+{
+  const BIT_ARRAY *arrs[3] = {st->b, st->c, st->q};
+  bit_index_t counts[3];
+  size_t i; uint64_t sum = 0;
+  for(i = 0; i < iters; i++) {
+    bit_array_count_many(BIT_ARRAY_COUNT_AND, st->a, arrs, 3, counts);
+    sum += counts[0] + counts[1] + counts[2];
+  }
+  sink = sum;
+}
+
+// Scan the whole array for one bit (setup_sparse)
+static void run_find_next_set(BenchState *st, size_t iters)
+{
+  size_t i; bit_index_t pos = 0;
+  for(i = 0; i < iters; i++) bit_array_find_next_set_bit(st->a, 0, &pos);
+  sink = pos;
+}
+
+static void run_find_prev_set(BenchState *st, size_t iters)
+{
+  size_t i; bit_index_t pos = 0;
+  for(i = 0; i < iters; i++) bit_array_find_prev_set_bit(st->b, st->nbits, &pos);
+  sink = pos;
+}
+
+// Positions of all set bits (setup_random), a buffer at a time
+static void run_decode_set_bits(BenchState *st, size_t iters)
+{
+  static uint64_t buf[NUM_INDICES];
+  size_t i, n; uint64_t sum = 0;
+  BIT_ARRAY_ITER it;
+  for(i = 0; i < iters; i++) {
+    bit_array_iter_init(&it, st->a, 0, st->nbits, 0);
+    while((n = bit_array_iter_decode64(&it, buf, NUM_INDICES)) > 0) sum += buf[n-1];
+  }
+  sink = sum;
+}
+
+static void run_shift_left(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_shift_left(st->a, 13, 0);
+}
+
+static void run_shift_right(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_shift_right(st->a, 13, 0);
+}
+
+// Word multiple distance: memmove only, no funnel shift
+static void run_shift_left_words(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_shift_left(st->a, 128, 0);
+}
+
+static void run_shift_right_words(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_shift_right(st->a, 128, 0);
+}
+
+static void run_cycle_left(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_cycle_left(st->a, 13);
+}
+
+static void run_cycle_right_words(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_cycle_right(st->a, 128);
+}
+
+// Too far to buffer the bits that wrap round
+static void run_cycle_left_half(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_cycle_left(st->a, st->nbits / 2 + 13);
+}
+
+static void run_random(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_random(st->a, 0.5f);
+}
+
+static void run_random_p(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_random(st->a, 0.1f);
+}
+
+static void run_shuffle(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_shuffle(st->a);
+}
+
+// Source and destination offsets in different words positions
+static void run_copy_unaligned(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_copy(st->c, 5, st->a, 3, st->nbits - 8);
+}
+
+static void run_interleave(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_interleave(st->c, st->a, st->b);
+}
+
+static void run_interleave_mt(BenchState *st, size_t iters)
+{
+  const BIT_ARRAY *srcs[2] = {st->a, st->b};
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_interleave_mt(st->c, srcs, 2, st->pool);
+}
+
+// 4 ways from quarter length a and b
+static void run_interleave4(BenchState *st, size_t iters)
+{
+  const BIT_ARRAY *srcs[4] = {st->a, st->b, st->a, st->b};
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_interleave_n(st->c, srcs, 4);
+}
+
+static void run_deinterleave(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_deinterleave(st->b, st->c, st->a);
+}
+
+static void run_deinterleave_mt(BenchState *st, size_t iters)
+{
+  BIT_ARRAY *dsts[2] = {st->b, st->c};
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_deinterleave_mt(dsts, st->a, 2, st->pool);
+}
+
+static void run_add(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_add(st->c, st->a, st->b);
+}
+
+static void run_subtract(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_subtract(st->c, st->a, st->b);
+}
+
+static void run_multiply(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_multiply(st->c, st->a, st->b);
+}
+
+// q = a / b, c = a % b (includes copying a to c)
+static void run_divide(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) {
+    bit_array_copy_all(st->c, st->a);
+    bit_array_divide(st->c, st->q, st->b);
+  }
+}
+
+static void run_to_hex(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_to_hex(st->a, 0, st->nbits, st->str, 0);
+}
+
+static void run_from_hex(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_from_hex(st->c, 0, st->str, st->nbits / 4);
+}
+
+static void run_to_decimal(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_to_decimal(st->a, st->str, st->nbits / 3 + 2);
+}
+
+static void run_from_decimal(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_from_decimal(st->c, st->str);
+}
+
+static void run_to_str(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_to_str(st->a, st->str);
+}
+
+static void run_from_str(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) bit_array_from_str(st->c, st->str);
+}
+
+static void run_save(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) {
+    rewind(st->file);
+    bit_array_save(st->a, st->file);
+  }
+  fflush(st->file);
+}
+
+static void run_load(BenchState *st, size_t iters)
+{
+  size_t i;
+  for(i = 0; i < iters; i++) {
+    rewind(st->file);
+    if(!bit_array_load(st->c, st->file)) { fprintf(stderr, "load failed\n"); exit(-1); }
+  }
+}
+
+static void setup_load(BenchState *st)
+{
+  setup_random(st);
+  run_save(st, 1);
+}
+
+#define ALL_SIZES (1ULL<<32)
+#define STR_SIZES (1ULL<<28)
+#define SLOW_SIZES (1ULL<<20)
+
+static const Benchmark benchmarks[] = {
+  {"get_macro",         setup_random, run_get_macro,        0, ALL_SIZES},
+  {"get_bit",           setup_random, run_get_func,         0, ALL_SIZES},
+  {"set_macro",         setup_random, run_set_macro,        0, ALL_SIZES},
+  {"set_bit",           setup_random, run_set_func,         0, ALL_SIZES},
+  {"set_batch",         setup_random, run_set_batch,        0, ALL_SIZES},
+  {"test_batch",        setup_random, run_test_batch,       0, ALL_SIZES},
+  {"bloom_contains",    setup_bloom,  run_bloom_contains,   0, ALL_SIZES},
+  {"bloom_contains_batch", setup_bloom, run_bloom_contains_batch, 0, ALL_SIZES},
+  {"bloom_add_batch",   setup_bloom,  run_bloom_add_batch,  0, ALL_SIZES},
+  {"set_region",        setup_random, run_set_region,       1, ALL_SIZES},
+  {"clear_region",      setup_random, run_clear_region,     1, ALL_SIZES},
+  {"toggle_region",     setup_random, run_toggle_region,    2, ALL_SIZES},
+  {"set_region_mt",     setup_random, run_set_region_mt,    1, ALL_SIZES},
+  {"and",               setup_random, run_and,              3, ALL_SIZES},
+  {"or",                setup_random, run_or,               3, ALL_SIZES},
+  {"xor",               setup_random, run_xor,              3, ALL_SIZES},
+  {"not",               setup_random, run_not,              2, ALL_SIZES},
+  {"and_mt",            setup_random, run_and_mt,           3, ALL_SIZES},
+  {"num_bits_set",      setup_random, run_num_bits_set,     1, ALL_SIZES},
+  {"num_bits_set_mt",   setup_random, run_num_bits_set_mt,  1, ALL_SIZES},
+  {"hamming_distance",  setup_random, run_hamming_distance, 2, ALL_SIZES},
+  {"and_count",         setup_random, run_and_count,        2, ALL_SIZES},
+  {"and_then_count",    setup_random, run_and_then_count,   4, ALL_SIZES},
+  {"count_many",        setup_random_q, run_count_many,     4, ALL_SIZES},
+  {"find_next_set_bit", setup_sparse, run_find_next_set,    1, ALL_SIZES},
+  {"find_prev_set_bit", setup_sparse, run_find_prev_set,    1, ALL_SIZES},
+  {"decode_set_bits",   setup_random, run_decode_set_bits,  1, ALL_SIZES},
+  {"shift_left",        setup_random, run_shift_left,       2, ALL_SIZES},
+  {"shift_right",       setup_random, run_shift_right,      2, ALL_SIZES},
+  {"shift_left_words",  setup_random, run_shift_left_words, 2, ALL_SIZES},
+  {"shift_right_words", setup_random, run_shift_right_words, 2, ALL_SIZES},
+  {"cycle_left",        setup_random, run_cycle_left,       2, ALL_SIZES},
+  {"cycle_right_words", setup_random, run_cycle_right_words, 2, ALL_SIZES},
+  {"cycle_left_half",   setup_random, run_cycle_left_half,  2, ALL_SIZES},
+  {"random",            setup_random, run_random,           1, ALL_SIZES},
+  {"random_p",          setup_random, run_random_p,         1, ALL_SIZES},
+  {"shuffle",           setup_random, run_shuffle,          1, ALL_SIZES},
+  {"copy_unaligned",    setup_random, run_copy_unaligned,   2, ALL_SIZES},
+  {"interleave",        setup_halves, run_interleave,       2, ALL_SIZES},
+  {"interleave_mt",     setup_halves, run_interleave_mt,    2, ALL_SIZES},
+  {"interleave4",       setup_quarters, run_interleave4,    2, ALL_SIZES},
+  {"deinterleave",      setup_random, run_deinterleave,     2, ALL_SIZES},
+  {"deinterleave_mt",   setup_random, run_deinterleave_mt,  2, ALL_SIZES},
+  {"add",               setup_random, run_add,              3, ALL_SIZES},
+  {"subtract",          setup_sub,    run_subtract,         3, ALL_SIZES},
+  {"multiply",          setup_mul,    run_multiply,         2, SLOW_SIZES},
+  {"divide",            setup_div,    run_divide,           2, SLOW_SIZES},
+  {"to_decimal",        setup_decimal, run_to_decimal,      1, SLOW_SIZES},
+  {"from_decimal",      setup_decimal, run_from_decimal,    1, SLOW_SIZES},
+  {"to_hex",            setup_hex,    run_to_hex,           1, STR_SIZES},
+  {"from_hex",          setup_hex,    run_from_hex,         1, STR_SIZES},
+  {"to_str",            setup_str,    run_to_str,           1, STR_SIZES},
+  {"from_str",          setup_str,    run_from_str,         1, STR_SIZES},
+  {"save",              setup_random, run_save,             1, 1ULL<<30},
+  {"load",              setup_load,   run_load,             1, 1ULL<<30}
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+//
+// Timing
+//
+
+static double now_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Find a number of iterations that takes at least min_time, and time it
+static double time_benchmark(const Benchmark *bench, BenchState *st,
+                             double min_time, size_t *iters_ptr)
+{
+  size_t iters = 1;
+  double secs;
+
+  while(1)
+  {
+    double start = now_secs();
+    bench->run(st, iters);
+    secs = now_secs() - start;
+
+    if(secs >= min_time || iters >= ((size_t)1 << 40)) break;
+
+    // Aim 40% past min_time, grow at most 100x at a time
+    double mult = secs > 0 ? min_time * 1.4 / secs : 100;
+    if(mult > 100) mult = 100;
+    if(mult < 2) mult = 2;
+    iters = (size_t)(iters * mult);
+  }
+
+  *iters_ptr = iters;
+  return secs;
+}
+
+int main(int argc, char **argv)
+{
+  const char *format = "csv", *filter = NULL;
+  double min_time = 0.1;
+  bit_index_t max_bits = 1ULL<<26, nbits;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned nthreads = ncpus > 0 ? (unsigned)ncpus : 1;
+  int i;
+  size_t b, j;
+
+  for(i = 1; i < argc; i++)
+  {
+    if(strncmp(argv[i], "--format=", 9) == 0) format = argv[i] + 9;
+    else if(strncmp(argv[i], "--min-time=", 11) == 0) min_time = atof(argv[i] + 11);
+    else if(strncmp(argv[i], "--max-bits=", 11) == 0) max_bits = strtoull(argv[i] + 11, NULL, 10);
+    else if(strncmp(argv[i], "--filter=", 9) == 0) filter = argv[i] + 9;
+    else if(strncmp(argv[i], "--threads=", 10) == 0) nthreads = (unsigned)atoi(argv[i] + 10);
+    else {
+      fprintf(stderr, "usage: ./bit_array_bench [--format=csv|json] [--min-time=SECS]\n"
+                      "         [--max-bits=N] [--filter=STR] [--threads=N]\n");
+      exit(-1);
+    }
+  }
+
+  char json = strcmp(format, "json") == 0;
+  if(!json && strcmp(format, "csv") != 0) {
+    fprintf(stderr, "Unknown format: %s (csv or json)\n", format);
+    exit(-1);
+  }
+
+  BenchState st;
+  memset(&st, 0, sizeof(st));
+  st.a = bit_array_create(0);
+  st.b = bit_array_create(0);
+  st.c = bit_array_create(0);
+  st.q = bit_array_create(0);
+  st.file = tmpfile();
+  st.pool = bit_array_pool_create(nthreads);
+
+  if(st.file == NULL || st.pool == NULL) {
+    fprintf(stderr, "Couldn't create temporary file or thread pool\n");
+    exit(-1);
+  }
+
+  if(json) {
+    printf("{\n  \"context\": {\n");
+    printf("    \"simd\": \"%s\",\n", bit_array_simd_name());
+    printf("    \"threads\": %u,\n", nthreads);
+    printf("    \"min_time\": %g\n", min_time);
+    printf("  },\n  \"benchmarks\": [");
+  } else {
+    printf("# simd=%s threads=%u\n", bit_array_simd_name(), nthreads);
+    printf("name,bits,iterations,ns_per_op,gb_per_s\n");
+  }
+
+  char first = 1;
+
+  // 64 bits, 1K, 16K, 256K, 4M, 64M, 1G, 4G
+  for(nbits = 64; nbits <= max_bits; nbits = (nbits == (1ULL<<30) ? (1ULL<<32) : nbits * 16))
+  {
+    st.nbits = nbits;
+    for(j = 0; j < NUM_INDICES; j++) st.indices[j] = ((uint64_t)rand() * 7919 + rand()) % nbits;
+
+    for(b = 0; b < NUM_BENCHMARKS; b++)
+    {
+      const Benchmark *bench = &benchmarks[b];
+      if(nbits > bench->max_bits) continue;
+      if(filter != NULL && strstr(bench->name, filter) == NULL) continue;
+
+      bench->setup(&st);
+
+      size_t iters;
+      double secs = time_benchmark(bench, &st, min_time, &iters);
+      double ns_per_op = secs * 1e9 / iters;
+      double gb_per_s = bench->bytes * (nbits / 8.0) / ns_per_op;
+
+      if(json) {
+        printf("%s\n    {\"name\": \"%s\", \"bits\": %llu, \"iterations\": %zu, "
+               "\"ns_per_op\": %.3f, \"gb_per_s\": %.3f}",
+               first ? "" : ",", bench->name, (unsigned long long)nbits, iters,
+               ns_per_op, gb_per_s);
+      } else {
+        printf("%s,%llu,%zu,%.3f,%.3f\n", bench->name, (unsigned long long)nbits,
+               iters, ns_per_op, gb_per_s);
+      }
+      fflush(stdout);
+      first = 0;
+    }
+  }
+
+  if(json) printf("\n  ]\n}\n");
+
+  bit_array_pool_free(st.pool);
+  if(st.bloom != NULL) bit_bloom_free(st.bloom);
+  bit_array_free(st.a);
+  bit_array_free(st.b);
+  bit_array_free(st.c);
+  bit_array_free(st.q);
+  free(st.str);
+  fclose(st.file);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,259 @@
+/*
+ dev/bit_array_hpp_test.cpp
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Tests for the C++ wrapper bit_array.hpp
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include "bit_array.hpp"
+
+using bitarr::bit_array;
+using bitarr::fixed_bit_array;
+
+//
+// Tests
+//
+const char *suite_name;
+char suite_pass;
+int suites_run = 0, suites_failed = 0, suites_empty = 0;
+int tests_in_suite = 0, tests_run = 0, tests_failed = 0;
+
+#define QUOTE(str) #str
+#define ASSERT(x) {tests_run++; tests_in_suite++; if(!(x)) \
+  { fprintf(stderr, "failed assert [%s:%i] %s\n", __FILE__, __LINE__, QUOTE(x)); \
+    suite_pass = 0; tests_failed++; }}
+
+void SUITE_START(const char *name)
+{
+  suite_pass = 1;
+  suite_name = name;
+  suites_run++;
+  tests_in_suite = 0;
+}
+
+void SUITE_END()
+{
+  printf("Testing %s ", suite_name);
+  size_t suite_i;
+  for(suite_i = strlen(suite_name); suite_i < 80-8-5; suite_i++) printf(".");
+  printf("%s\n", suite_pass ? " pass" : " fail");
+  if(!suite_pass) suites_failed++;
+  if(!tests_in_suite) suites_empty++;
+}
+
+// Random array
+bit_array random_array(bit_index_t nbits, unsigned seed)
+{
+  bit_array arr(nbits);
+  srand(seed);
+  for(bit_index_t i = 0; i < nbits; i++) arr.assign(i, rand() & 1);
+  return arr;
+}
+
+void test_ownership()
+{
+  SUITE_START("C++ ownership");
+
+  static_assert(!std::is_copy_constructible_v<bit_array>, "no hidden copies");
+  static_assert(std::is_nothrow_move_constructible_v<bit_array>, "cheap moves");
+
+  bit_array a(100);
+  ASSERT(a.size() == 100 && a.count() == 0);
+  a.set(3).set(99);
+  const BIT_ARRAY *ptr = a.c_ptr();
+
+  bit_array b(std::move(a));
+  ASSERT(b.c_ptr() == ptr);
+  ASSERT(b.count() == 2 && b[3] && b[99] && !b[4]);
+
+  bit_array c = b.clone();
+  ASSERT(c.c_ptr() != ptr && c == b);
+  c.clear(3);
+  ASSERT(b[3] && !c[3] && c != b);
+
+  bit_array d = b.clone_cow();
+  d.toggle(0);
+  ASSERT(d[0] && !b[0] && d.count() == 3 && b.count() == 2);
+
+  BIT_ARRAY *raw = b.release();
+  ASSERT(raw == ptr && b.c_ptr() == nullptr);
+  bit_array e = bit_array::adopt(raw);
+  ASSERT(e.c_ptr() == ptr && e.count() == 2);
+
+  bit_array s("0110");
+  ASSERT(s.size() == 4 && s.to_string() == "0110" && s[1] && s[2]);
+
+  e.resize(2);
+  ASSERT(e.size() == 2 && e.count() == 0);
+
+  SUITE_END();
+}
+
+void test_expressions()
+{
+  SUITE_START("C++ expressions");
+
+  bit_index_t lens[] = {1, 63, 64, 65, 130, 1000};
+  for(bit_index_t na : lens) {
+    for(bit_index_t nb : lens) {
+      bit_array a = random_array(na, 1), b = random_array(nb, 2), c = random_array(na, 3);
+      bit_index_t len = na > nb ? na : nb;
+
+      bit_array d = (a & b) | ~c;
+      ASSERT(d.size() == len);
+      bit_index_t nset = 0;
+      char ok = 1;
+      for(bit_index_t i = 0; i < len; i++) {
+        bool x = i < na && a[i], y = i < nb && b[i], z = i < na && c[i];
+        bool v = (x && y) || !z;
+        if(d[i] != v) ok = 0;
+        nset += v;
+      }
+      ASSERT(ok);
+      ASSERT(d.count() == nset);
+      ASSERT(bitarr::count((a & b) | ~c) == nset);
+
+      // Matches the C API
+      bit_array e(len), f(len);
+      bit_array_and(e.c_ptr(), a.c_ptr(), b.c_ptr());
+      bit_array_xor(f.c_ptr(), a.c_ptr(), b.c_ptr());
+      bit_array g = a & b;
+      ASSERT(g == e);
+      g = a ^ b;
+      ASSERT(g == f);
+
+      // Compound assignment with an operand aliasing the result
+      bit_array h = a.clone();
+      h |= b;
+      bit_array_or(e.c_ptr(), a.c_ptr(), b.c_ptr());
+      ASSERT(h == e);
+      h ^= h;
+      ASSERT(h.size() == len && h.count() == 0);
+    }
+  }
+
+  // Expression read from its own destination
+  bit_array a = random_array(300, 4), b = random_array(300, 5);
+  bit_array c = a.clone();
+  c = ~(c & b);
+  bit_array d = ~(a & b);
+  ASSERT(c == d);
+
+  // Expression on a copy-on-write clone separates it
+  bit_array e = a.clone_cow();
+  e &= b;
+  ASSERT(a == random_array(300, 4));
+  ASSERT(e == (bit_array)(a & b));
+
+  SUITE_END();
+}
+
+void test_words()
+{
+  SUITE_START("C++ word spans");
+
+  bit_array a(130);
+  a.set(0).set(64).set(129);
+  bitarr::span<const word_t> w = a.words();
+  ASSERT(w.size() == 3 && w[0] == 1 && w[1] == 1 && w[2] == 2);
+
+  bit_array b = a.clone_cow();
+  bitarr::span<word_t> mw = b.mutable_words();
+  ASSERT(mw.size() == 3);
+  mw[1] = 0xff;
+  ASSERT(b.count() == 10 && a.count() == 3);
+
+  bit_array empty;
+  ASSERT(empty.words().empty() && empty.to_string().empty());
+
+  SUITE_END();
+}
+
+// Evaluated at compile time
+constexpr fixed_bit_array<100> make_mask()
+{
+  fixed_bit_array<100> m;
+  m.set(1).set(64).set(99);
+  return m;
+}
+
+static_assert(make_mask().count() == 3, "constexpr count");
+static_assert((~make_mask()).count() == 97, "constexpr negate");
+static_assert((make_mask() << 1).count() == 2, "constexpr shift");
+static_assert(sizeof(fixed_bit_array<100>) == 2 * sizeof(word_t), "inline storage");
+
+void test_fixed()
+{
+  SUITE_START("C++ fixed_bit_array");
+
+  fixed_bit_array<100> a = make_mask();
+  ASSERT(a[1] && a[64] && a[99] && !a[0]);
+  ASSERT(a.any() && !a.none() && !a.all());
+
+  fixed_bit_array<100> b;
+  b.set_all();
+  ASSERT(b.all() && b.count() == 100);
+  ASSERT((a & b) == a);
+  ASSERT((a | b) == b);
+  ASSERT((a ^ b).count() == 97);
+  ASSERT((~b).none());
+
+  // Shifts across words
+  fixed_bit_array<100> s = a << 35;
+  ASSERT(s.count() == 2 && s[36] && s[99]);
+  s = a >> 36;
+  ASSERT(s.count() == 2 && s[28] && s[63]);
+  ASSERT((a << 100).none() && (a >> 100).none());
+  ASSERT((a << 0) == a && (a >> 64) == fixed_bit_array<100>().set(0).set(35));
+
+  // C functions through a view
+  BIT_ARRAY view = a.c_view();
+  ASSERT(bit_array_num_bits_set(&view) == 3);
+  bit_array_toggle_all(&view);
+  ASSERT(a.count() == 97 && !a[1] && a[0]);
+  bit_array_clear_all(&view);
+  ASSERT(a.none());
+
+  bitarr::span<word_t> w = b.words();
+  ASSERT(w.size() == 2 && w[0] == ~(word_t)0 && w[1] == 0xfffffffffULL);
+
+  fixed_bit_array<1> one;
+  ASSERT(one.none());
+  one.toggle(0);
+  ASSERT(one.all() && (~one).none());
+
+  SUITE_END();
+}
+
+int main(int argc, char* argv[])
+{
+  if(argc != 1)
+  {
+    printf("  Unused args '%s..'\n", argv[1]);
+    printf("Usage: ./bit_array_hpp_test\n");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("  Test bit_array.hpp C++ wrapper:\n\n");
+
+  test_ownership();
+  test_expressions();
+  test_words();
+  test_fixed();
+
+  printf("\n");
+  printf(" %i / %i suites failed\n", suites_failed, suites_run);
+  printf(" %i / %i suites empty\n", suites_empty, suites_run);
+  printf(" %i / %i tests failed\n", tests_failed, tests_run);
+
+  return tests_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -11,10 +11,21 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <limits.h>
 #include <time.h> // needed for rand()
 #include <unistd.h>  // need for getpid() for getting setting rand number
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include "bit_array.h"
+#include "bit_roaring.h"
+#include "bit_array_mt.h"
+#include "bit_array_atomic.h"
+#include "bit_array_shm.h"
+#include "bit_bloom.h"
 
 // Constants
 const char test_filename[] = "bitarr_example.dump";
@@ -187,6 +198,799 @@ void test_get_bits()
   SUITE_END();
 }
 
+static int _cmp_bit_index(const void *a, const void *b)
+{
+  bit_index_t x = *(const bit_index_t*)a, y = *(const bit_index_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Check batch functions against one bit at a time, for n random indices
+static void _test_batch(bit_index_t len, size_t n, char sorted)
+{
+  BIT_ARRAY *arr = bit_array_create(len), *exp = bit_array_create(len);
+  BIT_ARRAY *out = bit_array_create(3);
+  bit_index_t *idx = (bit_index_t*)malloc((n+1) * sizeof(bit_index_t));
+  int flags = sorted ? BIT_BATCH_SORTED : 0;
+  bit_index_t count;
+  size_t i;
+
+  for(i = 0; i < n; i++) idx[i] = RAND(len);
+  if(n > 1) idx[n-1] = idx[0]; // a repeat
+  if(sorted) qsort(idx, n, sizeof(bit_index_t), _cmp_bit_index);
+
+  bit_array_random(arr, 0.5f);
+  bit_array_copy_all(exp, arr);
+
+  bit_array_set_batch(arr, idx, n, flags);
+  for(i = 0; i < n; i++) bit_array_set_bit(exp, idx[i]);
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+
+  bit_array_random(arr, 0.5f);
+  bit_array_copy_all(exp, arr);
+  bit_array_toggle_batch(arr, idx, n, flags);
+  for(i = 0; i < n; i++) bit_array_toggle_bit(exp, idx[i]);
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+
+  bit_array_gather(arr, idx, n, out);
+  ASSERT(bit_array_length(out) == n);
+  for(i = 0, count = 0; i < n; i++) {
+    ASSERT(bit_array_get_bit(out, i) == bit_array_get_bit(arr, idx[i]));
+    count += bit_array_get_bit(arr, idx[i]);
+  }
+  ASSERT(bit_array_test_batch(arr, idx, n) == count);
+  ASSERT(bit_array_num_bits_set(out) == count);
+
+  bit_array_clear_batch(arr, idx, n, flags);
+  for(i = 0; i < n; i++) bit_array_clear_bit(exp, idx[i]);
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+  ASSERT(bit_array_test_batch(arr, idx, n) == 0);
+
+  free(idx);
+  bit_array_free(arr);
+  bit_array_free(exp);
+  bit_array_free(out);
+}
+
+void test_batch()
+{
+  SUITE_START("batch set/clear/toggle/test");
+
+  _test_batch(1, 0, 0);
+  _test_batch(1, 5, 0);
+  _test_batch(100, 3, 1);
+  _test_batch(1000, 2000, 0);
+  _test_batch(1000, 2000, 1);
+  _test_batch(65, 63, 1);
+  // Big enough to be bucketed
+  _test_batch(1UL << 24, 100000, 0);
+  _test_batch((1UL << 23) + 7, 1000, 0);
+  _test_batch(1UL << 24, 100000, 1);
+
+  SUITE_END();
+}
+
+// Check iterating over [start,end) of arr, using decode chunks of step
+static void _test_iter(const BIT_ARRAY *arr, bit_index_t start, bit_index_t end,
+                       char clear, size_t step)
+{
+  bit_index_t len = end > start ? end - start : 0, i, j, pos;
+  uint64_t *exp = (uint64_t*)malloc((len+1) * sizeof(uint64_t));
+  uint64_t *got = (uint64_t*)malloc((len+1) * sizeof(uint64_t));
+  uint32_t *got32 = (uint32_t*)malloc((len+1) * sizeof(uint32_t));
+  size_t n, k;
+  BIT_ARRAY_ITER it;
+
+  for(i = start, n = 0; i < end; i++)
+    if((char)bit_array_get(arr, i) != clear) exp[n++] = i;
+
+  // One at a time
+  bit_array_iter_init(&it, arr, start, end, clear);
+  for(j = 0; bit_array_iter_next(&it, &pos); j++) {
+    ASSERT(j < n && pos == exp[j]);
+  }
+  ASSERT(j == n);
+
+  // In chunks, the first position taken with iter_next
+  bit_array_iter_init(&it, arr, start, end, clear);
+  k = bit_array_iter_next(&it, &got[0]) ? 1 : 0;
+  while((j = bit_array_iter_decode64(&it, got + k, step)) > 0) k += j;
+  ASSERT(k == n && memcmp(got, exp, n * sizeof(uint64_t)) == 0);
+
+  bit_array_iter_init(&it, arr, start, end, clear);
+  for(k = 0; (j = bit_array_iter_decode32(&it, got32 + k, step)) > 0; k += j) {}
+  ASSERT(k == n);
+  for(k = 0; k < n; k++) ASSERT(got32[k] == exp[k]);
+
+  if(clear) n = bit_array_get_clear_bits(arr, start, end, got);
+  else n = bit_array_get_bits(arr, start, end, got);
+  ASSERT(n == k && memcmp(got, exp, n * sizeof(uint64_t)) == 0);
+
+  free(exp);
+  free(got);
+  free(got32);
+}
+
+void test_iter()
+{
+  SUITE_START("set bit iterator");
+
+  BIT_ARRAY *arr = bit_array_create(0);
+  float probs[] = {0, 0.01f, 0.3f, 0.9f, 1};
+  size_t steps[] = {1, 7, 64, 100, 100000};
+  size_t p, s, c;
+
+  _test_iter(arr, 0, 0, 0, 10);
+
+  for(p = 0; p < sizeof(probs) / sizeof(probs[0]); p++)
+  {
+    bit_array_resize(arr, 5000);
+    bit_array_random(arr, probs[p]);
+    for(c = 0; c < 2; c++) {
+      for(s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        _test_iter(arr, 0, 5000, (char)c, steps[s]);
+        _test_iter(arr, 3, 4097, (char)c, steps[s]);
+        _test_iter(arr, 64, 128, (char)c, steps[s]);
+        _test_iter(arr, 100, 101, (char)c, steps[s]);
+        _test_iter(arr, 130, 130, (char)c, steps[s]);
+      }
+    }
+    bit_array_resize(arr, 200);
+    _test_iter(arr, 0, 200, 0, 3);
+    _test_iter(arr, 199, 200, 1, 3);
+  }
+
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+//
+// Allocators
+//
+
+// Counts blocks and bytes, and checks free/realloc are given the right size
+#define TRACK_MAX 64
+
+typedef struct
+{
+  void *ptrs[TRACK_MAX];
+  size_t sizes[TRACK_MAX];
+  size_t num_blocks, num_allocs;
+  int bad_size;
+} TrackAllocator;
+
+static void _track_add(TrackAllocator *t, void *ptr, size_t size)
+{
+  size_t i;
+  for(i = 0; i < TRACK_MAX && t->ptrs[i] != NULL; i++) {}
+  if(i == TRACK_MAX) die("Too many blocks");
+  t->ptrs[i] = ptr;
+  t->sizes[i] = size;
+  t->num_blocks++;
+}
+
+static void _track_remove(TrackAllocator *t, void *ptr, size_t size)
+{
+  size_t i;
+  for(i = 0; i < TRACK_MAX && t->ptrs[i] != ptr; i++) {}
+  if(i == TRACK_MAX || t->sizes[i] != size) { t->bad_size = 1; return; }
+  t->ptrs[i] = NULL;
+  t->num_blocks--;
+}
+
+static void* _track_alloc(void *ctx, size_t size)
+{
+  TrackAllocator *t = (TrackAllocator*)ctx;
+  void *ptr = malloc(size);
+  _track_add(t, ptr, size);
+  t->num_allocs++;
+  return ptr;
+}
+
+static void* _track_realloc(void *ctx, void *ptr, size_t old_size,
+                            size_t new_size)
+{
+  TrackAllocator *t = (TrackAllocator*)ctx;
+  _track_remove(t, ptr, old_size);
+  ptr = realloc(ptr, new_size);
+  _track_add(t, ptr, new_size);
+  return ptr;
+}
+
+static void _track_free(void *ctx, void *ptr, size_t size)
+{
+  _track_remove((TrackAllocator*)ctx, ptr, size);
+  free(ptr);
+}
+
+// Resize, fill and compare against a malloc'd array
+static void _test_allocator_array(const BIT_ARRAY_ALLOCATOR *allocator,
+                                  bit_index_t len, size_t align)
+{
+  BIT_ARRAY *arr = bit_array_create_with(10, allocator);
+  BIT_ARRAY *exp = bit_array_create_with(len, NULL);
+  ASSERT(arr != NULL && arr->allocator == allocator);
+  if(arr == NULL) return;
+  bit_array_set_all(arr);
+
+  bit_array_resize(arr, len);
+  // Small arrays are stored in the struct, not the allocator
+  ASSERT(arr->words == arr->inline_words ||
+         ((size_t)arr->words & (align - 1)) == 0);
+  bit_array_set_region(exp, 0, MIN(10, len));
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+
+  bit_array_random(exp, 0.5f);
+  bit_array_copy_all(arr, exp);
+  BIT_ARRAY *cpy = bit_array_clone(arr);
+  ASSERT(cpy->allocator == allocator);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+
+  bit_array_resize(arr, len / 3);
+  bit_array_resize(exp, len / 3);
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+
+  bit_array_free(arr);
+  bit_array_free(cpy);
+  bit_array_free(exp);
+}
+
+void test_allocators()
+{
+  SUITE_START("allocators");
+
+  TrackAllocator track;
+  memset(&track, 0, sizeof(track));
+  BIT_ARRAY_ALLOCATOR track_alloc = {_track_alloc, _track_realloc, _track_free,
+                                     &track};
+
+  // Custom allocator
+  _test_allocator_array(&track_alloc, 100000, 1);
+  ASSERT(track.num_blocks == 0 && !track.bad_size);
+
+  // Default allocator is used by bit_array_create
+  ASSERT(bit_array_get_default_allocator() == NULL);
+  bit_array_set_default_allocator(&track_alloc);
+  BIT_ARRAY *arr = bit_array_create(1000), stack;
+  ASSERT(track.num_blocks == 2 && arr->allocator == &track_alloc);
+  ASSERT(bit_array_alloc(&stack, 1000) != NULL);
+  ASSERT(track.num_blocks == 3);
+  bit_array_set_default_allocator(NULL);
+  bit_array_resize(arr, 5000);
+  bit_array_free(arr);
+  bit_array_dealloc(&stack);
+  ASSERT(track.num_blocks == 0 && !track.bad_size);
+
+  // Aligned, including huge page backed sizes
+  const BIT_ARRAY_ALLOCATOR *aligned = bit_array_aligned_allocator();
+  _test_allocator_array(aligned, 0, 64);
+  _test_allocator_array(aligned, 1000, 64);
+  _test_allocator_array(aligned, 3UL * 8 * 1024 * 1024, 64);
+  _test_allocator_array(aligned, 40UL * 8 * 1024 * 1024, 2 * 1024 * 1024);
+
+  // Arena
+  BIT_ARRAY_ARENA *arena = bit_array_arena_create();
+  const BIT_ARRAY_ALLOCATOR *arena_alloc = bit_array_arena_allocator(arena);
+  BIT_ARRAY *arrs[100];
+  size_t i, j;
+
+  _test_allocator_array(arena_alloc, 0, 64);
+  _test_allocator_array(arena_alloc, 500, 64);
+  _test_allocator_array(arena_alloc, 100000, 64);
+
+  for(i = 0; i < 100; i++) {
+    arrs[i] = bit_array_create_with(RAND(3000), arena_alloc);
+    bit_array_set_all(arrs[i]);
+  }
+  // Free half, make more: blocks are reused and don't overlap
+  for(i = 0; i < 100; i += 2) bit_array_free(arrs[i]);
+  for(i = 0; i < 100; i += 2) {
+    arrs[i] = bit_array_create_with(RAND(3000), arena_alloc);
+    bit_array_resize(arrs[i], RAND(100000));
+  }
+  for(i = 1; i < 100; i += 2) {
+    ASSERT(bit_array_num_bits_set(arrs[i]) == bit_array_length(arrs[i]));
+    for(j = 0; j < 100; j += 2)
+      ASSERT(arrs[j]->words + arrs[j]->capacity_in_words <= arrs[i]->words ||
+             arrs[i]->words + arrs[i]->capacity_in_words <= arrs[j]->words);
+  }
+
+  // Frees what is left
+  bit_array_arena_free(arena);
+
+  SUITE_END();
+}
+
+void test_inline_words()
+{
+  SUITE_START("inline words");
+
+  TrackAllocator track;
+  memset(&track, 0, sizeof(track));
+  BIT_ARRAY_ALLOCATOR track_alloc = {_track_alloc, _track_realloc, _track_free,
+                                     &track};
+
+  // Up to BIT_ARRAY_INLINE_WORDS words only allocate the struct
+  BIT_ARRAY *arr = bit_array_create_with(10, &track_alloc), stack;
+  ASSERT(track.num_allocs == 1);
+  ASSERT(arr->words == arr->inline_words);
+  bit_array_alloc_with(&stack, BIT_ARRAY_INLINE_WORDS * 64, &track_alloc);
+  ASSERT(track.num_allocs == 1);
+  ASSERT(stack.words == stack.inline_words);
+  ASSERT(bit_array_num_bits_set(&stack) == 0);
+
+  bit_array_set(arr, 3);
+  bit_array_set_bit(arr, 9);
+  ASSERT(bit_array_get(arr, 3) && bit_array_get_bit(arr, 9));
+  ASSERT(bit_array_get_word64(arr, 0) == 0x208);
+
+  // Grow within and then past the inline words
+  bit_array_resize(arr, BIT_ARRAY_INLINE_WORDS * 64);
+  ASSERT(arr->words == arr->inline_words && track.num_allocs == 1);
+  bit_array_set_bit(arr, BIT_ARRAY_INLINE_WORDS * 64 - 1);
+  bit_array_resize(arr, BIT_ARRAY_INLINE_WORDS * 64 + 1);
+  ASSERT(arr->words != arr->inline_words && track.num_allocs == 2);
+  ASSERT(bit_array_num_bits_set(arr) == 3);
+  ASSERT(bit_array_get_bit(arr, BIT_ARRAY_INLINE_WORDS * 64 - 1));
+  ASSERT(!bit_array_get_bit(arr, BIT_ARRAY_INLINE_WORDS * 64));
+
+  // Shrinking keeps the heap words
+  bit_array_resize(arr, 10);
+  ASSERT(bit_array_get_word64(arr, 0) == 0x208);
+  bit_array_resize(arr, 1000);
+  ASSERT(bit_array_num_bits_set(arr) == 2);
+
+  // Clones of small arrays are inline and independent
+  bit_array_set_all(&stack);
+  BIT_ARRAY *cpy = bit_array_clone(&stack);
+  ASSERT(cpy->words == cpy->inline_words);
+  bit_array_clear_bit(&stack, 5);
+  ASSERT(bit_array_num_bits_set(cpy) == BIT_ARRAY_INLINE_WORDS * 64);
+
+  // Growing through the interleave path
+  BIT_ARRAY *a = bit_array_create(192), *b = bit_array_create(192);
+  BIT_ARRAY *dst = bit_array_create(0);
+  bit_array_set_all(a);
+  bit_array_interleave(dst, a, b);
+  ASSERT(bit_array_length(dst) == 384 && bit_array_num_bits_set(dst) == 192);
+  ASSERT(bit_array_get_word64(dst, 320) == 0x5555555555555555ULL);
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(dst);
+
+  bit_array_free(arr);
+  bit_array_free(cpy);
+  bit_array_dealloc(&stack);
+  ASSERT(track.num_blocks == 0 && !track.bad_size);
+
+  SUITE_END();
+}
+
+void test_growth()
+{
+  SUITE_START("growth and capacity");
+
+  BIT_ARRAY *arr = bit_array_create(1000), view;
+  word_t *words;
+  word_t vwords[4] = {0};
+
+  // Default is the next power of two
+  ASSERT(bit_array_get_growth() == BIT_ARRAY_GROW_DOUBLE);
+  ASSERT(bit_array_capacity(arr) == 2048);
+  bit_array_resize(arr, 2100);
+  ASSERT(bit_array_capacity(arr) == 4096);
+  bit_array_resize(arr, 1100);
+
+  // Reserve is exact and keeps the length; resizing within it does not move
+  ASSERT(bit_array_reserve(arr, 10000) && bit_array_capacity(arr) == 10048);
+  ASSERT(bit_array_length(arr) == 1100);
+  ASSERT(bit_array_reserve(arr, 100) && bit_array_capacity(arr) == 10048);
+  words = arr->words;
+  bit_array_set_bit(arr, 1099);
+  bit_array_resize(arr, 10000);
+  ASSERT(arr->words == words);
+  ASSERT(bit_array_num_bits_set(arr) == 1 && bit_array_get_bit(arr, 1099));
+
+  // Shrink to fit, then back into the struct
+  bit_array_resize(arr, 1100);
+  ASSERT(bit_array_shrink_to_fit(arr) && bit_array_capacity(arr) == 1152);
+  ASSERT(bit_array_num_bits_set(arr) == 1 && bit_array_get_bit(arr, 1099));
+  bit_array_resize(arr, 200);
+  bit_array_set_bit(arr, 199);
+  ASSERT(bit_array_shrink_to_fit(arr) && arr->words == arr->inline_words);
+  ASSERT(bit_array_capacity(arr) == BIT_ARRAY_INLINE_WORDS * 64);
+  ASSERT(bit_array_num_bits_set(arr) == 1 && bit_array_get_bit(arr, 199));
+  bit_array_resize(arr, 2000);
+  ASSERT(bit_array_num_bits_set(arr) == 1 && bit_array_get_bit(arr, 199));
+
+  // Exact
+  bit_array_set_growth(BIT_ARRAY_GROW_EXACT, 0);
+  ASSERT(bit_array_get_growth() == BIT_ARRAY_GROW_EXACT);
+  bit_array_shrink_to_fit(arr);
+  bit_array_resize(arr, 3000);
+  ASSERT(bit_array_capacity(arr) == 3008);
+  bit_array_set_bit(arr, 2999); // rset path
+  bit_array_ensure_size_critical(arr, 5000);
+  ASSERT(bit_array_capacity(arr) == 5056);
+  ASSERT(bit_array_num_bits_set(arr) == 2);
+
+  // 1.5x: by half the old capacity, or to the length if that is more
+  bit_array_set_growth(BIT_ARRAY_GROW_1_5X, 0);
+  bit_array_resize(arr, 5100);
+  ASSERT(bit_array_capacity(arr) == 79 * 64 + 39 * 64);
+  bit_array_resize(arr, 100000);
+  ASSERT(bit_array_capacity(arr) == 100032);
+
+  // Chunks
+  bit_array_set_growth(BIT_ARRAY_GROW_CHUNK, 4096);
+  bit_array_resize(arr, 100033);
+  ASSERT(bit_array_capacity(arr) == 25 * 4096);
+  BIT_ARRAY *arr2 = bit_array_create(500);
+  ASSERT(bit_array_capacity(arr2) == 4096);
+  bit_array_free(arr2);
+  ASSERT(bit_array_num_bits_set(arr) == 2);
+  ASSERT(bit_array_get_bit(arr, 199) && bit_array_get_bit(arr, 2999));
+
+  bit_array_set_growth(BIT_ARRAY_GROW_DOUBLE, 0);
+  bit_array_free(arr);
+
+  // Views cannot grow, shrinking is a no-op
+  bit_array_view(&view, vwords, 256);
+  ASSERT(bit_array_reserve(&view, 256));
+  errno = 0;
+  ASSERT(!bit_array_reserve(&view, 257) && errno == EPERM);
+  ASSERT(bit_array_shrink_to_fit(&view) && bit_array_capacity(&view) == 256);
+
+  // Big arrays: new words are zero after growing, shrinking and growing again
+  bit_index_t big = 1UL << 24, i;
+  arr = bit_array_create(big);
+  bit_array_set_all(arr);
+  bit_array_resize(arr, big * 4);
+  ASSERT(bit_array_num_bits_set(arr) == big);
+  bit_array_set_bit(arr, big * 4 - 1);
+  bit_array_resize(arr, 1000);
+  bit_array_resize(arr, big * 4);
+  ASSERT(bit_array_num_bits_set(arr) == 1000);
+  bit_array_set_region(arr, 0, big * 3 + 7);
+  bit_array_resize(arr, big + 9);
+  ASSERT(bit_array_shrink_to_fit(arr));
+  ASSERT(bit_array_capacity(arr) == big + 64);
+  bit_array_resize(arr, big * 2);
+  ASSERT(bit_array_num_bits_set(arr) == big + 9);
+  for(i = big + 9; i < big * 2; i += 4099) ASSERT(!bit_array_get_bit(arr, i));
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+#define STAT_THREADS 4
+#define STAT_CALLS 10000
+
+static void* _stat_worker(void *ptr)
+{
+  int i;
+  for(i = 0; i < STAT_CALLS; i++) bit_array_set_all((BIT_ARRAY*)ptr);
+  return NULL;
+}
+
+static void _stat_run_workers(BIT_ARRAY **arrs, int reset)
+{
+  pthread_t threads[STAT_THREADS];
+  int i;
+  for(i = 0; i < STAT_THREADS; i++)
+    pthread_create(&threads[i], NULL, _stat_worker, arrs[i]);
+  if(reset) { for(i = 0; i < 100; i++) bit_array_stats_reset(); }
+  for(i = 0; i < STAT_THREADS; i++) pthread_join(threads[i], NULL);
+}
+
+void test_stats()
+{
+  SUITE_START("statistics");
+
+  BIT_ARRAY_STAT stats[64];
+  size_t i, n;
+  bit_array_stats_reset();
+  n = bit_array_stats(stats, 64);
+
+  if(n == 0) {
+    // Built without BIT_ARRAY_STATS
+    SUITE_END();
+    return;
+  }
+
+  ASSERT(n <= 64);
+  for(i = 0; i < n; i++) ASSERT(stats[i].calls == 0);
+
+  BIT_ARRAY *a = bit_array_create(1000), *b = bit_array_create(2000);
+  bit_array_set_all(a);
+  bit_array_and(b, a, b);
+  bit_array_and(b, a, b);
+  bit_array_resize(a, 100000);
+  ASSERT(bit_array_num_bits_set(a) == 1000);
+
+  bit_array_stats(stats, n);
+  for(i = 0; i < n; i++) {
+    if(strcmp(stats[i].name, "logical_and") == 0) {
+      ASSERT(stats[i].calls == 2);
+      ASSERT(stats[i].bytes == 2 * (16 + 32 + 32) * sizeof(word_t));
+    }
+    else if(strcmp(stats[i].name, "set_all") == 0 ||
+            strcmp(stats[i].name, "resize") == 0 ||
+            strcmp(stats[i].name, "num_bits_set") == 0 ||
+            strcmp(stats[i].name, "grow") == 0) {
+      ASSERT(stats[i].calls == 1);
+    }
+    else if(strcmp(stats[i].name, "logical_or") == 0) {
+      ASSERT(stats[i].calls == 0);
+    }
+  }
+
+  bit_array_stats_reset();
+  bit_array_stats(stats, n);
+  for(i = 0; i < n; i++) ASSERT(stats[i].calls == 0);
+
+  // Reset while other threads are counting
+  BIT_ARRAY *arrs[STAT_THREADS];
+  for(i = 0; i < STAT_THREADS; i++) arrs[i] = bit_array_create(100);
+  _stat_run_workers(arrs, 1);
+  bit_array_stats_reset();
+  bit_array_stats(stats, n);
+  for(i = 0; i < n; i++) ASSERT(stats[i].calls == 0);
+
+  // No counts are lost across threads
+  _stat_run_workers(arrs, 0);
+  bit_array_stats(stats, n);
+  for(i = 0; i < n; i++) {
+    if(strcmp(stats[i].name, "set_all") == 0)
+      ASSERT(stats[i].calls == STAT_THREADS * STAT_CALLS);
+  }
+
+  for(i = 0; i < STAT_THREADS; i++) bit_array_free(arrs[i]);
+  bit_array_free(a);
+  bit_array_free(b);
+
+  SUITE_END();
+}
+
+void test_views()
+{
+  SUITE_START("views of external words");
+
+  // Caller's buffer: 3 words, 150 bits
+  word_t buf[3] = {0xf0, 0, 0x3fffff};
+  BIT_ARRAY view, *cpy;
+  ASSERT(bit_array_view(&view, buf, 150) == &view);
+  ASSERT(bit_array_is_view(&view) && view.words == buf);
+  ASSERT(bit_array_length(&view) == 150);
+  ASSERT(bit_array_num_bits_set(&view) == 4 + 22);
+  bit_index_t pos;
+  ASSERT(bit_array_find_first_set_bit(&view, &pos) && pos == 4);
+
+  // Same answers as a copy
+  cpy = bit_array_clone(&view);
+  ASSERT(!bit_array_is_view(cpy) && cpy->words != buf);
+  ASSERT(bit_array_cmp(cpy, &view) == 0);
+  ASSERT(bit_array_hash(cpy, 7) == bit_array_hash(&view, 7));
+  ASSERT(bit_array_resize(cpy, 1000) && bit_array_length(cpy) == 1000);
+
+  // Logic ops from views into a separate dst, and into the view
+  BIT_ARRAY *dst = bit_array_create(0);
+  bit_array_not(dst, &view);
+  ASSERT(bit_array_length(dst) == 150 && bit_array_num_bits_set(dst) == 150 - 26);
+  bit_array_xor(&view, &view, dst);
+  ASSERT(buf[0] == ~(word_t)0 && buf[2] == 0x3fffff);
+  bit_array_clear_bit(&view, 0);
+  ASSERT(buf[0] == ~(word_t)0 - 1);
+
+  // Length is fixed
+  errno = 0;
+  ASSERT(!bit_array_resize(&view, 10) && errno == EPERM);
+  ASSERT(!bit_array_resize(&view, 1000) && errno == EPERM);
+  ASSERT(bit_array_resize(&view, 150) && view.words == buf);
+
+  // Words are not freed
+  bit_array_dealloc(&view);
+  ASSERT(buf[0] == ~(word_t)0 - 1 && buf[2] == 0x3fffff);
+
+  // Dirty top word
+  buf[2] |= (word_t)1 << 40;
+  errno = 0;
+  ASSERT(bit_array_view(&view, buf, 150) == NULL && errno == EINVAL);
+  ASSERT(bit_array_view(&view, buf, 192) != NULL);
+  ASSERT(bit_array_view(&view, NULL, 0) != NULL && bit_array_num_bits_set(&view) == 0);
+
+  // Word aligned ranges of an array
+  BIT_ARRAY *big = bit_array_create(100000), range;
+  bit_array_random(big, 0.5f);
+  ASSERT(bit_array_view_range(&range, big, 640, 64000) == &range);
+  ASSERT(range.words == big->words + 10 && bit_array_length(&range) == 64000);
+  bit_array_resize_critical(cpy, 64000);
+  bit_array_copy(cpy, 0, big, 640, 64000);
+  ASSERT(bit_array_cmp(cpy, &range) == 0);
+  ASSERT(bit_array_num_bits_set(&range) == bit_array_num_bits_set(cpy));
+
+  // Range to the end of the array, then misaligned ones
+  ASSERT(bit_array_view_range(&range, big, 99968, 32) != NULL);
+  ASSERT(bit_array_get_word32(&range, 0) == bit_array_get_word32(big, 99968));
+  ASSERT(bit_array_view_range(&range, big, 0, 0) != NULL);
+  ASSERT(bit_array_view_range(&range, big, 1, 64) == NULL && errno == EINVAL);
+  ASSERT(bit_array_view_range(&range, big, 64, 65) == NULL && errno == EINVAL);
+
+  // Big views are copied rather than shared copy-on-write
+  bit_array_view_range(&range, big, 0, 100000);
+  BIT_ARRAY *cow = bit_array_clone_cow(&range);
+  ASSERT(cow != NULL && range.words == big->words && range.cow == NULL);
+  ASSERT(bit_array_cmp(cow, big) == 0);
+  bit_array_toggle_bit(cow, 5);
+  ASSERT(bit_array_get_bit(cow, 5) != bit_array_get_bit(big, 5));
+
+  bit_array_free(cow);
+  bit_array_free(big);
+  bit_array_free(dst);
+  bit_array_free(cpy);
+
+  SUITE_END();
+}
+
+// Apply the same update to a copy-on-write source and a plain array
+#define COW_BOTH(stmt) do {                                                    \
+  BIT_ARRAY *arr = src; stmt;                                                  \
+  arr = ref; stmt;                                                             \
+  ASSERT(bit_array_cmp(src, ref) == 0);                                        \
+  ASSERT(bit_array_cmp(cpy, exp) == 0);                                        \
+} while(0)
+
+// Logic op `op` on a fresh COW source (dst = src), with no other writes first
+// to unshare its pages: the result is right and the clone is unchanged.
+// op 5 copies a concurrent array into the source
+static void _test_cow_logic(bit_index_t len, int op)
+{
+  BIT_ARRAY *src = bit_array_create(len), *other = bit_array_create(len);
+  bit_array_random(src, 0.5f);
+  bit_array_random(other, 0.3f);
+  BIT_ARRAY *ref = bit_array_clone(src), *exp = bit_array_clone(src);
+  BIT_ARRAY *cpy = bit_array_clone_cow(src);
+  const BIT_ARRAY *in[2];
+  BIT_EXPR prog[] = {{BIT_EXPR_IN,0}, {BIT_EXPR_IN,1}, {BIT_EXPR_ANDNOT,0}};
+  BIT_ARRAY_ATOMIC *atomic = bit_array_atomic_create(len);
+  bit_array_atomic_set(atomic, 12345);
+
+  COW_BOTH(
+    switch(op) {
+      case 0: bit_array_and(arr, arr, other); break;
+      case 1: bit_array_or(arr, arr, other); break;
+      case 2: bit_array_xor(arr, arr, other); break;
+      case 3: bit_array_not(arr, arr); break;
+      case 4: in[0] = arr; in[1] = other; bit_array_eval(arr, prog, 3, in, 2);
+              break;
+      default: bit_array_atomic_to_array(atomic, arr);
+    });
+
+  bit_array_atomic_free(atomic);
+  bit_array_free(src);
+  bit_array_free(ref);
+  bit_array_free(exp);
+  bit_array_free(cpy);
+  bit_array_free(other);
+}
+
+void test_cow()
+{
+  SUITE_START("copy-on-write clones");
+
+  // 4MB: many pages
+  bit_index_t len = 32UL * 1024 * 1024 + 7;
+  BIT_ARRAY *src = bit_array_create(len);
+  bit_array_random(src, 0.5f);
+  BIT_ARRAY *ref = bit_array_clone(src);
+  BIT_ARRAY *exp = bit_array_clone(src);
+  BIT_ARRAY *other = bit_array_create(len);
+  bit_index_t idx[3] = {5, 100000, len - 1};
+  bit_array_random(other, 0.3f);
+
+  BIT_ARRAY *cpy = bit_array_clone_cow(src);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+#if defined(__linux__)
+  ASSERT(src->cow != NULL && cpy->cow != NULL);
+#endif
+
+  // Updates to the source are not seen by the clone
+  COW_BOTH(bit_array_toggle_bit(arr, 3));
+  COW_BOTH(bit_array_set_bit(arr, len / 2));
+  COW_BOTH(bit_array_clear_bit(arr, len - 1));
+  COW_BOTH(bit_array_assign_bit(arr, 70000, 1));
+  COW_BOTH(bit_array_set_word64(arr, len - 100, 0x123456789abcdefULL));
+  COW_BOTH(bit_array_set_word8(arr, 12345, 0xab));
+  COW_BOTH(bit_array_set_region(arr, 1000, 100000));
+  COW_BOTH(bit_array_clear_region(arr, len - 50000, 50000));
+  COW_BOTH(bit_array_toggle_region(arr, 77, 1 << 20));
+  COW_BOTH(bit_array_set_batch(arr, idx, 3, BIT_BATCH_SORTED));
+  COW_BOTH(bit_array_copy(arr, 10, arr, 10000000, 1000000));
+  COW_BOTH(bit_array_reverse_region(arr, 3000000, 5000000));
+  COW_BOTH(bit_array_add_word(arr, 4000000, 0xffffffffffffULL));
+
+  // Second clone of the updated source
+  BIT_ARRAY *exp2 = bit_array_clone(src);
+  BIT_ARRAY *cpy2 = bit_array_clone_cow(src);
+  ASSERT(bit_array_cmp(cpy2, exp2) == 0);
+
+  COW_BOTH(bit_array_shift_left(arr, 1000, 1));
+  COW_BOTH(bit_array_shift_right(arr, 65, 0));
+  COW_BOTH(bit_array_cycle_left(arr, 12345));
+  COW_BOTH(bit_array_xor(arr, arr, other));
+  COW_BOTH(bit_array_not(arr, arr));
+  ASSERT(bit_array_cmp(cpy2, exp2) == 0);
+
+  // Logic ops and copies into a source whose pages are all still shared
+  int op;
+  for(op = 0; op < 6; op++) _test_cow_logic(len, op);
+
+  // Writing the words directly
+  COW_BOTH(bit_array_prepare_write(arr, 200, 1); bit_array_toggle(arr, 200));
+
+  // Clones can be written, without changing the source or each other
+  bit_array_toggle_bit(cpy2, 9);
+  bit_array_toggle_bit(exp2, 9);
+  bit_array_set_region(cpy2, 2000000, 3000000);
+  bit_array_set_region(exp2, 2000000, 3000000);
+  ASSERT(bit_array_cmp(cpy2, exp2) == 0);
+  ASSERT(bit_array_cmp(src, ref) == 0);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+
+  // Free a clone, keep writing the source
+  bit_array_free(cpy2);
+  COW_BOTH(bit_array_clear_all(arr));
+  COW_BOTH(bit_array_set_all(arr));
+
+  // Clone of a clone, resizing both ways
+  cpy2 = bit_array_clone_cow(cpy);
+  bit_array_free(exp2);
+  exp2 = bit_array_clone(exp);
+  COW_BOTH(bit_array_resize(arr, len / 3));
+  COW_BOTH(bit_array_resize(arr, len * 2));
+  bit_array_resize(cpy2, len * 3);
+  bit_array_resize(exp2, len * 3);
+  bit_array_set_bit(cpy2, len * 3 - 1);
+  bit_array_set_bit(exp2, len * 3 - 1);
+  ASSERT(bit_array_cmp(cpy2, exp2) == 0);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+
+  // Free the source first, clones stay valid
+  bit_array_free(src);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+  bit_array_toggle_all(cpy);
+  bit_array_toggle_all(exp);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+
+  // Into an existing array, which may be small
+  BIT_ARRAY small;
+  bit_array_alloc(&small, 10);
+  bit_array_copy_all_cow(&small, cpy);
+  ASSERT(bit_array_cmp(&small, exp) == 0);
+  bit_array_clear_bit(cpy, 0);
+  bit_array_clear_bit(exp, 0);
+  ASSERT(bit_array_cmp(cpy, exp) == 0);
+  bit_array_dealloc(&small);
+
+  // Small arrays are copied
+  BIT_ARRAY *tiny = bit_array_create(1000), *tiny_cpy;
+  bit_array_set_bit(tiny, 999);
+  tiny_cpy = bit_array_clone_cow(tiny);
+  ASSERT(tiny->cow == NULL && tiny_cpy->cow == NULL);
+  ASSERT(bit_array_cmp(tiny, tiny_cpy) == 0);
+  bit_array_free(tiny);
+  bit_array_free(tiny_cpy);
+
+  bit_array_free(cpy);
+  bit_array_free(cpy2);
+  bit_array_free(exp);
+  bit_array_free(exp2);
+  bit_array_free(ref);
+  bit_array_free(other);
+
+  SUITE_END();
+}
+
 void test_arithmetic()
 {
   printf("== testing arithmetic ==\n");
@@ -530,10 +1334,106 @@ void test_interleave()
   bit_array_set_all(arr2);
   _test_interleave(result, arr1, arr2);
 
+  // Shrinks a longer dst
+  bit_array_resize(result, 1000);
+  bit_array_set_all(result);
+  bit_array_resize(arr1, 70);
+  bit_array_resize(arr2, 70);
+  bit_array_set_all(arr1);
+  bit_array_clear_all(arr2);
+  bit_array_interleave(result, arr1, arr2);
+  ASSERT(bit_array_length(result) == 140 && bit_array_num_bits_set(result) == 70);
+  ASSERT(!bit_array_get_bit(result, 139) && bit_array_get_bit(result, 138));
+
   bit_array_free(arr1);
   bit_array_free(arr2);
   bit_array_free(result);
 
+  // n-way and deinterleave, against bit by bit, at lengths around words and
+  // groups of words
+  bit_index_t lens[] = {0, 1, 31, 63, 64, 65, 127, 128, 129, 300, 1000, 4097};
+  size_t ways[] = {1, 2, 3, 4, 5, 7, 8, 16};
+  size_t l, w, j;
+  BIT_ARRAY *srcs[BIT_ARRAY_INTERLEAVE_MAX], *dsts[BIT_ARRAY_INTERLEAVE_MAX];
+  BIT_ARRAY *joined = bit_array_create(0);
+
+  for(j = 0; j < BIT_ARRAY_INTERLEAVE_MAX; j++) {
+    srcs[j] = bit_array_create(0);
+    dsts[j] = bit_array_create(300);
+    bit_array_set_all(dsts[j]);
+  }
+
+  for(l = 0; l < sizeof(lens)/sizeof(lens[0]); l++) {
+    for(w = 0; w < sizeof(ways)/sizeof(ways[0]); w++) {
+      bit_index_t len = lens[l], i;
+      size_t n = ways[w];
+      for(j = 0; j < n; j++) {
+        bit_array_resize(srcs[j], len);
+        bit_array_random(srcs[j], 0.5f);
+      }
+
+      bit_array_interleave_n(joined, (const BIT_ARRAY**)srcs, n);
+      ASSERT(bit_array_length(joined) == len * n);
+      char ok = 1;
+      for(i = 0; i < len * n; i++)
+        if(bit_array_get_bit(joined, i) != bit_array_get_bit(srcs[i % n], i / n))
+          ok = 0;
+      ASSERT(ok);
+
+      bit_array_deinterleave_n(dsts, joined, n);
+      for(j = 0; j < n; j++) ASSERT(bit_array_cmp(dsts[j], srcs[j]) == 0);
+
+      if(n == 2) {
+        bit_array_deinterleave(dsts[1], dsts[0], joined);
+        ASSERT(bit_array_cmp(dsts[1], srcs[0]) == 0);
+        ASSERT(bit_array_cmp(dsts[0], srcs[1]) == 0);
+      }
+    }
+  }
+
+  // Into a view of the right length (cannot be resized)
+  word_t buf[3];
+  BIT_ARRAY view;
+  bit_array_resize(srcs[0], 64);
+  bit_array_resize(srcs[1], 64);
+  bit_array_resize(srcs[2], 64);
+  bit_array_set_all(srcs[1]);
+  bit_array_clear_all(srcs[0]);
+  bit_array_clear_all(srcs[2]);
+  bit_array_interleave_n(bit_array_view(&view, buf, 192),
+                         (const BIT_ARRAY**)srcs, 3);
+  ASSERT(buf[0] == 0x2492492492492492ULL);
+  ASSERT(bit_array_num_bits_set(&view) == 64);
+
+  // Parallel versions give the same result
+  BIT_ARRAY_POOL *pool = bit_array_pool_create(4);
+  BIT_ARRAY *joined_mt = bit_array_create(0);
+  bit_index_t mt_lens[] = {BIT_ARRAY_MT_MIN_WORDS * 64 / 2 + 77,
+                           BIT_ARRAY_MT_MIN_WORDS * 64};
+  size_t mt_ways[] = {2, 3, 4, 7};
+  for(l = 0; l < 2; l++) {
+    for(w = 0; w < 4; w++) {
+      size_t n = mt_ways[w];
+      for(j = 0; j < n; j++) {
+        bit_array_resize(srcs[j], mt_lens[l]);
+        bit_array_random(srcs[j], 0.5f);
+      }
+      bit_array_interleave_n(joined, (const BIT_ARRAY**)srcs, n);
+      bit_array_interleave_mt(joined_mt, (const BIT_ARRAY**)srcs, n, pool);
+      ASSERT(bit_array_cmp(joined, joined_mt) == 0);
+      bit_array_deinterleave_mt(dsts, joined_mt, n, pool);
+      for(j = 0; j < n; j++) ASSERT(bit_array_cmp(dsts[j], srcs[j]) == 0);
+    }
+  }
+  bit_array_pool_free(pool);
+  bit_array_free(joined_mt);
+
+  for(j = 0; j < BIT_ARRAY_INTERLEAVE_MAX; j++) {
+    bit_array_free(srcs[j]);
+    bit_array_free(dsts[j]);
+  }
+  bit_array_free(joined);
+
   SUITE_END();
 }
 
@@ -894,6 +1794,100 @@ void test_random_and_shuffle()
   SUITE_END();
 }
 
+void test_rng()
+{
+  SUITE_START("seeded generator");
+
+  BIT_ARRAY_RNG rng, rng2;
+  size_t i, j;
+
+  // Same seed, same sequence; jump starts a different one
+  bit_array_rng_seed(&rng, 42);
+  bit_array_rng_seed(&rng2, 42);
+  for(i = 0; i < 100; i++) ASSERT(bit_array_rng_next(&rng) == bit_array_rng_next(&rng2));
+  bit_array_rng_jump(&rng2);
+  ASSERT(bit_array_rng_next(&rng) != bit_array_rng_next(&rng2));
+
+  // Reference output of xoshiro256** from state {1,2,3,4}
+  rng.s[0] = 1; rng.s[1] = 2; rng.s[2] = 3; rng.s[3] = 4;
+  ASSERT(bit_array_rng_next(&rng) == 11520ULL);
+  ASSERT(bit_array_rng_next(&rng) == 0ULL);
+  ASSERT(bit_array_rng_next(&rng) == 1509978240ULL);
+
+  // below: in range and every value hit
+  int hits[7] = {0};
+  for(i = 0; i < 7000; i++) {
+    uint64_t r = bit_array_rng_below(&rng, 7);
+    ASSERT(r < 7);
+    hits[r]++;
+  }
+  for(i = 0; i < 7; i++) ASSERT(hits[i] > 800 && hits[i] < 1200);
+  ASSERT(bit_array_rng_below(&rng, 1) == 0);
+  ASSERT(bit_array_rng_below(&rng, 0xffffffffffffffffULL) < 0xffffffffffffffffULL);
+
+  // Probabilities
+  const float probs[] = {0, 0.001f, 0.1f, 0.25f, 0.5f, 0.7f, 0.999f, 1};
+  bit_index_t len = 1000003;
+  BIT_ARRAY *arr = bit_array_create(len), *arr2 = bit_array_create(len);
+
+  for(i = 0; i < sizeof(probs) / sizeof(probs[0]); i++) {
+    bit_array_random_rng(arr, probs[i], &rng);
+    double set = (double)bit_array_num_bits_set(arr), exp = probs[i] * (double)len;
+    ASSERT(set >= exp - 5000 && set <= exp + 5000);
+  }
+
+  bit_array_rng_seed(&rng, 7);
+  bit_array_rng_seed(&rng2, 7);
+  bit_array_random_rng(arr, 0.3f, &rng);
+  bit_array_random_rng(arr2, 0.3f, &rng2);
+  ASSERT(bit_array_cmp(arr, arr2) == 0);
+
+  // Exactly k bits
+  const bit_index_t ks[] = {0, 1, 2, 1000, len / 2, len - 7, len - 1, len};
+  for(i = 0; i < sizeof(ks) / sizeof(ks[0]); i++) {
+    bit_array_random_k(arr, ks[i], &rng);
+    ASSERT(bit_array_num_bits_set(arr) == ks[i]);
+  }
+
+  // adjust from far away
+  bit_array_clear_all(arr);
+  bit_array_random_adjust(arr, len - 10, &rng);
+  ASSERT(bit_array_num_bits_set(arr) == len - 10);
+  bit_array_random_adjust(arr, 3, &rng);
+  ASSERT(bit_array_num_bits_set(arr) == 3);
+
+  // Shuffles keep the popcount and are uniform: 6 bits, 2 set, 15 choices
+  int counts[64] = {0};
+  bit_array_resize(arr, 6);
+  bit_array_clear_all(arr);
+  bit_array_set_bits(arr, 2, 0, 1);
+  for(i = 0; i < 15000; i++) {
+    bit_array_shuffle_rng(arr, &rng);
+    ASSERT(bit_array_num_bits_set(arr) == 2);
+    counts[arr->words[0]]++;
+  }
+  for(i = 0; i < 64; i++) {
+    if(__builtin_popcount((unsigned)i) == 2) { ASSERT(counts[i] > 800 && counts[i] < 1200); }
+    else { ASSERT(counts[i] == 0); }
+  }
+
+  // Each position equally likely after shuffling a long array
+  bit_array_resize(arr, 200);
+  memset(counts, 0, sizeof(counts));
+  for(i = 0; i < 10000; i++) {
+    bit_array_clear_all(arr);
+    bit_array_set_region(arr, 0, 50);
+    bit_array_shuffle_rng(arr, &rng);
+    ASSERT(bit_array_num_bits_set(arr) == 50);
+    for(j = 0; j < 64; j++) counts[j] += bit_array_get_bit(arr, j * 3);
+  }
+  for(i = 0; i < 64; i++) ASSERT(counts[i] > 2200 && counts[i] < 2800);
+
+  bit_array_free(arr);
+  bit_array_free(arr2);
+  SUITE_END();
+}
+
 /*
 // used in test_random
 void _print_random_arr(BIT_ARRAY* arr, float *rates, int num_rates, char *tmp)
@@ -1176,6 +2170,67 @@ void test_shift()
   SUITE_END();
 }
 
+// Compare shifts and cycles with moving one bit at a time.
+// op: 0 shift left, 1 shift right, 2 cycle left, 3 cycle right, 4 extend
+static void _test_move_bits(BIT_ARRAY *arr, BIT_ARRAY *exp, bit_index_t dist,
+                            int op, char fill)
+{
+  bit_index_t i, n = bit_array_length(arr), m = n ? dist % n : 0;
+
+  bit_array_resize(exp, op == 4 ? n + dist : n);
+  for(i = 0; i < bit_array_length(exp); i++)
+  {
+    char b;
+    switch(op) {
+      case 0: b = i < dist ? fill : bit_array_get_bit(arr, i - dist); break;
+      case 1: b = i + dist >= n ? fill : bit_array_get_bit(arr, i + dist); break;
+      case 2: b = bit_array_get_bit(arr, (i + n - m) % n); break;
+      case 3: b = bit_array_get_bit(arr, (i + m) % n); break;
+      default: b = i < dist ? fill : bit_array_get_bit(arr, i - dist); break;
+    }
+    bit_array_assign_bit(exp, i, b);
+  }
+
+  switch(op) {
+    case 0: bit_array_shift_left(arr, dist, fill); break;
+    case 1: bit_array_shift_right(arr, dist, fill); break;
+    case 2: bit_array_cycle_left(arr, dist); break;
+    case 3: bit_array_cycle_right(arr, dist); break;
+    default: bit_array_shift_left_extend(arr, dist, fill); break;
+  }
+
+  ASSERT(bit_array_cmp(arr, exp) == 0);
+  bit_array_resize(arr, n);
+}
+
+void test_shift_cycle_lengths()
+{
+  SUITE_START("shift and cycle lengths");
+
+  const bit_index_t lengths[] = {1, 63, 64, 65, 129, 200, 1000, 5000, 9000, 70001};
+  BIT_ARRAY *arr = bit_array_create(0), *exp = bit_array_create(0);
+  size_t l, j;
+  int op;
+
+  for(l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+  {
+    bit_index_t n = lengths[l];
+    bit_index_t dists[] = {0, 1, 13, 63, 64, 65, 128, 4099, 4096 * 2 + 7,
+                           n / 2, n - 1, n, n + 5, (bit_index_t)rand() % (n + 1)};
+
+    bit_array_resize(arr, n);
+    bit_array_random(arr, 0.5f);
+
+    for(j = 0; j < sizeof(dists) / sizeof(dists[0]); j++)
+      for(op = 0; op < 5; op++)
+        _test_move_bits(arr, exp, dists[j], op, (char)(j & 1));
+  }
+
+  bit_array_free(arr);
+  bit_array_free(exp);
+  SUITE_END();
+}
+
 void _test_hamming(BIT_ARRAY *arr1, BIT_ARRAY *arr2)
 {
   bit_index_t bits_set1 = 0, bits_set2 = 0, dist = 0;
@@ -1222,36 +2277,983 @@ void test_hamming_weight()
   _test_hamming(arr1, arr2);
   _test_hamming(arr2, arr1);
 
-  bit_array_resize(arr2, 10);
-  _test_hamming(arr1, arr2);
-  _test_hamming(arr2, arr1);
+  bit_array_resize(arr2, 10);
+  _test_hamming(arr1, arr2);
+  _test_hamming(arr2, arr1);
+
+  bit_array_set_bits(arr2, 3, 0, 2, 7);
+  _test_hamming(arr1, arr2);
+  _test_hamming(arr2, arr1);
+
+  bit_array_resize(arr1, 80);
+  bit_array_clear_bit(arr1, 2);
+  bit_array_set_region(arr1, 50, 20);
+  _test_hamming(arr1, arr2);
+  _test_hamming(arr2, arr1);
+
+  // random
+  int i;
+  for(i = 0; i < 10; i++)
+  {
+    size_t len1 = RAND(1000UL);
+    size_t len2 = RAND(1000UL);
+    bit_array_resize(arr1, len1);
+    bit_array_resize(arr2, len2);
+    bit_array_random(arr1, 0.5f);
+    bit_array_random(arr2, 0.5f);
+    _test_hamming(arr1, arr2);
+    _test_hamming(arr2, arr1);
+  }
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+
+  SUITE_END();
+}
+
+// Check logic operators against a bit by bit calculation
+void _test_logic_ops(bit_index_t len1, bit_index_t len2)
+{
+  BIT_ARRAY *arr1 = bit_array_create(len1);
+  BIT_ARRAY *arr2 = bit_array_create(len2);
+  BIT_ARRAY *dst = bit_array_create(0);
+
+  bit_array_random(arr1, 0.5f);
+  bit_array_random(arr2, 0.5f);
+
+  bit_index_t i, max = MAX(len1, len2);
+  char a, b, ok_and = 1, ok_or = 1, ok_xor = 1, ok_not = 1;
+
+  bit_array_and(dst, arr1, arr2);
+  for(i = 0; i < max; i++) {
+    a = i < len1 ? bit_array_get_bit(arr1, i) : 0;
+    b = i < len2 ? bit_array_get_bit(arr2, i) : 0;
+    if(bit_array_get_bit(dst, i) != (a & b)) ok_and = 0;
+  }
+
+  bit_array_or(dst, arr1, arr2);
+  for(i = 0; i < max; i++) {
+    a = i < len1 ? bit_array_get_bit(arr1, i) : 0;
+    b = i < len2 ? bit_array_get_bit(arr2, i) : 0;
+    if(bit_array_get_bit(dst, i) != (a | b)) ok_or = 0;
+  }
+
+  bit_array_xor(dst, arr1, arr2);
+  for(i = 0; i < max; i++) {
+    a = i < len1 ? bit_array_get_bit(arr1, i) : 0;
+    b = i < len2 ? bit_array_get_bit(arr2, i) : 0;
+    if(bit_array_get_bit(dst, i) != (a ^ b)) ok_xor = 0;
+  }
+
+  bit_array_not(dst, arr1);
+  for(i = 0; i < bit_array_length(dst); i++) {
+    a = i < len1 ? bit_array_get_bit(arr1, i) : 0;
+    if(bit_array_get_bit(dst, i) != !a) ok_not = 0;
+  }
+
+  ASSERT(ok_and);
+  ASSERT(ok_or);
+  ASSERT(ok_xor);
+  ASSERT(ok_not);
+
+  // dst aliases a source
+  BIT_ARRAY *cpy = bit_array_clone(arr1);
+  bit_array_xor(cpy, cpy, arr2);
+  bit_array_xor(cpy, cpy, arr2);
+  bit_array_resize(cpy, len1);
+  ASSERT(bit_array_cmp(cpy, arr1) == 0);
+
+  bit_array_free(cpy);
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+  bit_array_free(dst);
+}
+
+void test_logic_ops()
+{
+  SUITE_START("logic operators");
+
+  ASSERT(bit_array_simd_name() != NULL);
+
+  // lengths either side of the 128, 256 and 512 bit vector widths
+  bit_index_t lens[] = {0, 1, 63, 64, 65, 127, 128, 129, 255, 256, 257,
+                        511, 512, 513, 1000, 1024, 4097};
+  size_t i, j, n = sizeof(lens) / sizeof(lens[0]);
+
+  for(i = 0; i < n; i++)
+    for(j = 0; j < n; j += 3)
+      _test_logic_ops(lens[i], lens[j]);
+
+  for(i = 0; i < 10; i++)
+    _test_logic_ops(RAND(5000), RAND(5000));
+
+  SUITE_END();
+}
+
+// Set algebra counts against materialised logic ops
+void _test_set_counts(bit_index_t len1, bit_index_t len2, float p)
+{
+  BIT_ARRAY *arr1 = bit_array_create(len1);
+  BIT_ARRAY *arr2 = bit_array_create(len2);
+  BIT_ARRAY *tmp = bit_array_create(MAX(len1, len2));
+
+  bit_array_random(arr1, p);
+  bit_array_random(arr2, p);
+
+  bit_array_and(tmp, arr1, arr2);
+  bit_index_t num_and = bit_array_num_bits_set(tmp);
+  ASSERT(bit_array_and_count(arr1, arr2) == num_and);
+  ASSERT(bit_array_and_count(arr2, arr1) == num_and);
+  ASSERT(bit_array_intersects(arr1, arr2) == (num_and > 0));
+  ASSERT(bit_array_intersects(arr2, arr1) == (num_and > 0));
+
+  bit_array_or(tmp, arr1, arr2);
+  bit_index_t num_or = bit_array_num_bits_set(tmp);
+  ASSERT(bit_array_or_count(arr1, arr2) == num_or);
+  ASSERT(bit_array_or_count(arr2, arr1) == num_or);
+
+  // not() sets the bits of tmp past the end of arr2
+  bit_array_resize(tmp, MAX(len1, len2));
+  bit_array_not(tmp, arr2);
+  bit_array_and(tmp, arr1, tmp);
+  ASSERT(bit_array_andnot_count(arr1, arr2) == bit_array_num_bits_set(tmp));
+  ASSERT(bit_array_andnot_count(arr1, arr2) +
+         bit_array_andnot_count(arr2, arr1) ==
+         bit_array_hamming_distance(arr1, arr2));
+
+  double jaccard = bit_array_jaccard(arr1, arr2);
+  ASSERT(num_or ? jaccard == (double)num_and / num_or : jaccard == 1.0);
+
+  bit_array_free(arr1);
+  bit_array_free(arr2);
+  bit_array_free(tmp);
+}
+
+void test_set_counts()
+{
+  SUITE_START("set algebra counts");
+
+  // vector widths, and either side of 64 word Harley-Seal blocks
+  bit_index_t lens[] = {0, 1, 64, 65, 255, 257, 513, 4095, 4096, 4097,
+                        8192 + 129, 20000};
+  size_t i, j, n = sizeof(lens) / sizeof(lens[0]);
+
+  for(i = 0; i < n; i++)
+    for(j = 0; j < n; j++)
+      _test_set_counts(lens[i], lens[j], 0.5f);
+
+  // sparse: intersects has to find the one word in common
+  for(i = 0; i < 10; i++)
+    _test_set_counts(RAND(20000), RAND(20000), 0.001f);
+
+  BIT_ARRAY *a = bit_array_create(10000), *b = bit_array_create(10000);
+  ASSERT(!bit_array_intersects(a, b));
+  bit_array_set_bit(a, 9999);
+  ASSERT(!bit_array_intersects(a, b));
+  bit_array_set_bit(b, 9999);
+  ASSERT(bit_array_intersects(a, b));
+  bit_array_resize(b, 9999);
+  ASSERT(!bit_array_intersects(a, b));
+  bit_array_free(a);
+  bit_array_free(b);
+
+  // One vs many, longer than a block of the query, of mixed lengths
+  const BIT_ARRAY_COUNT_OP ops[] = {BIT_ARRAY_COUNT_AND, BIT_ARRAY_COUNT_OR,
+                                    BIT_ARRAY_COUNT_XOR, BIT_ARRAY_COUNT_ANDNOT};
+  bit_index_t arr_lens[] = {0, 100, 131071, 200000, 300001, 1000000};
+  const size_t m = sizeof(arr_lens) / sizeof(arr_lens[0]);
+  BIT_ARRAY *query = bit_array_create(300000);
+  BIT_ARRAY *arrs[sizeof(arr_lens) / sizeof(arr_lens[0])];
+  bit_index_t counts[sizeof(arr_lens) / sizeof(arr_lens[0])], expect;
+
+  bit_array_random(query, 0.5f);
+  for(j = 0; j < m; j++) {
+    arrs[j] = bit_array_create(arr_lens[j]);
+    bit_array_random(arrs[j], 0.3f);
+  }
+
+  for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    bit_array_count_many(ops[i], query, (const BIT_ARRAY**)arrs, m, counts);
+    for(j = 0; j < m; j++) {
+      switch(ops[i]) {
+        case BIT_ARRAY_COUNT_AND: expect = bit_array_and_count(query, arrs[j]); break;
+        case BIT_ARRAY_COUNT_OR: expect = bit_array_or_count(query, arrs[j]); break;
+        case BIT_ARRAY_COUNT_XOR: expect = bit_array_hamming_distance(query, arrs[j]); break;
+        default: expect = bit_array_andnot_count(query, arrs[j]);
+      }
+      ASSERT(counts[j] == expect);
+    }
+  }
+
+  bit_array_count_many(BIT_ARRAY_COUNT_AND, query, NULL, 0, counts);
+
+  for(j = 0; j < m; j++) bit_array_free(arrs[j]);
+  bit_array_free(query);
+
+  SUITE_END();
+}
+
+// popcount((A & B) | ~C) and A ^ (B &~ C) with eval vs chained logic ops
+void _test_eval(bit_index_t len)
+{
+  BIT_ARRAY *a = bit_array_create(len), *b = bit_array_create(len);
+  BIT_ARRAY *c = bit_array_create(len), *d = bit_array_create(RAND(len)+1);
+  BIT_ARRAY *tmp1 = bit_array_create(0), *tmp2 = bit_array_create(0);
+  BIT_ARRAY *dst = bit_array_create(0);
+  bit_index_t first_exp = 0, first = 0;
+
+  bit_array_random(a, 0.5f);
+  bit_array_random(b, 0.5f);
+  bit_array_random(c, 0.9f);
+  bit_array_random(d, 0.01f);
+
+  const BIT_ARRAY *in[] = {a, b, c, d};
+  BIT_EXPR prog1[] = {{BIT_EXPR_IN,0}, {BIT_EXPR_IN,1}, {BIT_EXPR_AND,0},
+                      {BIT_EXPR_IN,2}, {BIT_EXPR_NOT,0}, {BIT_EXPR_OR,0}};
+  BIT_EXPR prog2[] = {{BIT_EXPR_IN,0}, {BIT_EXPR_IN,1}, {BIT_EXPR_IN,2},
+                      {BIT_EXPR_ANDNOT,0}, {BIT_EXPR_XOR,0}};
+  BIT_EXPR prog3[] = {{BIT_EXPR_IN,3}, {BIT_EXPR_IN,2}, {BIT_EXPR_AND,0}};
+
+  ASSERT(bit_array_eval_valid(prog1, 6, 4));
+  ASSERT(!bit_array_eval_valid(prog1, 5, 4));
+  ASSERT(!bit_array_eval_valid(prog1, 6, 2));
+
+  bit_array_and(tmp1, a, b);
+  bit_array_not(tmp2, c);
+  bit_array_or(tmp1, tmp1, tmp2);
+  bit_array_eval(dst, prog1, 6, in, 4);
+  ASSERT(bit_array_cmp(dst, tmp1) == 0);
+  ASSERT(bit_array_eval_num_bits_set(prog1, 6, in, 4) ==
+         bit_array_num_bits_set(tmp1));
+
+  bit_array_not(tmp2, c);
+  bit_array_and(tmp2, b, tmp2);
+  bit_array_xor(tmp1, a, tmp2);
+  ASSERT(bit_array_eval_num_bits_set(prog2, 5, in, 4) ==
+         bit_array_num_bits_set(tmp1));
+
+  // different lengths, stop at first bit set
+  bit_array_and(tmp1, d, c);
+  char found_exp = bit_array_find_first_set_bit(tmp1, &first_exp);
+  char found = bit_array_eval_find_first_set_bit(prog3, 3, in, 4, &first);
+  ASSERT(found == found_exp);
+  ASSERT(first == first_exp);
+  ASSERT(bit_array_eval_num_bits_set(prog3, 3, in, 4) ==
+         bit_array_num_bits_set(tmp1));
+
+  // dst is an input
+  bit_array_xor(tmp1, a, tmp2);
+  bit_array_eval(a, prog2, 5, in, 4);
+  ASSERT(bit_array_cmp(a, tmp1) == 0);
+
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(c);
+  bit_array_free(d);
+  bit_array_free(tmp1);
+  bit_array_free(tmp2);
+  bit_array_free(dst);
+}
+
+void test_eval()
+{
+  SUITE_START("fused logic expressions");
+
+  bit_index_t lens[] = {1, 63, 64, 65, 1000, 128*64, 128*64+1, 20000};
+  size_t i;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    _test_eval(lens[i]);
+
+  SUITE_END();
+}
+
+// Compare rank/select index against bit by bit counts
+char _check_rank_select(const BIT_ARRAY_RANK *rs, const BIT_ARRAY *arr)
+{
+  bit_index_t i, count = 0, pos;
+  for(i = 0; i < bit_array_length(arr); i++)
+  {
+    if(bit_array_rank1(rs, i) != count) return 0;
+    if(bit_array_rank0(rs, i) != i - count) return 0;
+    if(bit_array_get_bit(arr, i)) {
+      if(!bit_array_select1(rs, count, &pos) || pos != i) return 0;
+      count++;
+    }
+  }
+  return bit_array_rank1(rs, i) == count && !bit_array_select1(rs, count, &pos);
+}
+
+void test_rank_select()
+{
+  SUITE_START("rank / select");
+
+  bit_index_t lens[] = {0, 1, 64, 2047, 2048, 2049, 10000, 100000};
+  float probs[] = {0.0f, 0.001f, 0.5f, 1.0f};
+  size_t i, j;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+  {
+    for(j = 0; j < sizeof(probs) / sizeof(probs[0]); j++)
+    {
+      BIT_ARRAY *arr = bit_array_create(lens[i]);
+      bit_array_random(arr, probs[j]);
+      BIT_ARRAY_RANK *rs = bit_array_rank_create(arr);
+      ASSERT(rs != NULL);
+      ASSERT(_check_rank_select(rs, arr));
+
+      // Incremental update of a region
+      if(lens[i] > 10) {
+        bit_index_t start = RAND(lens[i]-10), len = RAND(lens[i]-start);
+        bit_array_toggle_region(arr, start, len);
+        ASSERT(bit_array_rank_update(rs, start, len));
+        ASSERT(_check_rank_select(rs, arr));
+      }
+
+      // Rebuild after resize
+      bit_array_resize(arr, lens[i] + 3000);
+      bit_array_set_region(arr, lens[i], 1000);
+      ASSERT(bit_array_rank_rebuild(rs));
+      ASSERT(_check_rank_select(rs, arr));
+
+      bit_array_rank_free(rs);
+      bit_array_free(arr);
+    }
+  }
+
+  SUITE_END();
+}
+
+// Check a BIT_ROARING holds the same bits as a BIT_ARRAY
+char _roaring_equals(const BIT_ROARING *rarr, const BIT_ARRAY *arr)
+{
+  BIT_ARRAY *tmp = bit_array_create(0);
+  bit_index_t i, pos = 0, count = 0;
+  char ok = bit_roaring_length(rarr) == bit_array_length(arr) &&
+            bit_roaring_num_bits_set(rarr) == bit_array_num_bits_set(arr);
+
+  bit_roaring_to_array(rarr, tmp);
+  ok = ok && bit_array_cmp(tmp, arr) == 0;
+
+  // Walk set bits with find_next
+  for(i = 0; ok && bit_roaring_find_next_set_bit(rarr, i, &pos); i = pos + 1, count++)
+    ok = bit_array_get_bit(arr, pos);
+
+  bit_array_free(tmp);
+  return ok && count == bit_array_num_bits_set(arr);
+}
+
+void _test_roaring(bit_index_t len, float prob)
+{
+  BIT_ARRAY *a = bit_array_create(len), *b = bit_array_create(len/2);
+  BIT_ARRAY *tmp = bit_array_create(0);
+  BIT_ROARING *ra = bit_roaring_create(0), *rb = bit_roaring_create(0);
+  BIT_ROARING *rdst = bit_roaring_create(0);
+  bit_index_t i, pos;
+
+  bit_array_random(a, prob);
+  bit_array_random(b, 1.0f - prob);
+  if(len > 100) bit_array_set_region(a, len / 3, len / 4);
+
+  // Conversion
+  bit_roaring_from_array(ra, a);
+  bit_roaring_from_array(rb, b);
+  ASSERT(_roaring_equals(ra, a));
+  ASSERT(_roaring_equals(rb, b));
+
+  for(i = 0; i < 100 && len > 0; i++) {
+    pos = RAND(len);
+    ASSERT(bit_roaring_get_bit(ra, pos) == bit_array_get_bit(a, pos));
+  }
+
+  // Logic ops against BIT_ARRAY
+  bit_array_and(tmp, a, b);
+  bit_roaring_and(rdst, ra, rb);
+  ASSERT(_roaring_equals(rdst, tmp));
+
+  bit_array_or(tmp, a, b);
+  bit_roaring_or(rdst, ra, rb);
+  ASSERT(_roaring_equals(rdst, tmp));
+
+  bit_array_xor(tmp, a, b);
+  bit_roaring_xor(rdst, ra, rb);
+  ASSERT(_roaring_equals(rdst, tmp));
+
+  // dst is a source
+  bit_array_xor(a, a, b);
+  bit_roaring_xor(ra, ra, rb);
+  ASSERT(_roaring_equals(ra, a));
+
+  // Set and clear bits, crossing array/bitmap limits
+  for(i = 0; i < 10000 && len > 0; i++) {
+    pos = RAND(len);
+    if(RAND(2)) { bit_array_set_bit(a, pos); bit_roaring_set_bit(ra, pos); }
+    else { bit_array_clear_bit(a, pos); bit_roaring_clear_bit(ra, pos); }
+  }
+  ASSERT(_roaring_equals(ra, a));
+
+  // Runs
+  bit_roaring_run_optimize(ra);
+  ASSERT(_roaring_equals(ra, a));
+  if(len > 0) {
+    pos = RAND(len);
+    bit_array_toggle_bit(a, pos);
+    if(bit_array_get_bit(a, pos)) bit_roaring_set_bit(ra, pos);
+    else bit_roaring_clear_bit(ra, pos);
+  }
+  ASSERT(_roaring_equals(ra, a));
+
+  // Save / load
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_roaring_save(ra, f);
+  fclose(f);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(bit_roaring_load(rdst, f));
+  fclose(f);
+  ASSERT(_roaring_equals(rdst, a));
+
+  // Shrink and enlarge
+  bit_array_resize(a, len / 2 + 7);
+  bit_roaring_resize(ra, len / 2 + 7);
+  ASSERT(_roaring_equals(ra, a));
+  bit_array_resize(a, len + 70000);
+  bit_roaring_resize(ra, len + 70000);
+  ASSERT(_roaring_equals(ra, a));
+
+  bit_roaring_free(ra);
+  bit_roaring_free(rb);
+  bit_roaring_free(rdst);
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(tmp);
+}
+
+static void _write_le_test(FILE *f, uint64_t x, size_t nbytes)
+{
+  size_t i;
+  for(i = 0; i < nbytes; i++) fputc((int)((x >> (8*i)) & 0xff), f);
+}
+
+// Load a file of one container with nvals 16 bit values of data. A bad file
+// must leave rarr empty
+static char _roaring_load_crafted(bit_index_t nbits, uint64_t key, int type,
+                                  uint32_t card, uint32_t n,
+                                  const uint16_t *vals, uint32_t nvals)
+{
+  BIT_ROARING *rarr = bit_roaring_create(100);
+  uint32_t i;
+  char ok;
+  bit_roaring_set_bit(rarr, 7);
+
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  fwrite("BITROAR1", 1, 8, f);
+  _write_le_test(f, nbits, 8);
+  _write_le_test(f, 1, 8);
+  _write_le_test(f, key, 8);
+  _write_le_test(f, (uint64_t)type, 1);
+  _write_le_test(f, card, 4);
+  _write_le_test(f, n, 4);
+  for(i = 0; i < nvals; i++) _write_le_test(f, vals[i], 2);
+  fclose(f);
+
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ok = bit_roaring_load(rarr, f);
+  fclose(f);
+
+  if(ok) {
+    // Can be updated, e.g. a full array container becomes a bitmap
+    ASSERT(bit_roaring_num_bits_set(rarr) == card);
+    bit_roaring_set_bit(rarr, nbits - 1);
+    ASSERT(bit_roaring_get_bit(rarr, nbits - 1));
+  } else {
+    ASSERT(bit_roaring_length(rarr) == 0);
+    ASSERT(rarr->num_of_containers == 0);
+  }
+  bit_roaring_free(rarr);
+  return ok;
+}
+
+void _test_roaring_load_invalid()
+{
+  uint16_t vals[8192];
+  uint32_t i;
+  for(i = 0; i < 8192; i++) vals[i] = (uint16_t)i;
+
+  // Valid: array and run containers
+  ASSERT(_roaring_load_crafted(65536, 0, ROARING_ARRAY, 4096, 4096, vals, 4096));
+  ASSERT(_roaring_load_crafted(200000, 2, ROARING_ARRAY, 3, 3, vals, 3));
+  ASSERT(_roaring_load_crafted(65536, 0, ROARING_RUN, 5, 1, vals + 3, 2));
+
+  // Array: too many values, card != n, unsorted, repeated, past the end
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_ARRAY, 5000, 5000, vals, 5000));
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_ARRAY, 4, 3, vals, 3));
+  uint16_t unsorted[3] = {5, 3, 9}, repeated[3] = {1, 2, 2};
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_ARRAY, 3, 3, unsorted, 3));
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_ARRAY, 3, 3, repeated, 3));
+  ASSERT(!_roaring_load_crafted(100, 0, ROARING_ARRAY, 3, 3, vals + 98, 3));
+
+  // Key past the end
+  ASSERT(!_roaring_load_crafted(200000, 4, ROARING_ARRAY, 3, 3, vals, 3));
+  ASSERT(!_roaring_load_crafted(0, 0, ROARING_ARRAY, 3, 3, vals, 3));
+
+  // Runs: overlapping, wrong card, past the end
+  uint16_t runs[4] = {10, 5, 12, 1};
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_RUN, 8, 2, runs, 4));
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_RUN, 7, 1, runs, 2));
+  ASSERT(!_roaring_load_crafted(12, 0, ROARING_RUN, 6, 1, runs, 2));
+
+  // Bitmaps (4096 x 0xffff is 65536 bits): card must match, no bits past the end
+  uint16_t ones[4096];
+  for(i = 0; i < 4096; i++) ones[i] = 0xffff;
+  ASSERT(_roaring_load_crafted(65536, 0, ROARING_BITMAP, 65536, 0, ones, 4096));
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_BITMAP, 65535, 0, ones, 4096));
+  ASSERT(!_roaring_load_crafted(65535, 0, ROARING_BITMAP, 65536, 0, ones, 4096));
+
+  // Truncated part way through a container
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_ARRAY, 100, 100, vals, 50));
+  ASSERT(!_roaring_load_crafted(65536, 0, ROARING_BITMAP, 65536, 0, ones, 100));
+}
+
+void test_roaring()
+{
+  SUITE_START("compressed (roaring) arrays");
+
+  bit_index_t lens[] = {0, 1, 100, 65536, 65537, 300000};
+  float probs[] = {0.0f, 0.01f, 0.1f, 0.9f, 1.0f};
+  size_t i, j;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    for(j = 0; j < sizeof(probs) / sizeof(probs[0]); j++)
+      _test_roaring(lens[i], probs[j]);
+
+  _test_roaring_load_invalid();
+
+  // Sparse bits in a huge universe
+  BIT_ROARING *rarr = bit_roaring_create(1ULL << 40);
+  bit_index_t pos = 0;
+  bit_roaring_set_bit(rarr, 12345);
+  bit_roaring_set_bit(rarr, (1ULL << 40) - 1);
+  ASSERT(bit_roaring_num_bits_set(rarr) == 2);
+  ASSERT(bit_roaring_find_next_set_bit(rarr, 12346, &pos));
+  ASSERT(pos == (1ULL << 40) - 1);
+  ASSERT(bit_roaring_size_in_bytes(rarr) < 1024);
+  bit_roaring_free(rarr);
+
+  SUITE_END();
+}
+
+// Caller supplied pool: runs tasks in reverse order on this thread
+void _reverse_pool_run(BIT_ARRAY_POOL *pool, size_t n, bit_array_task_t fn, void *arg)
+{
+  (*(size_t*)pool->ctx)++;
+  while(n-- > 0) fn(arg, n);
+}
+
+void _test_mt(BIT_ARRAY_POOL *pool, bit_index_t len1, bit_index_t len2)
+{
+  BIT_ARRAY *a = bit_array_create(len1), *b = bit_array_create(len2);
+  BIT_ARRAY *exp = bit_array_create(0), *dst = bit_array_create(0);
+
+  bit_array_random(a, 0.5f);
+  bit_array_random(b, 0.3f);
+
+  ASSERT(bit_array_num_bits_set_mt(a, pool) == bit_array_num_bits_set(a));
+
+  bit_array_and(exp, a, b);
+  bit_array_and_mt(dst, a, b, pool);
+  ASSERT(bit_array_cmp(dst, exp) == 0);
+
+  bit_array_or(exp, a, b);
+  bit_array_or_mt(dst, a, b, pool);
+  ASSERT(bit_array_cmp(dst, exp) == 0);
+
+  bit_array_xor(exp, a, b);
+  bit_array_xor_mt(dst, b, a, pool);
+  ASSERT(bit_array_cmp(dst, exp) == 0);
+
+  // dst is a source
+  bit_array_xor(exp, a, b);
+  bit_array_xor_mt(a, a, b, pool);
+  ASSERT(bit_array_cmp(a, exp) == 0);
+
+  bit_index_t start = len1 / 7, len = len1 - len1 / 7 - 3;
+  bit_array_copy_all(exp, a);
+  bit_array_set_region(exp, start, len);
+  bit_array_set_region_mt(a, start, len, pool);
+  ASSERT(bit_array_cmp(a, exp) == 0);
+
+  // Same seed gives same bits with or without threads
+  bit_array_resize(a, len1);
+  bit_array_resize(exp, len1);
+  bit_array_random_mt(a, 0.25f, 42, pool);
+  bit_array_random_mt(exp, 0.25f, 42, NULL);
+  ASSERT(bit_array_cmp(a, exp) == 0);
+  bit_index_t nset = bit_array_num_bits_set(a);
+  ASSERT(nset > len1 / 5 && nset < len1 / 3);
+
+  bit_array_random_mt(exp, 0, 42, pool);
+  ASSERT(bit_array_num_bits_set(exp) == 0);
+  bit_array_random_mt(exp, 1, 42, pool);
+  ASSERT(bit_array_num_bits_set(exp) == len1);
+  bit_array_random_mt(exp, 0.25f, 42, NULL);
+
+  // Shuffle keeps the popcount, same seed gives the same bits
+  bit_array_shuffle_mt(a, 5, pool);
+  bit_array_shuffle_mt(exp, 5, NULL);
+  ASSERT(bit_array_cmp(a, exp) == 0);
+  ASSERT(bit_array_num_bits_set(a) == nset);
+
+  ASSERT(bit_array_hash_mt(a, 7, pool) == bit_array_hash_mt(a, 7, NULL));
+  if(a->num_of_words <= BIT_ARRAY_MT_CHUNK_WORDS)
+    ASSERT(bit_array_hash_mt(a, 7, pool) == bit_array_hash(a, 7));
+  bit_array_toggle_bit(a, len1 - 1);
+  ASSERT(bit_array_hash_mt(a, 7, pool) != bit_array_hash_mt(exp, 7, pool));
+
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(exp);
+  bit_array_free(dst);
+}
+
+void test_mt()
+{
+  SUITE_START("multithreaded bulk operations");
+
+  bit_index_t big = BIT_ARRAY_MT_MIN_WORDS * 64 * 3 + 13;
+  BIT_ARRAY_POOL *pool = bit_array_pool_create(4);
+  ASSERT(pool != NULL);
+
+  _test_mt(pool, 1000, 700);
+  _test_mt(pool, big, big / 2 + 5);
+  _test_mt(pool, big / 3, big);
+  _test_mt(NULL, big, big + 64);
+
+  bit_array_pool_free(pool);
+
+  // Caller supplied pool
+  size_t calls = 0;
+  BIT_ARRAY_POOL mypool = {_reverse_pool_run, &calls};
+  _test_mt(&mypool, big, big);
+  ASSERT(calls > 0);
+
+  SUITE_END();
+}
+
+// Each thread claims slots, growing the array whenever it is full
+#define ATOMIC_THREADS 8
+#define ATOMIC_CLAIMS 5000
+
+void* _atomic_claim_worker(void *ptr)
+{
+  BIT_ARRAY_ATOMIC *arr = *(BIT_ARRAY_ATOMIC**)ptr;
+  bit_index_t *slots = ((bit_index_t**)ptr)[1];
+  bit_index_t len;
+  size_t i;
+
+  for(i = 0; i < ATOMIC_CLAIMS; i++) {
+    while(!bit_array_atomic_find_next_clear_bit_and_claim(arr, 0, &slots[i])) {
+      len = bit_array_atomic_length(arr);
+      if(!bit_array_atomic_ensure_size(arr, len + 1000)) return NULL;
+    }
+  }
+
+  return NULL;
+}
+
+void test_atomic()
+{
+  SUITE_START("concurrent (atomic) arrays");
+
+  BIT_ARRAY_ATOMIC *arr = bit_array_atomic_create(100);
+  BIT_ARRAY *tmp = bit_array_create(0);
+  bit_index_t pos;
+  size_t i;
+
+  ASSERT(arr != NULL);
+  ASSERT(bit_array_atomic_length(arr) == 100);
+  ASSERT(bit_array_atomic_set(arr, 5) == 0);
+  ASSERT(bit_array_atomic_set(arr, 5) == 1);
+  ASSERT(bit_array_atomic_get(arr, 5) == 1);
+  ASSERT(bit_array_atomic_toggle(arr, 6) == 0);
+  ASSERT(bit_array_atomic_clear(arr, 5) == 1);
+  ASSERT(bit_array_atomic_get(arr, 5) == 0);
+  ASSERT(bit_array_atomic_num_bits_set(arr) == 1);
+
+  // Claim from an offset
+  ASSERT(bit_array_atomic_find_next_clear_bit_and_claim(arr, 6, &pos));
+  ASSERT(pos == 7);
+  ASSERT(bit_array_atomic_find_next_clear_bit_and_claim(arr, 0, &pos));
+  ASSERT(pos == 0);
+
+  // Fill up, then grow over several segments
+  while(bit_array_atomic_find_next_clear_bit_and_claim(arr, 0, &pos)) {}
+  ASSERT(bit_array_atomic_num_bits_set(arr) == 100);
+  ASSERT(bit_array_atomic_ensure_size(arr, 100000));
+  ASSERT(bit_array_atomic_length(arr) == 100000);
+  ASSERT(bit_array_atomic_find_next_clear_bit_and_claim(arr, 0, &pos));
+  ASSERT(pos == 100);
+  bit_array_atomic_set(arr, 99999);
+
+  word_t words[3] = {0xff, 0, ~(word_t)0};
+  bit_array_atomic_or_words(arr, 1000, words, 3);
+  bit_array_atomic_to_array(arr, tmp);
+  ASSERT(bit_array_length(tmp) == 100000);
+  ASSERT(bit_array_num_bits_set(tmp) == 102 + 8 + 64);
+  ASSERT(bit_array_get_bit(tmp, 99999) && bit_array_get_bit(tmp, 64000));
+  bit_array_atomic_and_words(arr, 1000, words, 2);
+  ASSERT(bit_array_atomic_num_bits_set(arr) == 102 + 8 + 64);
+  words[0] = 0;
+  bit_array_atomic_and_words(arr, 1000, words, 1);
+  ASSERT(bit_array_atomic_num_bits_set(arr) == 102 + 64);
+  bit_array_atomic_free(arr);
+
+  // Threads claim slots while others grow the array: every slot is unique
+  arr = bit_array_atomic_create(0);
+  pthread_t threads[ATOMIC_THREADS];
+  void *args[ATOMIC_THREADS][2];
+  bit_index_t *slots = (bit_index_t*)malloc(ATOMIC_THREADS * ATOMIC_CLAIMS *
+                                            sizeof(bit_index_t));
+
+  for(i = 0; i < ATOMIC_THREADS; i++) {
+    args[i][0] = arr;
+    args[i][1] = slots + i * ATOMIC_CLAIMS;
+    pthread_create(&threads[i], NULL, _atomic_claim_worker, args[i]);
+  }
+  for(i = 0; i < ATOMIC_THREADS; i++) pthread_join(threads[i], NULL);
+
+  ASSERT(bit_array_atomic_num_bits_set(arr) == ATOMIC_THREADS * ATOMIC_CLAIMS);
+  bit_array_resize(tmp, bit_array_atomic_length(arr));
+  bit_array_clear_all(tmp);
+  for(i = 0; i < ATOMIC_THREADS * ATOMIC_CLAIMS; i++) {
+    ASSERT(!bit_array_get_bit(tmp, slots[i]));
+    bit_array_set_bit(tmp, slots[i]);
+  }
+
+  free(slots);
+  bit_array_atomic_free(arr);
+  bit_array_free(tmp);
+
+  SUITE_END();
+}
+
+// Adds 1 to the word at bit `pos` many times, under the region lock
+static void _shm_locked_adds(BIT_ARRAY_SHM *arr, bit_index_t pos, int n)
+{
+  BIT_ARRAY view;
+  int i;
+  for(i = 0; i < n; i++) {
+    bit_array_shm_lock(arr, pos, 64);
+    bit_array_shm_view(arr, &view);
+    bit_array_set_word64(&view, pos, bit_array_get_word64(&view, pos) + 1);
+    bit_array_shm_unlock(arr, pos, 64);
+  }
+}
 
-  bit_array_set_bits(arr2, 3, 0, 2, 7);
-  _test_hamming(arr1, arr2);
-  _test_hamming(arr2, arr1);
+void test_shm()
+{
+  SUITE_START("shared memory arrays");
+
+  char name[64];
+  sprintf(name, "/bitarr_test_%i", (int)getpid());
+  bit_array_shm_unlink(name);
+
+  BIT_ARRAY_SHM *arr = bit_array_shm_create(name, 1000, 100000, 16), *arr2;
+  ASSERT(arr != NULL);
+  if(arr == NULL) { SUITE_END(); return; }
+  ASSERT(bit_array_shm_length(arr) == 1000);
+  ASSERT(bit_array_shm_capacity(arr) == 100032);
+  ASSERT(((size_t)arr->words & 63) == 0);
+  ASSERT(bit_array_shm_create(name, 10, 10, 0) == NULL && errno == EEXIST);
+
+  // A second mapping sees the same bits and length
+  arr2 = bit_array_shm_attach(name, 10, 10, 0);
+  ASSERT(arr2 != NULL && arr2->words != arr->words);
+  ASSERT(bit_array_shm_set(arr, 5) == 0);
+  ASSERT(bit_array_shm_get(arr2, 5) == 1);
+  ASSERT(bit_array_shm_set(arr2, 5) == 1);
+  ASSERT(bit_array_shm_toggle(arr2, 999) == 0);
+  ASSERT(bit_array_shm_clear(arr, 5) == 1);
+  ASSERT(bit_array_shm_num_bits_set(arr) == 1);
+  ASSERT(bit_array_shm_ensure_size(arr2, 10000));
+  ASSERT(bit_array_shm_length(arr) == 10000);
+  ASSERT(!bit_array_shm_ensure_size(arr, 200000) && errno == ENOMEM);
+  ASSERT(bit_array_shm_length(arr) == 10000);
+
+  word_t ws[2] = {0xff, 0xf0};
+  bit_array_shm_or_words(arr, 2, ws, 2);
+  bit_array_shm_and_words(arr2, 3, ws, 1);
+  ASSERT(bit_array_shm_num_bits_set(arr) == 1 + 8 + 4);
+  bit_array_shm_and_words(arr, 2, ws + 1, 1);
+  ASSERT(bit_array_shm_num_bits_set(arr2) == 1 + 4 + 4);
+
+  BIT_ARRAY *tmp = bit_array_create(0), view;
+  bit_array_shm_to_array(arr2, tmp);
+  ASSERT(bit_array_length(tmp) == 10000 && bit_array_num_bits_set(tmp) == 9);
+  ASSERT(bit_array_shm_view(arr, &view) != NULL && bit_array_cmp(&view, tmp) == 0);
+  bit_array_shm_close(arr2);
+
+  // Another process sets odd bits while we set even ones, and both update a
+  // word under the lock
+  bit_index_t i, counter = 8000;
+  int n = 2000, status = -1;
+  bit_array_shm_and_words(arr, 0, ws, 1); // clear all but bits 0..7
+  bit_array_shm_and_words(arr, 2, ws, 2);
+  bit_array_shm_and_words(arr, 15, ws, 1);
+
+  pid_t pid = fork();
+  if(pid == 0) {
+    BIT_ARRAY_SHM *child = bit_array_shm_open(name);
+    if(child == NULL) _exit(1);
+    for(i = 1; i < 8000; i += 2) bit_array_shm_set(child, i);
+    _shm_locked_adds(child, counter, n);
+    bit_array_shm_close(child);
+    _exit(0);
+  }
+  ASSERT(pid > 0);
+  for(i = 0; i < 8000; i += 2) bit_array_shm_set(arr, i);
+  _shm_locked_adds(arr, counter, n);
+  ASSERT(waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0);
+
+  bit_array_shm_view(arr, &view);
+  for(i = 0; i < 8000 && bit_array_get_bit(&view, i); i++) {}
+  ASSERT(i == 8000);
+  ASSERT(bit_array_get_word64(&view, counter) == (word_t)2 * n);
+
+  bit_array_shm_close(arr);
+  ASSERT(bit_array_shm_unlink(name) == 0);
+  ASSERT(bit_array_shm_open(name) == NULL && errno == ENOENT);
+
+  // Not a bit array
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  ASSERT(fd >= 0);
+  if(fd >= 0) {
+    char junk[128];
+    memset(junk, 0x7f, sizeof(junk));
+    ASSERT(write(fd, junk, sizeof(junk)) == (ssize_t)sizeof(junk));
+    close(fd);
+    ASSERT(bit_array_shm_open(name) == NULL && errno == EINVAL);
+    bit_array_shm_unlink(name);
+  }
 
-  bit_array_resize(arr1, 80);
-  bit_array_clear_bit(arr1, 2);
-  bit_array_set_region(arr1, 50, 20);
-  _test_hamming(arr1, arr2);
-  _test_hamming(arr2, arr1);
+  bit_array_free(tmp);
 
-  // random
-  int i;
-  for(i = 0; i < 10; i++)
-  {
-    size_t len1 = RAND(1000UL);
-    size_t len2 = RAND(1000UL);
-    bit_array_resize(arr1, len1);
-    bit_array_resize(arr2, len2);
-    bit_array_random(arr1, 0.5f);
-    bit_array_random(arr2, 0.5f);
-    _test_hamming(arr1, arr2);
-    _test_hamming(arr2, arr1);
+  SUITE_END();
+}
+
+void test_bloom()
+{
+  SUITE_START("bloom filters");
+
+  uint64_t i, n = 20000, key;
+  size_t hits;
+
+  errno = 0;
+  ASSERT(bit_bloom_create(1000, 0, 1) == NULL && errno == EINVAL);
+  ASSERT(bit_bloom_create(1000, BIT_BLOOM_MAX_K + 1, 1) == NULL);
+  ASSERT(bit_bloom_create_for(100, 0, 1) == NULL && errno == EINVAL);
+
+  // Sizes round up to whole cache line blocks
+  BIT_BLOOM *a = bit_bloom_create(1000, 7, 42), *b, *c;
+  ASSERT(a->num_of_blocks == 2 && bit_array_length(a->bits) == 1024);
+  ASSERT((uintptr_t)a->bits->words % 64 == 0);
+  bit_bloom_free(a);
+
+  // Hash: every byte and the length count
+  char buf[100];
+  memset(buf, 'x', sizeof(buf));
+  uint64_t hashes[101];
+  char ok = 1;
+  for(i = 0; i <= 100; i++) hashes[i] = bit_bloom_hash(buf, i, 0);
+  for(i = 1; i <= 100; i++) if(hashes[i] == hashes[i-1]) ok = 0;
+  ASSERT(ok);
+  ASSERT(bit_bloom_hash(buf, 40, 1) != bit_bloom_hash(buf, 40, 2));
+  for(i = 0, ok = 1; i < 100; i++) {
+    buf[i] = 'y';
+    if(bit_bloom_hash(buf, 100, 0) == hashes[100]) ok = 0;
+    buf[i] = 'x';
+  }
+  ASSERT(ok);
+
+  // No false negatives, false positive rate near the target
+  a = bit_bloom_create_for(n, 0.01, 7);
+  ASSERT(a != NULL && a->k >= 1 && a->k <= BIT_BLOOM_MAX_K);
+  for(i = 0; i < n; i++) bit_bloom_add(a, &i, sizeof(i));
+  for(i = 0, ok = 1; i < n; i++) if(!bit_bloom_contains(a, &i, sizeof(i))) ok = 0;
+  ASSERT(ok);
+  for(i = n, hits = 0; i < 11 * n; i++) hits += bit_bloom_contains(a, &i, sizeof(i));
+  ASSERT(hits > 0 && hits < 10 * n / 50); // under 2%
+  ASSERT(bit_bloom_fp_rate(a) > 0.001 && bit_bloom_fp_rate(a) < 0.05);
+
+  // Batches match single lookups
+  uint64_t *keys = (uint64_t*)malloc(2 * n * sizeof(uint64_t));
+  uint8_t *results = (uint8_t*)malloc(2 * n);
+  for(i = 0; i < 2 * n; i++) keys[i] = bit_bloom_hash(&i, sizeof(i), 7);
+  hits = bit_bloom_contains_hashes(a, keys, 2 * n, results);
+  ASSERT(hits == bit_bloom_contains_hashes(a, keys, 2 * n, NULL));
+  for(i = 0, ok = 1; i < 2 * n; i++) {
+    if(results[i] != bit_bloom_contains_hash(a, keys[i])) ok = 0;
+    if(i < n && !results[i]) ok = 0;
   }
+  ASSERT(ok);
+
+  b = bit_bloom_create_for(n, 0.01, 7);
+  bit_bloom_add_hashes(b, keys, n);
+  ASSERT(bit_array_cmp(a->bits, b->bits) == 0);
+
+  // Union and intersection: b has keys [n, 2n) and c has [0, n)
+  bit_bloom_clear(b);
+  ASSERT(bit_array_num_bits_set(b->bits) == 0);
+  bit_bloom_add_hashes(b, keys + n, n);
+  c = bit_bloom_create_for(n, 0.01, 7);
+  bit_bloom_union(c, a);
+  ASSERT(bit_bloom_union(c, b));
+  ASSERT(bit_bloom_contains_hashes(c, keys, 2 * n, NULL) == 2 * n);
+  ASSERT(bit_bloom_intersect(c, b));
+  ASSERT(bit_array_cmp(c->bits, b->bits) == 0);
+  bit_bloom_free(c);
+
+  c = bit_bloom_create_for(n, 0.01, 8);
+  errno = 0;
+  ASSERT(!bit_bloom_union(c, a) && errno == EINVAL);
+  ASSERT(!bit_bloom_intersect(a, c));
+  bit_bloom_free(c);
+
+  // Save / load
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_index_t nbytes = bit_bloom_save(a, f);
+  ASSERT(nbytes == 24 + 8 + a->num_of_blocks * 64);
+  fclose(f);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  c = bit_bloom_load(f);
+  fclose(f);
+  ASSERT(c != NULL);
+  ASSERT(c->num_of_blocks == a->num_of_blocks && c->k == a->k && c->seed == 7);
+  ASSERT(bit_array_cmp(c->bits, a->bits) == 0);
+  ASSERT((uintptr_t)c->bits->words % 64 == 0);
+  ASSERT(bit_bloom_contains_hashes(c, keys, 2 * n, NULL) == hits);
+  key = 3;
+  ASSERT(bit_bloom_contains(c, &key, sizeof(key)));
+  bit_bloom_free(c);
+
+  // Not a filter
+  f = fopen(test_filename, "w");
+  bit_array_save(a->bits, f);
+  fclose(f);
+  f = fopen(test_filename, "r");
+  ASSERT(bit_bloom_load(f) == NULL);
+  fclose(f);
 
-  bit_array_free(arr1);
-  bit_array_free(arr2);
+  free(keys);
+  free(results);
+  bit_bloom_free(a);
+  bit_bloom_free(b);
 
   SUITE_END();
 }
@@ -1337,6 +3339,289 @@ void test_save_load()
   SUITE_END();
 }
 
+// Saves arr in the aligned format, checks it maps and loads back the same
+void _test_mmap(BIT_ARRAY *arr, BIT_ARRAY *tmp)
+{
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  ASSERT(bit_array_save_aligned(arr, f) == 64 + 8 * arr->num_of_words);
+  fclose(f);
+
+  BIT_ARRAY *mapped = bit_array_mmap(test_filename, 0);
+  ASSERT(mapped != NULL);
+  if(mapped == NULL) return;
+  ASSERT(((size_t)mapped->words & 63) == 0);
+  ASSERT(bit_array_cmp(mapped, arr) == 0);
+  ASSERT(bit_array_is_view(mapped));
+  ASSERT(!bit_array_resize(mapped, arr->num_of_bits + 1));
+  bit_array_munmap(mapped);
+
+  // Copy-on-write mapping can be changed without touching the file
+  mapped = bit_array_mmap(test_filename, 1);
+  ASSERT(mapped != NULL);
+  if(mapped == NULL) return;
+  if(bit_array_length(mapped) > 0) {
+    bit_array_toggle_bit(mapped, 0);
+    ASSERT(bit_array_get_bit(mapped, 0) != bit_array_get_bit(arr, 0));
+  }
+  bit_array_munmap(mapped);
+
+  // bit_array_load reads both formats
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(bit_array_load(tmp, f));
+  fclose(f);
+  ASSERT(bit_array_cmp(tmp, arr) == 0);
+}
+
+void test_mmap()
+{
+  SUITE_START("memory mapped load");
+
+  BIT_ARRAY* arr = bit_array_create(0);
+  BIT_ARRAY* tmp = bit_array_create(0);
+  bit_index_t lens[] = {0, 1, 63, 64, 65, 5000, 100000};
+  size_t i;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr, lens[i]);
+    bit_array_random(arr, 0.5f);
+    _test_mmap(arr, tmp);
+  }
+
+  // Files in the old format can't be mapped
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_array_save(arr, f);
+  fclose(f);
+  ASSERT(bit_array_mmap(test_filename, 0) == NULL);
+
+  bit_array_free(arr);
+  bit_array_free(tmp);
+
+  SUITE_END();
+}
+
+// Encode arr in chunks of step bytes, returns stream length
+static size_t _stream_encode(BIT_ARRAY_ENCODER *enc, uint8_t *buf, size_t step)
+{
+  size_t len = 0, n;
+  while((n = bit_array_encoder_drain(enc, buf + len, step)) > 0) len += n;
+  ASSERT(bit_array_encoder_done(enc));
+  return len;
+}
+
+// Feed len bytes in chunks of step bytes
+static char _stream_decode(BIT_ARRAY_DECODER *dec, const uint8_t *buf,
+                           size_t len, size_t step)
+{
+  size_t i, n;
+  for(i = 0; i < len; i += n) {
+    n = bit_array_decoder_feed(dec, buf + i, MIN(step, len - i));
+    if(n == 0) break;
+  }
+  ASSERT(i == len);
+  return bit_array_decoder_finish(dec);
+}
+
+void test_streaming()
+{
+  SUITE_START("streaming save and load");
+
+  ASSERT(bit_array_crc32c(0, "123456789", 9) == 0xE3069283);
+  ASSERT(bit_array_crc32c(bit_array_crc32c(0, "1234", 4), "56789", 5) == 0xE3069283);
+
+  BIT_ARRAY* arr = bit_array_create(0);
+  BIT_ARRAY* tmp = bit_array_create(0);
+  BIT_ARRAY_ENCODER enc;
+  BIT_ARRAY_DECODER dec;
+  bit_index_t lens[] = {0, 1, 8, 63, 64, 65, 1000, 5000, 100003};
+  size_t steps[] = {1, 3, 8, 13, 4096, 1 << 20};
+  size_t max_size = 8 + 100003 / 8 + 1 + 4;
+  uint8_t *buf = (uint8_t*)malloc(max_size), *file = (uint8_t*)malloc(max_size);
+  size_t i, s, len, file_len;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+  {
+    bit_array_resize(arr, lens[i]);
+    bit_array_random(arr, 0.5f);
+
+    FILE *f = fopen(test_filename, "w");
+    if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+    bit_array_save(arr, f);
+    fclose(f);
+    f = fopen(test_filename, "r");
+    if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+    file_len = fread(file, 1, max_size, f);
+    fclose(f);
+    ASSERT(file_len == bit_array_stream_size(lens[i], 0));
+
+    for(s = 0; s < sizeof(steps) / sizeof(steps[0]); s++)
+    {
+      // Same bytes as bit_array_save, then a CRC
+      bit_array_encoder_init(&enc, arr, BIT_STREAM_CRC);
+      len = _stream_encode(&enc, buf, steps[s]);
+      ASSERT(len == bit_array_stream_size(lens[i], BIT_STREAM_CRC));
+      ASSERT(memcmp(buf, file, file_len) == 0);
+      ASSERT(bit_array_crc32c(0, buf, file_len) ==
+             (uint32_t)(buf[len-4] | buf[len-3] << 8 | buf[len-2] << 16 |
+                        (uint32_t)buf[len-1] << 24));
+
+      bit_array_resize(tmp, 7);
+      bit_array_set_all(tmp);
+      bit_array_decoder_init(&dec, tmp, BIT_STREAM_CRC);
+      ASSERT(_stream_decode(&dec, buf, len, steps[s]));
+      ASSERT(bit_array_cmp(tmp, arr) == 0);
+
+      // Stops at the end of the stream
+      ASSERT(bit_array_decoder_feed(&dec, buf, len) == 0);
+
+      // Without the CRC
+      bit_array_decoder_init(&dec, tmp, 0);
+      ASSERT(_stream_decode(&dec, file, file_len, steps[s]));
+      ASSERT(bit_array_cmp(tmp, arr) == 0);
+    }
+
+    // Corrupt or short streams fail
+    len = bit_array_stream_size(lens[i], BIT_STREAM_CRC);
+    buf[len / 2] ^= 0x10;
+    bit_array_decoder_init(&dec, tmp, BIT_STREAM_CRC);
+    if(len / 2 >= 8) ASSERT(!_stream_decode(&dec, buf, len, 7));
+    buf[len / 2] ^= 0x10;
+    bit_array_decoder_init(&dec, tmp, BIT_STREAM_CRC);
+    ASSERT(!_stream_decode(&dec, buf, len - 1, 7));
+    bit_array_decoder_init(&dec, tmp, 0);
+    ASSERT(!_stream_decode(&dec, buf, MIN(file_len - 1, 5), 7));
+
+    // Word ranges match the bytes in the file
+    word_addr_t nwords = arr->num_of_words, first, num, j;
+    for(first = 0; first <= nwords + 1; first += 1 + first * 3)
+    {
+      for(num = 0; num <= nwords + 2; num = num * 2 + 1)
+      {
+        uint64_t start = bit_array_stream_offset(lens[i], first);
+        uint64_t stop = bit_array_stream_offset(lens[i], first + num);
+
+        bit_array_encoder_init_range(&enc, arr, first, num, 0);
+        len = _stream_encode(&enc, buf, 5);
+        ASSERT(len == stop - start);
+        ASSERT(memcmp(buf, file + start, len) == 0);
+
+        bit_array_encoder_init_range(&enc, arr, first, num, BIT_STREAM_CRC);
+        len = _stream_encode(&enc, buf, 5);
+        ASSERT(len == stop - start + 4);
+
+        bit_array_decoder_init_range(&dec, tmp, lens[i], first, num,
+                                     BIT_STREAM_CRC);
+        ASSERT(_stream_decode(&dec, buf, len, 11));
+        ASSERT(bit_array_length(tmp) ==
+               (first >= nwords ? 0 : MIN(num * 64, lens[i] - first * 64)));
+        for(j = 0; j * 64 < bit_array_length(tmp); j++)
+          ASSERT(bit_array_get_word64(tmp, j * 64) ==
+                 bit_array_get_word64(arr, (first + j) * 64));
+      }
+    }
+  }
+
+  free(buf);
+  free(file);
+  bit_array_free(arr);
+  bit_array_free(tmp);
+
+  SUITE_END();
+}
+
+// Save arr with the given function, check load and load_range read it back
+static bit_index_t _test_compressed_file(BIT_ARRAY *arr, BIT_ARRAY *tmp,
+                                         bit_index_t (*save)(const BIT_ARRAY*, FILE*))
+{
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bit_index_t bytes = save(arr, f);
+  fclose(f);
+
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  bit_array_resize(tmp, 3);
+  bit_array_set_all(tmp);
+  ASSERT(bit_array_load(tmp, f));
+  ASSERT(bit_array_cmp(tmp, arr) == 0);
+
+  word_addr_t nwords = arr->num_of_words, first, num, j;
+  for(first = 0; first <= nwords + 1; first += 1 + first * 2 + RAND(100))
+  {
+    for(num = 0; num <= nwords + 1; num = num * 3 + 1 + RAND(50))
+    {
+      rewind(f);
+      ASSERT(bit_array_load_range(tmp, f, first, num));
+      ASSERT(bit_array_length(tmp) ==
+             (first >= nwords ? 0 : MIN(num * 64, arr->num_of_bits - first * 64)));
+      for(j = 0; j * 64 < bit_array_length(tmp); j++)
+        ASSERT(bit_array_get_word64(tmp, j * 64) ==
+               bit_array_get_word64(arr, (first + j) * 64));
+    }
+  }
+
+  fclose(f);
+  return bytes;
+}
+
+void test_compressed()
+{
+  SUITE_START("compressed save and load");
+
+  BIT_ARRAY* arr = bit_array_create(0);
+  BIT_ARRAY* tmp = bit_array_create(0);
+  bit_index_t lens[] = {0, 1, 64, 100, 4096*64, 4096*64+1, 3*4096*64+17};
+  size_t i, j;
+  bit_index_t bytes;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+  {
+    // Random, sparse, runs and all ones
+    for(j = 0; j < 4; j++)
+    {
+      bit_array_resize(arr, lens[i]);
+      bit_array_clear_all(arr);
+      if(j == 0) bit_array_random(arr, 0.5f);
+      else if(j == 1) bit_array_random(arr, 0.0001f);
+      else if(j == 2 && lens[i] > 0) {
+        bit_array_set_region(arr, lens[i] / 3, lens[i] / 3);
+        bit_array_set_bit(arr, lens[i] - 1);
+      }
+      else bit_array_set_all(arr);
+
+      bytes = _test_compressed_file(arr, tmp, bit_array_save_compressed);
+      if(j > 0 && lens[i] >= 4096*64) ASSERT(bytes * 8 < roundup_bits2bytes(lens[i]));
+      _test_compressed_file(arr, tmp, bit_array_save);
+      _test_compressed_file(arr, tmp, bit_array_save_aligned);
+    }
+  }
+
+  // Truncated files fail to load
+  bit_array_resize(arr, 4096*64*2);
+  bit_array_random(arr, 0.5f);
+  FILE *f = fopen(test_filename, "w");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  bytes = bit_array_save_compressed(arr, f);
+  fclose(f);
+  ASSERT(truncate(test_filename, (off_t)bytes - 3) == 0);
+  f = fopen(test_filename, "r");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  ASSERT(!bit_array_load(tmp, f));
+  rewind(f);
+  ASSERT(bit_array_load_range(tmp, f, 0, 10));
+  rewind(f);
+  ASSERT(!bit_array_load_range(tmp, f, 4096, 10));
+  fclose(f);
+
+  bit_array_free(arr);
+  bit_array_free(tmp);
+
+  SUITE_END();
+}
+
 //
 // Aggregate testing
 //
@@ -1749,6 +4034,100 @@ void test_hex_functions()
   SUITE_END();
 }
 
+// Long strings at word aligned and unaligned offsets go through the text
+// kernels, compare with bit by bit
+void _test_text_codecs(bit_index_t len, bit_index_t start)
+{
+  BIT_ARRAY *arr = bit_array_create(start + len), *arr2 = bit_array_create(0);
+  char *str = (char*)malloc(bit_array_str_size(len) + bit_array_hex_size(len) + 2);
+  char *hex = str + bit_array_str_size(len);
+  bit_index_t i;
+  char ok;
+
+  bit_array_random(arr, 0.5f);
+
+  // to_substr left to right and right to left
+  bit_array_to_substr(arr, start, len, str, 'x', '.', 1);
+  for(ok = 1, i = 0; i < len; i++)
+    ok &= (str[i] == (bit_array_get_bit(arr, start+i) ? 'x' : '.'));
+  ASSERT(ok);
+
+  bit_array_to_substr(arr, start, len, str, '1', '0', 0);
+  for(ok = 1, i = 0; i < len; i++)
+    ok &= (str[i] == (bit_array_get_bit(arr, start+len-1-i) ? '1' : '0'));
+  ASSERT(ok);
+
+  // from_substr into an offset
+  bit_array_to_substr(arr, start, len, str, 'x', '.', 1);
+  bit_array_resize(arr2, start);
+  bit_array_from_substr(arr2, start, str, len, "x", ".", 1);
+  ASSERT(bit_array_length(arr2) == start + len);
+  for(ok = 1, i = 0; i < len; i++)
+    ok &= (bit_array_get_bit(arr, start+i) == bit_array_get_bit(arr2, start+i));
+  ASSERT(ok);
+
+  // hex
+  size_t nchars = bit_array_to_hex(arr, start, len, hex, 0);
+  ASSERT(nchars + 1 == bit_array_hex_size(len));
+  ASSERT(strlen(hex) == nchars);
+  for(ok = 1, i = 0; i < len; i += 4) {
+    uint8_t b = 0, nib = 0, j;
+    for(j = 0; j < 4 && i+j < len; j++) nib |= bit_array_get_bit(arr, start+i+j) << j;
+    const char *c = strchr("0123456789abcdef", hex[i/4]);
+    b = c == NULL ? 0xff : (uint8_t)(c - "0123456789abcdef");
+    ok &= (b == nib);
+  }
+  ASSERT(ok);
+
+  bit_array_resize(arr2, 0);
+  ASSERT(bit_array_from_hex(arr2, start, hex, nchars) == 4 * nchars);
+  for(ok = 1, i = 0; i < len; i++)
+    ok &= (bit_array_get_bit(arr, start+i) == bit_array_get_bit(arr2, start+i));
+  ASSERT(ok);
+
+  // Stop at a non-hex char
+  if(nchars > 0) {
+    size_t bad = (size_t)RAND(nchars);
+    hex[bad] = 'g';
+    bit_array_resize(arr2, 0);
+    ASSERT(bit_array_from_hex(arr2, 0, hex, nchars) == 4 * bad);
+  }
+
+  free(str);
+  bit_array_free(arr);
+  bit_array_free(arr2);
+}
+
+void test_text_codecs()
+{
+  SUITE_START("text codecs");
+
+  bit_index_t lens[] = {0, 1, 63, 64, 65, 127, 128, 1000, 4096, 5000, 70000};
+  bit_index_t starts[] = {0, 1, 64, 67};
+  size_t i, j;
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++)
+    for(j = 0; j < sizeof(starts) / sizeof(starts[0]); j++)
+      _test_text_codecs(lens[i], starts[j]);
+
+  // Upper case, mixed case input
+  BIT_ARRAY *arr = bit_array_create(0);
+  char hex[129], out[129];
+  for(i = 0; i < 128; i++) hex[i] = "0123456789abcdefABCDEF"[i % 22];
+  hex[128] = '\0';
+  ASSERT(bit_array_from_hex(arr, 0, hex, 128) == 512);
+  bit_array_to_hex(arr, 0, 512, out, 1);
+  for(i = 0; i < 128; i++) hex[i] = (char)toupper(hex[i]);
+  ASSERT(strcmp(hex, out) == 0);
+  bit_array_free(arr);
+
+  ASSERT(bit_array_str_size(10) == 11);
+  ASSERT(bit_array_hex_size(0) == 1);
+  ASSERT(bit_array_hex_size(9) == 4);
+
+  SUITE_END();
+}
+
 void _next_permutation_str(char *str, size_t len)
 {
   if(len == 0)
@@ -2161,6 +4540,97 @@ void test_small_products()
   SUITE_END();
 }
 
+// Shift and add, one bit at a time
+void _slow_product(BIT_ARRAY *dst, const BIT_ARRAY *a, const BIT_ARRAY *b)
+{
+  bit_index_t i;
+  bit_array_clear_all(dst);
+  for(i = 0; i < bit_array_length(a); i++)
+    if(bit_array_get_bit(a, i)) bit_array_add_words(dst, i, b);
+}
+
+void _test_big_product(bit_index_t len1, bit_index_t len2)
+{
+  BIT_ARRAY *a = bit_array_create(len1), *b = bit_array_create(len2);
+  BIT_ARRAY *c = bit_array_create(0), *expect = bit_array_create(0);
+
+  bit_array_random(a, 0.5f);
+  bit_array_random(b, 0.5f);
+
+  bit_array_multiply(c, a, b);
+  _slow_product(expect, a, b);
+  ASSERT(bit_array_cmp_words(c, 0, expect) == 0);
+
+  // dst may be either source
+  bit_array_multiply(b, a, b);
+  ASSERT(bit_array_cmp_words(b, 0, expect) == 0);
+
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(c);
+  bit_array_free(expect);
+}
+
+void test_big_products()
+{
+  SUITE_START("product with big numbers");
+
+  // Schoolbook, Karatsuba and uneven lengths
+  _test_big_product(64*31, 64*31);
+  _test_big_product(64*32, 64*32);
+  _test_big_product(64*33+7, 64*33+5);
+  _test_big_product(5000, 3000);
+  _test_big_product(10000, 20);
+  _test_big_product(50, 7000);
+  _test_big_product(64*100, 64*255);
+
+  // a * (b + c) == a*b + a*c for 100k bit numbers
+  BIT_ARRAY *a = bit_array_create(100000), *b = bit_array_create(100000);
+  BIT_ARRAY *c = bit_array_create(90000), *lhs = bit_array_create(0);
+  BIT_ARRAY *ab = bit_array_create(0), *ac = bit_array_create(0);
+
+  bit_array_random(a, 0.5f);
+  bit_array_random(b, 0.5f);
+  bit_array_random(c, 0.5f);
+  bit_array_multiply(ab, a, b);
+  bit_array_multiply(ac, a, c);
+  bit_array_add(ab, ab, ac);
+  bit_array_add(b, b, c);
+  bit_array_multiply(lhs, a, b);
+  ASSERT(bit_array_cmp_words(lhs, 0, ab) == 0);
+
+  // an all ones number: (2^n - 1)^2 = 2^2n - 2^(n+1) + 1
+  bit_array_resize(a, 64*1000);
+  bit_array_set_all(a);
+  bit_array_multiply(lhs, a, a);
+  bit_array_resize(ab, 0);
+  bit_array_resize(ab, 64*2000+1);
+  bit_array_set_bit(ab, 64*2000);
+  bit_array_clear_all(ac);
+  bit_array_resize(ac, 64*1000+2);
+  bit_array_set_bit(ac, 64*1000+1);
+  bit_array_subtract(ab, ab, ac);
+  bit_array_add_uint64(ab, 1);
+  ASSERT(bit_array_cmp_words(lhs, 0, ab) == 0);
+
+  // mul_uint64 agrees with multiply
+  bit_array_resize(b, 1);
+  bit_array_clear_all(b);
+  bit_array_add_uint64(b, 0xfedcba9876543210ULL);
+  bit_array_multiply(lhs, c, b);
+  bit_array_mul_uint64(c, 0xfedcba9876543210ULL);
+  ASSERT(bit_array_cmp_words(lhs, 0, c) == 0);
+
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(c);
+  bit_array_free(lhs);
+  bit_array_free(ab);
+  bit_array_free(ac);
+
+  SUITE_END();
+}
+
 void _test_div(uint64_t nom, uint64_t denom)
 {
   BIT_ARRAY *nom_arr = bit_array_create(0);
@@ -2235,6 +4705,131 @@ void test_to_from_decimal()
   SUITE_END();
 }
 
+// One digit at a time with bit_array_div_uint64
+size_t _slow_to_decimal(const BIT_ARRAY *arr, char *str)
+{
+  BIT_ARRAY *tmp = bit_array_clone(arr);
+  size_t i, n = 0;
+  uint64_t rem;
+
+  do {
+    bit_array_div_uint64(tmp, 10, &rem);
+    str[n++] = '0' + (char)rem;
+  } while(bit_array_cmp_uint64(tmp, 0) != 0);
+
+  for(i = 0; i < n / 2; i++) {
+    char c = str[i]; str[i] = str[n-1-i]; str[n-1-i] = c;
+  }
+  str[n] = '\0';
+
+  bit_array_free(tmp);
+  return n;
+}
+
+void _test_big_decimal(bit_index_t nbits)
+{
+  BIT_ARRAY *arr = bit_array_create(nbits), *back = bit_array_create(0);
+  size_t len = nbits / 3 + 2;
+  char *str = (char*)malloc(len), *expect = (char*)malloc(len);
+
+  bit_array_random(arr, 0.5f);
+  bit_array_set_bit(arr, nbits-1);
+
+  size_t n = bit_array_to_decimal(arr, str, len);
+  ASSERT(n == strlen(str));
+  ASSERT(_slow_to_decimal(arr, expect) == n);
+  ASSERT(strcmp(str, expect) == 0);
+
+  ASSERT(bit_array_from_decimal(back, str) == n);
+  ASSERT(bit_array_cmp_words(back, 0, arr) == 0);
+
+  // Too short: least significant digits
+  ASSERT(bit_array_to_decimal(arr, str, 11) == n);
+  ASSERT(strcmp(str, expect + n - 10) == 0);
+
+  free(str);
+  free(expect);
+  bit_array_free(arr);
+  bit_array_free(back);
+}
+
+void test_big_decimal()
+{
+  SUITE_START("big decimal");
+
+  _test_big_decimal(64);
+  _test_big_decimal(65);
+  _test_big_decimal(1000);
+  _test_big_decimal(64*32+1);
+  _test_big_decimal(5000);
+  _test_big_decimal(20000);
+
+  // 10^k in and out
+  char str[1002];
+  BIT_ARRAY *arr = bit_array_create(0);
+  memset(str, '0', 1001);
+  str[0] = '1';
+  str[1001] = '\0';
+  ASSERT(bit_array_from_decimal(arr, str) == 1001);
+  char out[1002];
+  ASSERT(bit_array_to_decimal(arr, out, sizeof(out)) == 1001);
+  ASSERT(strcmp(str, out) == 0);
+  bit_array_free(arr);
+
+  SUITE_END();
+}
+
+void _test_big_divide(bit_index_t len1, bit_index_t len2)
+{
+  BIT_ARRAY *a = bit_array_create(len1), *b = bit_array_create(len2);
+  BIT_ARRAY *rem = bit_array_create(0), *q = bit_array_create(0);
+
+  bit_array_random(a, 0.5f);
+  do { bit_array_random(b, 0.5f); } while(bit_array_num_bits_set(b) == 0);
+
+  bit_array_copy_all(rem, a);
+  bit_array_divide(rem, q, b);
+
+  ASSERT(bit_array_cmp_words(rem, 0, b) < 0);
+  bit_array_multiply(q, q, b);
+  bit_array_add(q, q, rem);
+  ASSERT(bit_array_cmp_words(q, 0, a) == 0);
+
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(rem);
+  bit_array_free(q);
+}
+
+void test_big_divide()
+{
+  SUITE_START("big divide");
+
+  _test_big_divide(64*2, 64*2);
+  _test_big_divide(1000, 64);
+  _test_big_divide(1000, 65);
+  _test_big_divide(5000, 1000);
+  _test_big_divide(20000, 7000);
+  _test_big_divide(100000, 3);
+
+  // (2^2688 - 1) / (2^448 - 1) divides exactly, all ones hit the qhat corrections
+  BIT_ARRAY *a = bit_array_create(64*42), *b = bit_array_create(64*7);
+  BIT_ARRAY *q = bit_array_create(0);
+  bit_array_set_all(a);
+  bit_array_set_all(b);
+  bit_array_divide(a, q, b);
+  ASSERT(bit_array_cmp_uint64(a, 0) == 0);
+  bit_array_multiply(q, q, b);
+  bit_array_resize(a, 64*42);
+  bit_array_set_all(a);
+  ASSERT(bit_array_cmp_words(q, 0, a) == 0);
+  bit_array_free(a);
+  bit_array_free(b);
+  bit_array_free(q);
+
+  SUITE_END();
+}
+
 void _test_product_divide()
 {
   // Rand number between 0-255 inclusive
@@ -2591,6 +5186,184 @@ void test_bar_wrapper()
   SUITE_END();
 }
 
+// Cached popcount and hash must match a full rescan
+static void _check_tracked(BIT_ARRAY *arr)
+{
+  BIT_ARRAY *fresh = bit_array_clone(arr);
+  ASSERT(bit_array_track_start(fresh));
+  ASSERT(bit_array_track_num_bits_set(arr) == bit_array_num_bits_set(arr));
+  ASSERT(bit_array_track_hash(arr) == bit_array_track_hash(fresh));
+  bit_array_free(fresh);
+}
+
+// Save arr to a file, make ref a copy of it and clear dirty blocks
+static void _track_snapshot(BIT_ARRAY *arr, BIT_ARRAY *ref, char aligned)
+{
+  FILE *f = fopen(test_filename, "wb");
+  if(f == NULL) die("Couldn't open file to write: '%s'", test_filename);
+  if(aligned) bit_array_save_aligned(arr, f);
+  else bit_array_save(arr, f);
+  fclose(f);
+  bit_array_copy_all(ref, arr);
+  bit_array_dirty_clear(arr);
+}
+
+// Update the file with the dirty blocks, check it loads as arr
+static void _track_check_save(BIT_ARRAY *arr, BIT_ARRAY *ref)
+{
+  ASSERT(bit_array_dirty_hamming_distance(arr, ref) ==
+         bit_array_hamming_distance(arr, ref));
+
+  FILE *f = fopen(test_filename, "r+b");
+  if(f == NULL) die("Couldn't open file to update: '%s'", test_filename);
+  ASSERT(bit_array_save_dirty(arr, f) > 0);
+  fclose(f);
+
+  f = fopen(test_filename, "rb");
+  if(f == NULL) die("Couldn't open file to read: '%s'", test_filename);
+  BIT_ARRAY *loaded = bit_array_create(0);
+  ASSERT(bit_array_load(loaded, f));
+  fclose(f);
+  ASSERT(bit_array_cmp(loaded, arr) == 0);
+  bit_array_free(loaded);
+}
+
+void test_tracking()
+{
+  SUITE_START("write tracking");
+
+  // 1MB: 256 blocks of 512 words
+  bit_index_t len = 8UL * 1024 * 1024 - 3, blk = 512 * 64;
+  BIT_ARRAY *arr = bit_array_create(len), *ref = bit_array_create(0);
+  word_addr_t w, n;
+  char aligned;
+  bit_array_random(arr, 0.5f);
+
+  ASSERT(bit_array_track_start(arr));
+  ASSERT(bit_array_dirty_num_blocks(arr) == 0);
+  w = 0;
+  ASSERT(!bit_array_dirty_next(arr, &w, &n));
+  _check_tracked(arr);
+
+  // Runs of dirty blocks
+  bit_array_set_bit(arr, 5);
+  bit_array_toggle_bit(arr, 2 * blk + 1);
+  bit_array_set_region(arr, 5 * blk - 1, blk + 2);
+  ASSERT(bit_array_dirty_num_blocks(arr) == 5);
+  w = 0;
+  ASSERT(bit_array_dirty_next(arr, &w, &n) && w == 0 && n == 512);
+  w += n;
+  ASSERT(bit_array_dirty_next(arr, &w, &n) && w == 2 * 512 && n == 512);
+  w += n;
+  ASSERT(bit_array_dirty_next(arr, &w, &n) && w == 4 * 512 && n == 3 * 512);
+  w = 4 * 512 + 100;
+  ASSERT(bit_array_dirty_next(arr, &w, &n) && w == 4 * 512 + 100 && n == 3 * 512 - 100);
+  w = 7 * 512;
+  ASSERT(!bit_array_dirty_next(arr, &w, &n));
+  _check_tracked(arr);
+  bit_array_dirty_clear(arr);
+  ASSERT(bit_array_dirty_num_blocks(arr) == 0);
+
+  for(aligned = 0; aligned < 2; aligned++)
+  {
+    _track_snapshot(arr, ref, aligned);
+    bit_array_clear_bit(arr, len - 1);
+    bit_array_set_word64(arr, 100 * blk - 32, 0x123456789abcdefULL);
+    bit_array_toggle_region(arr, 10 * blk, 3 * blk);
+    ASSERT(bit_array_dirty_num_blocks(arr) == 1 + 2 + 3);
+    bit_array_add_word(arr, 50 * blk, 0xffffffffffffULL);
+    _check_tracked(arr);
+    _track_check_save(arr, ref);
+
+    // Longer, change at the end
+    _track_snapshot(arr, ref, aligned);
+    bit_array_resize(arr, len + 3 * blk + 11);
+    bit_array_set_bit(arr, len + 2 * blk);
+    _check_tracked(arr);
+    _track_check_save(arr, ref);
+
+    // Shorter
+    _track_snapshot(arr, ref, aligned);
+    bit_array_resize(arr, len - 7 * blk - 5);
+    _check_tracked(arr);
+    _track_check_save(arr, ref);
+
+    // Whole array operations
+    _track_snapshot(arr, ref, aligned);
+    bit_array_cycle_left(arr, 12345);
+    bit_array_not(arr, arr);
+    ASSERT(bit_array_dirty_num_blocks(arr) == (len - 7 * blk - 5 + blk - 1) / blk);
+    _check_tracked(arr);
+    _track_check_save(arr, ref);
+    bit_array_resize(arr, len);
+  }
+
+  // Batch updates mark the blocks of their bits
+  bit_index_t idx[3] = {3, 20 * blk + 7, len - 2};
+  bit_array_dirty_clear(arr);
+  bit_array_set_batch(arr, idx, 3, BIT_BATCH_SORTED);
+  ASSERT(bit_array_dirty_num_blocks(arr) == 3);
+  _check_tracked(arr);
+  bit_array_dirty_clear(arr);
+  bit_array_toggle_batch(arr, idx, 2, 0);
+  ASSERT(bit_array_dirty_num_blocks(arr) == 2);
+  _check_tracked(arr);
+  bit_array_dirty_clear(arr);
+  bit_array_clear_batch(arr, idx + 1, 2, 0);
+  ASSERT(bit_array_dirty_num_blocks(arr) == 2);
+  _check_tracked(arr);
+
+  // Logic operators mark every block of dst
+  BIT_ARRAY *other = bit_array_create(len);
+  const BIT_ARRAY *in[2] = {arr, other};
+  BIT_EXPR prog[] = {{BIT_EXPR_IN,0}, {BIT_EXPR_IN,1}, {BIT_EXPR_ANDNOT,0}};
+  int op;
+  bit_array_random(other, 0.5f);
+  for(op = 0; op < 5; op++)
+  {
+    bit_array_dirty_clear(arr);
+    switch(op) {
+      case 0: bit_array_and(arr, arr, other); break;
+      case 1: bit_array_or(arr, arr, other); break;
+      case 2: bit_array_xor(arr, arr, other); break;
+      case 3: bit_array_not(arr, arr); break;
+      default: bit_array_eval(arr, prog, 3, in, 2);
+    }
+    ASSERT(bit_array_dirty_num_blocks(arr) == (len + blk - 1) / blk);
+    _check_tracked(arr);
+  }
+  bit_array_free(other);
+
+  // Same contents and length, different history: same hash
+  bit_array_copy_all(ref, arr);
+  ASSERT(bit_array_track_start(ref));
+  bit_array_resize(ref, 3);
+  bit_array_resize(ref, len);
+  bit_array_copy_all(ref, arr);
+  ASSERT(bit_array_track_hash(ref) == bit_array_track_hash(arr));
+  bit_array_toggle_bit(ref, 1000);
+  ASSERT(bit_array_track_hash(ref) != bit_array_track_hash(arr));
+  bit_array_toggle_bit(ref, 1000);
+  ASSERT(bit_array_track_hash(ref) == bit_array_track_hash(arr));
+  bit_array_resize(ref, len + 1);
+  ASSERT(bit_array_track_hash(ref) != bit_array_track_hash(arr));
+  ASSERT(bit_array_track_num_bits_set(ref) == bit_array_track_num_bits_set(arr));
+
+  // Empty and small (inline) arrays
+  bit_array_resize(ref, 0);
+  _check_tracked(ref);
+  bit_array_resize(ref, 100);
+  bit_array_set_bit(ref, 99);
+  _check_tracked(ref);
+  ASSERT(bit_array_track_num_bits_set(ref) == 1);
+  bit_array_track_stop(ref);
+  bit_array_set_bit(ref, 1);
+
+  bit_array_free(arr);
+  bit_array_free(ref);
+  SUITE_END();
+}
+
 int main(int argc, char* argv[])
 {
   if(argc != 1)
@@ -2610,23 +5383,47 @@ int main(int argc, char* argv[])
   test_get_set_bytes();
 
   test_get_bits();
+  test_batch();
+  test_iter();
+  test_allocators();
+  test_views();
+  test_inline_words();
+  test_growth();
+  test_stats();
+  test_cow();
+  test_tracking();
   test_parity();
   test_interleave();
   test_reverse();
   test_toggle();
   test_cycle();
   test_shift();
+  test_shift_cycle_lengths();
 
   test_compare();
   test_compare2();
   test_first_last_bit_set();
   test_next_prev_bit_set();
   test_hamming_weight();
+  test_logic_ops();
+  test_set_counts();
+  test_eval();
+  test_rank_select();
+  test_roaring();
+  test_mt();
+  test_atomic();
+  test_shm();
+  test_bloom();
   test_save_load();
+  test_mmap();
+  test_streaming();
+  test_compressed();
 
   test_hex_functions();
+  test_text_codecs();
   test_string_functions();
   test_to_from_decimal();
+  test_big_decimal();
 
   test_as_num_cmp_num();
 
@@ -2642,13 +5439,16 @@ int main(int argc, char* argv[])
   test_multiply();
   test_div();
   test_small_products();
+  test_big_products();
   test_product_divide();
+  test_big_divide();
 
   test_bar_wrapper();
 
   // slooow
   test_next_permutation();
   test_random_and_shuffle();
+  test_rng();
 
   // Tests that need re-writing
   // test_hash();
@@ -0,0 +1,199 @@
+/*
+ dev/bitlock_bench.c
+ project: bit array C library
+ url: https://github.com/noporpoise/BitArray/
+ maintainer: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain, no warranty
+ date: Oct 2026
+*/
+
+// Lock throughput (millions of lock/unlock pairs per second) for 1, 2, 4 ...
+// threads, for two workloads:
+//   neighbours: thread t only takes lock t -- no real contention, but dense
+//               locks share cache lines (false sharing)
+//   hot:        every thread takes lock 0
+//
+// usage: ./bitlock_bench [max_threads] [loops per thread]
+// max_threads defaults to the number of CPUs. Spin locks with more threads
+// than CPUs mostly measure the scheduler.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "bit_macros.h"
+#include "bit_locks.h"
+
+#define NUM_LOCKS 4096
+
+typedef struct {
+  volatile size_t value;
+  char _pad[64 - sizeof(size_t)];
+} Counter;
+
+char *dense_locks;
+BITLOCK_TABLE *table;
+pthread_mutex_t *mutexes;
+ticketlock_t ticket = TICKETLOCK_INIT;
+mcslock_t mcs = MCSLOCK_INIT;
+Counter counters[NUM_LOCKS];
+
+typedef struct {
+  const char *name;
+  void (*acquire)(size_t i, mcslock_node_t *node);
+  void (*release)(size_t i, mcslock_node_t *node);
+  char single; // only one lock
+} LockMethod;
+
+static void spin_acquire(size_t i, mcslock_node_t *n) { (void)n; bitlock_acquire(dense_locks, i); }
+static void yield_acquire(size_t i, mcslock_node_t *n) { (void)n; bitlock_yield_acquire(dense_locks, i); }
+static void backoff_acquire(size_t i, mcslock_node_t *n) { (void)n; bitlock_backoff_acquire(dense_locks, i); }
+static void dense_release(size_t i, mcslock_node_t *n) { (void)n; bitlock_release(dense_locks, i); }
+
+static void table_acquire(size_t i, mcslock_node_t *n) { (void)n; bitlock_table_acquire(table, i); }
+static void table_release(size_t i, mcslock_node_t *n) { (void)n; bitlock_table_release(table, i); }
+
+static void mutex_acquire(size_t i, mcslock_node_t *n) { (void)n; pthread_mutex_lock(&mutexes[i]); }
+static void mutex_release(size_t i, mcslock_node_t *n) { (void)n; pthread_mutex_unlock(&mutexes[i]); }
+
+static void ticket_acquire(size_t i, mcslock_node_t *n) { (void)i; (void)n; ticketlock_acquire(&ticket); }
+static void ticket_release(size_t i, mcslock_node_t *n) { (void)i; (void)n; ticketlock_release(&ticket); }
+
+static void mcs_acquire(size_t i, mcslock_node_t *n) { (void)i; mcslock_acquire(&mcs, n); }
+static void mcs_release(size_t i, mcslock_node_t *n) { (void)i; mcslock_release(&mcs, n); }
+
+static const LockMethod methods[] = {
+  {"bitlock-spin",    spin_acquire,    dense_release,  0},
+  {"bitlock-yield",   yield_acquire,   dense_release,  0},
+  {"bitlock-backoff", backoff_acquire, dense_release,  0},
+  {"bitlock-table",   table_acquire,   table_release,  0},
+  {"pthread-mutex",   mutex_acquire,   mutex_release,  0},
+  {"ticket",          ticket_acquire,  ticket_release, 1},
+  {"mcs",             mcs_acquire,     mcs_release,    1}
+};
+
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+typedef struct {
+  pthread_t th;
+  size_t lock, loops;
+  const LockMethod *method;
+} BenchThread;
+
+static void* bench_worker(void *ptr)
+{
+  BenchThread *wrkr = (BenchThread*)ptr;
+  mcslock_node_t node;
+  size_t i;
+
+  for(i = 0; i < wrkr->loops; i++) {
+    wrkr->method->acquire(wrkr->lock, &node);
+    counters[wrkr->lock].value++;
+    wrkr->method->release(wrkr->lock, &node);
+  }
+
+  return NULL;
+}
+
+static double now_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns millions of lock/unlock per second, or -1 if the count is wrong
+static double run_bench(const LockMethod *method, size_t nthreads, size_t loops,
+                        char hot)
+{
+  BenchThread *workers = (BenchThread*)malloc(nthreads * sizeof(BenchThread));
+  size_t i, total = 0;
+  int rc;
+
+  memset(counters, 0, sizeof(counters));
+
+  double start = now_secs();
+
+  for(i = 0; i < nthreads; i++) {
+    workers[i].lock = hot ? 0 : i;
+    workers[i].loops = loops;
+    workers[i].method = method;
+    rc = pthread_create(&workers[i].th, NULL, bench_worker, &workers[i]);
+    if(rc) { fprintf(stderr, "pthread error: %s\n", strerror(rc)); exit(-1); }
+  }
+
+  for(i = 0; i < nthreads; i++) pthread_join(workers[i].th, NULL);
+
+  double secs = now_secs() - start;
+
+  for(i = 0; i < NUM_LOCKS; i++) total += counters[i].value;
+  free(workers);
+
+  return total == nthreads * loops ? (nthreads * loops) / secs / 1e6 : -1;
+}
+
+int main(int argc, char **argv)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_threads = ncpus > 0 ? (size_t)ncpus : 1, loops = 1000000;
+  size_t i, t, m;
+  int hot;
+
+  if(argc > 3 || (argc > 1 && atol(argv[1]) <= 0) || (argc > 2 && atol(argv[2]) <= 0)) {
+    fprintf(stderr, "usage: ./bitlock_bench [max_threads] [loops per thread]\n");
+    exit(-1);
+  }
+
+  if(argc > 1) max_threads = (size_t)atol(argv[1]);
+  if(argc > 2) loops = (size_t)atol(argv[2]);
+  if(max_threads > NUM_LOCKS) max_threads = NUM_LOCKS;
+
+  dense_locks = (char*)calloc(1, (NUM_LOCKS+7)/8);
+  table = bitlock_table_create(NUM_LOCKS, 64);
+  mutexes = (pthread_mutex_t*)calloc(NUM_LOCKS, sizeof(pthread_mutex_t));
+
+  for(i = 0; i < NUM_LOCKS; i++)
+    pthread_mutex_init(&mutexes[i], NULL);
+
+  int failed = 0;
+
+  for(hot = 0; hot < 2; hot++)
+  {
+    printf("\n%s (Mops/s, %zu loops per thread)\n",
+           hot ? "hot: all threads, one lock" : "neighbours: one lock per thread",
+           loops);
+
+    printf("%-16s", "threads");
+    for(t = 1; t <= max_threads; t *= 2) printf(" %9zu", t);
+    printf("\n");
+
+    for(m = 0; m < NUM_METHODS; m++)
+    {
+      // ticket and MCS locks only protect one value
+      if(methods[m].single && !hot) continue;
+
+      printf("%-16s", methods[m].name);
+      for(t = 1; t <= max_threads; t *= 2) {
+        double mops = run_bench(&methods[m], t, loops, (char)hot);
+        if(mops < 0) { printf(" %9s", "FAIL"); failed = 1; }
+        else printf(" %9.2f", mops);
+        fflush(stdout);
+      }
+      printf("\n");
+    }
+  }
+
+  printf("\n");
+
+  for(i = 0; i < NUM_LOCKS; i++)
+    pthread_mutex_destroy(&mutexes[i]);
+
+  free(dense_locks);
+  bitlock_table_free(table);
+  free(mutexes);
+
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -15,6 +15,7 @@
 #include <stdbool.h>
 
 #include "bit_macros.h"
+#include "bit_locks.h"
 
 typedef struct {
   pthread_t th;
@@ -25,6 +26,9 @@ typedef struct {
 #define NUM_LOOPS 10000
 char *locks, *data;
 pthread_mutex_t *mutexes;
+BITLOCK_TABLE *table;
+ticketlock_t ticket = TICKETLOCK_INIT;
+mcslock_t mcs = MCSLOCK_INIT;
 
 void* worker_bitlock(void *ptr)
 {
@@ -58,6 +62,69 @@ void* worker_bitlock_spin(void *ptr)
   return NULL;
 }
 
+void* worker_bitlock_backoff(void *ptr)
+{
+  TestThread *wrkr = (TestThread*)ptr;
+  size_t i;
+  for(i = 0; i < NUM_LOOPS; i++) {
+    bitlock_backoff_acquire(locks, i);
+    wrkr->result += i + *(volatile char *)&data[i];
+    data[i] = wrkr->id;
+    usleep(5);
+    bitlock_release(locks, i);
+    usleep(5);
+  }
+
+  return NULL;
+}
+
+void* worker_table(void *ptr)
+{
+  TestThread *wrkr = (TestThread*)ptr;
+  size_t i;
+  for(i = 0; i < NUM_LOOPS; i++) {
+    bitlock_table_acquire(table, i);
+    wrkr->result += i + *(volatile char *)&data[i];
+    data[i] = wrkr->id;
+    usleep(5);
+    bitlock_table_release(table, i);
+    usleep(5);
+  }
+
+  return NULL;
+}
+
+void* worker_ticket(void *ptr)
+{
+  TestThread *wrkr = (TestThread*)ptr;
+  size_t i;
+  for(i = 0; i < NUM_LOOPS; i++) {
+    ticketlock_acquire(&ticket);
+    wrkr->result += i + *(volatile char *)&data[i];
+    data[i] = wrkr->id;
+    ticketlock_release(&ticket);
+    usleep(5);
+  }
+
+  return NULL;
+}
+
+void* worker_mcs(void *ptr)
+{
+  TestThread *wrkr = (TestThread*)ptr;
+  mcslock_node_t node;
+  size_t i;
+  for(i = 0; i < NUM_LOOPS; i++) {
+    mcslock_acquire(&mcs, &node);
+    wrkr->result += i + *(volatile char *)&data[i];
+    data[i] = wrkr->id;
+    mcslock_release(&mcs, &node);
+    usleep(5);
+  }
+
+  return NULL;
+}
+
 void* worker_mutex(void *ptr)
 {
   TestThread *wrkr = (TestThread*)ptr;
@@ -111,8 +178,25 @@ int main(int argc, char **argv)
     method = "Bitlocks-Spin";
     func = worker_bitlock_spin;
   }
+  else if(argc == 2 && strcmp(argv[1],"backoff") == 0) {
+    method = "Bitlocks-Backoff";
+    func = worker_bitlock_backoff;
+  }
+  else if(argc == 2 && strcmp(argv[1],"table") == 0) {
+    method = "Bitlock-Table";
+    func = worker_table;
+  }
+  else if(argc == 2 && strcmp(argv[1],"ticket") == 0) {
+    method = "Ticket-Lock";
+    func = worker_ticket;
+  }
+  else if(argc == 2 && strcmp(argv[1],"mcs") == 0) {
+    method = "MCS-Lock";
+    func = worker_mcs;
+  }
   else if(argc != 1) {
-    fprintf(stderr, "usage: ./bitlock_test <bits|mutex|spin>\n");
+    fprintf(stderr, "usage: ./bitlock_test <bits|mutex|mutexes|spin|backoff|"
+                    "table|ticket|mcs>\n");
     exit(-1);
   }
 
@@ -125,6 +209,7 @@ int main(int argc, char **argv)
   locks = (char*)calloc(1, (NUM_LOOPS+7)/8);
   data = (char*)calloc(1, NUM_LOOPS);
   mutexes = (pthread_mutex_t*)calloc(NUM_LOOPS, sizeof(pthread_mutex_t));
+  table = bitlock_table_create(NUM_LOOPS, 64);
 
   for(i = 0; i < NUM_LOOPS; i++)
     pthread_mutex_init(&mutexes[i], NULL);
@@ -170,9 +255,18 @@ int main(int argc, char **argv)
   printf("sum: %zu exp: %zu\n", sum, expsum);
   printf("%s.\n\n", pass ? "Pass" : "Fail");
 
+  for(i = 0; i < table->num_of_lines * BITLOCK_LINE_BITS / 64; i++) {
+    if(table->words[i] != 0) {
+      printf("table locks not zeroed!\n");
+      pass = false;
+      break;
+    }
+  }
+
   free(mutexes);
   free(data);
   free(locks);
+  bitlock_table_free(table);
 
   return pass ? EXIT_SUCCESS : EXIT_FAILURE;
 }
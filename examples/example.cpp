@@ -8,7 +8,7 @@
 */
 
 #include <iostream>
-#include "bit_array.h"
+#include "bit_array.hpp"
 
 int main(int argc, char* argv[])
 {
@@ -21,6 +21,7 @@ int main(int argc, char* argv[])
     return -1;
   }
 
+  // C API
   BIT_ARRAY *bitarr = bit_array_create(10);
   bit_array_print(bitarr, stdout);
   cout << "\n";
@@ -29,5 +30,15 @@ int main(int argc, char* argv[])
   bit_array_print(bitarr, stdout);
   cout << "\n";
 
+  // C++ wrapper, frees the array when it goes out of scope
+  bitarr::bit_array a = bitarr::bit_array::adopt(bitarr);
+  bitarr::bit_array b("0110011001");
+  bitarr::bit_array c = (a & b) | ~b;
+  cout << c.to_string() << " (" << c.count() << " set)\n";
+
+  bitarr::fixed_bit_array<10> mask;
+  mask.set(0).set(9);
+  cout << (mask << 1).count() << "\n";
+
   return 0;
 }